@@ -464,6 +464,33 @@ DQLITE_API int dqlite_node_set_block_size(dqlite_node *n, size_t size);
  */
 DQLITE_API int dqlite_node_enable_disk_mode(dqlite_node *n);
 
+/**
+ * WARNING: This is an experimental API.
+ *
+ * By default dqlite holds every page of every database in memory. By enabling
+ * tiered-mode, at most @memory_budget bytes of database pages are kept in
+ * memory, and the least recently read pages are evicted to backing files in
+ * the data directory, while the WAL is still kept in memory. The budget is
+ * enforced at checkpoints: pages written since the last one, and pages
+ * evicted while queries were running, are only released once the WAL is
+ * reset, so the budget can be exceeded in between. Can't be combined with
+ * disk-mode. Has to be called after `dqlite_node_create` and before
+ * `dqlite_node_start`.
+ */
+DQLITE_API int dqlite_node_enable_tiered_mode(dqlite_node *n,
+					      size_t memory_budget);
+
+/**
+ * WARNING: This is an experimental API.
+ *
+ * In disk-mode, checkpoints write the pages of the WAL to the database file
+ * from a background thread. Set whether the database file is synced after
+ * being written, which is disabled by default since the database can always
+ * be recovered from the raft log.
+ */
+DQLITE_API int dqlite_node_set_disk_checkpoint_sync(dqlite_node *n,
+						    bool enabled);
+
 /**
  * Set the target number of voting nodes for the cluster.
  *
@@ -516,6 +543,118 @@ DQLITE_API int dqlite_node_set_auto_recovery(dqlite_node *n, bool enabled);
 DQLITE_API int dqlite_node_set_snapshot_compression(dqlite_node *n,
 						    bool enabled);
 
+/**
+ * Compress raft snapshots in chunks on several threads, and decompress them in
+ * parallel when they are loaded.
+ *
+ * Snapshots compressed in chunks can't be read by versions of dqlite that
+ * don't support them, so a node can't be downgraded to such a version while
+ * its latest snapshot is compressed in chunks. Snapshots sent to other nodes
+ * are not affected.
+ *
+ * This must be called before dqlite_node_start.
+ *
+ * By default snapshots are compressed as a single frame, on a single thread.
+ */
+DQLITE_API int dqlite_node_set_snapshot_chunks(dqlite_node *n, bool enabled);
+
+/**
+ * Compress raft log entries in batches of at least `threshold` bytes.
+ *
+ * Compressed batches are smaller on disk and on the wire. They are only sent
+ * to nodes that advertise support for them, but the raft log can't be read
+ * anymore by versions of dqlite without compression support. Returns an error
+ * if dqlite was built without LZ4.
+ *
+ * By default log entries are not compressed (threshold 0).
+ */
+DQLITE_API int dqlite_node_set_entries_compression(dqlite_node *n,
+						   size_t threshold);
+
+/**
+ * Set the maximum number of bytes of raft log entries kept in memory.
+ *
+ * Entries beyond this budget are released once they have been applied and
+ * written to disk, and read back from the log segments when a lagging node
+ * needs them. This bounds the memory used by the raft log, at the cost of disk
+ * reads when catching up slow nodes.
+ *
+ * By default all entries since the last snapshot, plus the trailing ones, are
+ * kept in memory (size 0).
+ */
+DQLITE_API int dqlite_node_set_log_cache_size(dqlite_node *n, size_t size);
+
+/**
+ * Set the maximum number of incremental snapshots taken in a row.
+ *
+ * An incremental snapshot only contains the database pages modified since the
+ * previous snapshot, instead of the full content of all databases. After
+ * `length` incremental snapshots, or when most pages were modified, a full
+ * snapshot is taken again and older snapshots can be removed. Incremental
+ * snapshots can't be loaded by versions of dqlite that don't support them.
+ * They are only available in the default in-memory mode.
+ *
+ * By default incremental snapshots are disabled (length 0).
+ */
+DQLITE_API int dqlite_node_set_snapshot_chain(dqlite_node *n, unsigned length);
+
+/**
+ * Set whether write transactions are replicated as page deltas.
+ *
+ * Instead of the full content of each modified page, the raft log entry of a
+ * transaction then only holds the byte ranges that differ from the committed
+ * version of the page, which every node has. This shrinks the log and the
+ * replication traffic when transactions modify a few bytes of each page. Such
+ * entries can't be applied by versions of dqlite that don't support them, so
+ * this must only be enabled once all nodes of the cluster do.
+ *
+ * By default pages are replicated in full.
+ */
+DQLITE_API int dqlite_node_set_frames_delta(dqlite_node *n, bool enabled);
+
+/**
+ * Callback receiving the timeline of a sampled write transaction, as a JSON
+ * array of events in the Trace Event Format (loadable in chrome://tracing or
+ * Perfetto). It is invoked in the thread running the node's main loop and the
+ * string is only valid during the call.
+ */
+typedef void (*dqlite_span_cb)(void *arg, const char *events, size_t len);
+
+/**
+ * Trace one out of every `rate` write transactions committed by this node
+ * while it's the leader, and pass their timeline to the given callback.
+ *
+ * The timeline breaks down the latency of the transaction into the time spent
+ * waiting in the write queue and for barriers, stepping the statement,
+ * collecting and encoding the modified pages, persisting the raft entry,
+ * waiting for a quorum of acknowledgements and applying the entry.
+ *
+ * This must be called before dqlite_node_start.
+ *
+ * By default no transaction is traced (rate 0).
+ */
+DQLITE_API int dqlite_node_set_span_tracing(dqlite_node *n,
+					    unsigned rate,
+					    dqlite_span_cb cb,
+					    void *arg);
+
+/**
+ * Set the number of raft log segments that are allocated ahead of time and the
+ * maximum number of retired segments that are recycled instead of deleted.
+ *
+ * Recycled segments are reused as new open segments without allocating and
+ * zeroing a new file, which reduces append latency under heavy write load.
+ * Segments written after recycling is enabled can't be read by versions of
+ * dqlite that don't support it.
+ *
+ * This must be called before dqlite_node_start.
+ *
+ * By default 2 segments are prepared and recycling is disabled.
+ */
+DQLITE_API int dqlite_node_set_segment_pool(dqlite_node *n,
+					    unsigned prepared,
+					    unsigned recycled);
+
 /**
  * Enable automatic role management on the server side for this node.
  *
@@ -536,6 +675,110 @@ DQLITE_API int dqlite_node_enable_role_management(dqlite_node *n);
  */
 DQLITE_API int dqlite_node_set_busy_timeout(dqlite_node *n, unsigned msecs);
 
+/**
+ * Classes of statements for admission control: statements that only read the
+ * database and statements that might write to it.
+ */
+#define DQLITE_SCHED_READ 0
+#define DQLITE_SCHED_WRITE 1
+
+/**
+ * Limit the number of statements of the given class that can run at the same
+ * time on this node while it's the leader, both across all databases (@limit)
+ * and against any single database (@db_limit). A value of 0 means no limit.
+ *
+ * Statements that exceed the limits wait in a queue shared by all client
+ * connections, which are served fairly: a connection running expensive
+ * statements gets to run fewer of them than one running cheap statements.
+ * Statements that are part of an open transaction are never queued.
+ *
+ * This must be called before dqlite_node_start.
+ *
+ * By default there are no limits.
+ */
+DQLITE_API int dqlite_node_set_sched_limits(dqlite_node *n,
+					    int klass,
+					    unsigned limit,
+					    unsigned db_limit);
+
+/**
+ * Set the maximum amount of time in milliseconds a statement is expected to
+ * wait because of the limits set with dqlite_node_set_sched_limits. Statements
+ * that would wait longer fail right away with SQLITE_BUSY, and an error message
+ * suggesting how many milliseconds to wait before retrying.
+ *
+ * This must be called before dqlite_node_start.
+ *
+ * By default statements wait as long as needed (0).
+ */
+DQLITE_API int dqlite_node_set_sched_target(dqlite_node *n, unsigned msecs);
+
+/**
+ * Statistics of the statements of a class, since the node started.
+ */
+struct dqlite_sched_stats
+{
+	uint64_t admitted;   /* Statements started */
+	uint64_t rejected;   /* Statements rejected because of the target */
+	uint64_t wait_total; /* Microseconds spent waiting, overall */
+	uint64_t wait_max;   /* Longest wait, in microseconds */
+	unsigned running;    /* Statements currently running */
+	unsigned waiting;    /* Statements currently waiting */
+};
+
+/**
+ * Get the statistics of the given class of statements. This can be called from
+ * any thread while the node is running.
+ */
+DQLITE_API int dqlite_node_get_sched_stats(dqlite_node *n,
+					   int klass,
+					   struct dqlite_sched_stats *stats);
+
+/**
+ * Limit the time a query can keep a worker thread busy in one go.
+ *
+ * Rows of a query are normally produced in batches filling a response buffer.
+ * With a time slice, a batch also ends after the row that brought the query
+ * over @steps SQLite virtual machine instructions or @usecs microseconds, and
+ * the next one is queued behind the requests submitted in the meantime, so
+ * that short queries don't wait for long scans to complete. A value of 0 means
+ * no limit.
+ *
+ * This only partially covers long queries. A query only yields between the
+ * rows it returns, because SQLite can't suspend a statement in the middle of
+ * its execution: its progress handler can only abort it. Statements doing all
+ * their work before returning their first row, such as COUNT(*) or other
+ * aggregates over a large table, or a sort without a matching index, are not
+ * sliced at all. Until they complete, they keep their worker thread, the
+ * database's execution slot and their WAL read lock, whatever the slice.
+ *
+ * The only bound for such statements is the deadline that a client can set
+ * with the TIMEOUT request. A statement running past it is aborted, and fails
+ * with SQLITE_INTERRUPT, rather than resumed later.
+ *
+ * This must be called before dqlite_node_start.
+ *
+ * By default queries are not time-sliced.
+ */
+DQLITE_API int dqlite_node_set_query_slice(dqlite_node *n,
+					   unsigned steps,
+					   unsigned usecs);
+
+/**
+ * Keep up to @size bytes of the most recent transactions committed to each
+ * database in memory, so that clients can subscribe to them.
+ *
+ * Subscribers are streamed the pages written by each transaction, tagged with
+ * the raft index that committed it, and can resume from that index on any
+ * node. A subscriber that falls behind the changes kept by the node it is
+ * connected to must start over from a backup of the database.
+ *
+ * This must be called before dqlite_node_start.
+ *
+ * By default no changes are kept (0), and subscriptions are refused.
+ */
+DQLITE_API int dqlite_node_set_change_feed(dqlite_node *n, size_t size);
+
 /**
  * Start a dqlite node.
  *
@@ -570,6 +813,167 @@ DQLITE_API int dqlite_node_handover(dqlite_node *n);
  */
 DQLITE_API int dqlite_node_stop(dqlite_node *n);
 
+/**
+ * In-process connection to a dqlite node.
+ *
+ * Applications embedding a node can use it to open a database and run
+ * statements on it without going through a socket: requests are posted to the
+ * node's main loop through a lock-free queue and served by the same code that
+ * serves network clients. Like a network connection, a local connection can
+ * only serve requests while the node is the leader.
+ *
+ * All functions taking a local connection can be called from any thread, and
+ * requests are served in the order they were submitted. Their callbacks are
+ * invoked in the thread running the node's main loop, so they must not block,
+ * but they can submit further requests.
+ */
+DQLITE_EXPERIMENTAL typedef struct dqlite_local dqlite_local;
+
+/**
+ * A value bound to a statement parameter or returned in a row. The type is one
+ * of SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB and SQLITE_NULL.
+ */
+struct dqlite_local_value
+{
+	int type;
+	union {
+		int64_t integer;
+		double real;
+		const char *text;
+		struct
+		{
+			const void *base;
+			size_t len;
+		} blob;
+	};
+};
+DQLITE_EXPERIMENTAL typedef struct dqlite_local_value dqlite_local_value;
+
+/**
+ * Result of a request submitted on a local connection, only valid during the
+ * callback it's passed to.
+ *
+ * The status is 0 on success, or an SQLite error code on failure, in which case
+ * message describes the error. If the connection is closed or the node stops
+ * before the request is served, the status is SQLITE_ABORT.
+ *
+ * Which of the other fields are set depends on the request: the ID and the
+ * number of parameters of a prepared statement, the last insert ID and number
+ * of rows affected by a statement, or a batch of rows returned by a query.
+ * Queries returning many rows invoke their callback once for each batch, so
+ * done is only set on the last callback of a request. If a batch can't be
+ * decoded for lack of memory, its callback gets SQLITE_NOMEM and no rows, and
+ * the following batches are still delivered.
+ */
+struct dqlite_local_result
+{
+	int status;
+	const char *message;
+	unsigned stmt_id;
+	unsigned n_params;
+	unsigned long long last_insert_id;
+	unsigned long long rows_affected;
+	unsigned column_count;
+	unsigned row_count;
+	const char *const *column_names;
+	bool done;
+};
+DQLITE_EXPERIMENTAL typedef struct dqlite_local_result dqlite_local_result;
+
+DQLITE_EXPERIMENTAL typedef void (*dqlite_local_cb)(
+    void *arg,
+    const dqlite_local_result *result);
+
+/**
+ * Open a local connection to the database with the given name on a running
+ * node. The callback is invoked once the database has been opened.
+ *
+ * The connection must be closed with dqlite_local_close before the node is
+ * stopped. Any connection still open when the node stops is released and must
+ * not be used anymore.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL int dqlite_local_open(dqlite_node *n,
+						     const char *name,
+						     dqlite_local_cb cb,
+						     void *arg,
+						     dqlite_local **local);
+
+/**
+ * Prepare a statement, whose ID is passed to the callback.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL int dqlite_local_prepare(dqlite_local *local,
+							const char *sql,
+							dqlite_local_cb cb,
+							void *arg);
+
+/**
+ * Execute a prepared statement with the given parameters.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL int dqlite_local_exec(
+    dqlite_local *local,
+    unsigned stmt_id,
+    const dqlite_local_value *params,
+    unsigned n_params,
+    dqlite_local_cb cb,
+    void *arg);
+
+/**
+ * Execute one or more SQL statements with the given parameters.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL int dqlite_local_exec_sql(
+    dqlite_local *local,
+    const char *sql,
+    const dqlite_local_value *params,
+    unsigned n_params,
+    dqlite_local_cb cb,
+    void *arg);
+
+/**
+ * Run a prepared query with the given parameters.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL int dqlite_local_query(
+    dqlite_local *local,
+    unsigned stmt_id,
+    const dqlite_local_value *params,
+    unsigned n_params,
+    dqlite_local_cb cb,
+    void *arg);
+
+/**
+ * Run an SQL query with the given parameters.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL int dqlite_local_query_sql(
+    dqlite_local *local,
+    const char *sql,
+    const dqlite_local_value *params,
+    unsigned n_params,
+    dqlite_local_cb cb,
+    void *arg);
+
+/**
+ * Finalize a prepared statement.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL int dqlite_local_finalize(dqlite_local *local,
+							 unsigned stmt_id,
+							 dqlite_local_cb cb,
+							 void *arg);
+
+/**
+ * Get the value in the given column of the given row of a query result. Text
+ * and blobs are only valid during the callback.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL void dqlite_local_result_value(
+    const dqlite_local_result *result,
+    unsigned row,
+    unsigned column,
+    dqlite_local_value *value);
+
+/**
+ * Close a local connection once the requests submitted so far have been
+ * served. The connection must not be used anymore.
+ */
+DQLITE_API DQLITE_EXPERIMENTAL void dqlite_local_close(dqlite_local *local);
+
 struct dqlite_node_info
 {
 	dqlite_node_id id;
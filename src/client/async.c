@@ -0,0 +1,610 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../lib/assert.h"
+
+#include "../message.h"
+#include "../protocol.h"
+#include "../request.h"
+#include "../response.h"
+#include "../tracing.h"
+#include "async.h"
+
+/* How many bytes to ask the kernel for at once. */
+#define READ_CHUNK (64 * 1024)
+
+/* Initial number of requests that can be in flight before growing the ring. */
+#define PENDING_INITIAL_CAP 16
+
+static void oom(void)
+{
+	abort();
+}
+
+int clientAsyncInit(struct client_async *c, int fd)
+{
+	uint64_t protocol;
+	void *cursor;
+	int flags;
+	int rv;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1) {
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+	rv = fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	if (rv == -1) {
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+
+	*c = (struct client_async){0};
+	c->fd = fd;
+	rv = buffer__init(&c->read);
+	if (rv != 0) {
+		oom();
+	}
+	rv = buffer__init(&c->write);
+	if (rv != 0) {
+		oom();
+	}
+	c->pending_cap = PENDING_INITIAL_CAP;
+	c->pending = mallocChecked(c->pending_cap * sizeof *c->pending);
+
+	/* The server doesn't reply to the handshake, so it's just queued ahead
+	 * of the first request. */
+	protocol = ByteFlipLe64(DQLITE_PROTOCOL_VERSION);
+	cursor = buffer__advance(&c->write, sizeof protocol);
+	if (cursor == NULL) {
+		oom();
+	}
+	memcpy(cursor, &protocol, sizeof protocol);
+	return 0;
+}
+
+static void pendingPush(struct client_async *c, client_async_cb cb, void *arg)
+{
+	struct client_async_pending *pending;
+	unsigned i;
+
+	if (c->n_pending == c->pending_cap) {
+		pending = mallocChecked(2 * c->pending_cap * sizeof *pending);
+		for (i = 0; i < c->n_pending; i++) {
+			pending[i] =
+			    c->pending[(c->pending_head + i) % c->pending_cap];
+		}
+		free(c->pending);
+		c->pending = pending;
+		c->pending_cap *= 2;
+		c->pending_head = 0;
+	}
+	i = (c->pending_head + c->n_pending) % c->pending_cap;
+	c->pending[i].cb = cb;
+	c->pending[i].arg = arg;
+	c->n_pending++;
+}
+
+static void pendingPop(struct client_async *c)
+{
+	assert(c->n_pending > 0);
+	c->pending_head = (c->pending_head + 1) % c->pending_cap;
+	c->n_pending--;
+}
+
+/* Mark the connection as broken and fail all requests in flight, including the
+ * ones queued by the callbacks being failed. */
+static void fail(struct client_async *c, int status)
+{
+	struct client_async_pending pending;
+
+	if (c->status == 0) {
+		c->status = status;
+	}
+	while (c->n_pending > 0) {
+		pending = c->pending[c->pending_head];
+		pendingPop(c);
+		pending.cb(c, pending.arg, c->status, NULL);
+	}
+}
+
+void clientAsyncClose(struct client_async *c)
+{
+	tracef("client async close");
+	fail(c, DQLITE_CLIENT_PROTO_ERROR);
+	close(c->fd);
+	c->fd = -1;
+	free(c->pending);
+	c->pending = NULL;
+	buffer__close(&c->write);
+	buffer__close(&c->read);
+	free(c->errmsg);
+	c->errmsg = NULL;
+}
+
+short clientAsyncEvents(const struct client_async *c)
+{
+	short events = POLLIN;
+	if (c->write_offset < c->write.offset) {
+		events |= POLLOUT;
+	}
+	return events;
+}
+
+/* Dispatch all the complete messages in the read buffer, then move the bytes
+ * of the last incomplete one to the front. */
+static int dispatch(struct client_async *c)
+{
+	struct client_async_pending pending;
+	struct client_response response;
+	struct message message;
+	struct cursor cursor;
+	size_t available;
+	size_t n;
+	int rv;
+
+	for (;;) {
+		available = buffer__offset(&c->read) - c->read_offset;
+		if (available < message__sizeof(&message)) {
+			break;
+		}
+		cursor.p = buffer__cursor(&c->read, c->read_offset);
+		cursor.cap = available;
+		rv = message__decode(&cursor, &message);
+		assert(rv == 0);
+		n = (size_t)message.words * 8;
+		if (cursor.cap < n) {
+			break;
+		}
+		if (c->n_pending == 0) {
+			tracef("unexpected response type:%u", message.type);
+			return DQLITE_CLIENT_PROTO_ERROR;
+		}
+
+		response.type = message.type;
+		response.schema = message.schema;
+		response.body.p = cursor.p;
+		response.body.cap = n;
+		c->read_offset += message__sizeof(&message) + n;
+
+		pending = c->pending[c->pending_head];
+		rv = pending.cb(c, pending.arg, 0, &response);
+		if (rv != CLIENT_ASYNC_MORE) {
+			pendingPop(c);
+		}
+	}
+
+	available = buffer__offset(&c->read) - c->read_offset;
+	if (available > 0 && c->read_offset > 0) {
+		memmove(buffer__cursor(&c->read, 0),
+			buffer__cursor(&c->read, c->read_offset), available);
+	}
+	c->read.offset = available;
+	c->read_offset = 0;
+	return 0;
+}
+
+/* Read and dispatch responses until the socket would block. */
+static int readAvailable(struct client_async *c)
+{
+	size_t offset;
+	void *cursor;
+	ssize_t n;
+	int rv;
+
+	for (;;) {
+		offset = buffer__offset(&c->read);
+		cursor = buffer__advance(&c->read, READ_CHUNK);
+		if (cursor == NULL) {
+			oom();
+		}
+		n = read(c->fd, cursor, READ_CHUNK);
+		c->read.offset = offset + (n > 0 ? (size_t)n : 0);
+		if (n == 0) {
+			tracef("client async eof");
+			return DQLITE_CLIENT_PROTO_SHORT;
+		}
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			tracef("client async read failed errno:%d", errno);
+			return DQLITE_CLIENT_PROTO_ERROR;
+		}
+		rv = dispatch(c);
+		if (rv != 0) {
+			return rv;
+		}
+	}
+}
+
+/* Write out pending requests until done or the socket would block. */
+static int flush(struct client_async *c)
+{
+	size_t n;
+	ssize_t rv;
+
+	while (c->write_offset < buffer__offset(&c->write)) {
+		n = buffer__offset(&c->write) - c->write_offset;
+		rv = write(c->fd, buffer__cursor(&c->write, c->write_offset),
+			   n);
+		if (rv < 0) {
+			if (errno == EAGAIN) {
+				return 0;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			tracef("client async write failed errno:%d", errno);
+			return DQLITE_CLIENT_PROTO_ERROR;
+		}
+		c->write_offset += (size_t)rv;
+	}
+	buffer__reset(&c->write);
+	c->write_offset = 0;
+	return 0;
+}
+
+int clientAsyncProcess(struct client_async *c, short revents)
+{
+	int rv;
+
+	if (c->status != 0) {
+		return c->status;
+	}
+	if (revents & (POLLIN | POLLHUP | POLLERR)) {
+		rv = readAvailable(c);
+		if (rv != 0) {
+			goto err;
+		}
+	}
+	rv = flush(c);
+	if (rv != 0) {
+		goto err;
+	}
+	return 0;
+
+err:
+	fail(c, rv);
+	return rv;
+}
+
+/* Append the message header and the encoded request to the write buffer,
+ * remembering where the message starts so its size can be filled in once any
+ * parameters are appended too. */
+#define BUFFER_REQUEST(LOWER, START)                                  \
+	{                                                             \
+		struct message _message = {0};                        \
+		size_t _n1;                                           \
+		size_t _n2;                                           \
+		char *_cursor;                                        \
+		_n1 = message__sizeof(&_message);                     \
+		_n2 = request_##LOWER##__sizeof(&request);            \
+		START = buffer__offset(&c->write);                    \
+		_cursor = buffer__advance(&c->write, _n1 + _n2);      \
+		if (_cursor == NULL) {                                \
+			oom();                                        \
+		}                                                     \
+		assert(_n2 % 8 == 0);                                 \
+		message__encode(&_message, &_cursor);                 \
+		request_##LOWER##__encode(&request, &_cursor);        \
+	}
+
+/* Fill in the header of the message starting at the given offset, and queue
+ * the callback for its response. */
+static void queueMessage(struct client_async *c,
+			 size_t start,
+			 uint8_t type,
+			 uint8_t schema,
+			 client_async_cb cb,
+			 void *arg)
+{
+	struct message message = {0};
+	char *cursor;
+	size_t n;
+
+	n = buffer__offset(&c->write) - start - message__sizeof(&message);
+	assert(n % 8 == 0);
+	message.words = (uint32_t)(n / 8);
+	message.type = type;
+	message.schema = schema;
+	cursor = buffer__cursor(&c->write, start);
+	message__encode(&message, &cursor);
+	pendingPush(c, cb, arg);
+}
+
+int clientAsyncSendOpen(struct client_async *c,
+			const char *name,
+			client_async_cb cb,
+			void *arg)
+{
+	tracef("client async send open name %s", name);
+	struct request_open request;
+	size_t start;
+
+	if (c->status != 0) {
+		return c->status;
+	}
+	request.filename = name;
+	request.flags = 0;    /* unused */
+	request.vfs = "test"; /* unused */
+	BUFFER_REQUEST(open, start);
+	queueMessage(c, start, DQLITE_REQUEST_OPEN, 0, cb, arg);
+	return 0;
+}
+
+int clientAsyncSendPrepare(struct client_async *c,
+			   const char *sql,
+			   client_async_cb cb,
+			   void *arg)
+{
+	tracef("client async send prepare");
+	struct request_prepare request;
+	size_t start;
+
+	if (c->status != 0) {
+		return c->status;
+	}
+	request.db_id = c->db_id;
+	request.sql = sql;
+	BUFFER_REQUEST(prepare, start);
+	queueMessage(c, start, DQLITE_REQUEST_PREPARE,
+		     DQLITE_PREPARE_STMT_SCHEMA_V1, cb, arg);
+	return 0;
+}
+
+/* Append the parameters of a request, dropping the whole request from the
+ * write buffer if they can't be encoded. */
+static int bufferParams(struct client_async *c,
+			size_t start,
+			struct value *params,
+			unsigned n_params)
+{
+	int rv;
+
+	rv = clientBufferParams(&c->write, params, n_params);
+	if (rv != 0) {
+		c->write.offset = start;
+		return rv;
+	}
+	return 0;
+}
+
+int clientAsyncSendExec(struct client_async *c,
+			uint32_t stmt_id,
+			struct value *params,
+			unsigned n_params,
+			client_async_cb cb,
+			void *arg)
+{
+	tracef("client async send exec id %" PRIu32, stmt_id);
+	struct request_exec request;
+	size_t start;
+	int rv;
+
+	if (c->status != 0) {
+		return c->status;
+	}
+	request.db_id = c->db_id;
+	request.stmt_id = stmt_id;
+	BUFFER_REQUEST(exec, start);
+	rv = bufferParams(c, start, params, n_params);
+	if (rv != 0) {
+		return rv;
+	}
+	queueMessage(c, start, DQLITE_REQUEST_EXEC, 1, cb, arg);
+	return 0;
+}
+
+int clientAsyncSendExecSQL(struct client_async *c,
+			   const char *sql,
+			   struct value *params,
+			   unsigned n_params,
+			   client_async_cb cb,
+			   void *arg)
+{
+	tracef("client async send exec sql");
+	struct request_exec_sql request;
+	size_t start;
+	int rv;
+
+	if (c->status != 0) {
+		return c->status;
+	}
+	request.db_id = c->db_id;
+	request.sql = sql;
+	BUFFER_REQUEST(exec_sql, start);
+	rv = bufferParams(c, start, params, n_params);
+	if (rv != 0) {
+		return rv;
+	}
+	queueMessage(c, start, DQLITE_REQUEST_EXEC_SQL, 1, cb, arg);
+	return 0;
+}
+
+int clientAsyncSendQuery(struct client_async *c,
+			 uint32_t stmt_id,
+			 struct value *params,
+			 unsigned n_params,
+			 client_async_cb cb,
+			 void *arg)
+{
+	tracef("client async send query stmt_id %" PRIu32, stmt_id);
+	struct request_query request;
+	size_t start;
+	int rv;
+
+	if (c->status != 0) {
+		return c->status;
+	}
+	request.db_id = c->db_id;
+	request.stmt_id = stmt_id;
+	BUFFER_REQUEST(query, start);
+	rv = bufferParams(c, start, params, n_params);
+	if (rv != 0) {
+		return rv;
+	}
+	queueMessage(c, start, DQLITE_REQUEST_QUERY, 1, cb, arg);
+	return 0;
+}
+
+int clientAsyncSendQuerySQL(struct client_async *c,
+			    const char *sql,
+			    struct value *params,
+			    unsigned n_params,
+			    client_async_cb cb,
+			    void *arg)
+{
+	tracef("client async send query sql %s", sql);
+	struct request_query_sql request;
+	size_t start;
+	int rv;
+
+	if (c->status != 0) {
+		return c->status;
+	}
+	request.db_id = c->db_id;
+	request.sql = sql;
+	BUFFER_REQUEST(query_sql, start);
+	rv = bufferParams(c, start, params, n_params);
+	if (rv != 0) {
+		return rv;
+	}
+	queueMessage(c, start, DQLITE_REQUEST_QUERY_SQL, 1, cb, arg);
+	return 0;
+}
+
+int clientAsyncSendFinalize(struct client_async *c,
+			    uint32_t stmt_id,
+			    client_async_cb cb,
+			    void *arg)
+{
+	tracef("client async send finalize %" PRIu32, stmt_id);
+	struct request_finalize request;
+	size_t start;
+
+	if (c->status != 0) {
+		return c->status;
+	}
+	request.db_id = c->db_id;
+	request.stmt_id = stmt_id;
+	BUFFER_REQUEST(finalize, start);
+	queueMessage(c, start, DQLITE_REQUEST_FINALIZE, 0, cb, arg);
+	return 0;
+}
+
+/* Check the type of a response, recording the details of a failure. */
+static int checkResponse(struct client_async *c,
+			 const struct client_response *response,
+			 uint8_t type)
+{
+	struct response_failure failure;
+	struct cursor cursor;
+	int rv;
+
+	if (response->type == type) {
+		return 0;
+	}
+	if (response->type != DQLITE_RESPONSE_FAILURE) {
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+	cursor = response->body;
+	rv = response_failure__decode(&cursor, &failure);
+	if (rv != 0) {
+		tracef("decode as failure failed rv:%d", rv);
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+	c->errcode = failure.code;
+	free(c->errmsg);
+	c->errmsg = strdupChecked(failure.message);
+	return DQLITE_CLIENT_PROTO_RECEIVED_FAILURE;
+}
+
+/* Check and decode a response. */
+#define RESPONSE(LOWER, UPPER)                                              \
+	{                                                                   \
+		struct cursor _cursor;                                      \
+		int _rv;                                                    \
+		_rv = checkResponse(c, response, DQLITE_RESPONSE_##UPPER); \
+		if (_rv != 0) {                                             \
+			return _rv;                                         \
+		}                                                           \
+		_cursor = response->body;                                   \
+		_rv = response_##LOWER##__decode(&_cursor, &decoded);       \
+		if (_rv != 0) {                                             \
+			return DQLITE_CLIENT_PROTO_ERROR;                   \
+		}                                                           \
+	}
+
+int clientAsyncRecvDb(struct client_async *c,
+		      const struct client_response *response)
+{
+	struct response_db decoded;
+	RESPONSE(db, DB);
+	c->db_id = decoded.id;
+	return 0;
+}
+
+int clientAsyncRecvStmt(struct client_async *c,
+			const struct client_response *response,
+			uint32_t *stmt_id,
+			uint64_t *n_params)
+{
+	struct response_stmt_with_offset decoded;
+	RESPONSE(stmt_with_offset, STMT_WITH_OFFSET);
+	if (stmt_id != NULL) {
+		*stmt_id = decoded.id;
+	}
+	if (n_params != NULL) {
+		*n_params = decoded.params;
+	}
+	return 0;
+}
+
+int clientAsyncRecvResult(struct client_async *c,
+			  const struct client_response *response,
+			  uint64_t *last_insert_id,
+			  uint64_t *rows_affected)
+{
+	struct response_result decoded;
+	RESPONSE(result, RESULT);
+	if (last_insert_id != NULL) {
+		*last_insert_id = decoded.last_insert_id;
+	}
+	if (rows_affected != NULL) {
+		*rows_affected = decoded.rows_affected;
+	}
+	return 0;
+}
+
+int clientAsyncRecvRowsArena(struct client_async *c,
+			     const struct client_response *response,
+			     struct client_rows *rows,
+			     bool columnar,
+			     bool *done)
+{
+	int rv;
+
+	*rows = (struct client_rows){0};
+	rv = checkResponse(c, response, DQLITE_RESPONSE_ROWS);
+	if (rv != 0) {
+		return rv;
+	}
+	return clientDecodeRowsArena(response->body.p, response->body.cap,
+				     rows, columnar, done);
+}
+
+int clientAsyncRecvEmpty(struct client_async *c,
+			 const struct client_response *response)
+{
+	struct response_empty decoded;
+	RESPONSE(empty, EMPTY);
+	(void)decoded;
+	return 0;
+}
@@ -0,0 +1,182 @@
+/* Non-blocking dqlite client, driven by an external event loop.
+ *
+ * Unlike the functions in protocol.h, which block until a whole request has
+ * been written or a whole response has been read, the functions declared here
+ * never block. Requests are encoded into an output buffer and responses are
+ * dispatched to callbacks as they are read, so a single thread can drive many
+ * connections, each with many requests in flight.
+ *
+ * The caller owns the event loop: it watches the fd of the client for the
+ * events returned by clientAsyncEvents (with poll, epoll or similar), and
+ * calls clientAsyncProcess when the fd is ready. Reads and writes are done in
+ * large chunks until the kernel would block, so there's no syscall per
+ * message. */
+
+#ifndef DQLITE_CLIENT_ASYNC_H_
+#define DQLITE_CLIENT_ASYNC_H_
+
+#include "../lib/buffer.h"
+#include "../lib/serialize.h"
+
+#include "protocol.h"
+
+struct client_async;
+
+/* A response received from the server. The body is borrowed from the read
+ * buffer of the client and is only valid while the callback runs. */
+struct client_response
+{
+	uint8_t type;
+	uint8_t schema;
+	struct cursor body;
+};
+
+/* Return value of a callback that expects more responses for the same request,
+ * like when a query returns its rows in several batches. */
+#define CLIENT_ASYNC_MORE 1
+
+/* Called when a response to a request is received, with @status set to 0, or
+ * when the request fails because the connection broke, with @status set to
+ * one of the DQLITE_CLIENT_PROTO_* codes and @response set to NULL.
+ *
+ * Returns 0 when done with the request, or CLIENT_ASYNC_MORE to also receive
+ * the next response. The return value is ignored on failure. Callbacks can send
+ * new requests, but must not close the client. */
+typedef int (*client_async_cb)(struct client_async *c,
+			       void *arg,
+			       int status,
+			       const struct client_response *response);
+
+struct client_async_pending
+{
+	client_async_cb cb;
+	void *arg;
+};
+
+struct client_async
+{
+	int fd;              /* Connected socket, in non-blocking mode */
+	uint32_t db_id;      /* Database ID provided by the server */
+	struct buffer read;  /* Bytes received and not yet dispatched */
+	size_t read_offset;  /* Start of the first undispatched message */
+	struct buffer write; /* Requests not yet written out */
+	size_t write_offset; /* Start of the bytes not yet written out */
+	struct client_async_pending *pending; /* Ring of requests in flight */
+	unsigned pending_cap;
+	unsigned pending_head;
+	unsigned n_pending;
+	int status;       /* Sticky error once the connection broke */
+	uint64_t errcode; /* Last error code returned by the server */
+	char *errmsg;     /* Last error string returned by the server (owned) */
+};
+
+/* Initialize a client on a connected socket and queue the protocol handshake.
+ * The fd is put in non-blocking mode, and is owned by the client. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncInit(struct client_async *c, int fd);
+
+/* Fail all requests in flight and close the socket. */
+DQLITE_VISIBLE_TO_TESTS void clientAsyncClose(struct client_async *c);
+
+/* Return the poll events the client is waiting for: POLLIN, plus POLLOUT while
+ * requests are waiting to be written out. */
+DQLITE_VISIBLE_TO_TESTS short clientAsyncEvents(const struct client_async *c);
+
+/* Read and dispatch the available responses, then write out as much of the
+ * pending requests as possible, according to the poll events in @revents.
+ *
+ * Once an error is returned the connection is broken, all requests in flight
+ * have been failed and so will any new one. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncProcess(struct client_async *c,
+					       short revents);
+
+/* Queue a request to open a database. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncSendOpen(struct client_async *c,
+						const char *name,
+						client_async_cb cb,
+						void *arg);
+
+/* Queue a request to prepare a statement. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncSendPrepare(struct client_async *c,
+						   const char *sql,
+						   client_async_cb cb,
+						   void *arg);
+
+/* Queue a request to execute a statement. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncSendExec(struct client_async *c,
+						uint32_t stmt_id,
+						struct value *params,
+						unsigned n_params,
+						client_async_cb cb,
+						void *arg);
+
+/* Queue a request to execute a non-prepared statement. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncSendExecSQL(struct client_async *c,
+						   const char *sql,
+						   struct value *params,
+						   unsigned n_params,
+						   client_async_cb cb,
+						   void *arg);
+
+/* Queue a request to perform a query. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncSendQuery(struct client_async *c,
+						 uint32_t stmt_id,
+						 struct value *params,
+						 unsigned n_params,
+						 client_async_cb cb,
+						 void *arg);
+
+/* Queue a request to perform a non-prepared query. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncSendQuerySQL(struct client_async *c,
+						    const char *sql,
+						    struct value *params,
+						    unsigned n_params,
+						    client_async_cb cb,
+						    void *arg);
+
+/* Queue a request to finalize a prepared statement. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncSendFinalize(struct client_async *c,
+						    uint32_t stmt_id,
+						    client_async_cb cb,
+						    void *arg);
+
+/* The following functions decode a response passed to a callback. They return
+ * DQLITE_CLIENT_PROTO_RECEIVED_FAILURE if the server replied with a failure,
+ * whose details are then available in the errcode and errmsg fields of the
+ * client, or DQLITE_CLIENT_PROTO_ERROR if the response is not of the expected
+ * type or malformed. */
+
+/* Decode the response to an open request, and remember the database ID. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncRecvDb(
+    struct client_async *c,
+    const struct client_response *response);
+
+/* Decode the response to a prepare request. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncRecvStmt(
+    struct client_async *c,
+    const struct client_response *response,
+    uint32_t *stmt_id,
+    uint64_t *n_params);
+
+/* Decode the response to an exec request. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncRecvResult(
+    struct client_async *c,
+    const struct client_response *response,
+    uint64_t *last_insert_id,
+    uint64_t *rows_affected);
+
+/* Decode a batch of rows in response to a query request, see
+ * clientRecvRowsArena. The callback should return CLIENT_ASYNC_MORE as long as
+ * @done is false. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncRecvRowsArena(
+    struct client_async *c,
+    const struct client_response *response,
+    struct client_rows *rows,
+    bool columnar,
+    bool *done);
+
+/* Decode an empty response, like the one to a finalize request. */
+DQLITE_VISIBLE_TO_TESTS int clientAsyncRecvEmpty(
+    struct client_async *c,
+    const struct client_response *response);
+
+#endif /* DQLITE_CLIENT_ASYNC_H_ */
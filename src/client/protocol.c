@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <poll.h>
@@ -268,6 +269,133 @@ static ssize_t doWrite(int fd,
 	return total;
 }
 
+/* Return the timeout to pass to poll(2) for the given context: -1 if there's no
+ * deadline, 0 if it already passed. */
+static int contextTimeout(struct client_context *context)
+{
+	struct timespec now;
+	long long millis;
+	int rv;
+
+	if (context == NULL) {
+		return -1;
+	}
+	rv = clock_gettime(CLOCK_REALTIME, &now);
+	assert(rv == 0);
+	millis = (context->deadline.tv_sec - now.tv_sec) * 1000 +
+		 (context->deadline.tv_nsec - now.tv_nsec) / 1000000;
+	if (millis < 0) {
+		return 0;
+	}
+	return millis > INT_MAX ? INT_MAX : (int)millis;
+}
+
+/* Sleep until the server signals progress on the shared memory channel.
+ * Return 1 when woken up, 0 on timeout and -1 on error. The server never
+ * writes to the socket after the switch, so any event on it means that the
+ * server went away. */
+static int shmWait(struct client_proto *c, struct client_context *context)
+{
+	struct pollfd pfds[2];
+	int rv;
+
+	pfds[0].fd = c->shm->wake_fd;
+	pfds[0].events = POLLIN;
+	pfds[0].revents = 0;
+	pfds[1].fd = c->fd;
+	pfds[1].events = POLLIN;
+	pfds[1].revents = 0;
+	do {
+		rv = poll(pfds, 2, contextTimeout(context));
+	} while (rv < 0 && errno == EINTR);
+	if (rv < 0) {
+		return -1;
+	} else if (rv == 0) {
+		return 0;
+	}
+	if (pfds[1].revents != 0 || pfds[0].revents != POLLIN) {
+		return -1;
+	}
+	shm__drain(c->shm);
+	return 1;
+}
+
+/* Same as doRead, but for a shared memory channel. */
+static ssize_t doReadShm(struct client_proto *c,
+			 void *buf,
+			 size_t buf_len,
+			 struct client_context *context)
+{
+	size_t total;
+	int rv;
+
+	total = 0;
+	while (total < buf_len) {
+		total += shm__read(c->shm, (char *)buf + total,
+				   buf_len - total);
+		if (total == buf_len || !shm__wait_read(c->shm)) {
+			continue;
+		}
+		rv = shmWait(c, context);
+		if (rv < 0) {
+			return -1;
+		} else if (rv == 0) {
+			break;
+		}
+	}
+	return (ssize_t)total;
+}
+
+/* Same as doWrite, but for a shared memory channel. */
+static ssize_t doWriteShm(struct client_proto *c,
+			  const void *buf,
+			  size_t buf_len,
+			  struct client_context *context)
+{
+	size_t total;
+	int rv;
+
+	total = 0;
+	while (total < buf_len) {
+		total += shm__write(c->shm, (const char *)buf + total,
+				    buf_len - total);
+		if (total == buf_len || !shm__wait_write(c->shm)) {
+			continue;
+		}
+		rv = shmWait(c, context);
+		if (rv < 0) {
+			return -1;
+		} else if (rv == 0) {
+			break;
+		}
+	}
+	return (ssize_t)total;
+}
+
+/* Read from the socket or from the shared memory channel, if any. */
+static ssize_t readBytes(struct client_proto *c,
+			 void *buf,
+			 size_t buf_len,
+			 struct client_context *context)
+{
+	if (c->shm != NULL) {
+		return doReadShm(c, buf, buf_len, context);
+	}
+	return doRead(c->fd, buf, buf_len, context);
+}
+
+/* Write to the socket or to the shared memory channel, if any. */
+static ssize_t writeBytes(struct client_proto *c,
+			  void *buf,
+			  size_t buf_len,
+			  struct client_context *context)
+{
+	if (c->shm != NULL) {
+		return doWriteShm(c, buf, buf_len, context);
+	}
+	return doWrite(c->fd, buf, buf_len, context);
+}
+
 static int handleFailure(struct client_proto *c)
 {
 	struct response_failure failure;
@@ -312,6 +440,7 @@ int clientOpen(struct client_proto *c, const char *addr, uint64_t server_id)
 		return DQLITE_CLIENT_PROTO_ERROR;
 	}
 	c->server_id = server_id;
+	c->shm = NULL;
 
 	rv = buffer__init(&c->read);
 	if (rv != 0) {
@@ -334,6 +463,11 @@ void clientClose(struct client_proto *c)
 	if (c->fd == -1) {
 		return;
 	}
+	if (c->shm != NULL) {
+		shm__close(c->shm);
+		free(c->shm);
+		c->shm = NULL;
+	}
 	close(c->fd);
 	c->fd = -1;
 	buffer__close(&c->write);
@@ -364,6 +498,60 @@ int clientSendHandshake(struct client_proto *c, struct client_context *context)
 	return 0;
 }
 
+int clientSendHandshakeShm(struct client_proto *c,
+			   struct client_context *context)
+{
+	uint64_t protocol;
+	int fds[SHM__N_FDS];
+	struct pollfd pfd;
+	struct shm *shm;
+	ssize_t n;
+	int rv;
+
+	tracef("client send shm handshake");
+	assert(c->shm == NULL);
+	protocol = ByteFlipLe64(DQLITE_PROTOCOL_SHM);
+
+	n = doWrite(c->fd, &protocol, sizeof protocol, context);
+	if (n < 0) {
+		tracef("client send shm handshake failed %zd", n);
+		return DQLITE_CLIENT_PROTO_ERROR;
+	} else if ((size_t)n < sizeof protocol) {
+		return DQLITE_CLIENT_PROTO_SHORT;
+	}
+
+	pfd.fd = c->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	do {
+		rv = poll(&pfd, 1, contextTimeout(context));
+	} while (rv < 0 && errno == EINTR);
+	if (rv < 0) {
+		return DQLITE_CLIENT_PROTO_ERROR;
+	} else if (rv == 0) {
+		return DQLITE_CLIENT_PROTO_SHORT;
+	}
+	rv = shm__recv(c->fd, &protocol, sizeof protocol, fds);
+	if (rv != 0) {
+		tracef("client recv shm channel failed %d", rv);
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+
+	shm = mallocChecked(sizeof *shm);
+	rv = shm__attach(shm, fds);
+	if (rv != 0) {
+		free(shm);
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+	if (ByteFlipLe64(protocol) != DQLITE_PROTOCOL_SHM) {
+		shm__close(shm);
+		free(shm);
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+	c->shm = shm;
+	return 0;
+}
+
 static int writeMessage(struct client_proto *c,
 			uint8_t type,
 			uint8_t schema,
@@ -381,7 +569,7 @@ static int writeMessage(struct client_proto *c,
 	message.schema = schema;
 	cursor = buffer__cursor(&c->write, 0);
 	message__encode(&message, &cursor);
-	rv = doWrite(c->fd, buffer__cursor(&c->write, 0), n, context);
+	rv = writeBytes(c, buffer__cursor(&c->write, 0), n, context);
 	if (rv < 0) {
 		tracef("request write failed rv:%zd", rv);
 		return DQLITE_CLIENT_PROTO_ERROR;
@@ -437,7 +625,7 @@ static int readMessage(struct client_proto *c,
 	if (p == NULL) {
 		oom();
 	}
-	rv = doRead(c->fd, p, n, context);
+	rv = readBytes(c, p, n, context);
 	if (rv < 0) {
 		return DQLITE_CLIENT_PROTO_ERROR;
 	} else if (rv < (ssize_t)n) {
@@ -458,7 +646,7 @@ static int readMessage(struct client_proto *c,
 	if (p == NULL) {
 		oom();
 	}
-	rv = doRead(c->fd, p, n, context);
+	rv = readBytes(c, p, n, context);
 	if (rv < 0) {
 		return DQLITE_ERROR;
 	} else if (rv < (ssize_t)n) {
@@ -570,9 +758,9 @@ int clientRecvStmt(struct client_proto *c,
 	return 0;
 }
 
-static int bufferParams(struct client_proto *c,
-			struct value *params,
-			unsigned n_params)
+int clientBufferParams(struct buffer *buffer,
+		       struct value *params,
+		       unsigned n_params)
 {
 	struct tuple_encoder tup;
 	size_t i;
@@ -581,7 +769,7 @@ static int bufferParams(struct client_proto *c,
 	if (n_params == 0) {
 		return 0;
 	}
-	rv = tuple_encoder__init(&tup, n_params, TUPLE__PARAMS32, &c->write);
+	rv = tuple_encoder__init(&tup, n_params, TUPLE__PARAMS32, buffer);
 	if (rv != 0) {
 		return DQLITE_CLIENT_PROTO_ERROR;
 	}
@@ -608,7 +796,7 @@ int clientSendExec(struct client_proto *c,
 	request.stmt_id = stmt_id;
 	BUFFER_REQUEST(exec, EXEC);
 
-	rv = bufferParams(c, params, n_params);
+	rv = clientBufferParams(&c->write, params, n_params);
 	if (rv != 0) {
 		return rv;
 	}
@@ -630,7 +818,7 @@ int clientSendExecSQL(struct client_proto *c,
 	request.sql = sql;
 	BUFFER_REQUEST(exec_sql, EXEC_SQL);
 
-	rv = bufferParams(c, params, n_params);
+	rv = clientBufferParams(&c->write, params, n_params);
 	if (rv != 0) {
 		return rv;
 	}
@@ -669,7 +857,7 @@ int clientSendQuery(struct client_proto *c,
 	request.stmt_id = stmt_id;
 	BUFFER_REQUEST(query, QUERY);
 
-	rv = bufferParams(c, params, n_params);
+	rv = clientBufferParams(&c->write, params, n_params);
 	if (rv != 0) {
 		return rv;
 	}
@@ -691,7 +879,7 @@ int clientSendQuerySQL(struct client_proto *c,
 	request.sql = sql;
 	BUFFER_REQUEST(query_sql, QUERY_SQL);
 
-	rv = bufferParams(c, params, n_params);
+	rv = clientBufferParams(&c->write, params, n_params);
 	if (rv != 0) {
 		return rv;
 	}
@@ -838,6 +1026,308 @@ void clientCloseRows(struct rows *rows)
 	free(rows->column_names);
 }
 
+/* Store a decoded value in the arena of the given rows object. */
+static void storeRowsValue(struct client_rows *rows,
+			   unsigned row,
+			   unsigned column,
+			   const struct value *value)
+{
+	struct client_column *col;
+	union client_cell *cell;
+
+	if (rows->values != NULL) {
+		rows->values[(size_t)row * rows->column_count + column] = *value;
+		return;
+	}
+
+	col = &rows->columns[column];
+	cell = &col->cells[row];
+	col->types[row] = (uint8_t)value->type;
+	switch (value->type) {
+		case SQLITE_INTEGER:
+			cell->integer = value->integer;
+			break;
+		case DQLITE_UNIXTIME:
+			cell->integer = value->unixtime;
+			break;
+		case DQLITE_BOOLEAN:
+			cell->integer = (int64_t)value->boolean;
+			break;
+		case SQLITE_FLOAT:
+			cell->real = value->real;
+			break;
+		case SQLITE_TEXT:
+			cell->offset =
+			    (uint64_t)((const uint8_t *)value->text - rows->payload);
+			break;
+		case DQLITE_ISO8601:
+			cell->offset = (uint64_t)((const uint8_t *)value->iso8601 -
+						  rows->payload);
+			break;
+		case SQLITE_BLOB:
+			cell->offset = (uint64_t)((const uint8_t *)value->blob.base -
+						  rows->payload);
+			break;
+		default:
+			cell->integer = 0;
+			break;
+	}
+}
+
+/* Decode the rows of a response up to the end marker, storing their values in
+ * the arena if requested, or just counting them otherwise. */
+static int decodeRowsArena(struct cursor *cursor,
+			   struct client_rows *rows,
+			   bool store,
+			   uint64_t *eof)
+{
+	struct tuple_decoder tup;
+	struct value value;
+	unsigned row = 0;
+	unsigned i;
+	int rv;
+
+	while (1) {
+		rv = peekUint64(*cursor, eof);
+		if (rv != 0) {
+			return rv;
+		}
+		if (*eof == DQLITE_RESPONSE_ROWS_DONE ||
+		    *eof == DQLITE_RESPONSE_ROWS_PART) {
+			break;
+		}
+		if (row == UINT_MAX) {
+			return DQLITE_CLIENT_PROTO_ERROR;
+		}
+		rv = tuple_decoder__init(&tup, rows->column_count, TUPLE__ROW,
+					 cursor);
+		if (rv != 0) {
+			return DQLITE_CLIENT_PROTO_ERROR;
+		}
+		for (i = 0; i < rows->column_count; ++i) {
+			rv = tuple_decoder__next(&tup, &value);
+			if (rv != 0) {
+				return DQLITE_CLIENT_PROTO_ERROR;
+			}
+			if (store) {
+				storeRowsValue(rows, row, i, &value);
+			}
+		}
+		row++;
+	}
+
+	rows->row_count = row;
+	return 0;
+}
+
+/* Decode the payload of a rows response into an arena allocated with the given
+ * function, copying the payload there if requested, or borrowing it otherwise.
+ * Return DQLITE_NOMEM if the allocation fails, done being set anyway. */
+static int decodeRows(const void *payload,
+		      size_t payload_len,
+		      struct client_rows *rows,
+		      bool columnar,
+		      bool copy,
+		      void *(*alloc)(size_t),
+		      bool *done)
+{
+	struct cursor cursor;
+	uint64_t column_count;
+	uint64_t eof;
+	const char *raw;
+	size_t n_values;
+	size_t size;
+	uint8_t *p;
+	unsigned i;
+	int rv;
+
+	*rows = (struct client_rows){0};
+
+	/* Validate the response and count its rows first, so that the arena
+	 * can be sized exactly. */
+	cursor.p = payload;
+	cursor.cap = payload_len;
+	rv = uint64__decode(&cursor, &column_count);
+	if (rv != 0 || column_count > UINT_MAX) {
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+	rows->column_count = (unsigned)column_count;
+	for (i = 0; i < rows->column_count; ++i) {
+		rv = text__decode(&cursor, &raw);
+		if (rv != 0) {
+			return DQLITE_CLIENT_PROTO_ERROR;
+		}
+	}
+	rv = decodeRowsArena(&cursor, rows, false, &eof);
+	if (rv != 0) {
+		return rv;
+	}
+	if (done != NULL) {
+		*done = eof == DQLITE_RESPONSE_ROWS_DONE;
+	}
+
+	/* The payload is a whole number of words, which keeps the arrays that
+	 * follow it aligned. Cell types go last since they are single bytes. */
+	n_values = (size_t)rows->row_count * rows->column_count;
+	size = copy ? payload_len : 0;
+	size += rows->column_count * sizeof *rows->column_names;
+	if (columnar) {
+		size += rows->column_count * sizeof *rows->columns;
+		size += n_values * (sizeof(union client_cell) + sizeof(uint8_t));
+	} else {
+		size += n_values * sizeof *rows->values;
+	}
+	p = alloc(size > 0 ? size : 1);
+	if (p == NULL) {
+		*rows = (struct client_rows){0};
+		return DQLITE_NOMEM;
+	}
+	rows->arena = p;
+
+	if (copy) {
+		memcpy(p, payload, payload_len);
+		rows->payload = p;
+		p += payload_len;
+	} else {
+		rows->payload = payload;
+	}
+	rows->column_names = (const char **)(void *)p;
+	p += rows->column_count * sizeof *rows->column_names;
+	if (columnar) {
+		rows->columns = (struct client_column *)(void *)p;
+		p += rows->column_count * sizeof *rows->columns;
+		for (i = 0; i < rows->column_count; ++i) {
+			rows->columns[i].cells = (union client_cell *)(void *)p;
+			p += rows->row_count * sizeof(union client_cell);
+		}
+		for (i = 0; i < rows->column_count; ++i) {
+			rows->columns[i].types = p;
+			p += rows->row_count;
+		}
+	} else {
+		rows->values = (struct value *)(void *)p;
+	}
+
+	/* Decode the validated payload again, which can't fail anymore. */
+	cursor.p = (const char *)rows->payload;
+	cursor.cap = payload_len;
+	rv = uint64__decode(&cursor, &column_count);
+	assert(rv == 0);
+	for (i = 0; i < rows->column_count; ++i) {
+		rv = text__decode(&cursor, &rows->column_names[i]);
+		assert(rv == 0);
+	}
+	rv = decodeRowsArena(&cursor, rows, true, &eof);
+	assert(rv == 0);
+
+	return 0;
+}
+
+int clientDecodeRowsArena(const void *payload,
+			  size_t payload_len,
+			  struct client_rows *rows,
+			  bool columnar,
+			  bool *done)
+{
+	return decodeRows(payload, payload_len, rows, columnar, true,
+			  mallocChecked, done);
+}
+
+int clientDecodeRowsInPlace(const void *payload,
+			    size_t payload_len,
+			    struct client_rows *rows,
+			    bool columnar,
+			    bool *done)
+{
+	return decodeRows(payload, payload_len, rows, columnar, false, malloc,
+			  done);
+}
+
+int clientRecvRowsArena(struct client_proto *c,
+			struct client_rows *rows,
+			bool columnar,
+			bool *done,
+			struct client_context *context)
+{
+	tracef("client recv rows arena");
+	uint8_t type;
+	int rv;
+
+	*rows = (struct client_rows){0};
+
+	rv = readMessage(c, &type, context);
+	if (rv != 0) {
+		return rv;
+	}
+	if (type == DQLITE_RESPONSE_FAILURE) {
+		rv = handleFailure(c);
+		return rv;
+	} else if (type != DQLITE_RESPONSE_ROWS) {
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+
+	return clientDecodeRowsArena(buffer__cursor(&c->read, 0),
+				     buffer__offset(&c->read), rows, columnar,
+				     done);
+}
+
+void clientRowsGet(const struct client_rows *rows,
+		   unsigned row,
+		   unsigned column,
+		   struct value *value)
+{
+	const struct client_column *col;
+	union client_cell cell;
+	uint64_t len;
+
+	assert(row < rows->row_count);
+	assert(column < rows->column_count);
+
+	if (rows->values != NULL) {
+		*value = rows->values[(size_t)row * rows->column_count + column];
+		return;
+	}
+
+	col = &rows->columns[column];
+	cell = col->cells[row];
+	value->type = col->types[row];
+	switch (value->type) {
+		case SQLITE_INTEGER:
+			value->integer = cell.integer;
+			break;
+		case DQLITE_UNIXTIME:
+			value->unixtime = cell.integer;
+			break;
+		case DQLITE_BOOLEAN:
+			value->boolean = (uint64_t)cell.integer;
+			break;
+		case SQLITE_FLOAT:
+			value->real = cell.real;
+			break;
+		case SQLITE_TEXT:
+			value->text = (const char *)&rows->payload[cell.offset];
+			break;
+		case DQLITE_ISO8601:
+			value->iso8601 = (const char *)&rows->payload[cell.offset];
+			break;
+		case SQLITE_BLOB:
+			memcpy(&len, &rows->payload[cell.offset - sizeof len],
+			       sizeof len);
+			value->blob.base = (char *)&rows->payload[cell.offset];
+			value->blob.len = (size_t)ByteFlipLe64(len);
+			break;
+		default:
+			value->null = 0;
+			break;
+	}
+}
+
+void clientCloseRowsArena(struct client_rows *rows)
+{
+	free(rows->arena);
+	*rows = (struct client_rows){0};
+}
+
 int clientSendInterrupt(struct client_proto *c, struct client_context *context)
 {
 	tracef("client send interrupt");
@@ -909,6 +1399,46 @@ int clientSendDump(struct client_proto *c, struct client_context *context)
 	return 0;
 }
 
+int clientSendBackup(struct client_proto *c,
+		     uint64_t position,
+		     struct client_context *context)
+{
+	tracef("client send backup");
+	struct request_backup request;
+	assert(c->db_is_init);
+	assert(c->db_name != NULL);
+	request.filename = c->db_name;
+	request.position = position;
+	REQUEST(backup, BACKUP, 0);
+	return 0;
+}
+
+int clientSendTimeout(struct client_proto *c,
+		      uint64_t msecs,
+		      struct client_context *context)
+{
+	tracef("client send timeout %" PRIu64, msecs);
+	struct request_timeout request;
+	request.db_id = c->db_id;
+	request.msecs = msecs;
+	REQUEST(timeout, TIMEOUT, 0);
+	return 0;
+}
+
+int clientSendSubscribe(struct client_proto *c,
+			uint64_t index,
+			struct client_context *context)
+{
+	tracef("client send subscribe %" PRIu64, index);
+	struct request_subscribe request;
+	assert(c->db_is_init);
+	assert(c->db_name != NULL);
+	request.filename = c->db_name;
+	request.index = index;
+	REQUEST(subscribe, SUBSCRIBE, 0);
+	return 0;
+}
+
 int clientSendCluster(struct client_proto *c, struct client_context *context)
 {
 	tracef("client send cluster");
@@ -1107,6 +1637,95 @@ err_after_alloc_fs:
 	return rv;
 }
 
+int clientRecvPages(struct client_proto *c,
+		    struct client_pages *pages,
+		    struct client_context *context)
+{
+	tracef("client recv pages");
+	struct cursor cursor;
+	struct response_pages response;
+	RESPONSE(pages, PAGES);
+	if (response.n > cursor.cap / (8 + response.page_size)) {
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+	pages->done = response.eof == DQLITE_RESPONSE_ROWS_DONE;
+	pages->position = response.position;
+	pages->incremental = response.incremental != 0;
+	pages->database_size = response.database_size;
+	pages->page_size = response.page_size;
+	pages->n = response.n;
+	pages->records = (const uint8_t *)cursor.p;
+	return 0;
+}
+
+void clientPagesGet(const struct client_pages *pages,
+		    uint64_t i,
+		    uint64_t *pgno,
+		    const void **page)
+{
+	const uint8_t *record;
+
+	assert(i < pages->n);
+	record = pages->records + i * (8 + pages->page_size);
+	memcpy(pgno, record, sizeof *pgno);
+	*pgno = ByteFlipLe64(*pgno);
+	*page = record + 8;
+}
+
+int clientRecvChanges(struct client_proto *c,
+		      struct client_changes *changes,
+		      struct client_context *context)
+{
+	tracef("client recv changes");
+	struct cursor cursor;
+	struct response_changes response;
+	RESPONSE(changes, CHANGES);
+	changes->done = response.eof == DQLITE_RESPONSE_ROWS_DONE;
+	changes->index = response.index;
+	changes->n = response.n;
+	changes->records = (const uint8_t *)cursor.p;
+	changes->len = cursor.cap;
+	return 0;
+}
+
+int clientChangesNext(struct client_changes *changes,
+		      struct client_change *change)
+{
+	struct cursor cursor = {
+		.p = (const char *)changes->records,
+		.cap = changes->len,
+	};
+	struct response_change header;
+	int rv;
+
+	rv = response_change__decode(&cursor, &header);
+	if (rv != 0 || header.page_size == 0 ||
+	    header.n > cursor.cap / (8 + header.page_size)) {
+		return DQLITE_CLIENT_PROTO_ERROR;
+	}
+	change->index = header.index;
+	change->page_size = header.page_size;
+	change->n = header.n;
+	change->records = (const uint8_t *)cursor.p;
+	changes->records = change->records + header.n * (8 + header.page_size);
+	changes->len = cursor.cap - header.n * (8 + header.page_size);
+	return 0;
+}
+
+void clientChangeGet(const struct client_change *change,
+		     uint64_t i,
+		     uint64_t *pgno,
+		     const void **page)
+{
+	const uint8_t *record;
+
+	assert(i < change->n);
+	record = change->records + i * (8 + change->page_size);
+	memcpy(pgno, record, sizeof *pgno);
+	*pgno = ByteFlipLe64(*pgno);
+	*page = record + 8;
+}
+
 int clientRecvMetadata(struct client_proto *c,
 		       uint64_t *failure_domain,
 		       uint64_t *weight,
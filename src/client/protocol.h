@@ -6,6 +6,7 @@
 #include "../../include/dqlite.h"
 
 #include "../lib/buffer.h"
+#include "../lib/shm.h"
 
 #include "../tuple.h"
 
@@ -39,6 +40,7 @@ struct client_proto
 	int (*connect)(void *, const char *, int *);
 	void *connect_arg;
 	int fd;          /* Connected socket */
+	struct shm *shm; /* Shared memory channel replacing the socket, or NULL */
 	uint32_t db_id;  /* Database ID provided by the server */
 	char *db_name;   /* Database filename (owned) */
 	bool db_is_init; /* Whether the database ID has been initialized */
@@ -80,6 +82,74 @@ struct rows
 	struct row *next;
 };
 
+/* A column of rows decoded in columnar layout. Each array has one entry per
+ * row, and the value of a row is stored in the cells array according to its
+ * type: as an integer for SQLITE_INTEGER, DQLITE_UNIXTIME and DQLITE_BOOLEAN,
+ * as a real for SQLITE_FLOAT, and as the offset of its data in the payload for
+ * SQLITE_TEXT, DQLITE_ISO8601 and SQLITE_BLOB. Text is zero-terminated, while
+ * the length of a blob is stored in the 8 bytes preceding its data. */
+union client_cell {
+	int64_t integer;
+	double real;
+	uint64_t offset;
+};
+
+struct client_column
+{
+	uint8_t *types;
+	union client_cell *cells;
+};
+
+/* Rows of a single response, decoded without allocating anything per row or
+ * per value. The payload of the response is copied once, unless it's borrowed,
+ * and column names, text and blobs point into it. Everything lives in a single
+ * arena, released with clientCloseRowsArena. */
+struct client_rows
+{
+	unsigned column_count;
+	unsigned row_count;
+	const char **column_names;
+	struct value *values;          /* Row-major layout, or NULL. */
+	struct client_column *columns; /* Columnar layout, or NULL. */
+	const uint8_t *payload;        /* Response payload, copied or not. */
+	void *arena;
+};
+
+/* A chunk of the pages of a database received in response to a backup
+ * request, borrowed from the read buffer until the next response. */
+struct client_pages
+{
+	bool done;              /* Whether this is the last chunk. */
+	uint64_t position;      /* To pass to the next incremental backup. */
+	bool incremental;       /* Whether only changed pages are sent. */
+	uint64_t database_size; /* Number of pages of the database. */
+	uint64_t page_size;
+	uint64_t n;             /* Number of pages in this chunk. */
+	const uint8_t *records; /* Page numbers, each followed by its page. */
+};
+
+/* A batch of the transactions committed to a database, received from a
+ * subscription, borrowed from the read buffer until the next response. */
+struct client_changes
+{
+	bool done;              /* Whether the subscription ended. */
+	uint64_t index;         /* To pass to the next subscription. */
+	uint64_t n;             /* Number of changes in this batch. */
+	const uint8_t *records; /* Changes not returned by clientChangesNext. */
+	size_t len;             /* Size of the records. */
+};
+
+/* A transaction committed to a database. The size of the database after it is
+ * found in the header of page 1, which is part of any transaction changing
+ * it. */
+struct client_change
+{
+	uint64_t index;         /* Raft index of the entry that committed it. */
+	uint64_t page_size;
+	uint64_t n;             /* Number of pages written. */
+	const uint8_t *records; /* Page numbers, each followed by its page. */
+};
+
 struct client_node_info
 {
 	uint64_t id;
@@ -119,6 +189,14 @@ DQLITE_VISIBLE_TO_TESTS void clientClose(struct client_proto *c);
 DQLITE_VISIBLE_TO_TESTS int clientSendHandshake(struct client_proto *c,
 						struct client_context *context);
 
+/* Like clientSendHandshake, but also ask the server to move the connection to
+ * shared memory, which avoids syscalls and socket copies for every message.
+ * The client must be connected to the server over a Unix socket, and be on
+ * the same host. Servers that don't support it close the connection. */
+DQLITE_VISIBLE_TO_TESTS int clientSendHandshakeShm(
+    struct client_proto *c,
+    struct client_context *context);
+
 /* Send a request to get the current leader. */
 DQLITE_VISIBLE_TO_TESTS int clientSendLeader(struct client_proto *c,
 					     struct client_context *context);
@@ -149,6 +227,11 @@ DQLITE_VISIBLE_TO_TESTS int clientRecvStmt(struct client_proto *c,
 					   uint64_t *offset,
 					   struct client_context *context);
 
+/* Append the given statement parameters to a request being encoded. */
+DQLITE_VISIBLE_TO_TESTS int clientBufferParams(struct buffer *buffer,
+					       struct value *params,
+					       unsigned n_params);
+
 /* Send a request to execute a statement. */
 DQLITE_VISIBLE_TO_TESTS int clientSendExec(struct client_proto *c,
 					   uint32_t stmt_id,
@@ -192,6 +275,41 @@ DQLITE_VISIBLE_TO_TESTS int clientRecvRows(struct client_proto *c,
 /* Release all memory used in the given rows object. */
 DQLITE_VISIBLE_TO_TESTS void clientCloseRows(struct rows *rows);
 
+/* Receive the response of a query request, decoding all its rows into a
+ * single arena, in columnar layout if requested. */
+DQLITE_VISIBLE_TO_TESTS int clientRecvRowsArena(struct client_proto *c,
+						struct client_rows *rows,
+						bool columnar,
+						bool *done,
+						struct client_context *context);
+
+/* Decode the payload of a rows response like clientRecvRowsArena does. */
+DQLITE_VISIBLE_TO_TESTS int clientDecodeRowsArena(const void *payload,
+						  size_t payload_len,
+						  struct client_rows *rows,
+						  bool columnar,
+						  bool *done);
+
+/* Decode the payload of a rows response like clientDecodeRowsArena, without
+ * copying it: the rows object borrows the payload, which must outlive it. Only
+ * the arrays pointing into the payload are allocated, and DQLITE_NOMEM is
+ * returned if that fails, done being still set. */
+DQLITE_VISIBLE_TO_TESTS int clientDecodeRowsInPlace(const void *payload,
+						    size_t payload_len,
+						    struct client_rows *rows,
+						    bool columnar,
+						    bool *done);
+
+/* Get the value at the given row and column, whatever the layout. The value
+ * borrows its text or blob from the rows object. */
+DQLITE_VISIBLE_TO_TESTS void clientRowsGet(const struct client_rows *rows,
+					   unsigned row,
+					   unsigned column,
+					   struct value *value);
+
+/* Release the arena of the given rows object. */
+DQLITE_VISIBLE_TO_TESTS void clientCloseRowsArena(struct client_rows *rows);
+
 /* Send a request to interrupt a server that's sending rows. */
 DQLITE_VISIBLE_TO_TESTS int clientSendInterrupt(struct client_proto *c,
 						struct client_context *context);
@@ -222,6 +340,33 @@ DQLITE_VISIBLE_TO_TESTS int clientSendRemove(struct client_proto *c,
 DQLITE_VISIBLE_TO_TESTS int clientSendDump(struct client_proto *c,
 					   struct client_context *context);
 
+/* Send a request to stream the pages of the attached database, or only the
+ * ones changed since the given position, as returned by a previous backup. */
+DQLITE_VISIBLE_TO_TESTS int clientSendBackup(struct client_proto *c,
+					     uint64_t position,
+					     struct client_context *context);
+
+/* Send a request to limit the time that the statements of the attached
+ * database can take, in milliseconds, or to lift the limit if 0. Statements
+ * running past the limit are aborted with SQLITE_INTERRUPT. Unlike query time
+ * slices, which only end between rows, this also bounds statements that
+ * return no row until they're done, like COUNT(*). */
+DQLITE_VISIBLE_TO_TESTS int clientSendTimeout(struct client_proto *c,
+					      uint64_t msecs,
+					      struct client_context *context);
+
+/* Send a request to follow the transactions committed to the attached
+ * database after the given raft index, or after the current one if 0. The
+ * changes keep coming in CHANGES responses as they are committed, until the
+ * connection is closed.
+ *
+ * The subscription ends if the node doesn't have the changes that follow the
+ * ones received anymore. The subscriber must then subscribe again from 0,
+ * take a backup, and apply the changes received on top of it. */
+DQLITE_VISIBLE_TO_TESTS int clientSendSubscribe(struct client_proto *c,
+						uint64_t index,
+						struct client_context *context);
+
 /* Send a request to list the nodes of the cluster with their addresses and
  * roles. */
 DQLITE_VISIBLE_TO_TESTS int clientSendCluster(struct client_proto *c,
@@ -273,6 +418,32 @@ DQLITE_VISIBLE_TO_TESTS int clientRecvFiles(struct client_proto *c,
 					    size_t *n_files,
 					    struct client_context *context);
 
+/* Receive a chunk of pages in response to a backup request. */
+DQLITE_VISIBLE_TO_TESTS int clientRecvPages(struct client_proto *c,
+					    struct client_pages *pages,
+					    struct client_context *context);
+
+/* Get the page number and the content of a page of the given chunk. */
+DQLITE_VISIBLE_TO_TESTS void clientPagesGet(const struct client_pages *pages,
+					    uint64_t i,
+					    uint64_t *pgno,
+					    const void **page);
+
+/* Receive a batch of changes from a subscription. */
+DQLITE_VISIBLE_TO_TESTS int clientRecvChanges(struct client_proto *c,
+					      struct client_changes *changes,
+					      struct client_context *context);
+
+/* Decode the next change of the given batch. */
+DQLITE_VISIBLE_TO_TESTS int clientChangesNext(struct client_changes *changes,
+					      struct client_change *change);
+
+/* Get the page number and the content of a page of the given change. */
+DQLITE_VISIBLE_TO_TESTS void clientChangeGet(const struct client_change *change,
+					     uint64_t i,
+					     uint64_t *pgno,
+					     const void **page);
+
 /* Receive metadata for a single server. */
 DQLITE_VISIBLE_TO_TESTS int clientRecvMetadata(struct client_proto *c,
 					       uint64_t *failure_domain,
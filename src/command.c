@@ -1,5 +1,6 @@
 #include <sqlite3.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "../include/dqlite.h"
 
@@ -46,26 +47,28 @@ static void frames__encode(const frames_t *frames, char **cursor)
 	}
 }
 
-static int page_numbers__decode(struct cursor *cursor, frames_t *frames)
+static int page_numbers__decode(struct cursor *cursor,
+				uint32_t n_pages,
+				uint64_t **page_numbers)
 {
-	if (frames->n_pages == 0) {
-		frames->page_numbers = NULL;
+	if (n_pages == 0) {
+		*page_numbers = NULL;
 		return DQLITE_OK;
 	}
-	frames->page_numbers = sqlite3_malloc64(sizeof(*frames->page_numbers) * frames->n_pages);
-	if (frames->page_numbers == NULL) {
+	*page_numbers = sqlite3_malloc64(sizeof(**page_numbers) * n_pages);
+	if (*page_numbers == NULL) {
 		return DQLITE_NOMEM;
 	}
 
-	for (uint32_t i = 0; i < frames->n_pages; i++) {
+	for (uint32_t i = 0; i < n_pages; i++) {
 		uint64_t pgno;
 		int rv = uint64__decode(cursor, &pgno);
 		if (rv != 0) {
-			sqlite3_free(frames->page_numbers);
+			sqlite3_free(*page_numbers);
 			return rv;
 		}
 		assert(pgno <= INT32_MAX);
-		frames->page_numbers[i] = (unsigned long)pgno;
+		(*page_numbers)[i] = (unsigned long)pgno;
 	}
 
 	return DQLITE_OK;
@@ -111,7 +114,8 @@ static int frames__decode(struct cursor *cursor, frames_t *frames)
 	if (rc != 0) {
 		return rc;
 	}
-	rc = page_numbers__decode(cursor, frames);
+	rc = page_numbers__decode(cursor, frames->n_pages,
+				  &frames->page_numbers);
 	if (rc != 0) {
 		return rc;
 	}
@@ -124,6 +128,206 @@ static int frames__decode(struct cursor *cursor, frames_t *frames)
 	return DQLITE_OK;
 }
 
+/* Kinds of page delta records. */
+enum { DELTA_FULL = 1, DELTA_PATCHES };
+
+/* Equal words between two changed ranges of a page that are still covered by
+ * a single patch, as a patch header is as large as a word. */
+#define DELTA__MERGE_GAP 1
+
+static size_t deltas__sizeof(const deltas_t *deltas)
+{
+	return uint32__sizeof(&deltas->n_pages) +
+	       uint16__sizeof(&deltas->page_size) +
+	       uint16__sizeof(&deltas->__unused__) +
+	       sizeof(uint64_t) * deltas->n_pages + /* Page numbers */
+	       uint64__sizeof(&deltas->len) +
+	       (size_t)deltas->len; /* Records */
+}
+
+static void deltas__encode(const deltas_t *deltas, char **cursor)
+{
+	unsigned i;
+	uint32__encode(&deltas->n_pages, cursor);
+	uint16__encode(&deltas->page_size, cursor);
+	uint16__encode(&deltas->__unused__, cursor);
+
+	for (i = 0; i < deltas->n_pages; i++) {
+		uint64__encode(&deltas->page_numbers[i], cursor);
+	}
+	uint64__encode(&deltas->len, cursor);
+	memcpy(*cursor, deltas->records, (size_t)deltas->len);
+	*cursor += deltas->len;
+}
+
+static int deltas__decode(struct cursor *cursor, deltas_t *deltas)
+{
+	int rc;
+	rc = uint32__decode(cursor, &deltas->n_pages);
+	if (rc != 0) {
+		return rc;
+	}
+	rc = uint16__decode(cursor, &deltas->page_size);
+	if (rc != 0) {
+		return rc;
+	}
+	rc = uint16__decode(cursor, &deltas->__unused__);
+	if (rc != 0) {
+		return rc;
+	}
+	rc = page_numbers__decode(cursor, deltas->n_pages,
+				  &deltas->page_numbers);
+	if (rc != 0) {
+		return rc;
+	}
+	rc = uint64__decode(cursor, &deltas->len);
+	if (rc != 0 || deltas->len > cursor->cap || deltas->len % 8 != 0) {
+		sqlite3_free(deltas->page_numbers);
+		return DQLITE_PARSE;
+	}
+
+	/* Records are validated while being applied. */
+	deltas->records = (void *)cursor->p;
+	cursor->p += deltas->len;
+	cursor->cap -= deltas->len;
+
+	return DQLITE_OK;
+}
+
+/* A record starts with its kind and number of patches, followed either by the
+ * whole page or by the patches, each with its offset, its length and its
+ * bytes. Offsets and lengths are multiple of 8, keeping records aligned. */
+size_t command__delta_encode(const void *base,
+			     const void *page,
+			     unsigned page_size,
+			     void *out)
+{
+	const char *a = base;
+	const char *b = page;
+	unsigned n_words = page_size / 8;
+	size_t size = 8;
+	uint32_t kind;
+	uint32_t n = 0;
+	unsigned i = 0;
+	char *cursor;
+
+	assert(page_size % 8 == 0);
+
+	if (base == NULL) {
+		goto full;
+	}
+
+	cursor = (char *)out + size;
+	while (i < n_words) {
+		unsigned start;
+		uint32_t offset;
+		uint32_t length;
+
+		if (memcmp(a + i * 8, b + i * 8, 8) == 0) {
+			i++;
+			continue;
+		}
+
+		start = i;
+		i++;
+		while (i < n_words) {
+			unsigned j;
+			if (memcmp(a + i * 8, b + i * 8, 8) != 0) {
+				i++;
+				continue;
+			}
+			for (j = i + 1; j < n_words && j <= i + DELTA__MERGE_GAP;
+			     j++) {
+				if (memcmp(a + j * 8, b + j * 8, 8) != 0) {
+					break;
+				}
+			}
+			if (j >= n_words || j > i + DELTA__MERGE_GAP) {
+				break;
+			}
+			i = j + 1;
+		}
+
+		offset = start * 8;
+		length = (i - start) * 8;
+		if (size + 8 + length >= COMMAND__DELTA_MAX(page_size)) {
+			goto full;
+		}
+		uint32__encode(&offset, &cursor);
+		uint32__encode(&length, &cursor);
+		memcpy(cursor, b + offset, length);
+		cursor += length;
+		size += 8 + length;
+		n++;
+	}
+
+	kind = DELTA_PATCHES;
+	cursor = out;
+	uint32__encode(&kind, &cursor);
+	uint32__encode(&n, &cursor);
+	return size;
+
+full:
+	kind = DELTA_FULL;
+	n = 0;
+	cursor = out;
+	uint32__encode(&kind, &cursor);
+	uint32__encode(&n, &cursor);
+	memcpy(cursor, page, page_size);
+	return COMMAND__DELTA_MAX(page_size);
+}
+
+size_t command__delta_apply(const void *record,
+			    size_t len,
+			    const void *base,
+			    unsigned page_size,
+			    void *page)
+{
+	struct cursor cursor = {record, len};
+	uint32_t kind;
+	uint32_t n;
+	uint32_t i;
+
+	if (uint32__decode(&cursor, &kind) != 0 ||
+	    uint32__decode(&cursor, &n) != 0) {
+		return 0;
+	}
+
+	switch (kind) {
+		case DELTA_FULL:
+			if (n != 0 || cursor.cap < page_size) {
+				return 0;
+			}
+			memcpy(page, cursor.p, page_size);
+			cursor.cap -= page_size;
+			break;
+		case DELTA_PATCHES:
+			if (base == NULL) {
+				return 0;
+			}
+			memcpy(page, base, page_size);
+			for (i = 0; i < n; i++) {
+				uint32_t offset;
+				uint32_t length;
+				if (uint32__decode(&cursor, &offset) != 0 ||
+				    uint32__decode(&cursor, &length) != 0 ||
+				    length > cursor.cap ||
+				    offset > page_size ||
+				    length > page_size - offset) {
+					return 0;
+				}
+				memcpy((char *)page + offset, cursor.p, length);
+				cursor.p += length;
+				cursor.cap -= length;
+			}
+			break;
+		default:
+			return 0;
+	}
+
+	return len - cursor.cap;
+}
+
 #define COMMAND__IMPLEMENT(LOWER, UPPER, _) \
 	SERIALIZE__IMPLEMENT(command_##LOWER, COMMAND__##UPPER);
 
@@ -11,7 +11,13 @@
 #include "raft.h"
 
 /* Command type codes */
-enum { COMMAND_OPEN = 1, COMMAND_FRAMES, COMMAND_UNDO, COMMAND_CHECKPOINT };
+enum {
+	COMMAND_OPEN = 1,
+	COMMAND_FRAMES,
+	COMMAND_UNDO,
+	COMMAND_CHECKPOINT,
+	COMMAND_FRAMES_DELTA
+};
 
 /* Hold information about an array of WAL frames. */
 struct frames
@@ -25,6 +31,20 @@ struct frames
 
 typedef struct frames frames_t;
 
+/* Hold information about an array of WAL frames whose pages are encoded as
+ * page delta records, see command__delta_encode(). */
+struct deltas
+{
+	uint32_t   n_pages;
+	uint16_t   page_size;
+	uint16_t   __unused__;
+	uint64_t  *page_numbers;
+	uint64_t   len;     /* Total size of the records. */
+	void      *records; /* One record per page, back to back. */
+};
+
+typedef struct deltas deltas_t;
+
 /* Serialization definitions for a raft FSM command. */
 #define COMMAND__DEFINE(LOWER, UPPER, _) \
 	SERIALIZE__DEFINE_STRUCT(command_##LOWER, COMMAND__##UPPER);
@@ -38,16 +58,28 @@ typedef struct frames frames_t;
 	X(uint16, __unused2__, ##__VA_ARGS__) \
 	X(frames, frames, ##__VA_ARGS__)
 
+/* Same as a frames command, with pages encoded as deltas against their
+ * committed content. Can't be applied by nodes older than the format. */
+#define COMMAND__FRAMES_DELTA(X, ...)         \
+	X(text, filename, ##__VA_ARGS__)      \
+	X(uint64, tx_id, ##__VA_ARGS__)       \
+	X(uint32, truncate, ##__VA_ARGS__)    \
+	X(uint8, is_commit, ##__VA_ARGS__)    \
+	X(uint8, __unused1__, ##__VA_ARGS__)  \
+	X(uint16, __unused2__, ##__VA_ARGS__) \
+	X(deltas, frames, ##__VA_ARGS__)
+
 /* These commands are not used and are no-ops for now. */
 #define COMMAND__OPEN(X, ...) X(text, filename, ##__VA_ARGS__)
 #define COMMAND__UNDO(X, ...) X(uint64, tx_id, ##__VA_ARGS__)
 #define COMMAND__CHECKPOINT(X, ...) X(text, filename, ##__VA_ARGS__)
 
-#define COMMAND__TYPES(X, ...)         \
-	X(open, OPEN, __VA_ARGS__)     \
-	X(frames, FRAMES, __VA_ARGS__) \
-	X(undo, UNDO, __VA_ARGS__)     \
-	X(checkpoint, CHECKPOINT, __VA_ARGS__)
+#define COMMAND__TYPES(X, ...)                 \
+	X(open, OPEN, __VA_ARGS__)             \
+	X(frames, FRAMES, __VA_ARGS__)         \
+	X(undo, UNDO, __VA_ARGS__)             \
+	X(checkpoint, CHECKPOINT, __VA_ARGS__) \
+	X(frames_delta, FRAMES_DELTA, __VA_ARGS__)
 
 COMMAND__TYPES(COMMAND__DEFINE);
 
@@ -59,5 +91,27 @@ DQLITE_VISIBLE_TO_TESTS int command__decode(const struct raft_buffer *buf,
 					    int *type,
 					    void **command);
 
+/* Maximum size of the page delta record of a page of the given size. */
+#define COMMAND__DELTA_MAX(PAGE_SIZE) (8 + (size_t)(PAGE_SIZE))
+
+/* Encode the given page as a page delta record against base, its committed
+ * content, which is NULL for a page that doesn't exist yet. The record holds
+ * the changed byte ranges, or the whole page if that's not smaller. Return the
+ * size of the record written to out, which must have room for
+ * COMMAND__DELTA_MAX(page_size) bytes. */
+DQLITE_VISIBLE_TO_TESTS size_t command__delta_encode(const void *base,
+						     const void *page,
+						     unsigned page_size,
+						     void *out);
+
+/* Rebuild the page encoded by the record at the start of the given buffer of
+ * len bytes into page, using base as command__delta_encode() did. Return the
+ * size of the record, or 0 if it's malformed. */
+DQLITE_VISIBLE_TO_TESTS size_t command__delta_apply(const void *record,
+						    size_t len,
+						    const void *base,
+						    unsigned page_size,
+						    void *page);
+
 
 #endif /* COMMAND_H_*/
@@ -58,6 +58,17 @@ int config__init(struct config *c,
 	c->voters = 3;
 	c->standbys = 0;
 	c->pool_thread_count = 4;
+	c->snapshot_chain = 0;
+	c->frames_delta = false;
+	c->span_rate = 0;
+	c->span_cb = NULL;
+	c->span_arg = NULL;
+	memset(c->sched_limits, 0, sizeof c->sched_limits);
+	memset(c->sched_db_limits, 0, sizeof c->sched_db_limits);
+	c->sched_target = 0;
+	c->query_slice_steps = 0;
+	c->query_slice_usecs = 0;
+	c->feed_size = 0;
 	serial++;
 	return 0;
 }
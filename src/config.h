@@ -23,6 +23,17 @@ struct config {
 	int voters;                        /* Target number of voters */
 	int standbys;                      /* Target number of standbys */
 	unsigned pool_thread_count;    /* Number of threads in thread pool */
+	unsigned snapshot_chain;       /* Max incremental snapshots in a row */
+	bool frames_delta;             /* Replicate pages as deltas */
+	unsigned span_rate;            /* Trace 1 in span_rate transactions */
+	dqlite_span_cb span_cb;        /* Receives the traced transactions */
+	void *span_arg;                /* Argument of span_cb */
+	unsigned sched_limits[2];      /* Running statements per class */
+	unsigned sched_db_limits[2];   /* Same, against a single database */
+	unsigned sched_target;         /* Max queueing in ms, 0 for no limit */
+	unsigned query_slice_steps;    /* VM steps before a query yields */
+	unsigned query_slice_usecs;    /* Microseconds before a query yields */
+	size_t feed_size;              /* Bytes of changes kept per database */
 };
 
 /**
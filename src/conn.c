@@ -148,6 +148,12 @@ static void read_request_cb(struct transport *transport, int status)
 
 	switch (c->request.type) {
 		case DQLITE_REQUEST_CONNECT:
+			/* Raft takes over the stream, which doesn't carry
+			 * data anymore once switched to shared memory. */
+			if (c->transport.shm != NULL) {
+				conn__stop(c);
+				return;
+			}
 			raft_connect(c);
 			return;
 	}
@@ -229,6 +235,20 @@ static int read_message(struct conn *c)
 	return 0;
 }
 
+/* Move the connection to a shared memory channel, as requested by a client on
+ * the same host, and echo the request as acknowledgement. */
+static int switch_to_shm(struct conn *c)
+{
+	uint64_t ack = ByteFlipLe64(DQLITE_PROTOCOL_SHM);
+	int rv;
+	rv = transport__shm(&c->transport, &ack, sizeof ack);
+	if (rv != 0) {
+		return rv;
+	}
+	c->protocol = DQLITE_PROTOCOL_VERSION;
+	return 0;
+}
+
 static void read_protocol_cb(struct transport *transport, int status)
 {
 	struct conn *c = transport->data;
@@ -247,6 +267,14 @@ static void read_protocol_cb(struct transport *transport, int status)
 	rv = uint64__decode(&cursor, &c->protocol);
 	assert(rv == 0); /* Can't fail, we know we have enough bytes */
 
+	if (c->protocol == DQLITE_PROTOCOL_SHM) {
+		rv = switch_to_shm(c);
+		if (rv != 0) {
+			conn_trace(c, "switch to shared memory failed %d", rv);
+			goto abort;
+		}
+	}
+
 	if (c->protocol != DQLITE_PROTOCOL_VERSION &&
 	    c->protocol != DQLITE_PROTOCOL_VERSION_LEGACY) {
 		/* errorf(c->logger, "unknown protocol version: %lx", */
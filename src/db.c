@@ -5,6 +5,7 @@
 #include "../include/dqlite.h"
 
 #include "./lib/assert.h"
+#include "./lib/hash.h"
 
 #include "db.h"
 #include "tracing.h"
@@ -12,17 +13,9 @@
 /* Limit taken from sqlite unix vfs. */
 #define MAX_PATHNAME 512
 
-static uint32_t str_hash(const char* name)
-{
-	const unsigned char *p;
-	uint32_t h = 5381U;
-
-	for (p = (const unsigned char *) name; *p != '\0'; p++) {
-		h = (h << 5) + h + *p;
-	}
-
-	return h;
-}
+/* Upper bound on the database size read through the VFS xFetch method, SQLite
+ * clamps it to its own compile-time limit. */
+#define MMAP_SIZE "1099511627776"
 
 int db__init(struct db *db, struct config *config, const char *filename)
 {
@@ -34,7 +27,7 @@ int db__init(struct db *db, struct config *config, const char *filename)
 	if (db->vfs == NULL) {
 		return DQLITE_MISUSE;
 	}
-	db->cookie = str_hash(filename);
+	db->cookie = hash__str(filename, strlen(filename));
 	db->filename = sqlite3_malloc((int)(strlen(filename) + 1));
 	if (db->filename == NULL) {
 		return DQLITE_NOMEM;
@@ -58,6 +51,11 @@ int db__init(struct db *db, struct config *config, const char *filename)
 	db->active_leader = NULL;
 	queue_init(&db->pending_queue);
 	db->read_lock = 0;
+	db->backups = 0;
+	db->spans = 0;
+	db->sched = NULL;
+	sched_db_init(&db->sched_db);
+	feed_init(&db->feed, config);
 	db->leaders = 0;
 	return 0;
 
@@ -71,6 +69,7 @@ err_after_filename_alloc:
 void db__close(struct db *db)
 {
 	assert(db->leaders == 0);
+	feed_close(&db->feed);
 	sqlite3_free(db->path);
 	sqlite3_free(db->filename);
 }
@@ -165,6 +164,19 @@ int db__open(struct db *db, sqlite3 **conn)
 		}
 	}
 
+	/* Let SQLite read pages of the in-memory database in place instead
+	 * of copying them into its page cache. This only saves memory when
+	 * the page cache is made much bigger than its 2MB default, and has no
+	 * effect in disk mode, where the VFS doesn't implement xFetch. Pages
+	 * past the mmap_size limit SQLite was compiled with, typically 2GB,
+	 * are still copied. */
+	rc = sqlite3_exec(*conn, "PRAGMA mmap_size=" MMAP_SIZE, NULL, NULL,
+			  &msg);
+	if (rc != SQLITE_OK) {
+		tracef("mmap_size failed %d", rc);
+		goto err;
+	}
+
 	/* Enable extended result codes */
 	rc = sqlite3_extended_result_codes(*conn, 1);
 	if (rc != SQLITE_OK) {
@@ -6,9 +6,12 @@
 #define DB_H_
 
 #include <stdint.h>
+#include "lib/hash.h"
 #include "lib/queue.h"
 
 #include "config.h"
+#include "feed.h"
+#include "sched.h"
 
 struct db
 {
@@ -17,11 +20,17 @@ struct db
 	char *filename;               /* Database filename */
 	char *path;                   /* Used for on-disk db */
 	uint32_t cookie;              /* Used to bind to the pool's thread */
+	struct hash_node hash_node;   /* Registry index entry, keyed by cookie */
 	int leaders;                  /* Open leader connections */
 	struct leader *active_leader; /* Current leader writing to the database */
 	queue pending_queue;          /* Queue of pending execs, used by leader */
 	queue queue;                  /* Prev/next database, used by the registry */
 	int read_lock;                /* Lock used by snapshots & checkpoints */
+	int backups;                  /* Streaming backups reading its pages */
+	unsigned spans;               /* Transactions since the last traced one */
+	struct sched *sched;          /* Admission control, set by the registry */
+	struct sched_db sched_db;     /* Statements admitted against the db */
+	struct feed feed;             /* Recent committed transactions */
 };
 
 /**
@@ -0,0 +1,168 @@
+#include <string.h>
+
+#include <sqlite3.h>
+
+#include "../include/dqlite.h"
+
+#include "feed.h"
+#include "tracing.h"
+#include "utils.h"
+
+void feed_init(struct feed *f, struct config *config)
+{
+	f->config = config;
+	queue_init(&f->changes);
+	f->size = 0;
+	f->horizon = 0;
+	f->known = false;
+	f->epoch = 0;
+	queue_init(&f->subs);
+}
+
+static void feedDrop(struct feed *f, struct feed_change *change)
+{
+	queue_remove(&change->queue);
+	f->size -= change->size;
+	sqlite3_free(change);
+}
+
+void feed_close(struct feed *f)
+{
+	assert(queue_empty(&f->subs));
+	while (!queue_empty(&f->changes)) {
+		feedDrop(f, QUEUE_DATA(queue_head(&f->changes),
+				       struct feed_change, queue));
+	}
+}
+
+/* Wake up all the waiting subscribers. They are detached first, so that they
+ * can subscribe again from their callback. */
+static void feedWake(struct feed *f)
+{
+	queue subs;
+	queue *head;
+
+	queue_move(&f->subs, &subs);
+	while (!queue_empty(&subs)) {
+		struct feed_sub *sub;
+		head = queue_head(&subs);
+		queue_remove(head);
+		sub = QUEUE_DATA(head, struct feed_sub, queue);
+		sub->cb(sub);
+	}
+}
+
+int feed_append(struct feed *f,
+		uint64_t index,
+		uint32_t page_size,
+		const struct vfsTransaction *transaction)
+{
+	struct feed_change *change;
+	size_t size;
+	char *page;
+	uint32_t i;
+
+	PRE(feed_enabled(f));
+	size = sizeof *change + (size_t)transaction->n_pages *
+				    (sizeof *change->page_numbers + page_size);
+	change = sqlite3_malloc64(size);
+	if (change == NULL) {
+		return DQLITE_NOMEM;
+	}
+	change->index = index;
+	change->page_size = page_size;
+	change->n_pages = transaction->n_pages;
+	change->page_numbers = (uint64_t *)(change + 1);
+	change->size = size;
+	page = (char *)(change->page_numbers + change->n_pages);
+	for (i = 0; i < transaction->n_pages; i++) {
+		change->page_numbers[i] = transaction->page_numbers[i];
+		memcpy(page, transaction->pages[i], page_size);
+		page += page_size;
+	}
+
+	if (!f->known) {
+		f->horizon = index - 1;
+		f->known = true;
+	}
+	queue_insert_tail(&f->changes, &change->queue);
+	f->size += size;
+
+	/* The newest change is always kept, even if it's over the limit on its
+	 * own, otherwise no subscriber could ever get it. */
+	while (f->size > f->config->feed_size &&
+	       queue_head(&f->changes) != &change->queue) {
+		struct feed_change *oldest = QUEUE_DATA(
+		    queue_head(&f->changes), struct feed_change, queue);
+		f->horizon = oldest->index;
+		feedDrop(f, oldest);
+	}
+
+	tracef("feed append index %" PRIu64 " pages %u", index,
+	       transaction->n_pages);
+	feedWake(f);
+	return 0;
+}
+
+void feed_reset(struct feed *f)
+{
+	tracef("feed reset");
+	while (!queue_empty(&f->changes)) {
+		feedDrop(f, QUEUE_DATA(queue_head(&f->changes),
+				       struct feed_change, queue));
+	}
+	f->known = false;
+	f->epoch++;
+	feedWake(f);
+}
+
+uint64_t feed_horizon(struct feed *f, uint64_t applied)
+{
+	if (!f->known) {
+		f->horizon = applied;
+		f->known = true;
+	}
+	return f->horizon;
+}
+
+struct feed_change *feed_next(struct feed *f, uint64_t index)
+{
+	struct feed_change *next = NULL;
+	queue *head;
+
+	/* Subscribers are usually close to the tail. */
+	for (head = queue_tail(&f->changes); head != &f->changes;
+	     head = head->prev) {
+		struct feed_change *change =
+		    QUEUE_DATA(head, struct feed_change, queue);
+		if (change->index <= index) {
+			break;
+		}
+		next = change;
+	}
+	return next;
+}
+
+struct feed_change *feed_after(struct feed *f, struct feed_change *change)
+{
+	queue *head = queue_next(&change->queue);
+	if (head == &f->changes) {
+		return NULL;
+	}
+	return QUEUE_DATA(head, struct feed_change, queue);
+}
+
+void feed_subscribe(struct feed *f,
+		    struct feed_sub *sub,
+		    void *data,
+		    feed_sub_cb cb)
+{
+	sub->data = data;
+	sub->cb = cb;
+	queue_insert_tail(&f->subs, &sub->queue);
+}
+
+void feed_unsubscribe(struct feed_sub *sub)
+{
+	queue_remove(&sub->queue);
+}
@@ -0,0 +1,112 @@
+/**
+ * Feed of the transactions committed to a database.
+ *
+ * Every node records the transactions it applies to a database as the content
+ * of the pages they wrote, tagged with the index of the raft entry that
+ * committed them, and keeps the most recent ones in memory, up to a configured
+ * size. Subscribers follow the feed from a given index, and are woken up when
+ * a new change is recorded.
+ *
+ * A subscriber that needs changes that are not retained anymore, either
+ * because it fell too far behind or because the database was replaced by a
+ * snapshot, can't resume from the feed and must start over from a copy of the
+ * database.
+ *
+ * Everything runs in the thread of the main loop.
+ */
+
+#ifndef FEED_H_
+#define FEED_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "lib/queue.h"
+#include "vfs.h"
+
+/* A transaction committed to the database. */
+struct feed_change
+{
+	uint64_t index;         /* Raft index of the entry that committed it */
+	uint32_t page_size;     /* Size of each page */
+	uint32_t n_pages;       /* Number of pages written */
+	uint64_t *page_numbers; /* Followed by the content of the pages */
+	size_t size;            /* Memory used by the change */
+	queue queue;            /* Prev/next change, in index order */
+};
+
+struct feed_sub;
+typedef void (*feed_sub_cb)(struct feed_sub *sub);
+
+/* A subscriber waiting for the next change. */
+struct feed_sub
+{
+	void *data;     /* User data */
+	feed_sub_cb cb; /* Called once, when a change is recorded */
+	queue queue;    /* Prev/next waiting subscriber */
+};
+
+struct feed
+{
+	struct config *config;
+	queue changes;    /* Retained changes, oldest first */
+	size_t size;      /* Memory used by the retained changes */
+	uint64_t horizon; /* All changes after this index are retained */
+	bool known;       /* Whether the horizon is known yet */
+	unsigned epoch;   /* Bumped each time the feed is reset */
+	queue subs;       /* Waiting subscribers */
+};
+
+void feed_init(struct feed *f, struct config *config);
+
+void feed_close(struct feed *f);
+
+/* Whether changes are recorded at all. */
+static inline bool feed_enabled(const struct feed *f)
+{
+	return f->config->feed_size > 0;
+}
+
+/* Record the transaction committed by the entry at the given index, evict the
+ * oldest changes if the feed is over its size and wake up the subscribers. The
+ * pages are copied. */
+int feed_append(struct feed *f,
+		uint64_t index,
+		uint32_t page_size,
+		const struct vfsTransaction *transaction);
+
+/* Drop all the changes, because the content of the database was replaced, and
+ * wake up the subscribers. */
+void feed_reset(struct feed *f);
+
+/* Return the index after which all the changes are retained. If nothing was
+ * recorded since the feed was initialized or reset, that's the given index of
+ * the last applied entry. */
+uint64_t feed_horizon(struct feed *f, uint64_t applied);
+
+/* Return the oldest change committed after the given index, or NULL. */
+struct feed_change *feed_next(struct feed *f, uint64_t index);
+
+/* Return the change following the given one, or NULL. */
+struct feed_change *feed_after(struct feed *f, struct feed_change *change);
+
+/* Return the content of the i'th page of the given change. */
+static inline const void *feed_page(const struct feed_change *change,
+				    uint32_t i)
+{
+	return (const char *)(change->page_numbers + change->n_pages) +
+	       (size_t)i * change->page_size;
+}
+
+/* Wait for the next change to be recorded, or for the feed to be reset. */
+void feed_subscribe(struct feed *f,
+		    struct feed_sub *sub,
+		    void *data,
+		    feed_sub_cb cb);
+
+/* Stop waiting. */
+void feed_unsubscribe(struct feed_sub *sub);
+
+#endif /* FEED_H_ */
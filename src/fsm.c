@@ -9,12 +9,17 @@
 #include "vfs.h"
 
 #include <assert.h>
+#include <string.h>
 #include <sys/mman.h>
 
 struct fsm
 {
 	struct logger *logger;
 	struct registry *registry;
+	bool has_base;          /* Persisted state is the VFS tracking base */
+	unsigned n_incremental; /* Incremental snapshots since the last full */
+	bool tracked;           /* Pending snapshot took the modified pages */
+	bool incremental;       /* Pending snapshot is incremental */
 };
 
 /* Not used */
@@ -51,10 +56,14 @@ static void maybeCheckpoint(struct db *db, sqlite3 *conn)
 	tracef("maybe checkpoint");
 	int rv;
 
-	/* Don't run when a snapshot is busy. Running a checkpoint while a
-	 * snapshot is busy will result in illegal memory accesses by the
-	 * routines that try to access database page pointers contained in the
-	 * snapshot. */
+	/* Don't run when a snapshot or a backup is busy. Running a checkpoint
+	 * while a snapshot is busy will result in illegal memory accesses by
+	 * the routines that try to access database page pointers contained in
+	 * the snapshot. */
+	if (db->backups > 0) {
+		tracef("busy backup");
+		return;
+	}
 	rv = databaseReadLock(db);
 	if (rv != 0) {
 		tracef("busy snapshot %d", rv);
@@ -72,15 +81,175 @@ static void maybeCheckpoint(struct db *db, sqlite3 *conn)
 	assert(rv == 0);
 }
 
-static int apply_frames(struct fsm *f, const struct command_frames *c)
+/* Frames commands, plain or with delta encoded pages, share these fields. */
+static const char *frames_filename(int type, const void *command)
+{
+	if (type == COMMAND_FRAMES_DELTA) {
+		return ((const struct command_frames_delta *)command)->filename;
+	}
+	return ((const struct command_frames *)command)->filename;
+}
+
+static bool frames_is_commit(int type, const void *command)
+{
+	if (type == COMMAND_FRAMES_DELTA) {
+		return ((const struct command_frames_delta *)command)->is_commit;
+	}
+	return ((const struct command_frames *)command)->is_commit;
+}
+
+/* Release the arrays decoded along with a frames command. */
+static void frames_close(int type, void *command)
+{
+	if (type == COMMAND_FRAMES_DELTA) {
+		struct command_frames_delta *c = command;
+		sqlite3_free(c->frames.page_numbers);
+		return;
+	}
+	struct command_frames *c = command;
+	sqlite3_free(c->frames.page_numbers);
+	sqlite3_free(c->frames.pages);
+}
+
+/* Fill a transaction with the pages of a frames command. The pages of a delta
+ * encoded one are rebuilt against their committed content in the database conn
+ * is open on, unless one of the given pending transactions, which precede it
+ * and aren't applied yet, contains them. Rebuilt pages are stored after the
+ * array of their pointers, which must be released with sqlite3_free(). */
+static int frames_transaction(sqlite3 *conn,
+			      int type,
+			      const void *command,
+			      const struct vfsTransaction pending[],
+			      unsigned n_pending,
+			      struct vfsTransaction *transaction)
+{
+	const struct command_frames_delta *c;
+	const char *records;
+	size_t len;
+	unsigned page_size;
+	void *scratch;
+	void **pages;
+	unsigned i;
+	int rv;
+
+	if (type == COMMAND_FRAMES) {
+		const struct command_frames *plain = command;
+		*transaction = (struct vfsTransaction){
+			.n_pages = plain->frames.n_pages,
+			.page_numbers = plain->frames.page_numbers,
+			.pages = plain->frames.pages,
+		};
+		return 0;
+	}
+
+	c = command;
+	records = c->frames.records;
+	len = (size_t)c->frames.len;
+	page_size = c->frames.page_size;
+
+	pages = sqlite3_malloc64((sizeof *pages + page_size) *
+				 c->frames.n_pages);
+	scratch = sqlite3_malloc64(page_size);
+	if (pages == NULL || scratch == NULL) {
+		rv = RAFT_NOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < c->frames.n_pages; i++) {
+		uint64_t pgno = c->frames.page_numbers[i];
+		const void *base = NULL;
+		size_t n;
+		unsigned j;
+		unsigned k;
+
+		for (j = n_pending; j > 0 && base == NULL; j--) {
+			const struct vfsTransaction *t = &pending[j - 1];
+			for (k = t->n_pages; k > 0; k--) {
+				if (t->page_numbers[k - 1] == pgno) {
+					base = t->pages[k - 1];
+					break;
+				}
+			}
+		}
+		if (base == NULL) {
+			rv = VfsCommittedPage(conn, (uint32_t)pgno, scratch,
+					      &base);
+			if (rv != SQLITE_OK) {
+				tracef("committed page %" PRIu64 " failed %d",
+				       pgno, rv);
+				rv = RAFT_IOERR;
+				goto err;
+			}
+		}
+
+		pages[i] = (char *)(pages + c->frames.n_pages) +
+			   (size_t)i * page_size;
+		n = command__delta_apply(records, len, base, page_size,
+					 pages[i]);
+		if (n == 0) {
+			tracef("malformed delta of page %" PRIu64, pgno);
+			rv = RAFT_MALFORMED;
+			goto err;
+		}
+		records += n;
+		len -= n;
+	}
+
+	sqlite3_free(scratch);
+	*transaction = (struct vfsTransaction){
+		.n_pages = c->frames.n_pages,
+		.page_numbers = c->frames.page_numbers,
+		.pages = pages,
+	};
+	return 0;
+
+err:
+	sqlite3_free(scratch);
+	sqlite3_free(pages);
+	return rv;
+}
+
+/* Index of the n'th entry of the ones being applied, or 0 if unknown. */
+static raft_index apply_index(struct fsm *f, unsigned n)
+{
+	if (f->registry->raft == NULL) {
+		return 0;
+	}
+	return raft_last_applied(f->registry->raft) + 1 + n;
+}
+
+/* Record a transaction applied to the database in its feed. Failing to do so
+ * is not fatal: the feed is reset, and its subscribers start over. */
+static void feed_frames(struct db *db,
+			raft_index index,
+			const struct vfsTransaction *transaction)
+{
+	int rv;
+
+	if (!feed_enabled(&db->feed) || index == 0) {
+		return;
+	}
+	rv = feed_append(&db->feed, index, db->config->page_size, transaction);
+	if (rv != 0) {
+		tracef("feed append failed %d", rv);
+		feed_reset(&db->feed);
+	}
+}
+
+static int apply_frames(struct fsm *f,
+			raft_index index,
+			int type,
+			void *command)
 {
 	tracef("fsm apply frames");
+	struct vfsTransaction transaction;
 	struct db *db;
 	int rv;
 
-	rv = registry__db_get(f->registry, c->filename, &db);
+	rv = registry__db_get(f->registry, frames_filename(type, command), &db);
 	if (rv != 0) {
 		tracef("db get failed %d", rv);
+		frames_close(type, command);
 		return rv;
 	}
 
@@ -93,23 +262,29 @@ static int apply_frames(struct fsm *f, const struct command_frames *c)
 		rv = db__open(db, &conn);
 		if (rv != 0) {
 			tracef("open follower failed %d", rv);
+			frames_close(type, command);
 			return rv;
 		}
 	}
 
 	/* The commit marker must be set as otherwise this must be an
 	 * upgrade from V1, which is not supported anymore. */
-	if (!c->is_commit) {
+	if (!frames_is_commit(type, command)) {
 		rv = DQLITE_PROTO;
 		goto error;
 	}
 
-	struct vfsTransaction transaction = {
-		.n_pages      = c->frames.n_pages,
-		.page_numbers = c->frames.page_numbers,
-		.pages   	  = c->frames.pages,
-	};
+	rv = frames_transaction(conn, type, command, NULL, 0, &transaction);
+	if (rv != 0) {
+		goto error;
+	}
 	rv = VfsApply(conn, &transaction);
+	if (rv == 0) {
+		feed_frames(db, index, &transaction);
+	}
+	if (type == COMMAND_FRAMES_DELTA) {
+		sqlite3_free(transaction.pages);
+	}
 	if (rv != 0) {
 		tracef("VfsApply failed %d", rv);
 		rv = rv == SQLITE_BUSY ? RAFT_BUSY : RAFT_IOERR;
@@ -121,8 +296,7 @@ error:
 	if (db->active_leader == NULL) {
 		sqlite3_close(conn);
 	}
-	sqlite3_free(c->frames.page_numbers);
-	sqlite3_free(c->frames.pages);
+	frames_close(type, command);
 	return rv;
 }
 
@@ -146,27 +320,20 @@ static int apply_checkpoint(struct fsm *f, const struct command_checkpoint *c)
 	return 0;
 }
 
-static int fsm__apply(struct raft_fsm *fsm,
-		      const struct raft_buffer *buf,
-		      void **result)
+static int apply_command(struct fsm *f,
+			 raft_index index,
+			 int type,
+			 void *command)
 {
-	tracef("fsm apply");
-	struct fsm *f = fsm->data;
-	int type;
-	void *command;
 	int rc;
-	rc = command__decode(buf, &type, &command);
-	if (rc != 0) {
-		tracef("fsm: decode command: %d", rc);
-		goto err;
-	}
 
 	switch (type) {
 		case COMMAND_OPEN:
 			rc = apply_open(f, command);
 			break;
 		case COMMAND_FRAMES:
-			rc = apply_frames(f, command);
+		case COMMAND_FRAMES_DELTA:
+			rc = apply_frames(f, index, type, command);
 			break;
 		case COMMAND_UNDO:
 			rc = apply_undo(f, command);
@@ -180,13 +347,223 @@ static int fsm__apply(struct raft_fsm *fsm,
 	}
 
 	raft_free(command);
+	return rc;
+}
+
+static int fsm__apply(struct raft_fsm *fsm,
+		      const struct raft_buffer *buf,
+		      void **result)
+{
+	tracef("fsm apply");
+	struct fsm *f = fsm->data;
+	int type;
+	void *command;
+	int rc;
+	rc = command__decode(buf, &type, &command);
+	if (rc != 0) {
+		tracef("fsm: decode command: %d", rc);
+		goto err;
+	}
+
+	rc = apply_command(f, apply_index(f, 0), type, command);
 err:
 	*result = NULL;
 	return rc;
 }
 
+/* Maximum number of frames commands appended to the WAL at once. */
+#define FSM__APPLY_BATCH_MAX 64
+
+static bool is_frames(int type)
+{
+	return type == COMMAND_FRAMES || type == COMMAND_FRAMES_DELTA;
+}
+
+static void free_frames(int type, void *command)
+{
+	frames_close(type, command);
+	raft_free(command);
+}
+
+/* Apply the given run of frames commands targeting the same database. On a
+ * follower their transactions are appended to the WAL at once, and a single
+ * checkpoint decision is taken for all of them. The first command of the run
+ * is the entry at the given index. The number of commands that were applied is
+ * stored in n_applied. */
+static int apply_frames_run(struct fsm *f,
+			    raft_index index,
+			    int types[],
+			    void *run[],
+			    unsigned n,
+			    unsigned *n_applied)
+{
+	struct vfsTransaction transactions[FSM__APPLY_BATCH_MAX];
+	struct db *db;
+	sqlite3 *conn;
+	unsigned i;
+	unsigned j;
+	int rv;
+
+	assert(n > 0 && n <= FSM__APPLY_BATCH_MAX);
+	*n_applied = 0;
+
+	rv = registry__db_get(f->registry, frames_filename(types[0], run[0]),
+			      &db);
+	if (rv != 0) {
+		tracef("db get failed %d", rv);
+		goto err;
+	}
+
+	/* The leader applies its own transaction through the connection that
+	 * polled it, which holds the write lock until then. */
+	if (n == 1 || db->active_leader != NULL) {
+		for (i = 0; i < n; i++) {
+			rv = apply_frames(f, index == 0 ? 0 : index + i, types[i],
+					  run[i]);
+			raft_free(run[i]);
+			if (rv != 0) {
+				*n_applied = i;
+				n -= i + 1;
+				types += i + 1;
+				run += i + 1;
+				goto err;
+			}
+		}
+		*n_applied = n;
+		return 0;
+	}
+
+	tracef("fsm apply %u frames commands", n);
+	rv = db__open(db, &conn);
+	if (rv != 0) {
+		tracef("open follower failed %d", rv);
+		goto err;
+	}
+
+	for (i = 0; i < n; i++) {
+		rv = frames_transaction(conn, types[i], run[i], transactions, i,
+					&transactions[i]);
+		if (rv != 0) {
+			break;
+		}
+	}
+	if (rv == 0) {
+		rv = VfsApplyBatch(conn, transactions, n);
+		if (rv != 0) {
+			tracef("VfsApplyBatch failed %d", rv);
+			rv = rv == SQLITE_BUSY ? RAFT_BUSY : RAFT_IOERR;
+		}
+	}
+	for (j = 0; j < i; j++) {
+		if (rv == 0) {
+			feed_frames(db, index == 0 ? 0 : index + j,
+				    &transactions[j]);
+		}
+		if (types[j] == COMMAND_FRAMES_DELTA) {
+			sqlite3_free(transactions[j].pages);
+		}
+	}
+	if (rv == 0) {
+		maybeCheckpoint(db, conn);
+		*n_applied = n;
+	}
+	sqlite3_close(conn);
+
+err:
+	for (i = 0; i < n; i++) {
+		free_frames(types[i], run[i]);
+	}
+	return rv;
+}
+
+/* Consecutive frames commands for the same database are grouped in runs that
+ * are appended to the WAL at once, other commands are applied one by one. */
+static int fsm__apply_batch(struct raft_fsm *fsm,
+			    const struct raft_buffer bufs[],
+			    unsigned n,
+			    void *results[],
+			    unsigned *n_applied)
+{
+	tracef("fsm apply batch of %u", n);
+	struct fsm *f = fsm->data;
+	void *run[FSM__APPLY_BATCH_MAX];
+	int types[FSM__APPLY_BATCH_MAX];
+	unsigned n_run = 0;
+	unsigned start = 0; /* Index of the first command not applied yet. */
+	unsigned done;
+	unsigned i;
+	int type;
+	void *command;
+	int rc;
+
+	for (i = 0; i < n; i++) {
+		bool batchable;
+
+		results[i] = NULL;
+		rc = command__decode(&bufs[i], &type, &command);
+		if (rc != 0) {
+			tracef("fsm: decode command: %d", rc);
+			goto err;
+		}
+		batchable = is_frames(type) && frames_is_commit(type, command);
+
+		if (n_run > 0 && batchable && n_run < FSM__APPLY_BATCH_MAX &&
+		    strcmp(frames_filename(type, command),
+			   frames_filename(types[0], run[0])) == 0) {
+			types[n_run] = type;
+			run[n_run++] = command;
+			continue;
+		}
+
+		if (n_run > 0) {
+			rc = apply_frames_run(f, apply_index(f, start), types,
+					      run, n_run, &done);
+			start += done;
+			n_run = 0;
+			if (rc != 0) {
+				if (is_frames(type)) {
+					free_frames(type, command);
+				} else {
+					raft_free(command);
+				}
+				goto out;
+			}
+		}
+
+		if (batchable) {
+			types[n_run] = type;
+			run[n_run++] = command;
+			continue;
+		}
+
+		rc = apply_command(f, apply_index(f, start), type, command);
+		if (rc != 0) {
+			goto out;
+		}
+		start++;
+	}
+
+	rc = 0;
+err:
+	if (n_run > 0) {
+		int rv = apply_frames_run(f, apply_index(f, start), types, run,
+					  n_run, &done);
+		start += done;
+		if (rv != 0) {
+			rc = rv;
+		}
+	}
+out:
+	*n_applied = start;
+	return rc;
+}
+
 #define SNAPSHOT_FORMAT 1
 
+/* Snapshots containing only the pages modified since the previous one. The
+ * format code doubles as the marker raft uses to detect them. */
+#define SNAPSHOT_FORMAT_INCREMENTAL RAFT_SNAPSHOT_INCREMENTAL
+
 #define SNAPSHOT_HEADER(X, ...)          \
 	X(uint64, format, ##__VA_ARGS__) \
 	X(uint64, n, ##__VA_ARGS__)
@@ -200,12 +577,23 @@ SERIALIZE__IMPLEMENT(snapshotHeader, SNAPSHOT_HEADER);
 SERIALIZE__DEFINE(snapshotDatabase, SNAPSHOT_DATABASE);
 SERIALIZE__IMPLEMENT(snapshotDatabase, SNAPSHOT_DATABASE);
 
+/* Header of a database in an incremental snapshot. It's followed by n_delta
+ * page numbers and then by the content of those pages. */
+#define SNAPSHOT_PAGES(X, ...)            \
+	X(text, filename, ##__VA_ARGS__)  \
+	X(uint64, n_pages, ##__VA_ARGS__) \
+	X(uint64, n_delta, ##__VA_ARGS__)
+SERIALIZE__DEFINE(snapshotPages, SNAPSHOT_PAGES);
+SERIALIZE__IMPLEMENT(snapshotPages, SNAPSHOT_PAGES);
+
 /* Encode the global snapshot header. */
-static int encodeSnapshotHeader(unsigned n, struct raft_buffer *buf)
+static int encodeSnapshotHeader(uint64_t format,
+				unsigned n,
+				struct raft_buffer *buf)
 {
 	struct snapshotHeader header;
 	char *cursor;
-	header.format = SNAPSHOT_FORMAT;
+	header.format = format;
 	header.n = n;
 	buf->len = snapshotHeader__sizeof(&header);
 	buf->base = sqlite3_malloc64(buf->len);
@@ -255,42 +643,63 @@ err:
 	return rv;
 }
 
-/* Decode the database contained in a snapshot. */
-static int decodeDatabase(struct fsm *f, struct cursor *cursor)
+/* Get the database with the given name, ready to be restored. */
+static int restoreDatabaseGet(struct fsm *f,
+			      const char *filename,
+			      struct db **db)
 {
-	struct snapshotDatabase header;
-	struct db *db;
-	size_t n;
 	int exists;
 	int rv;
 
-	rv = snapshotDatabase__decode(cursor, &header);
-	if (rv != 0) {
-		return rv;
-	}
-	rv = registry__db_get(f->registry, header.filename, &db);
+	rv = registry__db_get(f->registry, filename, db);
 	if (rv != 0) {
 		return rv;
 	}
 
-	if (db->leaders > 0) {
+	if ((*db)->leaders > 0 || (*db)->backups > 0) {
 		return RAFT_BUSY;
 	}
 
+	/* The changes recorded so far don't lead to the restored content. */
+	feed_reset(&(*db)->feed);
+
 	/* Check if the database file exists, and create it by opening a
 	 * connection if it doesn't. */
-	rv = db->vfs->xAccess(db->vfs, header.filename, 0, &exists);
+	rv = (*db)->vfs->xAccess((*db)->vfs, filename, 0, &exists);
 	assert(rv == 0);
 
 	if (!exists) {
 		sqlite3 *conn;
-		rv = db__open(db, &conn);
+		rv = db__open(*db, &conn);
 		if (rv != 0) {
 			return rv;
 		}
 		sqlite3_close(conn);
 	}
 
+	return 0;
+}
+
+/* Decode the database contained in a snapshot, whose pages are adopted by
+ * the VFS instead of being copied. */
+static int decodeDatabase(struct fsm *f,
+			  struct vfsAdopted *adopted,
+			  struct cursor *cursor)
+{
+	struct snapshotDatabase header;
+	struct db *db;
+	size_t n;
+	int rv;
+
+	rv = snapshotDatabase__decode(cursor, &header);
+	if (rv != 0) {
+		return rv;
+	}
+	rv = restoreDatabaseGet(f, header.filename, &db);
+	if (rv != 0) {
+		return rv;
+	}
+
 	tracef("main_size:%" PRIu64 " wal_size:%" PRIu64, header.main_size,
 	       header.wal_size);
 	if (header.main_size + header.wal_size > SIZE_MAX) {
@@ -300,11 +709,74 @@ static int decodeDatabase(struct fsm *f, struct cursor *cursor)
 
 	/* Due to the check above, this cast is safe. */
 	n = (size_t)(header.main_size + header.wal_size);
-	rv = VfsRestore(db->vfs, db->filename, cursor->p, n);
+	if (n > cursor->cap) {
+		return RAFT_MALFORMED;
+	}
+	rv = VfsRestoreAdopted(db->vfs, db->filename, adopted, cursor->p, n);
 	if (rv != 0) {
 		return rv;
 	}
 	cursor->p += n;
+	cursor->cap -= n;
+
+	if (f->registry->config->snapshot_chain > 0) {
+		rv = VfsDirtyReset(db->vfs, db->filename);
+		assert(rv == 0);
+	}
+
+	return 0;
+}
+
+/* Decode a database contained in an incremental snapshot, applying its pages
+ * on top of the current content. */
+static int decodeDatabasePages(struct fsm *f, struct cursor *cursor)
+{
+	struct snapshotPages header;
+	struct db *db;
+	uint64_t *pgnos;
+	uint64_t page_size = f->registry->config->page_size;
+	uint64_t i;
+	size_t n;
+	int rv;
+
+	rv = snapshotPages__decode(cursor, &header);
+	if (rv != 0) {
+		return rv;
+	}
+	if (header.n_delta > header.n_pages || header.n_pages > UINT32_MAX ||
+	    header.n_delta * (sizeof *pgnos + page_size) > cursor->cap) {
+		return RAFT_MALFORMED;
+	}
+	rv = restoreDatabaseGet(f, header.filename, &db);
+	if (rv != 0) {
+		return rv;
+	}
+
+	pgnos = sqlite3_malloc64(sizeof *pgnos * (header.n_delta + 1));
+	if (pgnos == NULL) {
+		return RAFT_NOMEM;
+	}
+	for (i = 0; i < header.n_delta; i++) {
+		rv = uint64__decode(cursor, &pgnos[i]);
+		assert(rv == 0);
+	}
+
+	tracef("n_pages:%" PRIu64 " n_delta:%" PRIu64, header.n_pages,
+	       header.n_delta);
+	n = (size_t)(header.n_delta * page_size);
+	rv = VfsRestorePages(db->vfs, db->filename, (uint32_t)header.n_pages,
+			     pgnos, (uint32_t)header.n_delta, cursor->p);
+	sqlite3_free(pgnos);
+	if (rv != 0) {
+		return rv;
+	}
+	cursor->p += n;
+	cursor->cap -= n;
+
+	if (f->registry->config->snapshot_chain > 0) {
+		rv = VfsDirtyReset(db->vfs, db->filename);
+		assert(rv == 0);
+	}
 
 	return 0;
 }
@@ -319,6 +791,234 @@ static unsigned dbNumPages(struct db *db)
 	return n;
 }
 
+/* Whether page i+1 is set in the given bitmap of modified pages. A NULL bitmap
+ * means that all pages are modified. */
+static bool pageIsDirty(const uint8_t *bitmap, unsigned i)
+{
+	return bitmap == NULL || (bitmap[i / 8] & (1 << (i % 8))) != 0;
+}
+
+static unsigned countDirtyPages(const uint8_t *bitmap, unsigned n)
+{
+	unsigned count = 0;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		count += pageIsDirty(bitmap, i);
+	}
+	return count;
+}
+
+/* Take the pages modified since the previous snapshot from all databases and
+ * decide whether an incremental snapshot is worth it. */
+static void takeDirtyPages(struct fsm *f,
+			   const uint8_t *bitmaps[],
+			   bool *incremental)
+{
+	unsigned chain = f->registry->config->snapshot_chain;
+	uint64_t n_dirty = 0;
+	uint64_t n_total = 0;
+	struct db *db;
+	queue *head;
+	unsigned i = 0;
+	int rv;
+
+	QUEUE_FOREACH(head, &f->registry->dbs)
+	{
+		db = QUEUE_DATA(head, struct db, queue);
+		unsigned n = dbNumPages(db);
+		rv = VfsDirtyTake(db->vfs, db->filename, n, &bitmaps[i]);
+		assert(rv == 0);
+		n_dirty += countDirtyPages(bitmaps[i], n);
+		n_total += n;
+		i++;
+	}
+	f->tracked = true;
+
+	/* Past half of the pages, a full snapshot is about as large and it
+	 * resets the chain. */
+	*incremental = f->has_base && f->n_incremental < chain &&
+		       2 * n_dirty <= n_total;
+	tracef("dirty pages %" PRIu64 "/%" PRIu64 " incremental %d", n_dirty,
+	       n_total, *incremental);
+}
+
+/* Release the modified pages taken for the pending snapshot. */
+static void settleDirtyPages(struct fsm *f, bool persisted)
+{
+	struct db *db;
+	queue *head;
+
+	if (!f->tracked) {
+		return;
+	}
+	QUEUE_FOREACH(head, &f->registry->dbs)
+	{
+		db = QUEUE_DATA(head, struct db, queue);
+		VfsDirtySettle(db->vfs, db->filename, persisted);
+	}
+	f->tracked = false;
+}
+
+/* Encode the pages of the given database that are set in the bitmap. */
+static int encodeDatabasePages(struct db *db,
+			       const uint8_t *bitmap,
+			       uint32_t n_pages,
+			       struct raft_buffer r_bufs[],
+			       unsigned n_delta)
+{
+	struct snapshotPages header;
+	struct dqlite_buffer *bufs = (struct dqlite_buffer *)r_bufs;
+	struct dqlite_buffer *pages = NULL;
+	char *cursor;
+	uint64_t pgno;
+	unsigned i;
+	unsigned j;
+	int rv;
+
+	header.filename = db->filename;
+	header.n_pages = n_pages;
+	header.n_delta = n_delta;
+
+	if (n_delta > 0) {
+		pages = sqlite3_malloc64(sizeof *pages * n_pages);
+		if (pages == NULL) {
+			rv = RAFT_NOMEM;
+			goto err;
+		}
+		rv = VfsShallowSnapshot(db->vfs, db->filename, pages, n_pages);
+		if (rv != 0) {
+			goto err_after_pages_alloc;
+		}
+	}
+
+	/* Database header and page numbers. */
+	bufs[0].len = snapshotPages__sizeof(&header) + sizeof pgno * n_delta;
+	bufs[0].base = sqlite3_malloc64(bufs[0].len);
+	if (bufs[0].base == NULL) {
+		rv = RAFT_NOMEM;
+		goto err_after_pages_alloc;
+	}
+	cursor = bufs[0].base;
+	snapshotPages__encode(&header, &cursor);
+	for (i = 0, j = 1; j <= n_delta; i++) {
+		if (!pageIsDirty(bitmap, i)) {
+			continue;
+		}
+		pgno = i + 1;
+		uint64__encode(&pgno, &cursor);
+		bufs[j++] = pages[i];
+	}
+
+	sqlite3_free(pages);
+	return 0;
+
+err_after_pages_alloc:
+	sqlite3_free(pages);
+err:
+	assert(rv != 0);
+	return rv;
+}
+
+/* An example array of incremental snapshot buffers looks like this:
+ *
+ * bufs:  SH DH1 P3 P7 DH2 DH3 P1
+ * index:  0   1  2  3   4   5  6
+ *
+ * SH:   Snapshot Header
+ * DHx:  Database Header, followed by the numbers of the pages
+ * Px:   Modified Database Page (not to be freed)
+ * */
+static void freeIncrementalSnapshotBufs(struct raft_buffer bufs[],
+					unsigned n_bufs)
+{
+	struct snapshotPages header;
+	struct cursor cursor;
+	unsigned i;
+	int rv;
+
+	if (bufs == NULL || n_bufs == 0) {
+		return;
+	}
+
+	sqlite3_free(bufs[0].base);
+
+	i = 1;
+	while (i < n_bufs) {
+		cursor.p = bufs[i].base;
+		cursor.cap = bufs[i].len;
+		rv = snapshotPages__decode(&cursor, &header);
+		assert(rv == 0);
+		(void)rv;
+		sqlite3_free(bufs[i].base);
+		i += 1 + (unsigned)header.n_delta;
+	}
+	assert(i == n_bufs);
+}
+
+/* Encode the pages of all databases modified since the previous snapshot. */
+static int snapshotIncremental(struct fsm *f,
+			       const uint8_t *bitmaps[],
+			       unsigned n_db,
+			       struct raft_buffer *bufs[],
+			       unsigned *n_bufs)
+{
+	struct db *db;
+	queue *head;
+	unsigned n = 1; /* snapshot header */
+	unsigned i;
+	unsigned k;
+	int rv;
+
+	k = 0;
+	QUEUE_FOREACH(head, &f->registry->dbs)
+	{
+		db = QUEUE_DATA(head, struct db, queue);
+		n += 1 + countDirtyPages(bitmaps[k], dbNumPages(db));
+		k++;
+	}
+
+	*bufs = sqlite3_malloc64(n * sizeof **bufs);
+	if (*bufs == NULL) {
+		rv = RAFT_NOMEM;
+		goto err;
+	}
+
+	rv = encodeSnapshotHeader(SNAPSHOT_FORMAT_INCREMENTAL, n_db,
+				  &(*bufs)[0]);
+	if (rv != 0) {
+		goto err_after_bufs_alloc;
+	}
+
+	i = 1;
+	k = 0;
+	QUEUE_FOREACH(head, &f->registry->dbs)
+	{
+		db = QUEUE_DATA(head, struct db, queue);
+		uint32_t n_pages = dbNumPages(db);
+		unsigned n_delta = countDirtyPages(bitmaps[k], n_pages);
+		rv = encodeDatabasePages(db, bitmaps[k], n_pages, &(*bufs)[i],
+					 n_delta);
+		if (rv != 0) {
+			goto err_after_encode_header;
+		}
+		i += 1 + n_delta;
+		k++;
+	}
+
+	assert(i == n);
+	*n_bufs = n;
+	return 0;
+
+err_after_encode_header:
+	freeIncrementalSnapshotBufs(*bufs, i);
+err_after_bufs_alloc:
+	sqlite3_free(*bufs);
+err:
+	assert(rv != 0);
+	return rv;
+}
+
 /* Determine the total number of raft buffers needed for a snapshot */
 static unsigned snapshotNumBufs(struct fsm *f)
 {
@@ -390,6 +1090,8 @@ static int fsm__snapshot(struct raft_fsm *fsm,
 	struct fsm *f = fsm->data;
 	queue *head;
 	struct db *db;
+	const uint8_t **bitmaps = NULL;
+	bool incremental = false;
 	unsigned n_db = 0;
 	unsigned i;
 	int rv;
@@ -413,6 +1115,25 @@ static int fsm__snapshot(struct raft_fsm *fsm,
 		assert(rv == 0);
 	}
 
+	if (f->registry->config->snapshot_chain > 0) {
+		bitmaps = sqlite3_malloc64(sizeof *bitmaps * (n_db + 1));
+		if (bitmaps == NULL) {
+			rv = RAFT_NOMEM;
+			goto err;
+		}
+		takeDirtyPages(f, bitmaps, &incremental);
+	}
+	f->incremental = incremental;
+	if (incremental) {
+		rv = snapshotIncremental(f, bitmaps, n_db, bufs, n_bufs);
+		sqlite3_free(bitmaps);
+		if (rv != 0) {
+			goto err;
+		}
+		return 0;
+	}
+	sqlite3_free(bitmaps);
+
 	*n_bufs = snapshotNumBufs(f);
 	*bufs = sqlite3_malloc64(*n_bufs * sizeof **bufs);
 	if (*bufs == NULL) {
@@ -420,7 +1141,7 @@ static int fsm__snapshot(struct raft_fsm *fsm,
 		goto err;
 	}
 
-	rv = encodeSnapshotHeader(n_db, &(*bufs)[0]);
+	rv = encodeSnapshotHeader(SNAPSHOT_FORMAT, n_db, &(*bufs)[0]);
 	if (rv != 0) {
 		goto err_after_bufs_alloc;
 	}
@@ -447,6 +1168,7 @@ err_after_encode_header:
 err_after_bufs_alloc:
 	sqlite3_free(*bufs);
 err:
+	settleDirtyPages(f, false);
 	QUEUE_FOREACH(head, &f->registry->dbs)
 	{
 		db = QUEUE_DATA(head, struct db, queue);
@@ -456,6 +1178,20 @@ err:
 	return rv;
 }
 
+static void fsm__snapshot_done(struct raft_fsm *fsm, int status)
+{
+	struct fsm *f = fsm->data;
+
+	if (!f->tracked) {
+		return;
+	}
+	settleDirtyPages(f, status == 0);
+	if (status == 0) {
+		f->has_base = true;
+		f->n_incremental = f->incremental ? f->n_incremental + 1 : 0;
+	}
+}
+
 static int fsm__snapshot_finalize(struct raft_fsm *fsm,
 				  struct raft_buffer *bufs[],
 				  unsigned *n_bufs)
@@ -478,13 +1214,18 @@ static int fsm__snapshot_finalize(struct raft_fsm *fsm,
 		tracef("decode failed %d", rv);
 		return -1;
 	}
-	if (header.format != SNAPSHOT_FORMAT) {
+	if (header.format != SNAPSHOT_FORMAT &&
+	    header.format != SNAPSHOT_FORMAT_INCREMENTAL) {
 		tracef("bad format");
 		return -1;
 	}
 
 	/* Free allocated buffers */
-	freeSnapshotBufs(f, *bufs, *n_bufs);
+	if (header.format == SNAPSHOT_FORMAT_INCREMENTAL) {
+		freeIncrementalSnapshotBufs(*bufs, *n_bufs);
+	} else {
+		freeSnapshotBufs(f, *bufs, *n_bufs);
+	}
 	sqlite3_free(*bufs);
 	*bufs = NULL;
 	*n_bufs = 0;
@@ -506,37 +1247,79 @@ static int fsm__snapshot_finalize(struct raft_fsm *fsm,
 	return 0;
 }
 
+/* Don't use sqlite3_free as snapshot buffers are allocated by raft. */
+static void releaseSnapshotBuffer(void *base)
+{
+	raft_free(base);
+}
+
 static int fsm__restore(struct raft_fsm *fsm, struct raft_buffer *buf)
 {
 	tracef("fsm restore");
 	struct fsm *f = fsm->data;
 	struct cursor cursor = {buf->base, buf->len};
 	struct snapshotHeader header;
+	struct vfsAdopted *adopted;
+	unsigned n_incremental = 0;
+	bool first = true;
 	unsigned i;
 	int rv;
 
-	rv = snapshotHeader__decode(&cursor, &header);
-	if (rv != 0) {
-		tracef("decode failed %d", rv);
-		return rv;
-	}
-	if (header.format != SNAPSHOT_FORMAT) {
-		tracef("bad format");
-		return RAFT_MALFORMED;
+	/* The restored databases keep pointing into the buffer until their
+	 * pages are modified, so from now on the buffer is released only once
+	 * the last of them is gone. */
+	adopted = VfsAdopt(buf->base, buf->len, releaseSnapshotBuffer);
+	if (adopted == NULL) {
+		return RAFT_NOMEM;
 	}
 
-	for (i = 0; i < header.n; i++) {
-		rv = decodeDatabase(f, &cursor);
+	/* The buffer holds a full snapshot, possibly followed by the chain of
+	 * incremental snapshots based on it. */
+	do {
+		rv = snapshotHeader__decode(&cursor, &header);
 		if (rv != 0) {
-			tracef("decode failed");
-			return rv;
+			tracef("decode failed %d", rv);
+			goto err;
+		}
+		if (header.format == SNAPSHOT_FORMAT_INCREMENTAL && !first) {
+			n_incremental++;
+		} else if (header.format != SNAPSHOT_FORMAT) {
+			tracef("bad format");
+			rv = RAFT_MALFORMED;
+			goto err;
 		}
-	}
 
-	/* Don't use sqlite3_free as this buffer is allocated by raft. */
-	raft_free(buf->base);
+		for (i = 0; i < header.n; i++) {
+			if (header.format == SNAPSHOT_FORMAT_INCREMENTAL) {
+				rv = decodeDatabasePages(f, &cursor);
+			} else {
+				rv = decodeDatabase(f, adopted, &cursor);
+			}
+			if (rv != 0) {
+				tracef("decode failed");
+				goto err;
+			}
+		}
+		first = false;
+	} while (cursor.cap > 0);
+
+	f->has_base = true;
+	f->n_incremental = n_incremental;
+
+	raft_free(VfsAdoptedPut(adopted));
 
 	return 0;
+
+err:
+	/* The databases restored so far copy their pages out of the buffer, so
+	 * that raft can retry with it. If some can't, they keep using it and
+	 * release it along with their pages, and raft is left with nothing. */
+	if (VfsAdoptedDetach(sqlite3_vfs_find(f->registry->config->name),
+			     adopted) == NULL) {
+		buf->base = NULL;
+		buf->len = 0;
+	}
+	return rv;
 }
 
 int fsm__init(struct raft_fsm *fsm,
@@ -552,13 +1335,20 @@ int fsm__init(struct raft_fsm *fsm,
 
 	f->logger = &config->logger;
 	f->registry = registry;
+	f->has_base = false;
+	f->n_incremental = 0;
+	f->tracked = false;
+	f->incremental = false;
 
-	fsm->version = 2;
+	fsm->version = 5;
 	fsm->data = f;
 	fsm->apply = fsm__apply;
 	fsm->snapshot = fsm__snapshot;
 	fsm->snapshot_finalize = fsm__snapshot_finalize;
+	fsm->snapshot_async = NULL;
+	fsm->snapshot_done = fsm__snapshot_done;
 	fsm->restore = fsm__restore;
+	fsm->apply_batch = fsm__apply_batch;
 
 	return 0;
 }
@@ -582,6 +1372,9 @@ static int encodeDiskDatabaseSync(struct db *db, struct raft_buffer *r_buf)
 
 	rv = VfsDiskSnapshotWal(db->vfs, db->path, buf);
 	if (rv != 0) {
+		/* A background checkpoint is writing the database file, retry
+		 * later. */
+		rv = rv == SQLITE_BUSY ? RAFT_BUSY : rv;
 		goto err;
 	}
 
@@ -732,7 +1525,7 @@ static int fsm__snapshot_disk(struct raft_fsm *fsm,
 		(*bufs)[j].len = 0;
 	}
 
-	rv = encodeSnapshotHeader(n_db, &(*bufs)[0]);
+	rv = encodeSnapshotHeader(SNAPSHOT_FORMAT, n_db, &(*bufs)[0]);
 	if (rv != 0) {
 		goto err_after_bufs_alloc;
 	}
@@ -882,6 +1675,7 @@ static int decodeDiskDatabase(struct fsm *f, struct cursor *cursor)
 	if (rv != 0) {
 		return rv;
 	}
+	feed_reset(&db->feed);
 
 	/* Check if the database file exists, and create it by opening a
 	 * connection if it doesn't. */
@@ -966,6 +1760,10 @@ int fsm__init_disk(struct raft_fsm *fsm,
 
 	f->logger = &config->logger;
 	f->registry = registry;
+	f->has_base = false;
+	f->n_incremental = 0;
+	f->tracked = false;
+	f->incremental = false;
 
 	fsm->version = 3;
 	fsm->data = f;
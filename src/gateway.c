@@ -16,6 +16,45 @@
 
 #define RAFT_GATEWAY_PARSE 0xff01 /* Internal use only */
 
+/* Upper bound of the size of the pages sent in a single backup response. */
+#define BACKUP_CHUNK_SIZE (1024 * 1024)
+
+/* State of a streaming backup. The pages of the database are borrowed from
+ * the VFS, and checkpoints and restores of the database are held off until
+ * the backup is over. Each response carries at most BACKUP_CHUNK_SIZE bytes
+ * of pages, encoded by a worker thread, and the next one is only started
+ * once the previous one was sent. */
+struct backup
+{
+	struct db *db;
+	struct dqlite_buffer *pages; /* Pages to send, or NULL to skip. */
+	uint32_t n_pages;            /* Size of the database. */
+	uint32_t next;               /* Index of the next page to consider. */
+	uint32_t page_size;
+	uint64_t position;           /* Position of the WAL. */
+	bool incremental;            /* Only changed pages are sent. */
+	bool running;                /* A chunk is being encoded. */
+	bool eof;                    /* The last chunk was encoded. */
+};
+
+/* Upper bound of the size of the changes sent in a single response, unless a
+ * single change is larger than that. */
+#define CHANGES_CHUNK_SIZE (1024 * 1024)
+
+/* State of a subscription to the change feed of a database. The changes are
+ * copied in the response buffer straight from the feed, and the next response
+ * is only prepared once the previous one was sent, so a slow subscriber
+ * doesn't make the node buffer more changes than the feed retains: if it
+ * falls behind them, the stream ends and it must start over from a backup. */
+struct subscription
+{
+	struct db *db;
+	struct feed_sub sub;
+	uint64_t index;  /* All changes up to this index were sent */
+	unsigned epoch;  /* Epoch of the feed when subscribing */
+	bool waiting;    /* Waiting for a change to be recorded */
+};
+
 static bool is_statement_empty(sqlite3 *conn, const char *sql)
 {
 	if (sql == NULL || sql[0] == '\0') {
@@ -28,6 +67,8 @@ static bool is_statement_empty(sqlite3 *conn, const char *sql)
 }
 
 static void interrupt(struct gateway *g);
+static void backupClose(struct gateway *g);
+static void subscriptionClose(struct gateway *g);
 
 void gateway__init(struct gateway *g,
 		   struct config *config,
@@ -79,6 +120,16 @@ void gateway__close(struct gateway *g, gateway_close_cb cb)
 {
 	PRE(cb != NULL);
 	g->close_cb = cb;
+	if (g->backup != NULL && !g->backup->running) {
+		/* The backup is waiting for its last chunk to be sent. */
+		backupClose(g);
+		g->req = NULL;
+	}
+	if (g->subscription != NULL) {
+		/* Responses are prepared on the loop, so nothing is pending. */
+		subscriptionClose(g);
+		g->req = NULL;
+	}
 	if (g->req != NULL) {
 		tracef("gateway deferred close");
 		/* An exec is still running, so it is not possible to close
@@ -216,7 +267,14 @@ static void exec_failure(struct gateway *g, struct handle *req, int raft_rc)
 	if (raft_rc == RAFT_BUSY) {
 		return failure(req, SQLITE_BUSY, sqlite3_errstr(SQLITE_BUSY));
 	}
-	
+
+	if (raft_rc == RAFT_OVERLOADED) {
+		char message[64];
+		snprintf(message, sizeof message, "overloaded, retry after %u ms",
+			 g->leader->retry_after);
+		return failure(req, SQLITE_BUSY, message);
+	}
+
 	if (raft_rc == RAFT_NOTLEADER) {
 		return failure(req, SQLITE_IOERR_NOT_LEADER, "not leader");
 	}
@@ -687,6 +745,10 @@ static int query_work(struct raft_io_async_work *work)
 	struct exec *exec = work->data;
 	struct gateway *g = exec->data;
 	struct handle *req = g->req;
+	struct query_budget budget = {
+		.steps = g->config->query_slice_steps,
+		.usecs = g->config->query_slice_usecs,
+	};
 
 	int rv;
 	if (!req->parameters_bound) {
@@ -705,7 +767,7 @@ static int query_work(struct raft_io_async_work *work)
 		req->parameters_bound = true;
 	}
 
-	return query__batch(exec->stmt, req->buffer);
+	return query__batch(exec->stmt, req->buffer, &budget);
 }
 
 static void query_work_done(struct raft_io_async_work *work, int rc)
@@ -732,6 +794,11 @@ static void query_work_done(struct raft_io_async_work *work, int rc)
 		return;
 	}
 
+	if (rc != SQLITE_DONE) {
+		/* Drop the rows encoded before the failure, the response is
+		 * going to be a failure one. */
+		buffer__reset(req->buffer);
+	}
 	leader_exec_result(exec, rc == SQLITE_DONE ? RAFT_OK : RAFT_ERROR);		
 	return leader_exec_resume(exec);
 }
@@ -1224,6 +1291,317 @@ out_free_data:
 	return 0;
 }
 
+static void backupClose(struct gateway *g)
+{
+	struct backup *b = g->backup;
+	PRE(b != NULL && !b->running);
+	b->db->backups--;
+	sqlite3_free(b->pages);
+	raft_free(b);
+	g->backup = NULL;
+}
+
+/* Encode the next chunk of pages in the response buffer, off the loop. */
+static int backupWork(struct raft_io_async_work *work)
+{
+	struct gateway *g = work->data;
+	struct backup *b = g->backup;
+	struct handle *req = g->req;
+	struct response_pages response = {0};
+	uint64_t pgno;
+	size_t offset;
+	size_t size = 0;
+	char *cur;
+
+	offset = buffer__offset(req->buffer);
+	cur = buffer__advance(req->buffer, response_pages__sizeof(&response));
+	if (cur == NULL) {
+		return DQLITE_NOMEM;
+	}
+	for (; b->next < b->n_pages && size < BACKUP_CHUNK_SIZE; b->next++) {
+		struct dqlite_buffer *page = &b->pages[b->next];
+		if (page->base == NULL) {
+			continue;
+		}
+		assert(page->len == b->page_size);
+		pgno = b->next + 1;
+		cur = buffer__advance(req->buffer,
+				      uint64__sizeof(&pgno) + page->len);
+		if (cur == NULL) {
+			/* Drop the partial response. */
+			req->buffer->offset = offset;
+			return DQLITE_NOMEM;
+		}
+		uint64__encode(&pgno, &cur);
+		memcpy(cur, page->base, page->len);
+		size += page->len;
+		response.n++;
+	}
+
+	b->eof = b->next == b->n_pages;
+	response.eof = b->eof ? DQLITE_RESPONSE_ROWS_DONE
+			      : DQLITE_RESPONSE_ROWS_PART;
+	response.position = b->position;
+	response.incremental = b->incremental;
+	response.database_size = b->n_pages;
+	response.page_size = b->page_size;
+	cur = buffer__cursor(req->buffer, offset);
+	response_pages__encode(&response, &cur);
+	return 0;
+}
+
+static void backupWorkDone(struct raft_io_async_work *work, int rc)
+{
+	struct gateway *g = work->data;
+	struct backup *b = g->backup;
+	struct handle *req = g->req;
+
+	b->running = false;
+	if (g->close_cb != NULL) {
+		backupClose(g);
+		g->req = NULL;
+		return gateway_finalize(g);
+	}
+	if (rc != 0) {
+		backupClose(g);
+		g->req = NULL;
+		failure(req, rc, "failed to encode backup");
+		return;
+	}
+	if (b->eof) {
+		backupClose(g);
+		g->req = NULL;
+	}
+	req->cb(req, 0, DQLITE_RESPONSE_PAGES, 0);
+}
+
+static void backupNextChunk(struct gateway *g)
+{
+	struct handle *req = g->req;
+	int rv;
+
+	g->backup->running = true;
+	g->work = (struct raft_io_async_work){
+		.data = g,
+		.work = backupWork,
+	};
+	rv = g->raft->io->async_work(g->raft->io, &g->work, backupWorkDone);
+	if (rv != 0) {
+		g->backup->running = false;
+		backupClose(g);
+		g->req = NULL;
+		failure(req, translateRaftErrCode(rv), raft_strerror(rv));
+	}
+}
+
+/* Stream a consistent copy of the pages of a database, or of the ones changed
+ * since a position returned by a previous backup, without materializing it in
+ * memory. */
+static int handle_backup(struct gateway *g, struct handle *req)
+{
+	tracef("handle backup");
+	struct cursor *cursor = &req->cursor;
+	struct backup *b;
+	struct db *db;
+	sqlite3_vfs *vfs;
+	int rv;
+	START_V0(backup);
+
+	if (g->config->disk) {
+		failure(req, SQLITE_MISUSE, "backup not supported in disk mode");
+		return 0;
+	}
+
+	rv = registry__db_get(g->registry, request.filename, &db);
+	if (rv != 0) {
+		failure(req, rv, "failed to get database");
+		return 0;
+	}
+
+	b = raft_malloc(sizeof *b);
+	if (b == NULL) {
+		failure(req, DQLITE_NOMEM, "failed to start backup");
+		return 0;
+	}
+	*b = (struct backup){
+		.db = db,
+		.position = request.position,
+	};
+
+	/* It is not possible to use g->leader->db->vfs as backups can be
+	 * requested without opening the leader connection first. */
+	vfs = sqlite3_vfs_find(g->config->name);
+	rv = VfsBackup(vfs, request.filename, &b->position, &b->incremental,
+		       &b->pages, &b->n_pages);
+	if (rv != 0) {
+		tracef("backup failed");
+		raft_free(b);
+		failure(req, rv, "failed to backup database");
+		return 0;
+	}
+	if (b->n_pages > 0) {
+		b->page_size = g->config->page_size;
+	}
+
+	db->backups++;
+	g->backup = b;
+	g->req = req;
+	backupNextChunk(g);
+	return 0;
+}
+
+static void subscriptionClose(struct gateway *g)
+{
+	struct subscription *s = g->subscription;
+	PRE(s != NULL);
+	if (s->waiting) {
+		feed_unsubscribe(&s->sub);
+	}
+	raft_free(s);
+	g->subscription = NULL;
+}
+
+/* Whether the subscriber is owed a response: either there are changes it
+ * didn't get yet, or the ones it needs are gone. */
+static bool subscriptionReady(struct gateway *g)
+{
+	struct subscription *s = g->subscription;
+	struct feed *feed = &s->db->feed;
+	return s->epoch != feed->epoch ||
+	       s->index < feed_horizon(feed, raft_last_applied(g->raft)) ||
+	       feed_next(feed, s->index) != NULL;
+}
+
+/* Encode the changes following the ones sent so far, up to
+ * CHANGES_CHUNK_SIZE, and send them. */
+static void subscriptionSend(struct gateway *g)
+{
+	struct subscription *s = g->subscription;
+	struct feed *feed = &s->db->feed;
+	struct handle *req = g->req;
+	struct response_changes response = { 0 };
+	struct feed_change *change;
+	uint64_t applied = raft_last_applied(g->raft);
+	size_t offset;
+	size_t size = 0;
+	char *cur;
+	uint32_t i;
+
+	if (s->epoch != feed->epoch || s->index < feed_horizon(feed, applied)) {
+		tracef("subscriber behind the feed at %" PRIu64, s->index);
+		response.eof = DQLITE_RESPONSE_ROWS_DONE;
+		response.index = s->index;
+		subscriptionClose(g);
+		g->req = NULL;
+		SUCCESS(changes, CHANGES, response, 0);
+		return;
+	}
+
+	offset = buffer__offset(req->buffer);
+	cur = buffer__advance(req->buffer, response_changes__sizeof(&response));
+	assert(cur != NULL);
+	for (change = feed_next(feed, s->index);
+	     change != NULL && (response.n == 0 || size < CHANGES_CHUNK_SIZE);
+	     change = feed_after(feed, change)) {
+		struct response_change header = {
+			.index = change->index,
+			.page_size = change->page_size,
+			.n = change->n_pages,
+		};
+		size_t n = response_change__sizeof(&header) +
+			   (size_t)change->n_pages * (8 + change->page_size);
+		cur = buffer__advance(req->buffer, n);
+		if (cur == NULL) {
+			req->buffer->offset = offset;
+			subscriptionClose(g);
+			g->req = NULL;
+			failure(req, DQLITE_NOMEM, "failed to encode changes");
+			return;
+		}
+		response_change__encode(&header, &cur);
+		for (i = 0; i < change->n_pages; i++) {
+			uint64_t pgno = change->page_numbers[i];
+			uint64__encode(&pgno, &cur);
+			memcpy(cur, feed_page(change, i), change->page_size);
+			cur += change->page_size;
+		}
+		s->index = change->index;
+		size += n;
+		response.n++;
+	}
+	/* Once all the changes were sent, the subscriber is in sync with the
+	 * entries applied so far. */
+	if (change == NULL && applied > s->index) {
+		s->index = applied;
+	}
+
+	response.eof = DQLITE_RESPONSE_ROWS_PART;
+	response.index = s->index;
+	cur = buffer__cursor(req->buffer, offset);
+	response_changes__encode(&response, &cur);
+	req->cb(req, 0, DQLITE_RESPONSE_CHANGES, 0);
+}
+
+static void subscriptionWakeCb(struct feed_sub *sub)
+{
+	struct gateway *g = sub->data;
+	PRE(g->subscription != NULL && g->subscription->waiting);
+	g->subscription->waiting = false;
+	subscriptionSend(g);
+}
+
+/* Send the next changes, or wait for them to be recorded. */
+static void subscriptionResume(struct gateway *g)
+{
+	struct subscription *s = g->subscription;
+	if (subscriptionReady(g)) {
+		subscriptionSend(g);
+		return;
+	}
+	s->waiting = true;
+	feed_subscribe(&s->db->feed, &s->sub, g, subscriptionWakeCb);
+}
+
+/* Stream the changes committed to a database after the given raft index, or
+ * after the last applied one if 0. The first response is sent right away, the
+ * next ones as soon as there are new changes. The stream only ends if the
+ * subscriber needs changes that the feed doesn't retain anymore. */
+static int handle_subscribe(struct gateway *g, struct handle *req)
+{
+	tracef("handle subscribe");
+	struct cursor *cursor = &req->cursor;
+	struct subscription *s;
+	struct db *db;
+	int rv;
+	START_V0(subscribe);
+
+	rv = registry__db_get(g->registry, request.filename, &db);
+	if (rv != 0) {
+		failure(req, rv, "failed to get database");
+		return 0;
+	}
+	if (!feed_enabled(&db->feed)) {
+		failure(req, SQLITE_MISUSE, "change feed not enabled");
+		return 0;
+	}
+
+	s = raft_malloc(sizeof *s);
+	if (s == NULL) {
+		failure(req, DQLITE_NOMEM, "failed to subscribe");
+		return 0;
+	}
+	*s = (struct subscription){
+		.db = db,
+		.index = request.index != 0 ? request.index
+					    : raft_last_applied(g->raft),
+		.epoch = db->feed.epoch,
+	};
+	g->subscription = s;
+	g->req = req;
+	subscriptionSend(g);
+	return 0;
+}
+
 static int encodeServer(struct gateway *g,
 			unsigned i,
 			struct buffer *buffer,
@@ -1370,6 +1748,26 @@ static int handle_weight(struct gateway *g, struct handle *req)
 	struct cursor *cursor = &req->cursor;
 	START_V0(weight, empty);
 	g->config->weight = request.weight;
+	raft_set_metadata(g->raft, g->config->failure_domain,
+			  g->config->weight);
+	SUCCESS_V0(empty, EMPTY);
+	return 0;
+}
+
+/* Set the time that the statements submitted from now on can take, including
+ * the time spent waiting to run. Statements running past it fail with
+ * SQLITE_INTERRUPT. */
+static int handle_timeout(struct gateway *g, struct handle *req)
+{
+	tracef("handle timeout");
+	struct cursor *cursor = &req->cursor;
+	START_V0(timeout, empty);
+	LOOKUP_DB(request.db_id);
+	if (request.msecs > UINT32_MAX) {
+		failure(req, SQLITE_RANGE, "timeout too large");
+		return 0;
+	}
+	g->leader->timeout = (unsigned)request.msecs;
 	SUCCESS_V0(empty, EMPTY);
 	return 0;
 }
@@ -1440,8 +1838,22 @@ handle:
 	return rc;
 }
 
+static void backupNextChunk(struct gateway *g);
+
 int gateway__resume(struct gateway *g, bool *finished)
 {
+	if (g->req != NULL && g->req->type == DQLITE_REQUEST_SUBSCRIBE) {
+		tracef("gateway resume - subscription");
+		*finished = false;
+		subscriptionResume(g);
+		return 0;
+	}
+	if (g->req != NULL && g->req->type == DQLITE_REQUEST_BACKUP) {
+		tracef("gateway resume - backup");
+		*finished = false;
+		backupNextChunk(g);
+		return 0;
+	}
 	if (g->req == NULL || (g->req->type != DQLITE_REQUEST_QUERY &&
 			       g->req->type != DQLITE_REQUEST_QUERY_SQL)) {
 		tracef("gateway resume - finished");
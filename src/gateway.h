@@ -33,6 +33,8 @@ struct gateway {
 	struct leader *leader;          /* Leader connection to the database */
 	struct handle *req;             /* Asynchronous request being handled */
 	struct raft_io_async_work work; /* Work request for off-the-loop execution */
+	struct backup *backup;          /* Streaming backup in progress */
+	struct subscription *subscription; /* Change feed being streamed */
 	struct stmt__registry stmts;    /* Registry of prepared statements */
 	uint64_t protocol;              /* Protocol format version */
 	uint64_t client_id;
@@ -12,6 +12,7 @@
 #include "lib/queue.h"
 #include "lib/sm.h"
 #include "raft.h"
+#include "sched.h"
 #include "tracing.h"
 #include "utils.h"
 #include "vfs.h"
@@ -56,6 +57,7 @@ int leader__init(struct leader *l, struct db *db, struct raft *raft)
 		.raft = raft,
 	};
 	queue_init(&l->queue);
+	sched_conn_init(&l->sched);
 	db->leaders++;
 	return 0;
 }
@@ -85,6 +87,17 @@ static int progress_abort(void *db) {
 	return SQLITE_ABORT;
 }
 
+/* Number of virtual machine instructions between deadline checks. */
+#define LEADER_DEADLINE_STEPS 1000
+
+/* Interrupt the running statement once past its deadline. This is called on
+ * the thread stepping the statement. */
+static int progress_deadline(void *arg)
+{
+	struct leader *leader = arg;
+	return span_now() >= leader->deadline;
+}
+
 void leader__close(struct leader *leader, leader_close_cb close_cb)
 {
 	if (leader->close_cb != NULL) {
@@ -203,6 +216,9 @@ err_after_buf_alloc:
  *                  │                  │
  *                  │work_cb != NULL   │work_cb == NULL
  *                  ▼                  │
+ *         EXEC_WAITING_SCHED          │
+ *                  │                  │
+ *                  ▼                  │
  *         EXEC_WAITING_QUEUE          │
  *                  │                  │
  *                  ▼                  │
@@ -221,6 +237,8 @@ err_after_buf_alloc:
  * All states can also reach `EXEC_DONE` in case of an error.
  * The state machine is suspended in the following states:
  *  - EXEC_PREPARE_BARRIER: if exec_needs_barrier returns true
+ *  - EXEC_WAITING_SCHED: if admission control queued the statement, until
+ *    another statement releases its slot
  *  - EXEC_WAITING_QUEUE: if the statement is not readonly and the db is busy
  *    with another leader
  *  - EXEC_RUN_BARRIER: if exec_needs_barrier returns true; this is necessary
@@ -233,6 +251,7 @@ enum {
 	EXEC_PREPARE_BARRIER,
 	EXEC_PREPARED,
 
+	EXEC_WAITING_SCHED,
 	EXEC_WAITING_QUEUE,
 
 	EXEC_RUN_BARRIER,
@@ -248,6 +267,7 @@ static const char* exec_state_name(int state) {
 	case EXEC_INITED:          return "EXEC_INITED";
 	case EXEC_PREPARE_BARRIER: return "EXEC_PREPARE_BARRIER";
 	case EXEC_PREPARED:        return "EXEC_PREPARED";
+	case EXEC_WAITING_SCHED:   return "EXEC_WAITING_SCHED";
 	case EXEC_WAITING_QUEUE:   return "EXEC_WAITING_QUEUE";
 	case EXEC_RUN_BARRIER:     return "EXEC_RUN_BARRIER";
 	case EXEC_RUNNING:         return "EXEC_RUNNING";
@@ -264,7 +284,8 @@ static const char* exec_state_name(int state) {
 static const struct sm_conf exec_states[EXEC_NR] = {
 	S(INITED,                 A(PREPARE_BARRIER)|A(RUNNING)|A(PREPARED)|A(DONE),     SM_INITIAL),
 	S(PREPARE_BARRIER,        A(PREPARED)|A(DONE),                                   0),
-	S(PREPARED,               A(WAITING_QUEUE)|A(RUN_BARRIER)|A(RUNNING)|A(DONE),    0),
+	S(PREPARED,               A(WAITING_SCHED)|A(DONE),                              0),
+	S(WAITING_SCHED,          A(WAITING_QUEUE)|A(RUN_BARRIER)|A(RUNNING)|A(DONE),    0),
 	S(WAITING_QUEUE,          A(RUN_BARRIER)|A(RUNNING)|A(DONE),                     0),
 	S(RUN_BARRIER,            A(RUNNING)|A(DONE),                                    0),
 	S(RUNNING,                A(WAITING_APPLY)|A(DONE),                              0),
@@ -291,6 +312,11 @@ void leader_exec(struct leader *leader,
 	req->leader = leader;
 	req->work_cb = work;
 	req->done_cb = done;
+	req->admitted = false;
+	req->deadline = leader->timeout != 0
+			    ? span_now() + (uint64_t)leader->timeout * 1000000
+			    : 0;
+	span_init(&req->span, leader->db->config->span_rate > 0);
 	queue_init(&req->queue);
 	sm_init(&req->sm, exec_invariant, NULL, exec_states, "exec",
 		EXEC_INITED);
@@ -324,6 +350,13 @@ void leader_exec_abort(struct exec *req)
 		 * This will be reset when a new query is executed. */
 		sqlite3_progress_handler(req->leader->conn, 1, progress_abort, NULL);
 		return;
+	case EXEC_WAITING_SCHED:
+		/* The request is still waiting for a slot, so it can give up its
+		 * place in the queue and move on directly. */
+		sched_cancel(req->leader->db->sched, &req->sched);
+		req->admitted = false;
+		leader_exec_result(req, RAFT_CANCELED);
+		TAIL return exec_tick(req);
 	case EXEC_WAITING_QUEUE:
 		/* timers are cancellable, so the request can move on directly. */
 		leader_exec_result(req, RAFT_CANCELED);
@@ -357,6 +390,63 @@ void leader_exec_resume(struct exec *req)
 	TAIL return exec_tick(req);
 }
 
+/* Encode a frames delta command for the given transaction, each page being
+ * diffed against its committed content. */
+static int exec_encode_delta(struct leader *leader,
+			     const struct vfsTransaction *transaction,
+			     struct raft_buffer *buf)
+{
+	struct db *db = leader->db;
+	unsigned page_size = db->config->page_size;
+	char *records;
+	void *scratch;
+	size_t len = 0;
+	unsigned i;
+	int rv;
+
+	records = sqlite3_malloc64(COMMAND__DELTA_MAX(page_size) *
+				   transaction->n_pages);
+	scratch = sqlite3_malloc64(page_size);
+	if (records == NULL || scratch == NULL) {
+		rv = DQLITE_NOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < transaction->n_pages; i++) {
+		const void *base;
+		rv = VfsCommittedPage(leader->conn,
+				      (uint32_t)transaction->page_numbers[i],
+				      scratch, &base);
+		if (rv != SQLITE_OK) {
+			tracef("committed page failed %d", rv);
+			goto out;
+		}
+		len += command__delta_encode(base, transaction->pages[i],
+					     page_size, records + len);
+	}
+
+	const struct command_frames_delta c = {
+		.filename = db->filename,
+		.tx_id = 0,
+		.truncate = 0,
+		.is_commit = 1,
+		.frames = {
+			.n_pages = (uint32_t)transaction->n_pages,
+			.page_size = (uint16_t)page_size,
+			.page_numbers = transaction->page_numbers,
+			.len = len,
+			.records = records,
+		}
+	};
+	tracef("delta encoded %u pages in %zu bytes", transaction->n_pages, len);
+	rv = command__encode(COMMAND_FRAMES_DELTA, &c, buf);
+
+out:
+	sqlite3_free(scratch);
+	sqlite3_free(records);
+	return rv;
+}
+
 static int exec_apply(struct exec *req, const struct vfsTransaction *transaction)
 {
 	tracef("leader apply frames");
@@ -373,23 +463,29 @@ static int exec_apply(struct exec *req, const struct vfsTransaction *transaction
 		return SQLITE_FULL;
 	}
 
-	const struct command_frames c = {
-		.filename = db->filename,
-		.tx_id = 0,
-		.truncate = 0,
-		.is_commit = 1,
-		.frames = {
-			.n_pages = (uint32_t)transaction->n_pages,
-			.page_size = (uint16_t)db->config->page_size,
-			.page_numbers = transaction->page_numbers,
-			.pages = transaction->pages,
-		}
-	};
-	int rv = command__encode(COMMAND_FRAMES, &c, &buf);
+	int rv;
+	if (db->config->frames_delta) {
+		rv = exec_encode_delta(leader, transaction, &buf);
+	} else {
+		const struct command_frames c = {
+			.filename = db->filename,
+			.tx_id = 0,
+			.truncate = 0,
+			.is_commit = 1,
+			.frames = {
+				.n_pages = (uint32_t)transaction->n_pages,
+				.page_size = (uint16_t)db->config->page_size,
+				.page_numbers = transaction->page_numbers,
+				.pages = transaction->pages,
+			}
+		};
+		rv = command__encode(COMMAND_FRAMES, &c, &buf);
+	}
 	if (rv != 0) {
 		tracef("encode %d", rv);
 		return rv;
 	}
+	span_mark(&req->span, SPAN_ENCODED);
 
 	rv = raft_apply(leader->raft, &req->apply, &buf, 1, exec_apply_cb);
 	if (rv != 0) {
@@ -397,6 +493,8 @@ static int exec_apply(struct exec *req, const struct vfsTransaction *transaction
 		raft_free(buf.base);
 		return rv;
 	}
+	span_mark(&req->span, SPAN_PROPOSED);
+	req->span.index = req->apply.index;
 
 	return 0;
 }
@@ -450,13 +548,39 @@ static bool exec_invariant(const struct sm *sm, int prev)
 		       CHECK(req->status == 0);
 	}
 
-	if (IN(sm_state(sm), EXEC_WAITING_QUEUE, EXEC_RUN_BARRIER, EXEC_RUNNING, EXEC_WAITING_APPLY)) {
+	if (IN(sm_state(sm), EXEC_WAITING_SCHED, EXEC_WAITING_QUEUE, EXEC_RUN_BARRIER, EXEC_RUNNING, EXEC_WAITING_APPLY)) {
 		return CHECK(req->stmt != NULL);
 	}
 	
 	return true;
 }
 
+/* Pass the timeline of a committed write to the span callback, if it's one of
+ * the sampled ones. */
+static void exec_span_done(struct exec *req)
+{
+	struct db *db = req->leader->db;
+	struct config *config = db->config;
+	char events[4096];
+	size_t len;
+
+	span_mark(&req->span, SPAN_DONE);
+	if (req->status != 0 || req->span.times[SPAN_APPLIED] == 0) {
+		return;
+	}
+	db->spans++;
+	if (db->spans < config->span_rate) {
+		return;
+	}
+	db->spans = 0;
+	len = span_encode(&req->span, config->id, events, sizeof events);
+	if (len >= sizeof events) {
+		tracef("span truncated");
+		return;
+	}
+	config->span_cb(config->span_arg, events, len);
+}
+
 static void exec_tick(struct exec *req)
 {
 	PRE(req != NULL);
@@ -464,6 +588,8 @@ static void exec_tick(struct exec *req)
 	struct leader *leader = req->leader;
 	struct db *db = leader->db;
 	struct vfsTransaction transaction;
+	struct sched_req *next = NULL;
+	int rv;
 
 	for (;;) {
 		leader_trace(leader, "exec tick %s (status = %d)",
@@ -522,12 +648,45 @@ static void exec_tick(struct exec *req)
 			continue;
 		case EXEC_PREPARED:
 			PRE(req->status == 0);
+			span_mark(&req->span, SPAN_PREPARED);
 			if (req->work_cb == NULL) {
 				/* no work callback, we are done */
 				sm_move(&req->sm, EXEC_DONE);
 				continue;
 			}
-			
+
+			if (db->active_leader == leader) {
+				/* Statements of an open transaction are never
+				 * queued, as no other writer can make progress
+				 * until the transaction ends. */
+				sm_move(&req->sm, EXEC_WAITING_SCHED);
+				continue;
+			}
+
+			rv = sched_submit(db->sched, &req->sched,
+					  sqlite3_stmt_readonly(req->stmt)
+					      ? SCHED_READ
+					      : SCHED_WRITE,
+					  &db->sched_db, &leader->sched,
+					  span_now(), &leader->retry_after);
+			if (rv == SCHED_REJECTED) {
+				req->status = RAFT_OVERLOADED;
+				sm_move(&req->sm, EXEC_DONE);
+				continue;
+			}
+			req->admitted = true;
+			sm_move(&req->sm, EXEC_WAITING_SCHED);
+			if (rv == SCHED_QUEUED) {
+				leader_trace(leader, "waiting for a slot");
+				suspend;
+			}
+			continue;
+		case EXEC_WAITING_SCHED:
+			if (req->status != 0) {
+				sm_move(&req->sm, EXEC_DONE);
+				continue;
+			}
+
 			if (sqlite3_stmt_readonly(req->stmt)) {
 				/* database in in WAL mode, readers can always proceed */
 				sm_move(&req->sm, EXEC_WAITING_QUEUE);
@@ -557,6 +716,7 @@ static void exec_tick(struct exec *req)
 			sm_move(&req->sm, EXEC_WAITING_QUEUE);
 			suspend;
 		case EXEC_WAITING_QUEUE:
+			span_mark(&req->span, SPAN_DEQUEUED);
 			raft_timer_stop(leader->raft, &req->timer);
 			queue_remove(&req->queue);
 			queue_init(&req->queue);
@@ -587,9 +747,17 @@ static void exec_tick(struct exec *req)
 			}
 
 			leader_trace(leader, "executing query");
+			if (req->deadline != 0) {
+				leader->deadline = req->deadline;
+				sqlite3_progress_handler(leader->conn,
+							 LEADER_DEADLINE_STEPS,
+							 progress_deadline, leader);
+			}
+			span_mark(&req->span, SPAN_STARTED);
 			sm_move(&req->sm, EXEC_RUNNING);
 			TAIL return req->work_cb(req);
 		case EXEC_RUNNING: /* -> EXEC_DONE */
+			span_mark(&req->span, SPAN_STEPPED);
 			leader_trace(leader, "executed query on leader (status=%d)", req->status);
 			if (req->status != RAFT_OK) {
 				sm_move(&req->sm, EXEC_DONE);
@@ -606,6 +774,7 @@ static void exec_tick(struct exec *req)
 				continue;
 			}
 
+			span_mark(&req->span, SPAN_POLLED);
 			leader_trace(leader, "polled connection (%d frames)", transaction.n_pages);
 			if (transaction.n_pages == 0) {
 				sm_move(&req->sm, EXEC_DONE);
@@ -629,6 +798,13 @@ static void exec_tick(struct exec *req)
 			sm_move(&req->sm, EXEC_DONE);
 			continue;
 		case EXEC_DONE: 
+			if (UNLIKELY(req->span.enabled)) {
+				exec_span_done(req);
+			}
+			if (req->admitted) {
+				next = sched_done(db->sched, &req->sched,
+						  span_now());
+			}
 			sm_fini(&req->sm);
 			req->leader = NULL;
 			req->done_cb(req);
@@ -655,6 +831,12 @@ static void exec_tick(struct exec *req)
 				leader_finalize(leader);
 			}
 
+			if (next != NULL) {
+				/* Admission control let a queued request take
+				 * the slot released by this one. */
+				exec_tick(CONTAINER_OF(next, struct exec, sched));
+			}
+
 			req = exec_dequeue(db);
 			if (req != NULL) {
 				PRE(IN(db->active_leader, NULL, req->leader));
@@ -702,6 +884,11 @@ static void exec_apply_cb(struct raft_apply *apply, int status, void *result)
 	struct exec *req = CONTAINER_OF(apply, struct exec, apply);
 	struct leader *leader = req->leader;
 	leader_trace(leader, "query applied (status=%d)", status);
+	if (UNLIKELY(req->span.enabled)) {
+		req->span.times[SPAN_STORED] = apply->timings[0];
+		req->span.times[SPAN_COMMITTED] = apply->timings[1];
+		req->span.times[SPAN_APPLIED] = apply->timings[2];
+	}
 	if (leader) {
 		if (status != 0) {
 			VfsAbort(leader->conn);
@@ -13,6 +13,11 @@
 #include "lib/sm.h" /* struct sm */
 #include "lib/threadpool.h"
 #include "raft.h"
+#include "sched.h"
+#include "span.h"
+
+/* Status of a statement rejected by admission control. Internal use only. */
+#define RAFT_OVERLOADED 0xff02
 
 struct exec;
 struct leader;
@@ -31,6 +36,13 @@ struct leader {
 	int             pending;  /* Number of pending requests. */
 	leader_close_cb close_cb; /* Close callback. When not NULL it means that
 				     the leader is closing. */
+	struct sched_conn sched;  /* Share of the node for admission control. */
+	unsigned retry_after;     /* Milliseconds to wait before retrying, set
+				     when a statement fails with
+				     RAFT_OVERLOADED. */
+	unsigned timeout;         /* Milliseconds a statement can take from
+				     submission, or 0 for no limit. */
+	uint64_t deadline;        /* Deadline of the running statement. */
 };
 
 /**
@@ -94,6 +106,22 @@ struct exec {
 	struct raft_timer timer; 
 	struct raft_apply apply;
 
+	/*
+	 * Slot taken by the request, if it went through admission control.
+	 */
+	struct sched_req sched;
+	bool admitted;
+
+	/*
+	 * Time after which the statement is interrupted, or 0 for none.
+	 */
+	uint64_t deadline;
+
+	/*
+	 * Timeline of the request, only recorded when span tracing is enabled.
+	 */
+	struct span span;
+
 	exec_work_cb work_cb;
 	exec_done_cb done_cb;
 };
@@ -0,0 +1,111 @@
+#include <sqlite3.h>
+
+#include "assert.h"
+#include "hash.h"
+
+#define HASH__INITIAL_BUCKETS 16
+
+uint32_t hash__str(const char *key, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	uint32_t h = 5381U;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		h = (h << 5) + h + p[i];
+	}
+
+	return h;
+}
+
+void hash__init(struct hash *h)
+{
+	h->buckets = NULL;
+	h->n_buckets = 0;
+	h->n = 0;
+}
+
+void hash__close(struct hash *h)
+{
+	sqlite3_free(h->buckets);
+	hash__init(h);
+}
+
+/* Rehash all nodes into a bucket array twice as large. */
+static void grow(struct hash *h)
+{
+	size_t n_buckets = h->n_buckets * 2;
+	struct hash_node **buckets;
+	size_t i;
+
+	buckets = sqlite3_malloc64(sizeof *buckets * n_buckets);
+	if (buckets == NULL) {
+		return;
+	}
+	for (i = 0; i < n_buckets; i++) {
+		buckets[i] = NULL;
+	}
+	for (i = 0; i < h->n_buckets; i++) {
+		struct hash_node *node = h->buckets[i];
+		while (node != NULL) {
+			struct hash_node *next = node->next;
+			size_t j = node->hash & (n_buckets - 1);
+			node->next = buckets[j];
+			buckets[j] = node;
+			node = next;
+		}
+	}
+	sqlite3_free(h->buckets);
+	h->buckets = buckets;
+	h->n_buckets = n_buckets;
+}
+
+int hash__insert(struct hash *h, struct hash_node *node, uint32_t hash)
+{
+	size_t i;
+
+	if (h->buckets == NULL) {
+		h->buckets = sqlite3_malloc64(sizeof *h->buckets *
+					      HASH__INITIAL_BUCKETS);
+		if (h->buckets == NULL) {
+			return DQLITE_NOMEM;
+		}
+		h->n_buckets = HASH__INITIAL_BUCKETS;
+		for (i = 0; i < h->n_buckets; i++) {
+			h->buckets[i] = NULL;
+		}
+	} else if (h->n >= h->n_buckets) {
+		grow(h);
+	}
+
+	node->hash = hash;
+	i = hash & (h->n_buckets - 1);
+	node->next = h->buckets[i];
+	h->buckets[i] = node;
+	h->n++;
+
+	return 0;
+}
+
+void hash__remove(struct hash *h, struct hash_node *node)
+{
+	struct hash_node **cur;
+
+	assert(h->buckets != NULL);
+	cur = &h->buckets[node->hash & (h->n_buckets - 1)];
+	while (*cur != node) {
+		assert(*cur != NULL);
+		cur = &(*cur)->next;
+	}
+	*cur = node->next;
+	node->next = NULL;
+	h->n--;
+}
+
+struct hash_node *hash__bucket(struct hash *h, uint32_t hash)
+{
+	if (h->buckets == NULL) {
+		return NULL;
+	}
+	return h->buckets[hash & (h->n_buckets - 1)];
+}
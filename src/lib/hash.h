@@ -0,0 +1,68 @@
+/**
+ * Intrusive hash table keyed by string hashes.
+ *
+ * Objects embed a struct hash_node and are chained into buckets by their
+ * 32-bit hash. The table only compares hashes: callers walk the chain returned
+ * by hash__bucket() and check their own keys, which lets them match on
+ * sub-strings (e.g. a WAL filename against its main database name).
+ *
+ * The table doubles its bucket array when the load factor exceeds 1, so
+ * lookups stay O(1) on average regardless of how many objects are stored.
+ */
+
+#ifndef LIB_HASH_H_
+#define LIB_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../include/dqlite.h"
+
+struct hash_node
+{
+	struct hash_node *next; /* Next node in the same bucket */
+	uint32_t hash;          /* Cached hash of the node's key */
+};
+
+struct hash
+{
+	struct hash_node **buckets; /* Bucket heads, NULL if not allocated */
+	size_t n_buckets;           /* Number of buckets, a power of two */
+	size_t n;                   /* Number of nodes in the table */
+};
+
+/**
+ * Hash the first @n bytes of @key using djb2.
+ */
+DQLITE_VISIBLE_TO_TESTS uint32_t hash__str(const char *key, size_t n);
+
+DQLITE_VISIBLE_TO_TESTS void hash__init(struct hash *h);
+
+/**
+ * Release the bucket array. The nodes themselves are owned by the caller.
+ */
+DQLITE_VISIBLE_TO_TESTS void hash__close(struct hash *h);
+
+/**
+ * Insert @node with the given @hash. Return 0 on success or DQLITE_NOMEM if
+ * the initial bucket array could not be allocated. Failing to grow an existing
+ * table is not an error, chains just become longer.
+ */
+DQLITE_VISIBLE_TO_TESTS int hash__insert(struct hash *h,
+					 struct hash_node *node,
+					 uint32_t hash);
+
+/**
+ * Unlink @node, which must have been previously inserted.
+ */
+DQLITE_VISIBLE_TO_TESTS void hash__remove(struct hash *h,
+					  struct hash_node *node);
+
+/**
+ * Return the head of the chain that may contain nodes with the given @hash,
+ * or NULL if the chain is empty. Nodes in the chain can have different hashes.
+ */
+DQLITE_VISIBLE_TO_TESTS struct hash_node *hash__bucket(struct hash *h,
+						       uint32_t hash);
+
+#endif /* LIB_HASH_H_ */
@@ -0,0 +1,338 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "assert.h"
+#include "shm.h"
+
+#define SHM__MAGIC UINT64_C(0x64716c697465726e) /* "nretilqd" */
+
+/* Control fields written by different sides live on separate cache lines. */
+struct shm_ring
+{
+	_Atomic uint64_t head; /* Total bytes written, only moved by the writer */
+	uint8_t pad0[56];
+	_Atomic uint64_t tail; /* Total bytes read, only moved by the reader */
+	uint8_t pad1[56];
+	_Atomic uint32_t reader_waiting; /* Set by the reader before sleeping */
+	_Atomic uint32_t writer_waiting; /* Set by the writer before sleeping */
+	uint8_t pad2[56];
+	uint8_t data[SHM__RING_SIZE];
+};
+
+/* Layout of the memfd. The first ring carries requests from the client to the
+ * server, the second one carries responses back. */
+struct shm_region
+{
+	uint64_t magic;
+	uint64_t ring_size;
+	uint8_t pad[48];
+	struct shm_ring rings[2];
+};
+
+static void closeFds(int fds[SHM__N_FDS])
+{
+	unsigned i;
+	for (i = 0; i < SHM__N_FDS; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+			fds[i] = -1;
+		}
+	}
+}
+
+static int shmMap(struct shm *s, bool server)
+{
+	struct shm_region *region;
+
+	s->map_len = sizeof *region;
+	s->map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      s->fds[0], 0);
+	if (s->map == MAP_FAILED) {
+		s->map = NULL;
+		return DQLITE_ERROR;
+	}
+	region = s->map;
+	if (server) {
+		s->in = &region->rings[0];
+		s->out = &region->rings[1];
+		s->wake_fd = s->fds[1];
+		s->peer_fd = s->fds[2];
+	} else {
+		s->in = &region->rings[1];
+		s->out = &region->rings[0];
+		s->wake_fd = s->fds[2];
+		s->peer_fd = s->fds[1];
+	}
+	return 0;
+}
+
+int shm__create(struct shm *s)
+{
+	struct shm_region *region;
+	unsigned i;
+	int rv;
+
+	s->map = NULL;
+	s->fds[0] = memfd_create("dqlite-channel", MFD_CLOEXEC);
+	s->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	s->fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	for (i = 0; i < SHM__N_FDS; i++) {
+		if (s->fds[i] < 0) {
+			goto err;
+		}
+	}
+	rv = ftruncate(s->fds[0], (off_t)sizeof *region);
+	if (rv != 0) {
+		goto err;
+	}
+	rv = shmMap(s, true);
+	if (rv != 0) {
+		goto err;
+	}
+	/* The memfd is zero-filled, so the rings start out empty. */
+	region = s->map;
+	region->magic = SHM__MAGIC;
+	region->ring_size = SHM__RING_SIZE;
+	return 0;
+
+err:
+	closeFds(s->fds);
+	return DQLITE_ERROR;
+}
+
+int shm__attach(struct shm *s, int fds[SHM__N_FDS])
+{
+	struct shm_region *region;
+	struct stat st;
+	int rv;
+
+	memcpy(s->fds, fds, sizeof s->fds);
+	s->map = NULL;
+	rv = fstat(s->fds[0], &st);
+	if (rv != 0 || (size_t)st.st_size != sizeof *region) {
+		goto err;
+	}
+	rv = shmMap(s, false);
+	if (rv != 0) {
+		goto err;
+	}
+	region = s->map;
+	if (region->magic != SHM__MAGIC ||
+	    region->ring_size != SHM__RING_SIZE) {
+		munmap(s->map, s->map_len);
+		s->map = NULL;
+		goto err;
+	}
+	return 0;
+
+err:
+	closeFds(s->fds);
+	return DQLITE_ERROR;
+}
+
+void shm__close(struct shm *s)
+{
+	if (s->map != NULL) {
+		munmap(s->map, s->map_len);
+		s->map = NULL;
+	}
+	closeFds(s->fds);
+}
+
+int shm__send(const struct shm *s, int sock, const void *data, size_t len)
+{
+	char control[CMSG_SPACE(sizeof s->fds)];
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t rv;
+
+	iov.iov_base = (void *)data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	memset(control, 0, sizeof control);
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof s->fds);
+	memcpy(CMSG_DATA(cmsg), s->fds, sizeof s->fds);
+
+	rv = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (rv != (ssize_t)len) {
+		return DQLITE_ERROR;
+	}
+	return 0;
+}
+
+int shm__recv(int sock, void *data, size_t len, int fds[SHM__N_FDS])
+{
+	char control[CMSG_SPACE(sizeof(int) * SHM__N_FDS)];
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	ssize_t rv;
+	unsigned i;
+
+	for (i = 0; i < SHM__N_FDS; i++) {
+		fds[i] = -1;
+	}
+	iov.iov_base = data;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+
+	do {
+		rv = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	} while (rv < 0 && errno == EINTR);
+	if (rv != (ssize_t)len) {
+		return DQLITE_ERROR;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(int) * SHM__N_FDS)) {
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * SHM__N_FDS);
+			break;
+		}
+	}
+	if (cmsg == NULL || (msg.msg_flags & MSG_CTRUNC) != 0) {
+		closeFds(fds);
+		return DQLITE_ERROR;
+	}
+	return 0;
+}
+
+static void wakePeer(struct shm *s)
+{
+	uint64_t one = 1;
+	ssize_t rv;
+	/* Failures are harmless: the counter can't realistically overflow,
+	 * and a peer that went away won't read it anyway. */
+	rv = write(s->peer_fd, &one, sizeof one);
+	(void)rv;
+}
+
+/* The stores and loads of the position and waiting flags below are
+ * sequentially consistent: a side that sets its waiting flag and then finds
+ * the ring unchanged is guaranteed that the other side will see the flag after
+ * moving its position, so wake ups can't be lost. */
+
+size_t shm__read(struct shm *s, void *buf, size_t len)
+{
+	struct shm_ring *r = s->in;
+	uint64_t head;
+	uint64_t tail;
+	size_t offset;
+	size_t first;
+	size_t n;
+
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&r->head, memory_order_acquire);
+	n = (size_t)(head - tail);
+	/* Don't trust the peer to keep the positions consistent. */
+	if (n > SHM__RING_SIZE) {
+		n = SHM__RING_SIZE;
+	}
+	if (n > len) {
+		n = len;
+	}
+	if (n == 0) {
+		return 0;
+	}
+	offset = (size_t)tail & (SHM__RING_SIZE - 1);
+	first = SHM__RING_SIZE - offset;
+	if (first > n) {
+		first = n;
+	}
+	memcpy(buf, &r->data[offset], first);
+	memcpy((uint8_t *)buf + first, r->data, n - first);
+	atomic_store(&r->tail, tail + n);
+
+	if (atomic_load(&r->writer_waiting) != 0 &&
+	    atomic_exchange(&r->writer_waiting, 0) != 0) {
+		wakePeer(s);
+	}
+	return n;
+}
+
+size_t shm__write(struct shm *s, const void *buf, size_t len)
+{
+	struct shm_ring *r = s->out;
+	uint64_t head;
+	uint64_t tail;
+	size_t offset;
+	size_t first;
+	size_t n;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	n = (size_t)(head - tail);
+	n = n < SHM__RING_SIZE ? SHM__RING_SIZE - n : 0;
+	if (n > len) {
+		n = len;
+	}
+	if (n == 0) {
+		return 0;
+	}
+	offset = (size_t)head & (SHM__RING_SIZE - 1);
+	first = SHM__RING_SIZE - offset;
+	if (first > n) {
+		first = n;
+	}
+	memcpy(&r->data[offset], buf, first);
+	memcpy(r->data, (const uint8_t *)buf + first, n - first);
+	atomic_store(&r->head, head + n);
+
+	if (atomic_load(&r->reader_waiting) != 0 &&
+	    atomic_exchange(&r->reader_waiting, 0) != 0) {
+		wakePeer(s);
+	}
+	return n;
+}
+
+bool shm__wait_read(struct shm *s)
+{
+	struct shm_ring *r = s->in;
+	atomic_store(&r->reader_waiting, 1);
+	if (atomic_load(&r->head) != atomic_load(&r->tail)) {
+		atomic_store(&r->reader_waiting, 0);
+		return false;
+	}
+	return true;
+}
+
+bool shm__wait_write(struct shm *s)
+{
+	struct shm_ring *r = s->out;
+	atomic_store(&r->writer_waiting, 1);
+	if (atomic_load(&r->head) - atomic_load(&r->tail) < SHM__RING_SIZE) {
+		atomic_store(&r->writer_waiting, 0);
+		return false;
+	}
+	return true;
+}
+
+void shm__drain(struct shm *s)
+{
+	uint64_t count;
+	ssize_t rv;
+	rv = read(s->wake_fd, &count, sizeof count);
+	(void)rv;
+}
@@ -0,0 +1,108 @@
+/**
+ * Shared memory channel between a node and a client running on the same host.
+ *
+ * A channel is a pair of single-producer single-consumer byte rings, one per
+ * direction, living in a memfd that both processes map. The server creates
+ * the channel and passes its file descriptors to the client over the Unix
+ * socket the client connected to.
+ *
+ * Each side owns an eventfd that the other side writes to when it makes data
+ * or space available while the first side is waiting for it. A side announces
+ * that it's about to wait by setting a flag in the ring, so as long as neither
+ * side runs dry no syscall is made at all.
+ */
+
+#ifndef LIB_SHM_H_
+#define LIB_SHM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "../../include/dqlite.h"
+
+/* Capacity of each ring, in bytes. Must be a power of two. */
+#define SHM__RING_SIZE (1 << 20)
+
+/* Number of file descriptors describing a channel: the memfd, the eventfd of
+ * the server and the eventfd of the client, in this order. */
+#define SHM__N_FDS 3
+
+struct shm_ring;
+
+struct shm
+{
+	void *map;             /* Mapping of the memfd */
+	size_t map_len;        /* Size of the mapping */
+	struct shm_ring *in;   /* Ring we read from */
+	struct shm_ring *out;  /* Ring we write to */
+	int fds[SHM__N_FDS];   /* Descriptors of the channel */
+	int wake_fd;           /* Eventfd the peer signals to wake us up */
+	int peer_fd;           /* Eventfd we signal to wake the peer up */
+};
+
+/**
+ * Create a new channel, on the server side.
+ */
+DQLITE_VISIBLE_TO_TESTS int shm__create(struct shm *s);
+
+/**
+ * Map the channel described by the given file descriptors, on the client side.
+ * The descriptors are owned by the channel from now on, even on failure.
+ */
+DQLITE_VISIBLE_TO_TESTS int shm__attach(struct shm *s, int fds[SHM__N_FDS]);
+
+/**
+ * Unmap the channel and close its file descriptors.
+ */
+DQLITE_VISIBLE_TO_TESTS void shm__close(struct shm *s);
+
+/**
+ * Send the file descriptors of the channel to the peer connected to the given
+ * Unix socket, along with @len bytes of @data.
+ */
+DQLITE_VISIBLE_TO_TESTS int shm__send(const struct shm *s,
+				      int sock,
+				      const void *data,
+				      size_t len);
+
+/**
+ * Receive @len bytes of @data and the file descriptors of a channel from the
+ * given Unix socket.
+ */
+DQLITE_VISIBLE_TO_TESTS int shm__recv(int sock,
+				      void *data,
+				      size_t len,
+				      int fds[SHM__N_FDS]);
+
+/**
+ * Copy up to @len bytes out of the incoming ring, waking up the peer if it was
+ * waiting for space. Return the number of bytes copied, possibly 0.
+ */
+DQLITE_VISIBLE_TO_TESTS size_t shm__read(struct shm *s, void *buf, size_t len);
+
+/**
+ * Copy up to @len bytes into the outgoing ring, waking up the peer if it was
+ * waiting for data. Return the number of bytes copied, possibly 0.
+ */
+DQLITE_VISIBLE_TO_TESTS size_t shm__write(struct shm *s,
+					  const void *buf,
+					  size_t len);
+
+/**
+ * Ask the peer to wake us up when it writes to the incoming ring. Return false
+ * if data arrived in the meantime, in which case there's no need to wait.
+ */
+DQLITE_VISIBLE_TO_TESTS bool shm__wait_read(struct shm *s);
+
+/**
+ * Ask the peer to wake us up when it frees space in the outgoing ring. Return
+ * false if space was freed in the meantime.
+ */
+DQLITE_VISIBLE_TO_TESTS bool shm__wait_write(struct shm *s);
+
+/**
+ * Consume the pending wake ups signalled by the peer.
+ */
+DQLITE_VISIBLE_TO_TESTS void shm__drain(struct shm *s);
+
+#endif /* LIB_SHM_H_ */
@@ -20,27 +20,33 @@ int sm_state(const struct sm *m)
 	return m->state;
 }
 
+/* State machines are only observable when tracing is enabled, in which case
+ * the process ID is looked up once per trace. Nothing is done otherwise, as
+ * state machines are created on the hot path of every exec and append. */
 static inline void sm_obs(const struct sm *m)
 {
 	tracef("%s pid: %d sm_id: %" PRIu64 " %s |",
-		m->name, m->pid, m->id, m->conf[sm_state(m)].name);
+		m->name, getpid(), m->id, m->conf[sm_state(m)].name);
 }
 
 void sm_relate(const struct sm *from, const struct sm *to)
 {
 	tracef("%s-to-%s opid: %d dpid: %d id: %" PRIu64 " id: %" PRIu64 " |",
-		from->name, to->name, from->pid, to->pid, from->id, to->id);
+		from->name, to->name, getpid(), getpid(), from->id, to->id);
 }
 
 void sm_attr(const struct sm *m, const char *k, const char *fmt, ...)
 {
 	char v[SM_MAX_ATTR_LENGTH];
 	va_list ap;
+	if (!_dqliteTracingEnabled) {
+		return;
+	}
 	va_start(ap, fmt);
 	vsnprintf(v, sizeof(v), fmt, ap);
 	va_end(ap);
 	tracef("%s-attr pid: %d sm_id: %" PRIu64 " %s %s |",
-	       m->name, m->pid, m->id, k, v);
+	       m->name, getpid(), m->id, k, v);
 }
 
 void sm_init(struct sm *m,
@@ -59,11 +65,10 @@ void sm_init(struct sm *m,
 		.state = state,
 		.invariant = invariant,
 		.is_locked = is_locked,
-		.id = ++id,
-		.pid = getpid(),
+		.name = name,
+		.id = atomic_fetch_add_explicit(&id, 1, memory_order_relaxed) + 1,
 		.rc = 0,
 	};
-	snprintf(m->name, SM_MAX_NAME_LENGTH, "%s", name);
 	sm_obs(m);
 
 	POST(m->invariant != NULL && m->invariant(m, SM_PREV_NONE));
@@ -9,7 +9,6 @@
 
 #define CHECK(cond) sm_check((cond), __FILE__, __LINE__, #cond)
 
-#define SM_MAX_NAME_LENGTH 50
 #define SM_MAX_ATTR_LENGTH 100
 
 enum {
@@ -33,9 +32,8 @@ struct sm
 {
 	int rc;
 	int state;
-	char name[SM_MAX_NAME_LENGTH];
+	const char *name; /* Not copied, usually a string literal */
 	uint64_t id;
-	pid_t pid;
 	bool (*is_locked)(const struct sm *);
 	bool (*invariant)(const struct sm *, int);
 	const struct sm_conf *conf;
@@ -3,8 +3,22 @@
 #include "../../include/dqlite.h"
 
 #include "assert.h"
+#include "shm.h"
 #include "transport.h"
 
+struct transport_shm
+{
+	struct shm shm;
+	struct uv_poll_s poll; /* Watches the eventfd signalled by the client */
+	struct uv_idle_s idle; /* Runs operations started outside the pump */
+	uv_buf_t write;        /* Data still to be written */
+	char scratch[8];       /* Sink for unexpected data on the stream */
+	int status;            /* Sticky error, e.g. the client went away */
+	bool pumping;          /* Whether shmPump is running */
+	bool closing;          /* Whether transport__close was called */
+	unsigned n_handles;    /* Handles not closed yet */
+};
+
 /* Called to allocate a buffer for the next stream read. */
 static void alloc_cb(uv_handle_t *stream, size_t suggested_size, uv_buf_t *buf)
 {
@@ -126,6 +140,7 @@ int transport__init(struct transport *t, struct uv_stream_s *stream)
 	t->read_cb = NULL;
 	t->write_cb = NULL;
 	t->close_cb = NULL;
+	t->shm = NULL;
 
 	return 0;
 }
@@ -139,13 +154,21 @@ static void close_cb(uv_handle_t *handle)
 	}
 }
 
+static void shmClose(struct transport *t);
+
 void transport__close(struct transport *t, transport_close_cb cb)
 {
 	assert(t->close_cb == NULL);
 	t->close_cb = cb;
+	if (t->shm != NULL) {
+		shmClose(t);
+		return;
+	}
 	uv_close((uv_handle_t *)t->stream, close_cb);
 }
 
+static void shmStart(struct transport *t);
+
 int transport__read(struct transport *t, uv_buf_t *buf, transport_read_cb cb)
 {
 	int rv;
@@ -154,6 +177,10 @@ int transport__read(struct transport *t, uv_buf_t *buf, transport_read_cb cb)
 	assert(t->read.len == 0);
 	t->read = *buf;
 	t->read_cb = cb;
+	if (t->shm != NULL) {
+		shmStart(t);
+		return 0;
+	}
 	rv = uv_read_start(t->stream, alloc_cb, read_cb);
 	if (rv != 0) {
 		return DQLITE_ERROR;
@@ -177,9 +204,246 @@ int transport__write(struct transport *t, uv_buf_t *buf, transport_write_cb cb)
 	int rv;
 	assert(t->write_cb == NULL);
 	t->write_cb = cb;
+	if (t->shm != NULL) {
+		t->shm->write = *buf;
+		shmStart(t);
+		return 0;
+	}
 	rv = uv_write(&t->write, t->stream, buf, 1, write_cb);
 	if (rv != 0) {
 		return rv;
 	}
 	return 0;
 }
+
+/* Complete the pending read, if any. */
+static void shmReadDone(struct transport *t, int status)
+{
+	transport_read_cb cb = t->read_cb;
+	t->read_cb = NULL;
+	t->read.base = NULL;
+	t->read.len = 0;
+	cb(t, status);
+}
+
+/* Complete the pending write, if any. */
+static void shmWriteDone(struct transport *t, int status)
+{
+	transport_write_cb cb = t->write_cb;
+	t->write_cb = NULL;
+	t->shm->write.base = NULL;
+	t->shm->write.len = 0;
+	cb(t, status);
+}
+
+/* Move data between the rings and the pending read and write buffers until
+ * neither can make progress, then ask the client to wake us up.
+ *
+ * Callbacks started from here can start new operations, which are picked up by
+ * the next iteration instead of recursing, just like with a stream where
+ * callbacks always fire from a later loop iteration. */
+static void shmPump(struct transport *t)
+{
+	struct transport_shm *s = t->shm;
+	bool progress;
+	size_t n;
+
+	if (s->pumping) {
+		return;
+	}
+	s->pumping = true;
+	do {
+		progress = false;
+		if (t->read_cb != NULL && s->status == 0) {
+			n = shm__read(&s->shm, t->read.base, t->read.len);
+			t->read.base += n;
+			t->read.len -= n;
+			if (t->read.len == 0) {
+				shmReadDone(t, 0);
+				progress = true;
+			}
+		}
+		if (s->closing) {
+			break;
+		}
+		if (t->write_cb != NULL && s->status == 0) {
+			n = shm__write(&s->shm, s->write.base, s->write.len);
+			s->write.base += n;
+			s->write.len -= n;
+			if (s->write.len == 0) {
+				shmWriteDone(t, 0);
+				progress = true;
+			}
+		}
+		if (s->closing) {
+			break;
+		}
+		if (s->status != 0) {
+			if (t->read_cb != NULL) {
+				shmReadDone(t, s->status);
+				progress = true;
+			} else if (t->write_cb != NULL) {
+				shmWriteDone(t, s->status);
+				progress = true;
+			}
+			continue;
+		}
+		if (!progress && t->read_cb != NULL &&
+		    !shm__wait_read(&s->shm)) {
+			progress = true;
+		}
+		if (!progress && t->write_cb != NULL &&
+		    !shm__wait_write(&s->shm)) {
+			progress = true;
+		}
+	} while (progress && !s->closing);
+	s->pumping = false;
+}
+
+static void shmIdleCb(uv_idle_t *idle)
+{
+	struct transport *t = idle->data;
+	int rv;
+	rv = uv_idle_stop(idle);
+	assert(rv == 0);
+	shmPump(t);
+}
+
+/* Called when an operation is started. Operations started from a callback are
+ * picked up by the running pump, others on the next loop iteration. */
+static void shmStart(struct transport *t)
+{
+	int rv;
+	if (t->shm->pumping) {
+		return;
+	}
+	rv = uv_idle_start(&t->shm->idle, shmIdleCb);
+	assert(rv == 0);
+}
+
+static void shmPollCb(uv_poll_t *poll, int status, int events)
+{
+	struct transport *t = poll->data;
+	(void)events;
+	if (status != 0 && t->shm->status == 0) {
+		t->shm->status = status;
+	}
+	shm__drain(&t->shm->shm);
+	shmPump(t);
+}
+
+static void shmAllocCb(uv_handle_t *stream, size_t suggested_size, uv_buf_t *buf)
+{
+	struct transport *t = stream->data;
+	(void)suggested_size;
+	buf->base = t->shm->scratch;
+	buf->len = sizeof t->shm->scratch;
+}
+
+/* The client doesn't write to the stream after the switch, so any read event
+ * means either that it went away or that it misbehaves. */
+static void shmStreamReadCb(uv_stream_t *stream,
+			    ssize_t nread,
+			    const uv_buf_t *buf)
+{
+	struct transport *t = stream->data;
+	(void)buf;
+	if (nread == 0) {
+		return;
+	}
+	uv_read_stop(stream);
+	if (t->shm->status == 0) {
+		t->shm->status = nread < 0 ? (int)nread : UV_EPROTO;
+	}
+	shmPump(t);
+}
+
+int transport__shm(struct transport *t, const void *data, size_t len)
+{
+	struct transport_shm *s;
+	int fd;
+	int rv;
+
+	assert(t->shm == NULL);
+	assert(t->read_cb == NULL);
+	assert(t->write_cb == NULL);
+
+	if (t->stream->type != UV_NAMED_PIPE) {
+		return TRANSPORT__BADSOCKET;
+	}
+	rv = uv_fileno((uv_handle_t *)t->stream, &fd);
+	if (rv != 0) {
+		return TRANSPORT__BADSOCKET;
+	}
+	s = raft_malloc(sizeof *s);
+	if (s == NULL) {
+		return DQLITE_NOMEM;
+	}
+	rv = shm__create(&s->shm);
+	if (rv != 0) {
+		goto err_after_alloc;
+	}
+	rv = shm__send(&s->shm, fd, data, len);
+	if (rv != 0) {
+		goto err_after_create;
+	}
+	rv = uv_poll_init(t->stream->loop, &s->poll, s->shm.wake_fd);
+	if (rv != 0) {
+		rv = DQLITE_ERROR;
+		goto err_after_create;
+	}
+	s->poll.data = t;
+	rv = uv_poll_start(&s->poll, UV_READABLE, shmPollCb);
+	assert(rv == 0);
+	rv = uv_idle_init(t->stream->loop, &s->idle);
+	assert(rv == 0);
+	s->idle.data = t;
+	s->write.base = NULL;
+	s->write.len = 0;
+	s->status = 0;
+	s->pumping = false;
+	s->closing = false;
+	s->n_handles = 3;
+	t->shm = s;
+
+	rv = uv_read_start(t->stream, shmAllocCb, shmStreamReadCb);
+	if (rv != 0) {
+		s->status = rv;
+	}
+	return 0;
+
+err_after_create:
+	shm__close(&s->shm);
+err_after_alloc:
+	raft_free(s);
+	return rv;
+}
+
+static void shmCloseCb(uv_handle_t *handle)
+{
+	struct transport *t = handle->data;
+	struct transport_shm *s = t->shm;
+	s->n_handles--;
+	if (s->n_handles > 0) {
+		return;
+	}
+	shm__close(&s->shm);
+	raft_free(s);
+	t->shm = NULL;
+	raft_free(t->stream);
+	if (t->close_cb != NULL) {
+		t->close_cb(t);
+	}
+}
+
+/* Pending operations are dropped without invoking their callbacks. */
+static void shmClose(struct transport *t)
+{
+	struct transport_shm *s = t->shm;
+	s->closing = true;
+	t->read_cb = NULL;
+	t->write_cb = NULL;
+	uv_close((uv_handle_t *)&s->poll, shmCloseCb);
+	uv_close((uv_handle_t *)&s->idle, shmCloseCb);
+	uv_close((uv_handle_t *)t->stream, shmCloseCb);
+}
@@ -17,6 +17,8 @@ typedef void (*transport_read_cb)(struct transport *t, int status);
 typedef void (*transport_write_cb)(struct transport *t, int status);
 typedef void (*transport_close_cb)(struct transport *t);
 
+struct transport_shm;
+
 /**
  * Light wrapper around a libuv stream handle, providing a more convenient way
  * to read a certain amount of bytes.
@@ -30,6 +32,7 @@ struct transport
 	transport_read_cb read_cb;   /* Read callback */
 	transport_write_cb write_cb; /* Write callback */
 	transport_close_cb close_cb; /* Close callback */
+	struct transport_shm *shm;   /* Shared memory channel, if any */
 };
 
 /**
@@ -58,4 +61,11 @@ int transport__stream(struct uv_loop_s *loop,
 		      int fd,
 		      struct uv_stream_s **stream);
 
+/* Switch the transport to a shared memory channel (see shm.h) with a client
+ * running on the same host. The channel is created and its descriptors are
+ * sent to the client over the stream, which must be a Unix socket, along with
+ * @len bytes of @data. From then on the stream is only watched to detect when
+ * the client goes away. */
+int transport__shm(struct transport *t, const void *data, size_t len);
+
 #endif /* LIB_TRANSPORT_H_ */
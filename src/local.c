@@ -0,0 +1,725 @@
+#include "local.h"
+
+#include <stdlib.h>
+#include <uv.h>
+
+#include "client/protocol.h"
+#include "lib/assert.h"
+#include "protocol.h"
+#include "request.h"
+#include "response.h"
+#include "tracing.h"
+#include "tuple.h"
+#include "utils.h"
+
+/* Result passed to callbacks, along with the rows it refers to. */
+struct local_result
+{
+	dqlite_local_result result;
+	struct client_rows rows;
+};
+
+/******************************************************************************
+ *
+ * Submitting requests, from any thread.
+ *
+ ******************************************************************************/
+
+static struct local_request *requestCreate(struct dqlite_local *l,
+					   int type,
+					   int schema,
+					   dqlite_local_cb cb,
+					   void *arg)
+{
+	struct local_request *req;
+	int rv;
+
+	req = sqlite3_malloc(sizeof *req);
+	if (req == NULL) {
+		return NULL;
+	}
+	rv = buffer__init(&req->body);
+	if (rv != 0) {
+		sqlite3_free(req);
+		return NULL;
+	}
+	req->next = NULL;
+	req->local = l;
+	req->type = type;
+	req->schema = schema;
+	req->cb = cb;
+	req->arg = arg;
+	return req;
+}
+
+static void requestDestroy(struct local_request *req)
+{
+	/* The close request is part of its connection. */
+	if (req->type == LOCAL_REQUEST_CLOSE) {
+		return;
+	}
+	buffer__close(&req->body);
+	sqlite3_free(req);
+}
+
+/* Push a request onto the inbox of the node, waking up its loop if the inbox
+ * was empty. Otherwise a wake-up is already pending, and the loop will find
+ * this request along with the others. */
+static void requestSubmit(struct local_request *req)
+{
+	struct dqlite_node *d = req->local->node;
+	struct local_request *head;
+	int rv;
+
+	head = atomic_load_explicit(&d->local_inbox, memory_order_relaxed);
+	do {
+		req->next = head;
+	} while (!atomic_compare_exchange_weak_explicit(
+	    &d->local_inbox, &head, req, memory_order_release,
+	    memory_order_relaxed));
+
+	if (head == NULL) {
+		rv = uv_async_send(&d->local_wakeup);
+		assert(rv == 0);
+	}
+}
+
+/* Encode the body of a request. */
+#define ENCODE(LOWER)                                            \
+	{                                                        \
+		size_t _n = request_##LOWER##__sizeof(&request); \
+		char *_cursor = buffer__advance(&req->body, _n); \
+		if (_cursor == NULL) {                           \
+			rv = DQLITE_NOMEM;                       \
+			goto err_after_req_create;               \
+		}                                                \
+		request_##LOWER##__encode(&request, &_cursor);   \
+	}
+
+/* Encode the parameters of a request. */
+static int encodeParams(struct buffer *buffer,
+			const dqlite_local_value *params,
+			unsigned n_params)
+{
+	struct tuple_encoder encoder;
+	struct value value;
+	unsigned i;
+	int rv;
+
+	if (n_params == 0) {
+		return 0;
+	}
+	rv = tuple_encoder__init(&encoder, n_params, TUPLE__PARAMS32, buffer);
+	if (rv != 0) {
+		return DQLITE_NOMEM;
+	}
+	for (i = 0; i < n_params; i++) {
+		value.type = params[i].type;
+		switch (params[i].type) {
+			case SQLITE_INTEGER:
+				value.integer = params[i].integer;
+				break;
+			case SQLITE_FLOAT:
+				value.real = params[i].real;
+				break;
+			case SQLITE_TEXT:
+				value.text = params[i].text;
+				break;
+			case SQLITE_BLOB:
+				value.blob.base = (char *)params[i].blob.base;
+				value.blob.len = params[i].blob.len;
+				break;
+			case SQLITE_NULL:
+				value.null = 0;
+				break;
+			default:
+				return DQLITE_MISUSE;
+		}
+		rv = tuple_encoder__next(&encoder, &value);
+		if (rv != 0) {
+			return DQLITE_NOMEM;
+		}
+	}
+	return 0;
+}
+
+int dqlite_local_open(dqlite_node *n,
+		      const char *name,
+		      dqlite_local_cb cb,
+		      void *arg,
+		      dqlite_local **local)
+{
+	tracef("local open name %s", name);
+	struct request_open request;
+	struct local_request *req;
+	struct dqlite_local *l;
+	int rv;
+
+	if (n == NULL || name == NULL || cb == NULL || local == NULL) {
+		return DQLITE_MISUSE;
+	}
+
+	l = sqlite3_malloc(sizeof *l);
+	if (l == NULL) {
+		rv = DQLITE_NOMEM;
+		goto err;
+	}
+	*l = (struct dqlite_local){.node = n};
+	l->close.local = l;
+	l->close.type = LOCAL_REQUEST_CLOSE;
+
+	req = requestCreate(l, DQLITE_REQUEST_OPEN, 0, cb, arg);
+	if (req == NULL) {
+		rv = DQLITE_NOMEM;
+		goto err_after_local_alloc;
+	}
+	request.filename = name;
+	request.flags = 0;    /* unused */
+	request.vfs = "test"; /* unused */
+	ENCODE(open);
+
+	*local = l;
+	requestSubmit(req);
+	return 0;
+
+err_after_req_create:
+	requestDestroy(req);
+err_after_local_alloc:
+	sqlite3_free(l);
+err:
+	return rv;
+}
+
+int dqlite_local_prepare(dqlite_local *l,
+			 const char *sql,
+			 dqlite_local_cb cb,
+			 void *arg)
+{
+	tracef("local prepare");
+	struct request_prepare request;
+	struct local_request *req;
+	int rv;
+
+	if (l == NULL || sql == NULL || cb == NULL) {
+		return DQLITE_MISUSE;
+	}
+	req = requestCreate(l, DQLITE_REQUEST_PREPARE,
+			    DQLITE_PREPARE_STMT_SCHEMA_V1, cb, arg);
+	if (req == NULL) {
+		return DQLITE_NOMEM;
+	}
+	request.db_id = 0;
+	request.sql = sql;
+	ENCODE(prepare);
+	requestSubmit(req);
+	return 0;
+
+err_after_req_create:
+	requestDestroy(req);
+	return rv;
+}
+
+/* Submit an exec or query request, by statement ID or SQL text. */
+#define SUBMIT_STATEMENT(LOWER, UPPER, FIELD, VALUE)                           \
+	{                                                                      \
+		struct request_##LOWER request;                                \
+		struct local_request *req;                                     \
+		int rv;                                                        \
+		if (l == NULL || cb == NULL ||                                 \
+		    (params == NULL && n_params > 0)) {                        \
+			return DQLITE_MISUSE;                                  \
+		}                                                              \
+		req = requestCreate(l, DQLITE_REQUEST_##UPPER,                 \
+				    DQLITE_REQUEST_PARAMS_SCHEMA_V1, cb, arg); \
+		if (req == NULL) {                                             \
+			return DQLITE_NOMEM;                                   \
+		}                                                              \
+		request.db_id = 0;                                             \
+		request.FIELD = VALUE;                                         \
+		ENCODE(LOWER);                                                 \
+		rv = encodeParams(&req->body, params, n_params);               \
+		if (rv != 0) {                                                 \
+			goto err_after_req_create;                             \
+		}                                                              \
+		requestSubmit(req);                                            \
+		return 0;                                                      \
+	err_after_req_create:                                                  \
+		requestDestroy(req);                                           \
+		return rv;                                                     \
+	}
+
+int dqlite_local_exec(dqlite_local *l,
+		      unsigned stmt_id,
+		      const dqlite_local_value *params,
+		      unsigned n_params,
+		      dqlite_local_cb cb,
+		      void *arg)
+{
+	tracef("local exec id %u", stmt_id);
+	SUBMIT_STATEMENT(exec, EXEC, stmt_id, (uint32_t)stmt_id);
+}
+
+int dqlite_local_exec_sql(dqlite_local *l,
+			  const char *sql,
+			  const dqlite_local_value *params,
+			  unsigned n_params,
+			  dqlite_local_cb cb,
+			  void *arg)
+{
+	tracef("local exec sql");
+	if (sql == NULL) {
+		return DQLITE_MISUSE;
+	}
+	SUBMIT_STATEMENT(exec_sql, EXEC_SQL, sql, sql);
+}
+
+int dqlite_local_query(dqlite_local *l,
+		       unsigned stmt_id,
+		       const dqlite_local_value *params,
+		       unsigned n_params,
+		       dqlite_local_cb cb,
+		       void *arg)
+{
+	tracef("local query id %u", stmt_id);
+	SUBMIT_STATEMENT(query, QUERY, stmt_id, (uint32_t)stmt_id);
+}
+
+int dqlite_local_query_sql(dqlite_local *l,
+			   const char *sql,
+			   const dqlite_local_value *params,
+			   unsigned n_params,
+			   dqlite_local_cb cb,
+			   void *arg)
+{
+	tracef("local query sql");
+	if (sql == NULL) {
+		return DQLITE_MISUSE;
+	}
+	SUBMIT_STATEMENT(query_sql, QUERY_SQL, sql, sql);
+}
+
+int dqlite_local_finalize(dqlite_local *l,
+			  unsigned stmt_id,
+			  dqlite_local_cb cb,
+			  void *arg)
+{
+	tracef("local finalize id %u", stmt_id);
+	struct request_finalize request;
+	struct local_request *req;
+	int rv;
+
+	if (l == NULL || cb == NULL) {
+		return DQLITE_MISUSE;
+	}
+	req = requestCreate(l, DQLITE_REQUEST_FINALIZE, 0, cb, arg);
+	if (req == NULL) {
+		return DQLITE_NOMEM;
+	}
+	request.db_id = 0;
+	request.stmt_id = (uint32_t)stmt_id;
+	ENCODE(finalize);
+	requestSubmit(req);
+	return 0;
+
+err_after_req_create:
+	requestDestroy(req);
+	return rv;
+}
+
+void dqlite_local_close(dqlite_local *l)
+{
+	tracef("local close");
+	requestSubmit(&l->close);
+}
+
+void dqlite_local_result_value(const dqlite_local_result *result,
+			       unsigned row,
+			       unsigned column,
+			       dqlite_local_value *value)
+{
+	const struct local_result *r =
+	    CONTAINER_OF(result, const struct local_result, result);
+	struct value v;
+
+	PRE(row < result->row_count && column < result->column_count);
+	clientRowsGet(&r->rows, row, column, &v);
+	switch (v.type) {
+		case SQLITE_INTEGER:
+		case DQLITE_UNIXTIME:
+			value->type = SQLITE_INTEGER;
+			value->integer = v.integer;
+			break;
+		case DQLITE_BOOLEAN:
+			value->type = SQLITE_INTEGER;
+			value->integer = v.boolean != 0;
+			break;
+		case SQLITE_FLOAT:
+			value->type = SQLITE_FLOAT;
+			value->real = v.real;
+			break;
+		case SQLITE_TEXT:
+		case DQLITE_ISO8601:
+			value->type = SQLITE_TEXT;
+			value->text = v.text;
+			break;
+		case SQLITE_BLOB:
+			value->type = SQLITE_BLOB;
+			value->blob.base = v.blob.base;
+			value->blob.len = v.blob.len;
+			break;
+		default:
+			value->type = SQLITE_NULL;
+			break;
+	}
+}
+
+/******************************************************************************
+ *
+ * Serving requests, on the loop thread.
+ *
+ ******************************************************************************/
+
+/* Invoke the callback of a request that could not be served. */
+static void requestAbort(struct local_request *req, const char *message)
+{
+	struct local_result r = {0};
+
+	if (req->cb != NULL) {
+		r.result.status = SQLITE_ABORT;
+		r.result.message = message;
+		r.result.done = true;
+		req->cb(req->arg, &r.result);
+	}
+}
+
+/* Decode a response written by the gateway and pass it to the callback of the
+ * request. Return whether more responses will follow. */
+static bool requestRespond(struct local_request *req,
+			   uint8_t type,
+			   struct buffer *buffer)
+{
+	struct local_result r = {0};
+	struct response_failure failure;
+	struct response_stmt_with_offset stmt;
+	struct response_result result;
+	struct cursor cursor;
+	int rv = 0;
+
+	cursor.p = buffer__cursor(buffer, 0);
+	cursor.cap = buffer__offset(buffer);
+	r.result.done = true;
+
+	switch (type) {
+		case DQLITE_RESPONSE_FAILURE:
+			rv = response_failure__decode(&cursor, &failure);
+			if (rv == 0) {
+				r.result.status = (int)failure.code;
+				r.result.message = failure.message;
+			}
+			break;
+		case DQLITE_RESPONSE_STMT_WITH_OFFSET:
+			rv = response_stmt_with_offset__decode(&cursor, &stmt);
+			if (rv == 0) {
+				r.result.stmt_id = stmt.id;
+				r.result.n_params = (unsigned)stmt.params;
+			}
+			break;
+		case DQLITE_RESPONSE_RESULT:
+			rv = response_result__decode(&cursor, &result);
+			if (rv == 0) {
+				r.result.last_insert_id = result.last_insert_id;
+				r.result.rows_affected = result.rows_affected;
+			}
+			break;
+		case DQLITE_RESPONSE_ROWS:
+			/* The response buffer outlives the callback, so the
+			 * rows can point into it. */
+			rv = clientDecodeRowsInPlace(cursor.p, cursor.cap,
+						     &r.rows, false,
+						     &r.result.done);
+			if (rv == 0) {
+				r.result.column_count = r.rows.column_count;
+				r.result.row_count = r.rows.row_count;
+				r.result.column_names = r.rows.column_names;
+			}
+			break;
+		case DQLITE_RESPONSE_DB:
+		case DQLITE_RESPONSE_EMPTY:
+			break;
+		default:
+			rv = DQLITE_ERROR;
+			break;
+	}
+	if (rv == DQLITE_NOMEM) {
+		/* Only this batch is lost, the gateway goes on with the
+		 * query until it's done. */
+		tracef("local response type %u out of memory", type);
+		r.result.status = SQLITE_NOMEM;
+		r.result.message = "out of memory";
+	} else if (rv != 0) {
+		tracef("local response type %u malformed", type);
+		r.result.status = SQLITE_PROTOCOL;
+		r.result.message = "malformed response";
+		r.result.done = true;
+	}
+
+	req->cb(req->arg, &r.result);
+	clientCloseRowsArena(&r.rows);
+	return !r.result.done;
+}
+
+static void localCloseCb(struct gateway *g)
+{
+	struct dqlite_local *l = CONTAINER_OF(g, struct dqlite_local, gateway);
+	tracef("local closed");
+	queue_remove(&l->queue);
+	if (l->deferred) {
+		queue_remove(&l->ready);
+	}
+	buffer__close(&l->response);
+	sqlite3_free(l);
+}
+
+/* Serve a connection again from the main loop, once the gateway call that
+ * responded asynchronously has returned. */
+static void localDefer(struct dqlite_local *l)
+{
+	struct dqlite_node *d = l->node;
+	int rv;
+
+	if (l->deferred) {
+		return;
+	}
+	l->deferred = true;
+	queue_insert_tail(&d->local_ready, &l->ready);
+	rv = uv_async_send(&d->local_wakeup);
+	assert(rv == 0);
+}
+
+static void localHandleCb(struct handle *handle,
+			  int status,
+			  uint8_t type,
+			  uint8_t schema)
+{
+	struct dqlite_local *l = handle->data;
+	(void)status;
+	(void)schema;
+
+	/* The request was already aborted. */
+	if (l->current == NULL || l->closing) {
+		return;
+	}
+	if (!requestRespond(l->current, type, &l->response)) {
+		requestDestroy(l->current);
+		l->current = NULL;
+	}
+	l->responded = true;
+	/* The gateway is still on the stack and might use the statement it
+	 * responded about, so a following request like FINALIZE can't be
+	 * handled right away, unless localServe is what called the gateway. */
+	if (!l->serving) {
+		localDefer(l);
+	}
+}
+
+/* Hand the queued requests of a connection to its gateway, one at a time.
+ *
+ * The gateway can respond either right away or later from another callback,
+ * so this loops instead of recursing when a response comes synchronously, to
+ * keep the stack bounded while a query yields many batches of rows. */
+static void localServe(struct dqlite_local *l)
+{
+	struct local_request *req;
+	queue *head;
+	bool finished;
+	int rv;
+
+	if (l->serving) {
+		return;
+	}
+	l->serving = true;
+	for (;;) {
+		if (l->responded) {
+			l->responded = false;
+			buffer__reset(&l->response);
+			rv = gateway__resume(&l->gateway, &finished);
+			assert(rv == 0);
+			assert(finished == (l->current == NULL));
+			continue;
+		}
+		if (l->current != NULL || queue_empty(&l->requests)) {
+			break;
+		}
+
+		head = queue_head(&l->requests);
+		req = QUEUE_DATA(head, struct local_request, queue);
+		queue_remove(head);
+
+		if (req->type == LOCAL_REQUEST_CLOSE) {
+			requestDestroy(req);
+			l->closing = true;
+			l->serving = false;
+			gateway__close(&l->gateway, localCloseCb);
+			return;
+		}
+
+		l->current = req;
+		buffer__reset(&l->response);
+		l->handle.cursor.p = buffer__cursor(&req->body, 0);
+		l->handle.cursor.cap = buffer__offset(&req->body);
+		rv = gateway__handle(&l->gateway, &l->handle, req->type,
+				     req->schema, &l->response, localHandleCb);
+		if (rv != 0) {
+			tracef("local gateway handle error %d", rv);
+			requestAbort(req, "failed to handle request");
+			requestDestroy(req);
+			l->current = NULL;
+		}
+	}
+	l->serving = false;
+}
+
+/* Start a connection the first time one of its requests is received. */
+static void localStart(struct dqlite_node *d, struct dqlite_local *l)
+{
+	int rv;
+
+	gateway__init(&l->gateway, &d->config, &d->registry, &d->raft);
+	l->gateway.protocol = DQLITE_PROTOCOL_VERSION;
+	l->handle = (struct handle){.data = l};
+	rv = buffer__init(&l->response);
+	if (rv != 0) {
+		abort();
+	}
+	queue_init(&l->requests);
+	queue_insert_tail(&d->locals, &l->queue);
+	l->started = true;
+}
+
+/* Fail all requests of a connection and close it, while the node stops. */
+static void localAbort(struct dqlite_local *l)
+{
+	struct local_request *req;
+	queue *head;
+
+	if (l->current != NULL) {
+		requestAbort(l->current, "node is stopping");
+		requestDestroy(l->current);
+		l->current = NULL;
+	}
+	while (!queue_empty(&l->requests)) {
+		head = queue_head(&l->requests);
+		req = QUEUE_DATA(head, struct local_request, queue);
+		queue_remove(head);
+		requestAbort(req, "node is stopping");
+		requestDestroy(req);
+	}
+	/* The gateway might only be closed once a running statement is done,
+	 * so forget about the connection right away. */
+	queue_remove(&l->queue);
+	queue_init(&l->queue);
+	if (l->deferred) {
+		queue_remove(&l->ready);
+		l->deferred = false;
+	}
+	if (!l->closing) {
+		l->closing = true;
+		gateway__close(&l->gateway, localCloseCb);
+	}
+}
+
+/* Take all requests from the inbox, oldest first. */
+static struct local_request *inboxTake(struct dqlite_node *d)
+{
+	struct local_request *req;
+	struct local_request *next;
+	struct local_request *list = NULL;
+
+	req = atomic_exchange_explicit(&d->local_inbox, NULL,
+				       memory_order_acquire);
+	for (; req != NULL; req = next) {
+		next = req->next;
+		req->next = list;
+		list = req;
+	}
+	return list;
+}
+
+/* Queue the requests from the inbox on their connections and serve them, or
+ * fail them if the node is stopping. */
+static void inboxDrain(struct dqlite_node *d)
+{
+	struct local_request *req;
+	struct local_request *next;
+	struct dqlite_local *l;
+
+	for (req = inboxTake(d); req != NULL; req = next) {
+		next = req->next;
+		l = req->local;
+		if (!d->running) {
+			requestAbort(req, "node is stopping");
+			requestDestroy(req);
+			if (req == &l->close && !l->started) {
+				sqlite3_free(l);
+			}
+			continue;
+		}
+		if (!l->started) {
+			localStart(d, l);
+		}
+		queue_insert_tail(&l->requests, &req->queue);
+		localServe(l);
+	}
+}
+
+/* Serve the connections whose gateway responded outside of localServe. */
+static void readyDrain(struct dqlite_node *d)
+{
+	struct dqlite_local *l;
+	queue *head;
+
+	while (!queue_empty(&d->local_ready)) {
+		head = queue_head(&d->local_ready);
+		l = QUEUE_DATA(head, struct dqlite_local, ready);
+		queue_remove(head);
+		l->deferred = false;
+		localServe(l);
+	}
+}
+
+static void localWakeupCb(uv_async_t *wakeup)
+{
+	struct dqlite_node *d = wakeup->data;
+	inboxDrain(d);
+	readyDrain(d);
+}
+
+void LocalStart(struct dqlite_node *d)
+{
+	int rv;
+
+	d->local_wakeup.data = d;
+	rv = uv_async_init(&d->loop, &d->local_wakeup, localWakeupCb);
+	assert(rv == 0);
+}
+
+void LocalStop(struct dqlite_node *d)
+{
+	struct dqlite_local *l;
+	queue *head;
+
+	/* Requests submitted before the node was asked to stop, like closing a
+	 * connection, are still served. */
+	inboxDrain(d);
+	while (!queue_empty(&d->locals)) {
+		head = queue_head(&d->locals);
+		l = QUEUE_DATA(head, struct dqlite_local, queue);
+		localAbort(l);
+	}
+}
+
+void LocalClose(struct dqlite_node *d)
+{
+	inboxDrain(d);
+	uv_close((struct uv_handle_s *)&d->local_wakeup, NULL);
+}
@@ -0,0 +1,62 @@
+/* In-process connections to a node, bypassing sockets.
+ *
+ * Requests are encoded by the submitting thread and pushed onto a lock-free
+ * inbox of the node, whose main loop is then woken up to hand them to the
+ * gateway of their connection, one at a time and in order. */
+
+#ifndef DQLITE_LOCAL_H_
+#define DQLITE_LOCAL_H_
+
+#include "../include/dqlite.h"
+
+#include "gateway.h"
+#include "lib/buffer.h"
+#include "lib/queue.h"
+#include "server.h"
+
+/* Pseudo request type used to close a connection after the requests submitted
+ * before it have been served. */
+#define LOCAL_REQUEST_CLOSE 255
+
+struct local_request
+{
+	struct local_request *next; /* Link in the inbox of the node */
+	struct dqlite_local *local;
+	int type;           /* DQLITE_REQUEST_* or LOCAL_REQUEST_CLOSE */
+	int schema;
+	struct buffer body; /* Encoded request, without message header */
+	dqlite_local_cb cb;
+	void *arg;
+	queue queue; /* Link in the requests of the connection */
+};
+
+struct dqlite_local
+{
+	struct dqlite_node *node;
+	struct gateway gateway;
+	struct handle handle;
+	struct buffer response;        /* Written by the gateway */
+	queue requests;                /* Requests waiting to be served */
+	struct local_request *current; /* Request being served */
+	bool started;                  /* Whether the gateway is initialized */
+	bool serving;                  /* Whether localServe is running */
+	bool responded;                /* Whether the gateway sent a response */
+	bool closing;                  /* Whether the gateway is closing */
+	bool deferred;                 /* Whether waiting to be served again */
+	struct local_request close;    /* Submitted by dqlite_local_close */
+	queue queue;                   /* Link in the connections of the node */
+	queue ready;                   /* Link in the deferred connections */
+};
+
+/* Start serving local connections, on the loop thread. */
+void LocalStart(struct dqlite_node *d);
+
+/* Close all local connections because the node is stopping, failing their
+ * pending requests. */
+void LocalStop(struct dqlite_node *d);
+
+/* Fail the requests that were submitted after the node stopped, and release
+ * the handle used to wake up the loop. */
+void LocalClose(struct dqlite_node *d);
+
+#endif /* DQLITE_LOCAL_H_ */
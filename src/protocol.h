@@ -17,6 +17,12 @@ enum { DQLITE_VOTER, DQLITE_STANDBY, DQLITE_SPARE };
 /* Legacly pre-1.0 version. */
 #define DQLITE_PROTOCOL_VERSION_LEGACY 0x86104dd760433fe5
 
+/* Sent instead of the protocol version by clients connected over a Unix socket
+ * that want to exchange messages through shared memory. The server replies
+ * with the same value along with the descriptors of the channel, and the
+ * current protocol version is used from then on. */
+#define DQLITE_PROTOCOL_SHM 0x6d68732d656c7164
+
 /* Special value indicating that a batch of rows is over, but there are more. */
 #define DQLITE_RESPONSE_ROWS_PART 0xeeeeeeeeeeeeeeee
 
@@ -47,7 +53,10 @@ enum {
 	DQLITE_REQUEST_CLUSTER,
 	DQLITE_REQUEST_TRANSFER,
 	DQLITE_REQUEST_DESCRIBE,
-	DQLITE_REQUEST_WEIGHT
+	DQLITE_REQUEST_WEIGHT,
+	DQLITE_REQUEST_BACKUP,
+	DQLITE_REQUEST_TIMEOUT,
+	DQLITE_REQUEST_SUBSCRIBE
 };
 
 #define DQLITE_REQUEST_CLUSTER_FORMAT_V0 0 /* ID and address */
@@ -82,6 +91,8 @@ enum {
 	DQLITE_RESPONSE_EMPTY,
 	DQLITE_RESPONSE_FILES,
 	DQLITE_RESPONSE_METADATA,
+	DQLITE_RESPONSE_PAGES,
+	DQLITE_RESPONSE_CHANGES,
 };
 
 #endif /* DQLITE_PROTOCOL_H_ */
@@ -1,3 +1,5 @@
+#include <time.h>
+
 #include "query.h"
 #include "tuple.h"
 
@@ -94,12 +96,43 @@ static int encode_row(sqlite3_stmt *stmt, struct buffer *buffer, int n)
 	return SQLITE_OK;
 }
 
-int query__batch(sqlite3_stmt *stmt, struct buffer *buffer)
+static uint64_t query_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/* Whether the statement used up the given budget since it was at @steps
+ * instructions and @start microseconds. */
+static bool query_over_budget(sqlite3_stmt *stmt,
+			      const struct query_budget *budget,
+			      int steps,
+			      uint64_t start)
+{
+	if (budget->steps != 0 &&
+	    (unsigned)(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0) -
+		       steps) >= budget->steps) {
+		return true;
+	}
+	return budget->usecs != 0 && query_now() - start >= budget->usecs;
+}
+
+int query__batch(sqlite3_stmt *stmt,
+		 struct buffer *buffer,
+		 const struct query_budget *budget)
 {
 	int column_count;
 	char *cursor;
+	int steps = 0;
+	uint64_t start = 0;
 	int rc;
 
+	if (budget != NULL) {
+		steps = sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+		start = budget->usecs != 0 ? query_now() : 0;
+	}
+
 	column_count = sqlite3_column_count(stmt);
 	if (column_count < 0) {
 		return SQLITE_ERROR;
@@ -138,6 +171,13 @@ int query__batch(sqlite3_stmt *stmt, struct buffer *buffer)
 		if (rc != SQLITE_OK) {
 			break;
 		}
+		if (budget != NULL &&
+		    query_over_budget(stmt, budget, steps, start)) {
+			/* Give other requests a chance to run, the rows
+			 * encoded so far will be sent as a partial batch. */
+			rc = SQLITE_ROW;
+			break;
+		}
 
 	} while (1);
 
@@ -10,11 +10,25 @@
 #include "lib/buffer.h"
 #include "lib/serialize.h"
 
+/**
+ * Budget of a single batch. A zero field means no limit.
+ */
+struct query_budget {
+	unsigned steps; /* Virtual machine instructions */
+	unsigned usecs; /* Microseconds */
+};
+
 /**
  * Step through the given query statement progressively encoding the yielded row
- * tuples, either until #SQLITE_DONE is returned or a full page of the given
- * buffer is filled.
+ * tuples, either until #SQLITE_DONE is returned, a full page of the given
+ * buffer is filled or, when @budget is not NULL, the statement used up its
+ * budget while producing the last row.
+ *
+ * The budget is only checked between rows, so a statement that does all its
+ * work before its first row, like a single-row aggregate, is not sliced.
  */
-int query__batch(sqlite3_stmt *stmt, struct buffer *buffer);
+int query__batch(sqlite3_stmt *stmt,
+		 struct buffer *buffer,
+		 const struct query_budget *budget);
 
 #endif /* QUERY_H_*/
@@ -279,7 +279,9 @@ struct raft_append_entries
 	struct raft_entry *entries; /* Log entries to append. */
 	unsigned n_entries;         /* Size of the log entries array. */
 };
-#define RAFT_APPEND_ENTRIES_VERSION 0
+/* Since version 1 the entries may travel compressed, which leaders only do
+ * towards servers advertising support for it in their feature flags. */
+#define RAFT_APPEND_ENTRIES_VERSION 1
 
 /**
  * Hold the result of an AppendEntries RPC (figure 3.1).
@@ -292,8 +294,10 @@ struct raft_append_entries_result
 	raft_index
 	    last_log_index;  /* Receiver's last log entry index, as hint. */
 	raft_flags features; /* Feature flags. */
+	uint64_t failure_domain; /* Receiver's failure domain (version 2). */
+	uint64_t weight;         /* Receiver's weight (version 2). */
 };
-#define RAFT_APPEND_ENTRIES_RESULT_VERSION 1
+#define RAFT_APPEND_ENTRIES_RESULT_VERSION 2
 
 typedef uint32_t checksum_t;
 typedef uint32_t pageno_t;
@@ -549,6 +553,10 @@ struct raft_io_snapshot_put
 {
 	void *data;                 /* User data */
 	raft_io_snapshot_put_cb cb; /* Request callback */
+	/* Term and index of the snapshot that an incremental snapshot builds
+	 * on (see RAFT_SNAPSHOT_INCREMENTAL). Ignored for other snapshots. */
+	raft_term base_term;
+	raft_index base_index;
 };
 
 /**
@@ -641,7 +649,7 @@ struct raft_timer {
  */
 struct raft_io
 {
-	int version; /* 1 or 2 or 3 */
+	int version; /* 1, 2, 3 or 4 */
 	void *data;
 	void *impl;
 	char errmsg[RAFT_ERRMSG_BUF_SIZE];
@@ -703,6 +711,16 @@ struct raft_io
 				raft_timer_cb cb);
 	int (*timer_stop)(struct raft_io *io,
 				struct raft_timer *req);
+	/* Field(s) below added since version 4. */
+	/* Synchronously read back @n persisted entries starting at @index,
+	 * filling the given array. The payloads of all entries must be
+	 * allocated in a single batch, which the caller frees. May be NULL if
+	 * entries can't be read back, in which case the whole log is kept in
+	 * memory. */
+	int (*read_entries)(struct raft_io *io,
+			    raft_index index,
+			    unsigned n,
+			    struct raft_entry entries[]);
 };
 
 /**
@@ -731,11 +749,39 @@ struct raft_io
  * `snapshot_async` to NULL.
  * All memory allocated by the snapshot routines MUST be freed by the snapshot
  * routines themselves.
+ *
+ * version 4:
+ * Adds `snapshot_done`, which, if not NULL, is called right before
+ * `snapshot_finalize` with the status of the whole snapshot operation: 0 if the
+ * snapshot was persisted by the io backend, an error code otherwise. An FSM
+ * producing incremental snapshots (see RAFT_SNAPSHOT_INCREMENTAL) can use it to
+ * know which snapshot the next one can be based on.
+ *
+ * version 5:
+ * Adds `apply_batch`, which, if not NULL, is called instead of `apply` with a
+ * run of consecutive committed RAFT_COMMAND entries, in log order, letting the
+ * FSM amortize work shared by the commands. The result of the i'th command
+ * must be stored in `results[i]` and the number of commands that were applied
+ * in `n_applied`. When a non-zero value is returned, `n_applied` must be the
+ * index of the command that failed, as commands following it are retried in a
+ * later call.
  */
 
+/**
+ * Marker for incremental snapshots.
+ *
+ * If the first 8 bytes of the data of a snapshot, read as a little-endian
+ * integer, are equal to this value, the snapshot only contains the changes
+ * since the snapshot taken before it. The io backend must then retain all the
+ * snapshots of the chain, back to the last non-incremental one, and loading
+ * the snapshot yields the data of the whole chain concatenated in a single
+ * buffer, oldest first. Such a concatenation must not start with the marker.
+ */
+#define RAFT_SNAPSHOT_INCREMENTAL UINT64_C(0x4c4e4352434e4924)
+
 struct raft_fsm
 {
-	int version; /* 1, 2 or 3 */
+	int version; /* 1, 2, 3, 4 or 5 */
 	void *data;
 	int (*apply)(struct raft_fsm *fsm,
 		     const struct raft_buffer *buf,
@@ -752,6 +798,14 @@ struct raft_fsm
 	int (*snapshot_async)(struct raft_fsm *fsm,
 			      struct raft_buffer *bufs[],
 			      unsigned *n_bufs);
+	/* Fields below added since version 4. */
+	void (*snapshot_done)(struct raft_fsm *fsm, int status);
+	/* Fields below added since version 5. */
+	int (*apply_batch)(struct raft_fsm *fsm,
+			   const struct raft_buffer bufs[],
+			   unsigned n,
+			   void *results[],
+			   unsigned *n_applied);
 };
 
 struct raft; /* Forward declaration. */
@@ -1036,8 +1090,12 @@ struct raft
 	 * user-supplied callbacks. */
 	uint64_t callbacks;
 
+	/* Whether to record the timings of RAFT_COMMAND requests. */
+	bool request_timings;
+	uint8_t reserved2[7];
+
 	/* Future extensions */
-	uint64_t reserved[31];
+	uint64_t reserved[30];
 };
 
 RAFT_API int raft_init(struct raft *r,
@@ -1157,6 +1215,23 @@ RAFT_API void raft_set_pre_vote(struct raft *r, bool enabled);
  */
 RAFT_API void raft_set_snapshot_trailing(struct raft *r, unsigned n);
 
+/**
+ * Maximum number of bytes of entry payloads to keep in memory. Once applied and
+ * persisted, the payloads of the oldest entries beyond this budget are released
+ * and read back from disk when a lagging follower needs them. The io backend
+ * must implement `read_entries`, otherwise this has no effect. The default is
+ * 0, meaning that all entries are kept in memory.
+ */
+RAFT_API void raft_set_log_cache_size(struct raft *r, size_t size);
+
+/**
+ * Record in the `timings` of each RAFT_COMMAND request the monotonic times at
+ * which its first entry was persisted by this server, committed and applied to
+ * the FSM, so that callers can break down where the latency of a request went.
+ * The default is false, in which case `timings` is zeroed.
+ */
+RAFT_API void raft_set_request_timings(struct raft *r, bool enabled);
+
 /**
  * Strategy to compute trailing amount. The default is RAFT_TRAILING_STRATEGY_STATIC.
  */
@@ -1226,9 +1301,46 @@ RAFT_API raft_index raft_commit_index(const struct raft *r);
  */
 RAFT_API int raft_voter_contacts(struct raft *r);
 
+/**
+ * Set the failure domain and weight of this server. They are sent to the leader
+ * along with every AppendEntries result, so that the leader can learn them
+ * without contacting the server out of band.
+ */
+RAFT_API void raft_set_metadata(struct raft *r,
+				uint64_t failure_domain,
+				uint64_t weight);
+
+/**
+ * Information tracked by the leader about another server in the cluster.
+ */
+struct raft_peer_info
+{
+	bool online;             /* Heard from within the election timeout,
+				    or leadership was acquired more recently
+				    than that. */
+	bool has_metadata;       /* Whether the fields below are known. */
+	uint64_t failure_domain; /* Last failure domain reported. */
+	uint64_t weight;         /* Last weight reported. */
+};
+
+/**
+ * Fill @info with what the leader knows about the server with the given ID,
+ * without performing any I/O.
+ *
+ * Returns #RAFT_NOTLEADER if called on a server that is not the leader and
+ * #RAFT_BADID if the server is not part of the current configuration. The
+ * leader itself is always reported as online, with its own metadata.
+ */
+RAFT_API int raft_peer_info(struct raft *r,
+			    raft_id id,
+			    struct raft_peer_info *info);
+
 /**
  * Common fields across client request types.
  * `req_id`, `client_id` and `unique_id` are currently unused.
+ * `timings` holds the monotonic times, in nanoseconds, at which the entry of
+ * the request was persisted locally, committed and applied, see
+ * raft_set_request_timings().
  * `reserved` fields should be replaced by new members with the same size
  * and alignment requirements as `uint64_t`.
  */
@@ -1241,7 +1353,8 @@ RAFT_API int raft_voter_contacts(struct raft *r);
 	uint8_t req_id[16];    \
 	uint8_t client_id[16]; \
 	uint8_t unique_id[16]; \
-	uint64_t reserved[4]
+	uint64_t timings[3];   \
+	uint64_t reserved[1]
 
 /**
  * Asynchronous request to append a new command entry to the log and apply it to
@@ -1549,6 +1662,24 @@ RAFT_API void raft_uv_set_block_size(struct raft_io *io, size_t size);
  */
 RAFT_API void raft_uv_set_segment_size(struct raft_io *io, size_t size);
 
+/**
+ * Configure the pools of open segments.
+ *
+ * The @prepared parameter is the number of open segments that are allocated
+ * ahead of time, so that appends don't have to wait for a new segment to be
+ * created. Values lower than 1 are rounded up to 1. The default is 2.
+ *
+ * The @recycled parameter is the maximum number of closed segments that are
+ * kept around after a snapshot, instead of being deleted, in order to be reused
+ * as open segments without having to allocate and zero a new file. Recycled
+ * segments are written using a newer disk format, that can't be read by
+ * releases not supporting it. The default is 0, meaning that recycling is
+ * disabled.
+ */
+RAFT_API void raft_uv_set_segment_pool(struct raft_io *io,
+				       unsigned prepared,
+				       unsigned recycled);
+
 /**
  * Turn snapshot compression on or off.
  * Returns non-0 on failure, this can e.g. happen when compression is requested
@@ -1559,6 +1690,31 @@ RAFT_API void raft_uv_set_segment_size(struct raft_io *io, size_t size);
 RAFT_API int raft_uv_set_snapshot_compression(struct raft_io *io,
 					      bool compressed);
 
+/**
+ * Compress snapshots in chunks of 1 megabyte, each one compressed on its own
+ * thread and decompressed in parallel when the snapshot is loaded, instead of
+ * as a single LZ4 frame on a single thread. Both ways stream the compressed
+ * data to disk.
+ *
+ * Snapshots compressed in chunks can't be read by releases not supporting
+ * them, so a node can't be downgraded to such a release while its latest
+ * snapshot is compressed in chunks. The default is false.
+ */
+RAFT_API void raft_uv_set_snapshot_chunks(struct raft_io *io, bool chunked);
+
+/**
+ * Compress batches of log entries whose data is at least @threshold bytes
+ * large, both in the segment files and in the AppendEntries messages sent to
+ * servers advertising support for it. A @threshold of 0 turns compression off.
+ * Returns non-0 on failure, this can e.g. happen when compression is requested
+ * while no suitable compression library is found.
+ *
+ * By default entries are not compressed. Segments holding compressed entries
+ * can't be read by versions of this library not supporting them.
+ */
+RAFT_API int raft_uv_set_entries_compression(struct raft_io *io,
+					     size_t threshold);
+
 /**
  * Set how many milliseconds to wait between subsequent retries when
  * establishing a connection with another server. The default is 1000
@@ -1788,7 +1944,8 @@ struct raft_fixture
 	struct raft_fixture_event *event; /* Last event occurred. */
 	raft_fixture_event_cb hook;       /* Event callback. */
 	struct raft_fixture_server *servers[RAFT_FIXTURE_MAX_SERVERS];
-	uint64_t reserved[16]; /* For future expansion of struct. */
+	bool skip_append_only; /* Don't check the Leader Append-Only property. */
+	uint64_t reserved[15]; /* For future expansion of struct. */
 };
 
 /**
@@ -2037,6 +2194,14 @@ RAFT_API bool raft_fixture_step_until_delivered(struct raft_fixture *f,
 RAFT_API void raft_fixture_hook(struct raft_fixture *f,
 				raft_fixture_event_cb hook);
 
+/**
+ * Enable or disable checking the Leader Append-Only property after every step.
+ * The check is enabled by default and takes time proportional to the size of
+ * the leader's log, so long simulations might want to turn it off.
+ */
+RAFT_API void raft_fixture_check_append_only(struct raft_fixture *f,
+					     bool enabled);
+
 /**
  * Disconnect the @i'th and the @j'th servers, so attempts to send a message
  * from @i to @j will fail with #RAFT_NOCONNECTION.
@@ -2134,6 +2299,31 @@ RAFT_API void raft_fixture_set_work_duration(struct raft_fixture *f,
 					     unsigned i,
 					     unsigned msecs);
 
+/**
+ * Function returning how many milliseconds a request of the @i'th server should
+ * take. The @kind of the request is either RAFT_FIXTURE_DISK, for disk I/O, or
+ * RAFT_FIXTURE_NETWORK, for a message sent to the @j'th server. The @size is
+ * the number of entry or snapshot payload bytes the request transfers.
+ */
+typedef unsigned (*raft_fixture_latency_fn)(void *data,
+					    int kind,
+					    unsigned i,
+					    unsigned j,
+					    size_t size);
+
+/**
+ * Use @fn to compute the latency of disk and network requests of the @i'th
+ * server from now on, in place of the fixed values set with
+ * raft_fixture_set_disk_latency() and raft_fixture_set_network_latency().
+ * Disk requests still complete and messages to the same server are still
+ * delivered in the order they were submitted. Pass NULL to restore the fixed
+ * values.
+ */
+RAFT_API void raft_fixture_set_latency_fn(struct raft_fixture *f,
+					  unsigned i,
+					  raft_fixture_latency_fn fn,
+					  void *data);
+
 /**
  * Set the persisted term of the @i'th server.
  */
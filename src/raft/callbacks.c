@@ -1,4 +1,5 @@
 #include "callbacks.h"
+#include "flags.h"
 #include "heap.h"
 
 int raftInitCallbacks(struct raft *r)
@@ -22,3 +23,13 @@ struct raft_callbacks *raftGetCallbacks(struct raft *r)
 {
 	return (void *)(uintptr_t)r->callbacks;
 }
+
+void raftFillAppendEntriesResult(struct raft *r,
+				 struct raft_append_entries_result *result)
+{
+	struct raft_callbacks *cbs = raftGetCallbacks(r);
+	result->version = RAFT_APPEND_ENTRIES_RESULT_VERSION;
+	result->features = RAFT_DEFAULT_FEATURE_FLAGS;
+	result->failure_domain = cbs != NULL ? cbs->failure_domain : 0;
+	result->weight = cbs != NULL ? cbs->weight : 0;
+}
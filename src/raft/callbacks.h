@@ -6,10 +6,18 @@
 struct raft_callbacks
 {
 	raft_state_cb state_cb;
+	/* Metadata reported to the leader in AppendEntries results. */
+	uint64_t failure_domain;
+	uint64_t weight;
 };
 
 int raftInitCallbacks(struct raft *r);
 void raftDestroyCallbacks(struct raft *r);
 struct raft_callbacks *raftGetCallbacks(struct raft *r);
 
+/* Fill the version, features and metadata fields of an AppendEntries result
+ * about to be sent to the leader. */
+void raftFillAppendEntriesResult(struct raft *r,
+				 struct raft_append_entries_result *result);
+
 #endif
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include "../lib/queue.h"
 #include "../raft.h"
 #include "../tracing.h"
@@ -40,6 +42,7 @@ int raft_apply(struct raft *r,
 	req->type = RAFT_COMMAND;
 	req->index = start;
 	req->cb = cb;
+	memset(req->timings, 0, sizeof req->timings);
 
 	sm_init(&req->sm, request_invariant, NULL, request_states, "apply-request",
 		REQUEST_START);
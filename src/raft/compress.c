@@ -4,7 +4,9 @@
 #include <lz4frame.h>
 #endif
 #include <limits.h>
+#include <pthread.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "assert.h"
 #include "byte.h"
@@ -14,250 +16,1062 @@
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #define MEGABYTE 1048576
 
-int Compress(struct raft_buffer bufs[],
-	     unsigned n_bufs,
-	     struct raft_buffer *compressed,
-	     char *errmsg)
+/* Snapshots are split in chunks of this size, each compressed as an
+ * independent LZ4 frame, so that chunks can be compressed and decompressed in
+ * parallel and written out as soon as they are ready. */
+#define COMPRESS_CHUNK_SIZE MEGABYTE
+
+/* Maximum number of threads used to compress or decompress a single stream. */
+#define COMPRESS_MAX_THREADS 8
+
+/* When a stream consists of more than one frame, it is terminated by an LZ4
+ * skippable frame holding the index of the chunks:
+ *
+ * - magic (4 bytes), size of the payload (4 bytes)
+ * - for each chunk: compressed size (8 bytes), uncompressed size (8 bytes)
+ * - number of chunks (8 bytes), magic again (4 bytes)
+ *
+ * The trailing copy of the magic allows to locate the index from the end of
+ * the stream. A stream made of a single chunk is a plain LZ4 frame, as
+ * produced by earlier versions. */
+#define COMPRESS_INDEX_MAGIC 0x184D2A5EU
+#define COMPRESS_INDEX_HEADER_SIZE 8
+#define COMPRESS_INDEX_ENTRY_SIZE 16
+#define COMPRESS_INDEX_TRAILER_SIZE 12
+
+#ifdef LZ4_AVAILABLE
+
+static size_t compressIndexSize(unsigned n_chunks)
+{
+	return COMPRESS_INDEX_HEADER_SIZE +
+	       COMPRESS_INDEX_ENTRY_SIZE * (size_t)n_chunks +
+	       COMPRESS_INDEX_TRAILER_SIZE;
+}
+
+/* Number of threads to use for the given number of chunks. */
+static unsigned compressThreads(unsigned n_chunks)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) {
+		n = 1;
+	}
+	if (n > COMPRESS_MAX_THREADS) {
+		n = COMPRESS_MAX_THREADS;
+	}
+	return min((unsigned)n, n_chunks);
+}
+
+static void compressPreferences(LZ4F_preferences_t *pref, size_t size)
+{
+	memset(pref, 0, sizeof *pref);
+	/* Detect data corruption when decompressing */
+	pref->frameInfo.contentChecksumFlag = 1;
+	/* For allocating a suitable buffer when decompressing */
+	pref->frameInfo.contentSize = size;
+}
+
+/* A scratch buffer holding the compressed frame of a single chunk. */
+struct compressSlot
+{
+	void *base;
+	size_t len;
+	bool done;
+	int status;
+	char errmsg[RAFT_ERRMSG_BUF_SIZE];
+};
+
+struct compress
+{
+	struct raft_buffer *bufs; /* Data to compress */
+	unsigned n_bufs;
+	size_t size;                /* Total size of the data */
+	unsigned n_chunks;          /* Number of chunks */
+	unsigned next;              /* Next chunk to be compressed */
+	unsigned written;           /* Number of chunks already written */
+	bool stop;                  /* Set when the writer bails out */
+	struct compressSlot *slots; /* Chunk i is compressed into slot i % n */
+	unsigned n_slots;
+	size_t slot_size; /* Capacity of each slot */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+/* Compress the i'th chunk of the data into the given slot. */
+static int compressChunk(struct compress *c,
+			 unsigned i,
+			 struct compressSlot *slot)
+{
+	LZ4F_compressionContext_t ctx;
+	LZ4F_preferences_t pref;
+	size_t offset = (size_t)i * COMPRESS_CHUNK_SIZE;
+	size_t size = min(c->size - offset, (size_t)COMPRESS_CHUNK_SIZE);
+	size_t n;
+	size_t ret;
+	unsigned k;
+	int rv = RAFT_IOERR;
+
+	compressPreferences(&pref, size);
+
+	ret = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+	if (LZ4F_isError(ret)) {
+		ErrMsgPrintf(slot->errmsg, "LZ4F_createCompressionContext %s",
+			     LZ4F_getErrorName(ret));
+		return RAFT_NOMEM;
+	}
+
+	/* Returns the size of the lz4 header, data should be written after the
+	 * header */
+	slot->len = LZ4F_compressBegin(ctx, slot->base, c->slot_size, &pref);
+	if (LZ4F_isError(slot->len)) {
+		ErrMsgPrintf(slot->errmsg, "LZ4F_compressBegin %s",
+			     LZ4F_getErrorName(slot->len));
+		goto out;
+	}
+
+	/* Find the buffer where the chunk starts. */
+	for (k = 0; offset >= c->bufs[k].len; k++) {
+		offset -= c->bufs[k].len;
+	}
+
+	/* There is guaranteed enough room in the slot to perform the
+	 * compression, since it was sized with `LZ4F_compressBound`. */
+	while (size > 0) {
+		assert(k < c->n_bufs);
+		n = min(c->bufs[k].len - offset, size);
+		ret = LZ4F_compressUpdate(
+		    ctx, (char *)slot->base + slot->len,
+		    c->slot_size - slot->len,
+		    (char *)c->bufs[k].base + offset, n, NULL);
+		if (LZ4F_isError(ret)) {
+			ErrMsgPrintf(slot->errmsg, "LZ4F_compressUpdate %s",
+				     LZ4F_getErrorName(ret));
+			goto out;
+		}
+		slot->len += ret;
+		size -= n;
+		offset = 0;
+		k++;
+	}
+
+	/* Finalize compression */
+	ret = LZ4F_compressEnd(ctx, (char *)slot->base + slot->len,
+			       c->slot_size - slot->len, NULL);
+	if (LZ4F_isError(ret)) {
+		ErrMsgPrintf(slot->errmsg, "LZ4F_compressEnd %s",
+			     LZ4F_getErrorName(ret));
+		goto out;
+	}
+	slot->len += ret;
+	rv = 0;
+
+out:
+	LZ4F_freeCompressionContext(ctx);
+	return rv;
+}
+
+/* Claim chunks and compress them until there are none left, waiting for a
+ * free slot when the writer falls behind. */
+static void *compressWorker(void *arg)
+{
+	struct compress *c = arg;
+	struct compressSlot *slot;
+	unsigned i;
+	int rv;
+
+	pthread_mutex_lock(&c->mutex);
+	for (;;) {
+		while (!c->stop && c->next < c->n_chunks &&
+		       c->next >= c->written + c->n_slots) {
+			pthread_cond_wait(&c->cond, &c->mutex);
+		}
+		if (c->stop || c->next == c->n_chunks) {
+			break;
+		}
+		i = c->next++;
+		slot = &c->slots[i % c->n_slots];
+		pthread_mutex_unlock(&c->mutex);
+
+		rv = compressChunk(c, i, slot);
+
+		pthread_mutex_lock(&c->mutex);
+		slot->status = rv;
+		slot->done = true;
+		pthread_cond_broadcast(&c->cond);
+	}
+	pthread_mutex_unlock(&c->mutex);
+	return NULL;
+}
+
+static int compressWriteIndex(uint64_t *sizes,
+			      unsigned n_chunks,
+			      size_t size,
+			      CompressWriteCb cb,
+			      void *arg,
+			      char *errmsg)
+{
+	size_t len = compressIndexSize(n_chunks);
+	void *index;
+	void *cursor;
+	unsigned i;
+	int rv;
+
+	index = raft_malloc(len);
+	if (index == NULL) {
+		return RAFT_NOMEM;
+	}
+	cursor = index;
+	bytePut32(&cursor, COMPRESS_INDEX_MAGIC);
+	bytePut32(&cursor, (uint32_t)(len - COMPRESS_INDEX_HEADER_SIZE));
+	for (i = 0; i < n_chunks; i++) {
+		bytePut64(&cursor, sizes[i]);
+		bytePut64(&cursor,
+			  min(size - (size_t)i * COMPRESS_CHUNK_SIZE,
+			      (size_t)COMPRESS_CHUNK_SIZE));
+	}
+	bytePut64(&cursor, n_chunks);
+	bytePut32(&cursor, COMPRESS_INDEX_MAGIC);
+
+	rv = cb(arg, index, len, errmsg);
+	raft_free(index);
+	return rv;
+}
+
+/* Compress the data as a single LZ4 frame on the calling thread, passing the
+ * compressed data to the callback at most one chunk at a time. */
+static int compressStreamFrame(struct raft_buffer bufs[],
+			       unsigned n_bufs,
+			       size_t size,
+			       CompressWriteCb cb,
+			       void *arg,
+			       char *errmsg)
+{
+	LZ4F_compressionContext_t ctx;
+	LZ4F_preferences_t pref;
+	void *out;
+	size_t cap;
+	size_t len;
+	size_t offset;
+	size_t n;
+	size_t ret;
+	unsigned i;
+	int rv;
+
+	compressPreferences(&pref, size);
+	/* The bound covers a single update of a whole chunk, including data
+	 * buffered by the previous updates and the end of the frame. */
+	cap = LZ4F_compressBound(COMPRESS_CHUNK_SIZE, &pref) +
+	      LZ4F_HEADER_SIZE_MAX_RAFT;
+	out = raft_malloc(cap);
+	if (out == NULL) {
+		return RAFT_NOMEM;
+	}
+
+	ret = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+	if (LZ4F_isError(ret)) {
+		ErrMsgPrintf(errmsg, "LZ4F_createCompressionContext %s",
+			     LZ4F_getErrorName(ret));
+		rv = RAFT_NOMEM;
+		goto err_after_out_alloc;
+	}
+
+	rv = RAFT_IOERR;
+	len = LZ4F_compressBegin(ctx, out, cap, &pref);
+	if (LZ4F_isError(len)) {
+		ErrMsgPrintf(errmsg, "LZ4F_compressBegin %s",
+			     LZ4F_getErrorName(len));
+		goto err_after_ctx_alloc;
+	}
+	rv = cb(arg, out, len, errmsg);
+	if (rv != 0) {
+		goto err_after_ctx_alloc;
+	}
+
+	for (i = 0; i < n_bufs; i++) {
+		for (offset = 0; offset < bufs[i].len; offset += n) {
+			n = min(bufs[i].len - offset,
+				(size_t)COMPRESS_CHUNK_SIZE);
+			ret = LZ4F_compressUpdate(
+			    ctx, out, cap, (char *)bufs[i].base + offset, n,
+			    NULL);
+			if (LZ4F_isError(ret)) {
+				ErrMsgPrintf(errmsg, "LZ4F_compressUpdate %s",
+					     LZ4F_getErrorName(ret));
+				rv = RAFT_IOERR;
+				goto err_after_ctx_alloc;
+			}
+			if (ret > 0) {
+				rv = cb(arg, out, ret, errmsg);
+				if (rv != 0) {
+					goto err_after_ctx_alloc;
+				}
+			}
+		}
+	}
+
+	ret = LZ4F_compressEnd(ctx, out, cap, NULL);
+	if (LZ4F_isError(ret)) {
+		ErrMsgPrintf(errmsg, "LZ4F_compressEnd %s",
+			     LZ4F_getErrorName(ret));
+		rv = RAFT_IOERR;
+		goto err_after_ctx_alloc;
+	}
+	rv = cb(arg, out, ret, errmsg);
+
+err_after_ctx_alloc:
+	LZ4F_freeCompressionContext(ctx);
+err_after_out_alloc:
+	raft_free(out);
+	return rv;
+}
+
+#endif /* LZ4_AVAILABLE */
+
+int CompressStream(struct raft_buffer bufs[],
+		   unsigned n_bufs,
+		   bool chunked,
+		   CompressWriteCb cb,
+		   void *arg,
+		   char *errmsg)
 {
 #ifndef LZ4_AVAILABLE
 	(void)bufs;
 	(void)n_bufs;
-	(void)compressed;
+	(void)chunked;
+	(void)cb;
+	(void)arg;
 	ErrMsgPrintf(errmsg, "LZ4 not available");
 	return RAFT_INVALID;
 #else
 	assert(bufs != NULL);
 	assert(n_bufs > 0);
-	assert(compressed != NULL);
+	assert(cb != NULL);
 	assert(errmsg != NULL);
 
-	int rv = RAFT_IOERR;
-	size_t src_size = 0;
-	size_t dst_size = 0;
-	size_t src_offset = 0;
-	size_t dst_offset = 0;
-	size_t dst_size_needed = 0; /* Store minimal dst_size */
-	size_t ret = 0;             /* Return value of LZ4F_XXX functions */
-	compressed->base = NULL;
-	compressed->len = 0;
+	struct compress c;
+	struct compressSlot *slot;
+	LZ4F_preferences_t pref;
+	pthread_t threads[COMPRESS_MAX_THREADS];
+	unsigned n_threads = 0;
+	uint64_t *sizes;
+	unsigned i;
+	int rv = 0;
+
+	memset(&c, 0, sizeof c);
+	c.bufs = bufs;
+	c.n_bufs = n_bufs;
 
 	/* Determine total uncompressed size */
-	for (unsigned i = 0; i < n_bufs; ++i) {
-		src_size += bufs[i].len;
+	for (i = 0; i < n_bufs; ++i) {
+		c.size += bufs[i].len;
 	}
 
 	/* Work around a bug in liblz4 on bionic, in practice raft should only
 	 * Compress non-0 length buffers, so this should be fine.
 	 * https://github.com/lz4/lz4/issues/157
 	 * */
-	if (src_size == 0) {
+	if (c.size == 0) {
 		ErrMsgPrintf(errmsg, "total size must be larger then 0");
-		rv = RAFT_INVALID;
-		goto err;
+		return RAFT_INVALID;
 	}
 
-	/* Set LZ4 preferences */
-	LZ4F_preferences_t lz4_pref;
-	memset(&lz4_pref, 0, sizeof(lz4_pref));
-	/* Detect data corruption when decompressing */
-	lz4_pref.frameInfo.contentChecksumFlag = 1;
-	/* For allocating a suitable buffer when decompressing */
-	lz4_pref.frameInfo.contentSize = src_size;
+	if (!chunked) {
+		return compressStreamFrame(bufs, n_bufs, c.size, cb, arg,
+					   errmsg);
+	}
 
-	/* Context to track compression progress */
-	LZ4F_compressionContext_t ctx;
-	ret = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
-	if (LZ4F_isError(ret)) {
-		ErrMsgPrintf(errmsg, "LZ4F_createDecompressionContext %s",
-			     LZ4F_getErrorName(ret));
+	c.n_chunks = (unsigned)((c.size + COMPRESS_CHUNK_SIZE - 1) /
+				COMPRESS_CHUNK_SIZE);
+	compressPreferences(&pref, COMPRESS_CHUNK_SIZE);
+	c.slot_size = LZ4F_compressBound(COMPRESS_CHUNK_SIZE, &pref) +
+		      LZ4F_HEADER_SIZE_MAX_RAFT;
+
+	/* Give each worker two slots, so it can make progress while the
+	 * previous chunk it compressed is being written. */
+	c.n_slots = min(2 * compressThreads(c.n_chunks), c.n_chunks);
+	c.slots = raft_calloc(c.n_slots, sizeof *c.slots);
+	if (c.slots == NULL) {
 		rv = RAFT_NOMEM;
 		goto err;
 	}
-
-	/* Guestimate of eventual compressed size, mainly not to allocate a huge
-	 * buffer as `LZ4F_compressBound` calculates the worst case scenario. */
-	dst_size = LZ4F_compressBound(
-	    max(MEGABYTE, (size_t)lz4_pref.frameInfo.contentSize / 10),
-	    &lz4_pref);
-	dst_size += LZ4F_HEADER_SIZE_MAX_RAFT;
-	compressed->base = raft_malloc(dst_size);
-	if (compressed->base == NULL) {
+	for (i = 0; i < c.n_slots; i++) {
+		c.slots[i].base = raft_malloc(c.slot_size);
+		if (c.slots[i].base == NULL) {
+			rv = RAFT_NOMEM;
+			goto err_after_slots_alloc;
+		}
+	}
+	sizes = raft_malloc(c.n_chunks * sizeof *sizes);
+	if (sizes == NULL) {
 		rv = RAFT_NOMEM;
-		goto err_after_ctx_alloc;
+		goto err_after_slots_alloc;
 	}
 
-	/* Returns the size of the lz4 header, data should be written after the
-	 * header */
-	dst_offset =
-	    LZ4F_compressBegin(ctx, compressed->base, dst_size, &lz4_pref);
-	if (LZ4F_isError(dst_offset)) {
-		ErrMsgPrintf(errmsg, "LZ4F_compressBegin %s",
-			     LZ4F_getErrorName(dst_offset));
-		rv = RAFT_IOERR;
-		goto err_after_buff_alloc;
-	}
-
-	/* Compress all buffers */
-	for (unsigned i = 0; i < n_bufs; ++i) {
-		src_offset = 0;
-		while (src_offset < bufs[i].len) {
-			/* Compress in chunks of maximum 1MB and check if there
-			 * is enough room in the dst buffer, if not realloc */
-			src_size =
-			    min(bufs[i].len - src_offset, (size_t)MEGABYTE);
-			dst_size_needed =
-			    LZ4F_compressBound(src_size, &lz4_pref);
-			if (dst_size - dst_offset < dst_size_needed) {
-				dst_size +=
-				    max(dst_size_needed,
-					(size_t)lz4_pref.frameInfo.contentSize /
-					    10);
-				compressed->base =
-				    raft_realloc(compressed->base, dst_size);
-				if (compressed->base == NULL) {
-					rv = RAFT_NOMEM;
-					goto err_after_ctx_alloc;
-				}
-			}
-			/* There is guaranteed enough room in `dst` to perform
-			 * the compression */
-			ret = LZ4F_compressUpdate(
-			    ctx, (char *)compressed->base + dst_offset,
-			    dst_size - dst_offset,
-			    (char *)bufs[i].base + src_offset, src_size, NULL);
-			if (LZ4F_isError(ret)) {
-				ErrMsgPrintf(errmsg, "LZ4F_compressUpdate %s",
-					     LZ4F_getErrorName(ret));
-				rv = RAFT_IOERR;
-				goto err_after_buff_alloc;
+	pthread_mutex_init(&c.mutex, NULL);
+	pthread_cond_init(&c.cond, NULL);
+
+	/* A single chunk is compressed inline, as are all of them if no
+	 * thread can be started. */
+	if (c.n_chunks > 1) {
+		n_threads = compressThreads(c.n_chunks);
+		for (i = 0; i < n_threads; i++) {
+			if (pthread_create(&threads[i], NULL, compressWorker,
+					   &c) != 0) {
+				break;
 			}
-			dst_offset += ret;
-			src_offset += src_size;
 		}
+		n_threads = i;
 	}
 
-	/* Make sure LZ4F_compressEnd has enough room to succeed */
-	dst_size_needed = LZ4F_compressBound(0, &lz4_pref);
-	if ((dst_size - dst_offset) < dst_size_needed) {
-		dst_size += dst_size_needed;
-		compressed->base = raft_realloc(compressed->base, dst_size);
-		if (compressed->base == NULL) {
-			rv = RAFT_NOMEM;
-			goto err_after_ctx_alloc;
+	/* Write out the chunks in order, as soon as they are ready. */
+	pthread_mutex_lock(&c.mutex);
+	while (c.written < c.n_chunks) {
+		slot = &c.slots[c.written % c.n_slots];
+		if (n_threads == 0) {
+			pthread_mutex_unlock(&c.mutex);
+			slot->status = compressChunk(&c, c.written, slot);
+			slot->done = true;
+			pthread_mutex_lock(&c.mutex);
+		}
+		while (!slot->done) {
+			pthread_cond_wait(&c.cond, &c.mutex);
 		}
+		pthread_mutex_unlock(&c.mutex);
+		rv = slot->status;
+		if (rv != 0) {
+			ErrMsgPrintf(errmsg, "%s", slot->errmsg);
+		} else {
+			sizes[c.written] = slot->len;
+			rv = cb(arg, slot->base, slot->len, errmsg);
+		}
+		pthread_mutex_lock(&c.mutex);
+		if (rv != 0) {
+			c.stop = true;
+			pthread_cond_broadcast(&c.cond);
+			break;
+		}
+		slot->done = false;
+		c.written++;
+		pthread_cond_broadcast(&c.cond);
 	}
+	pthread_mutex_unlock(&c.mutex);
 
-	/* Finalize compression */
-	ret = LZ4F_compressEnd(ctx, (char *)compressed->base + dst_offset,
-			       dst_size - dst_offset, NULL);
-	if (LZ4F_isError(ret)) {
-		ErrMsgPrintf(errmsg, "LZ4F_compressEnd %s",
-			     LZ4F_getErrorName(ret));
-		rv = RAFT_IOERR;
-		goto err_after_buff_alloc;
+	for (i = 0; i < n_threads; i++) {
+		pthread_join(threads[i], NULL);
 	}
+	pthread_cond_destroy(&c.cond);
+	pthread_mutex_destroy(&c.mutex);
 
-	dst_offset += ret;
-	compressed->len = dst_offset;
+	if (rv == 0 && c.n_chunks > 1) {
+		rv = compressWriteIndex(sizes, c.n_chunks, c.size, cb, arg,
+					errmsg);
+	}
 
-	LZ4F_freeCompressionContext(ctx);
-	return 0;
+	raft_free(sizes);
 
-err_after_buff_alloc:
-	raft_free(compressed->base);
-	compressed->base = NULL;
-err_after_ctx_alloc:
-	LZ4F_freeCompressionContext(ctx);
+err_after_slots_alloc:
+	for (i = 0; i < c.n_slots; i++) {
+		raft_free(c.slots[i].base);
+	}
+	raft_free(c.slots);
 err:
 	return rv;
 #endif /* LZ4_AVAILABLE */
 }
 
-int Decompress(struct raft_buffer buf,
-	       struct raft_buffer *decompressed,
-	       char *errmsg)
+struct compressBuffer
+{
+	struct raft_buffer *buf;
+	size_t cap;
+};
+
+/* Append compressed data to a growing buffer. */
+static int compressAppend(void *arg, const void *data, size_t len, char *errmsg)
+{
+	struct compressBuffer *b = arg;
+	struct raft_buffer *buf = b->buf;
+	void *base;
+	(void)errmsg;
+
+	if (b->cap - buf->len < len) {
+		b->cap = max(2 * b->cap, buf->len + len);
+		base = raft_realloc(buf->base, b->cap);
+		if (base == NULL) {
+			return RAFT_NOMEM;
+		}
+		buf->base = base;
+	}
+	memcpy((char *)buf->base + buf->len, data, len);
+	buf->len += len;
+	return 0;
+}
+
+int Compress(struct raft_buffer bufs[],
+	     unsigned n_bufs,
+	     struct raft_buffer *compressed,
+	     char *errmsg)
+{
+	struct compressBuffer b = {compressed, 0};
+	int rv;
+
+	assert(compressed != NULL);
+	compressed->base = NULL;
+	compressed->len = 0;
+
+	rv = CompressStream(bufs, n_bufs, true, compressAppend, &b, errmsg);
+	if (rv != 0) {
+		raft_free(compressed->base);
+		compressed->base = NULL;
+		compressed->len = 0;
+		return rv;
+	}
+
+	return 0;
+}
+
+size_t CompressBound(size_t len)
 {
 #ifndef LZ4_AVAILABLE
-	(void)buf;
-	(void)decompressed;
+	(void)len;
+	return 0;
+#else
+	LZ4F_preferences_t pref;
+	memset(&pref, 0, sizeof pref);
+	pref.frameInfo.contentSize = len;
+	return LZ4F_HEADER_SIZE_MAX_RAFT + LZ4F_compressBound(len, &pref);
+#endif /* LZ4_AVAILABLE */
+}
+
+int CompressInto(const struct raft_buffer bufs[],
+		 unsigned n_bufs,
+		 void *dst,
+		 size_t cap,
+		 size_t *len,
+		 char *errmsg)
+{
+#ifndef LZ4_AVAILABLE
+	(void)bufs;
+	(void)n_bufs;
+	(void)dst;
+	(void)cap;
+	(void)len;
 	ErrMsgPrintf(errmsg, "LZ4 not available");
 	return RAFT_INVALID;
 #else
-	assert(decompressed != NULL);
-
+	LZ4F_compressionContext_t ctx;
+	LZ4F_preferences_t pref;
+	size_t size = 0;
+	size_t ret;
+	unsigned i;
 	int rv = RAFT_IOERR;
-	size_t src_offset = 0;
-	size_t dst_offset = 0;
-	size_t src_size = 0;
-	size_t dst_size = 0;
-	size_t ret = 0;
 
-	LZ4F_decompressionContext_t ctx;
-	if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) {
-		ErrMsgPrintf(errmsg, "LZ4F_createDecompressionContext");
-		rv = RAFT_NOMEM;
-		goto err;
+	assert(dst != NULL);
+	assert(len != NULL);
+
+	for (i = 0; i < n_bufs; i++) {
+		size += bufs[i].len;
 	}
 
-	src_size = buf.len;
-	LZ4F_frameInfo_t frameInfo = {0};
-	/* `src_size` will contain the size of the LZ4 Frame Header after the
-	 * call, decompression must resume at that offset. */
-	ret = LZ4F_getFrameInfo(ctx, &frameInfo, buf.base, &src_size);
+	/* The data is small and usually already covered by a checksum of its
+	 * own, so skip the content checksum. */
+	memset(&pref, 0, sizeof pref);
+	pref.frameInfo.contentSize = size;
+
+	ret = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
 	if (LZ4F_isError(ret)) {
-		ErrMsgPrintf(errmsg, "LZ4F_getFrameInfo %s",
+		ErrMsgPrintf(errmsg, "LZ4F_createCompressionContext %s",
 			     LZ4F_getErrorName(ret));
-		rv = RAFT_IOERR;
-		goto err_after_ctx_alloc;
+		return RAFT_NOMEM;
 	}
-	src_offset = src_size;
 
-	decompressed->base = raft_malloc((size_t)frameInfo.contentSize);
-	decompressed->len = (size_t)frameInfo.contentSize;
-	if (decompressed->base == NULL) {
-		rv = RAFT_NOMEM;
-		goto err_after_ctx_alloc;
+	*len = LZ4F_compressBegin(ctx, dst, cap, &pref);
+	if (LZ4F_isError(*len)) {
+		ErrMsgPrintf(errmsg, "LZ4F_compressBegin %s",
+			     LZ4F_getErrorName(*len));
+		goto out;
+	}
+
+	for (i = 0; i < n_bufs; i++) {
+		ret = LZ4F_compressUpdate(ctx, (char *)dst + *len, cap - *len,
+					  bufs[i].base, bufs[i].len, NULL);
+		if (LZ4F_isError(ret)) {
+			ErrMsgPrintf(errmsg, "LZ4F_compressUpdate %s",
+				     LZ4F_getErrorName(ret));
+			goto out;
+		}
+		*len += ret;
+	}
+
+	ret = LZ4F_compressEnd(ctx, (char *)dst + *len, cap - *len, NULL);
+	if (LZ4F_isError(ret)) {
+		ErrMsgPrintf(errmsg, "LZ4F_compressEnd %s",
+			     LZ4F_getErrorName(ret));
+		goto out;
+	}
+	*len += ret;
+	rv = 0;
+
+out:
+	LZ4F_freeCompressionContext(ctx);
+	return rv;
+#endif /* LZ4_AVAILABLE */
+}
+
+#ifdef LZ4_AVAILABLE
+
+/* Decompress a single LZ4 frame of `len` bytes into `dst`, which must be
+ * exactly as large as the frame content. */
+static int decompressFrame(const void *src,
+			   size_t len,
+			   void *dst,
+			   size_t dst_len,
+			   char *errmsg)
+{
+	LZ4F_decompressionContext_t ctx;
+	size_t src_offset = 0;
+	size_t dst_offset = 0;
+	size_t src_size;
+	size_t dst_size;
+	size_t ret;
+	int rv = RAFT_IOERR;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) {
+		ErrMsgPrintf(errmsg, "LZ4F_createDecompressionContext");
+		return RAFT_NOMEM;
 	}
 
 	ret = 1;
 	while (ret != 0) {
-		src_size = buf.len - src_offset;
+		src_size = len - src_offset;
 		/* !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
 		 * The next line works around a bug in an older lz4 lib where
 		 * the `size_t` dst_size parameter would overflow an `int`.
 		 * !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!
 		 */
-		dst_size = min(decompressed->len - dst_offset, (size_t)INT_MAX);
+		dst_size = min(dst_len - dst_offset, (size_t)INT_MAX);
 		/* `dst_size` will contain the number of bytes written to
-		 * decompressed->base, while `src_size` will contain the number
-		 * of bytes consumed from buf.base */
-		ret = LZ4F_decompress(
-		    ctx, (char *)decompressed->base + dst_offset, &dst_size,
-		    (char *)buf.base + src_offset, &src_size, NULL);
+		 * dst, while `src_size` will contain the number of bytes
+		 * consumed from src */
+		ret = LZ4F_decompress(ctx, (char *)dst + dst_offset, &dst_size,
+				      (const char *)src + src_offset, &src_size,
+				      NULL);
 		if (LZ4F_isError(ret)) {
 			ErrMsgPrintf(errmsg, "LZ4F_decompress %s",
 				     LZ4F_getErrorName(ret));
-			rv = RAFT_IOERR;
-			goto err_after_buff_alloc;
+			goto out;
+		}
+		if (ret != 0 && src_size == 0 && dst_size == 0) {
+			ErrMsgPrintf(errmsg, "LZ4F_decompress truncated frame");
+			goto out;
 		}
 		src_offset += src_size;
 		dst_offset += dst_size;
 	}
 
-	if (LZ4F_freeDecompressionContext(ctx) != 0) {
+	if (dst_offset != dst_len) {
+		ErrMsgPrintf(errmsg, "LZ4F_decompress short frame");
+		goto out;
+	}
+	rv = 0;
+
+out:
+	if (LZ4F_freeDecompressionContext(ctx) != 0 && rv == 0) {
+		rv = RAFT_IOERR;
+	}
+	return rv;
+}
+
+struct decompressChunk
+{
+	size_t offset;         /* Offset of the frame in the stream */
+	size_t len;            /* Size of the frame */
+	size_t content_offset; /* Offset of the content in the output */
+	size_t content_len;    /* Size of the content */
+};
+
+struct decompress
+{
+	struct decompressChunk *chunks;
+	unsigned n_chunks;
+	const void *src;       /* Stream held in memory, if any */
+	DecompressReadCb read; /* Otherwise, read chunks with this */
+	void *arg;
+	void *scratch[COMPRESS_MAX_THREADS]; /* Per-thread read buffers */
+	void *dst;
+	unsigned next; /* Next chunk to be decompressed */
+	int status;
+	char errmsg[RAFT_ERRMSG_BUF_SIZE];
+	pthread_mutex_t mutex;
+};
+
+struct decompressWorker
+{
+	struct decompress *d;
+	unsigned id;
+	pthread_t thread;
+};
+
+static void *decompressWorker(void *arg)
+{
+	struct decompressWorker *w = arg;
+	struct decompress *d = w->d;
+	struct decompressChunk *chunk;
+	char errmsg[RAFT_ERRMSG_BUF_SIZE];
+	const void *src;
+	unsigned i;
+	int rv;
+
+	for (;;) {
+		pthread_mutex_lock(&d->mutex);
+		if (d->status != 0 || d->next == d->n_chunks) {
+			pthread_mutex_unlock(&d->mutex);
+			break;
+		}
+		i = d->next++;
+		pthread_mutex_unlock(&d->mutex);
+
+		chunk = &d->chunks[i];
+		if (d->src != NULL) {
+			src = (const char *)d->src + chunk->offset;
+			rv = 0;
+		} else {
+			src = d->scratch[w->id];
+			rv = d->read(d->arg, chunk->offset, d->scratch[w->id],
+				     chunk->len, errmsg);
+		}
+		if (rv == 0) {
+			rv = decompressFrame(
+			    src, chunk->len,
+			    (char *)d->dst + chunk->content_offset,
+			    chunk->content_len, errmsg);
+		}
+		if (rv != 0) {
+			pthread_mutex_lock(&d->mutex);
+			if (d->status == 0) {
+				d->status = rv;
+				ErrMsgPrintf(d->errmsg, "%s", errmsg);
+			}
+			pthread_mutex_unlock(&d->mutex);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* Parse the index of a stream of `size` bytes, given its trailer. Return
+ * `false` if there's no index. */
+static bool decompressHasIndex(const void *trailer,
+			       size_t size,
+			       unsigned *n_chunks)
+{
+	const void *cursor = trailer;
+	uint64_t n;
+
+	if (size < compressIndexSize(1)) {
+		return false;
+	}
+	n = byteGet64(&cursor);
+	if (byteGet32(&cursor) != COMPRESS_INDEX_MAGIC) {
+		return false;
+	}
+	if (n < 2 || n > UINT_MAX ||
+	    (size - COMPRESS_INDEX_HEADER_SIZE - COMPRESS_INDEX_TRAILER_SIZE) /
+		    COMPRESS_INDEX_ENTRY_SIZE <
+		n) {
+		return false;
+	}
+	*n_chunks = (unsigned)n;
+	return true;
+}
+
+/* Decode the index of a stream of `size` bytes and fill the chunks array. */
+static int decompressIndex(const void *index,
+			   size_t size,
+			   struct decompressChunk *chunks,
+			   unsigned n_chunks,
+			   size_t *content_len,
+			   char *errmsg)
+{
+	const void *cursor = index;
+	size_t offset = 0;
+	unsigned i;
+
+	if (byteGet32(&cursor) != COMPRESS_INDEX_MAGIC ||
+	    byteGet32(&cursor) != compressIndexSize(n_chunks) -
+				      COMPRESS_INDEX_HEADER_SIZE) {
+		goto corrupt;
+	}
+	*content_len = 0;
+	for (i = 0; i < n_chunks; i++) {
+		chunks[i].offset = offset;
+		chunks[i].len = (size_t)byteGet64(&cursor);
+		chunks[i].content_offset = *content_len;
+		chunks[i].content_len = (size_t)byteGet64(&cursor);
+		if (chunks[i].len > size - offset ||
+		    chunks[i].content_len > COMPRESS_CHUNK_SIZE) {
+			goto corrupt;
+		}
+		offset += chunks[i].len;
+		*content_len += chunks[i].content_len;
+	}
+	if (offset + compressIndexSize(n_chunks) != size) {
+		goto corrupt;
+	}
+	return 0;
+
+corrupt:
+	ErrMsgPrintf(errmsg, "corrupt compression index");
+	return RAFT_CORRUPT;
+}
+
+/* Decompress all chunks of an indexed stream, in parallel. */
+static int decompressChunks(struct decompress *d,
+			    size_t content_len,
+			    struct raft_buffer *decompressed,
+			    char *errmsg)
+{
+	struct decompressWorker workers[COMPRESS_MAX_THREADS];
+	unsigned n_threads = compressThreads(d->n_chunks);
+	size_t scratch_size = 0;
+	unsigned i;
+	int rv = 0;
+
+	d->dst = raft_malloc(content_len);
+	if (d->dst == NULL) {
+		return RAFT_NOMEM;
+	}
+
+	/* When reading from a file, each thread needs a buffer able to hold
+	 * the largest frame, and that's all the compressed data held in memory
+	 * at any time. */
+	if (d->src == NULL) {
+		for (i = 0; i < d->n_chunks; i++) {
+			scratch_size = max(scratch_size, d->chunks[i].len);
+		}
+		for (i = 0; i < n_threads; i++) {
+			d->scratch[i] = raft_malloc(scratch_size);
+			if (d->scratch[i] == NULL) {
+				rv = RAFT_NOMEM;
+				goto out;
+			}
+		}
+	}
+
+	pthread_mutex_init(&d->mutex, NULL);
+	/* The calling thread acts as the first worker. */
+	for (i = 0; i < n_threads; i++) {
+		workers[i].d = d;
+		workers[i].id = i;
+		if (i > 0 && pthread_create(&workers[i].thread, NULL,
+					    decompressWorker, &workers[i]) != 0) {
+			break;
+		}
+	}
+	n_threads = i;
+	decompressWorker(&workers[0]);
+	for (i = 1; i < n_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	pthread_mutex_destroy(&d->mutex);
+
+	rv = d->status;
+	if (rv != 0) {
+		ErrMsgPrintf(errmsg, "%s", d->errmsg);
+	}
+
+out:
+	for (i = 0; i < COMPRESS_MAX_THREADS; i++) {
+		raft_free(d->scratch[i]);
+	}
+	if (rv != 0) {
+		raft_free(d->dst);
+		return rv;
+	}
+	decompressed->base = d->dst;
+	decompressed->len = content_len;
+	return 0;
+}
+
+/* Decompress a stream made of a single LZ4 frame held in memory. */
+static int decompressSingle(struct raft_buffer buf,
+			    struct raft_buffer *decompressed,
+			    char *errmsg)
+{
+	LZ4F_decompressionContext_t ctx;
+	LZ4F_frameInfo_t frameInfo = {0};
+	size_t src_size = buf.len;
+	size_t ret;
+	int rv;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION))) {
+		ErrMsgPrintf(errmsg, "LZ4F_createDecompressionContext");
+		return RAFT_NOMEM;
+	}
+	ret = LZ4F_getFrameInfo(ctx, &frameInfo, buf.base, &src_size);
+	LZ4F_freeDecompressionContext(ctx);
+	if (LZ4F_isError(ret)) {
+		ErrMsgPrintf(errmsg, "LZ4F_getFrameInfo %s",
+			     LZ4F_getErrorName(ret));
+		return RAFT_IOERR;
+	}
+
+	decompressed->base = raft_malloc((size_t)frameInfo.contentSize);
+	decompressed->len = (size_t)frameInfo.contentSize;
+	if (decompressed->base == NULL) {
+		return RAFT_NOMEM;
+	}
+
+	rv = decompressFrame(buf.base, buf.len, decompressed->base,
+			     decompressed->len, errmsg);
+	if (rv != 0) {
 		raft_free(decompressed->base);
 		decompressed->base = NULL;
-		return RAFT_IOERR;
+		return rv;
 	}
 
 	return 0;
+}
+
+#endif /* LZ4_AVAILABLE */
+
+int Decompress(struct raft_buffer buf,
+	       struct raft_buffer *decompressed,
+	       char *errmsg)
+{
+#ifndef LZ4_AVAILABLE
+	(void)buf;
+	(void)decompressed;
+	ErrMsgPrintf(errmsg, "LZ4 not available");
+	return RAFT_INVALID;
+#else
+	assert(decompressed != NULL);
+
+	struct decompress d;
+	size_t content_len;
+	int rv;
+
+	memset(&d, 0, sizeof d);
+	if (buf.len < COMPRESS_INDEX_TRAILER_SIZE ||
+	    !decompressHasIndex((const char *)buf.base + buf.len -
+				    COMPRESS_INDEX_TRAILER_SIZE,
+				buf.len, &d.n_chunks)) {
+		return decompressSingle(buf, decompressed, errmsg);
+	}
+
+	d.chunks = raft_malloc(d.n_chunks * sizeof *d.chunks);
+	if (d.chunks == NULL) {
+		return RAFT_NOMEM;
+	}
+	rv = decompressIndex((const char *)buf.base + buf.len -
+				 compressIndexSize(d.n_chunks),
+			     buf.len, d.chunks, d.n_chunks, &content_len,
+			     errmsg);
+	if (rv == 0) {
+		d.src = buf.base;
+		rv = decompressChunks(&d, content_len, decompressed, errmsg);
+	}
+	raft_free(d.chunks);
+	if (rv != 0) {
+		decompressed->base = NULL;
+	}
+	return rv;
+#endif /* LZ4_AVAILABLE */
+}
+
+int DecompressInto(struct raft_buffer buf,
+		   void *dst,
+		   size_t len,
+		   char *errmsg)
+{
+#ifndef LZ4_AVAILABLE
+	(void)buf;
+	(void)dst;
+	(void)len;
+	ErrMsgPrintf(errmsg, "LZ4 not available");
+	return RAFT_INVALID;
+#else
+	return decompressFrame(buf.base, buf.len, dst, len, errmsg);
+#endif /* LZ4_AVAILABLE */
+}
+
+int DecompressStream(size_t size,
+		     DecompressReadCb read,
+		     void *arg,
+		     struct raft_buffer *decompressed,
+		     char *errmsg)
+{
+#ifndef LZ4_AVAILABLE
+	(void)size;
+	(void)read;
+	(void)arg;
+	(void)decompressed;
+	ErrMsgPrintf(errmsg, "LZ4 not available");
+	return RAFT_INVALID;
+#else
+	assert(read != NULL);
+	assert(decompressed != NULL);
 
-err_after_buff_alloc:
-	raft_free(decompressed->base);
+	struct decompress d;
+	struct raft_buffer buf;
+	uint8_t trailer[COMPRESS_INDEX_TRAILER_SIZE];
+	void *index;
+	size_t index_size;
+	size_t content_len;
+	int rv;
+
+	memset(&d, 0, sizeof d);
 	decompressed->base = NULL;
-err_after_ctx_alloc:
-	LZ4F_freeDecompressionContext(ctx);
-err:
+
+	if (size >= COMPRESS_INDEX_TRAILER_SIZE) {
+		rv = read(arg, size - sizeof trailer, trailer, sizeof trailer,
+			  errmsg);
+		if (rv != 0) {
+			return rv;
+		}
+	}
+
+	/* A stream without index is a single frame, read it all. */
+	if (size < COMPRESS_INDEX_TRAILER_SIZE ||
+	    !decompressHasIndex(trailer, size, &d.n_chunks)) {
+		buf.len = size;
+		buf.base = raft_malloc(size);
+		if (buf.base == NULL) {
+			return RAFT_NOMEM;
+		}
+		rv = read(arg, 0, buf.base, size, errmsg);
+		if (rv == 0) {
+			rv = decompressSingle(buf, decompressed, errmsg);
+		}
+		raft_free(buf.base);
+		return rv;
+	}
+
+	index_size = compressIndexSize(d.n_chunks);
+	index = raft_malloc(index_size);
+	if (index == NULL) {
+		return RAFT_NOMEM;
+	}
+	d.chunks = raft_malloc(d.n_chunks * sizeof *d.chunks);
+	if (d.chunks == NULL) {
+		rv = RAFT_NOMEM;
+		goto out;
+	}
+	rv = read(arg, size - index_size, index, index_size, errmsg);
+	if (rv != 0) {
+		goto out;
+	}
+	rv = decompressIndex(index, size, d.chunks, d.n_chunks, &content_len,
+			     errmsg);
+	if (rv != 0) {
+		goto out;
+	}
+	d.read = read;
+	d.arg = arg;
+	rv = decompressChunks(&d, content_len, decompressed, errmsg);
+
+out:
+	raft_free(d.chunks);
+	raft_free(index);
 	return rv;
 #endif /* LZ4_AVAILABLE */
 }
@@ -19,6 +19,51 @@ int Compress(struct raft_buffer bufs[],
 	     struct raft_buffer *compressed,
 	     char *errmsg);
 
+/*
+ * Returns an upper bound of the size of the output of `CompressInto` for `len`
+ * bytes of data, or 0 if no compression library is available.
+ */
+size_t CompressBound(size_t len);
+
+/*
+ * Compresses the content of `bufs` as a single LZ4 frame into `dst`, which has
+ * room for `cap` bytes, on the calling thread. The size of the frame is
+ * returned through `len`. Meant for small amounts of data. Returns a non-0
+ * value upon failure.
+ */
+int CompressInto(const struct raft_buffer bufs[],
+		 unsigned n_bufs,
+		 void *dst,
+		 size_t cap,
+		 size_t *len,
+		 char *errmsg);
+
+/*
+ * Callback invoked by `CompressStream` with each compressed frame, in order
+ * and from the calling thread. Returns a non-0 value upon failure.
+ */
+typedef int (*CompressWriteCb)(void *arg,
+			       const void *data,
+			       size_t len,
+			       char *errmsg);
+
+/*
+ * Compresses the content of `bufs` and passes the compressed data to `cb` as
+ * soon as it's ready, so that only a few chunks are in memory at any time.
+ *
+ * If `chunked` is true, the data is split in chunks, each one an independent
+ * LZ4 frame compressed on a pool of threads, followed by an index of the
+ * chunks when there's more than one. Otherwise the data is compressed on the
+ * calling thread as a single LZ4 frame, which releases not supporting chunks
+ * can read. Returns a non-0 value upon failure.
+ */
+int CompressStream(struct raft_buffer bufs[],
+		   unsigned n_bufs,
+		   bool chunked,
+		   CompressWriteCb cb,
+		   void *arg,
+		   char *errmsg);
+
 /*
  * Decompresses the content of `buf` into a newly allocated buffer that is
  * returned to the caller through `decompressed`. Returns a non-0 value upon
@@ -28,6 +73,40 @@ int Decompress(struct raft_buffer buf,
 	       struct raft_buffer *decompressed,
 	       char *errmsg);
 
+/*
+ * Decompresses the single LZ4 frame held in `buf` into `dst`, whose size `len`
+ * must match the size of the frame content, on the calling thread. Returns a
+ * non-0 value upon failure.
+ */
+int DecompressInto(struct raft_buffer buf,
+		   void *dst,
+		   size_t len,
+		   char *errmsg);
+
+/*
+ * Callback invoked by `DecompressStream` to read `len` bytes of compressed
+ * data at the given offset. It can be invoked concurrently from several
+ * threads. Returns a non-0 value upon failure.
+ */
+typedef int (*DecompressReadCb)(void *arg,
+				size_t offset,
+				void *buf,
+				size_t len,
+				char *errmsg);
+
+/*
+ * Decompresses `size` bytes of data produced by `CompressStream` into a newly
+ * allocated buffer returned through `decompressed`, which holds the whole
+ * decompressed data. Chunked data is read through `read` one chunk at a time
+ * on a pool of threads, while a single frame is read all at once. Returns a
+ * non-0 value upon failure.
+ */
+int DecompressStream(size_t size,
+		     DecompressReadCb read,
+		     void *arg,
+		     struct raft_buffer *decompressed,
+		     char *errmsg);
+
 /* Returns `true` if `data` is compressed, `false` otherwise. */
 bool IsCompressed(const void *data, size_t sz);
 
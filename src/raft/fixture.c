@@ -181,6 +181,7 @@ struct peer
 	bool connected; /* Whether a connection is established. */
 	bool saturated; /* Whether the established connection is saturated. */
 	unsigned send_latency;
+	raft_time delivery_time; /* When the last message will be delivered. */
 };
 
 /* Stub I/O implementation implementing all operations in-memory. */
@@ -221,6 +222,11 @@ struct io
 	unsigned disk_latency;           /* Milliseconds to perform disk I/O */
 	unsigned work_duration;          /* Milliseconds to run async work */
 
+	/* If set, overrides the network and disk latencies above. */
+	raft_fixture_latency_fn latency_fn;
+	void *latency_data;
+	raft_time disk_time; /* When the last disk request will complete. */
+
 	int append_fault_countdown;
 	int vote_fault_countdown;
 	int term_fault_countdown;
@@ -408,6 +414,79 @@ static struct peer *ioGetPeer(struct io *io, raft_id id)
 	return NULL;
 }
 
+/* Return the total size of the payload of the given entries. */
+static size_t entriesSize(const struct raft_entry entries[], unsigned n)
+{
+	size_t size = 0;
+	unsigned i;
+	for (i = 0; i < n; i++) {
+		size += entries[i].buf.len;
+	}
+	return size;
+}
+
+/* Return the total size of the data of the given snapshot. */
+static size_t snapshotSize(const struct raft_snapshot *snapshot)
+{
+	size_t size = 0;
+	unsigned i;
+	if (snapshot == NULL) {
+		return 0;
+	}
+	for (i = 0; i < snapshot->n_bufs; i++) {
+		size += snapshot->bufs[i].len;
+	}
+	return size;
+}
+
+/* Return the time at which a disk request transferring @size bytes and
+ * submitted now should complete. When a latency function is set, requests
+ * still complete in the order they were submitted, like on a real disk. */
+static raft_time ioDiskCompletionTime(struct io *io, size_t size)
+{
+	raft_time t;
+	if (io->latency_fn == NULL) {
+		return *io->time + io->disk_latency;
+	}
+	t = *io->time + io->latency_fn(io->latency_data, RAFT_FIXTURE_DISK,
+				       io->index, io->index, size);
+	if (t < io->disk_time) {
+		t = io->disk_time;
+	}
+	io->disk_time = t;
+	return t;
+}
+
+/* Return the time at which a message transmitted now to the given peer should
+ * be delivered. When a latency function is set, messages are still delivered
+ * in the order they were sent, like over a stream connection. */
+static raft_time ioNetworkCompletionTime(struct io *io,
+					 struct peer *peer,
+					 const struct raft_message *message)
+{
+	size_t size = 0;
+	raft_time t;
+	if (io->latency_fn == NULL) {
+		return *io->time + io->network_latency;
+	}
+	switch (message->type) {
+		case RAFT_IO_APPEND_ENTRIES:
+			size = entriesSize(message->append_entries.entries,
+					   message->append_entries.n_entries);
+			break;
+		case RAFT_IO_INSTALL_SNAPSHOT:
+			size = message->install_snapshot.data.len;
+			break;
+	}
+	t = *io->time + io->latency_fn(io->latency_data, RAFT_FIXTURE_NETWORK,
+				       io->index, peer->io->index, size);
+	if (t < peer->delivery_time) {
+		t = peer->delivery_time;
+	}
+	peer->delivery_time = t;
+	return t;
+}
+
 /* Copy the dynamically allocated memory of an AppendEntries message. */
 static void copyAppendEntries(const struct raft_append_entries *src,
 			      struct raft_append_entries *dst)
@@ -451,7 +530,8 @@ static void ioFlushSend(struct io *io, struct send *send)
 	assert(transmit != NULL);
 
 	transmit->type = TRANSMIT;
-	transmit->completion_time = *io->time + io->network_latency;
+	transmit->completion_time =
+	    ioNetworkCompletionTime(io, peer, &send->message);
 
 	src = &send->message;
 	dst = &transmit->message;
@@ -684,7 +764,7 @@ static int ioMethodAppend(struct raft_io *raft_io,
 	sm_init(&req->sm, fio_invariant, NULL, fio_states, "fio-append", FIO_START);
 
 	r->type = APPEND;
-	r->completion_time = *io->time + io->disk_latency;
+	r->completion_time = ioDiskCompletionTime(io, entriesSize(entries, n));
 	r->req = req;
 	r->entries = entries;
 	r->n = n;
@@ -708,7 +788,7 @@ static int ioMethodTruncate(struct raft_io *raft_io,
 	assert(r != NULL);
 	*r = (struct truncate){
 		.type = TRUNCATE,
-		.completion_time = *io->time + io->disk_latency,
+		.completion_time = ioDiskCompletionTime(io, 0),
 		.req = trunc,
 		.index = index,
 	};
@@ -733,7 +813,7 @@ static int ioMethodSnapshotPut(struct raft_io *raft_io,
 	r->req = req;
 	r->req->cb = cb;
 	r->snapshot = snapshot;
-	r->completion_time = *io->time + io->disk_latency;
+	r->completion_time = ioDiskCompletionTime(io, snapshotSize(snapshot));
 	r->trailing = trailing;
 
 	queue_insert_tail(&io->requests, &r->queue);
@@ -773,7 +853,8 @@ static int ioMethodSnapshotGet(struct raft_io *raft_io,
 	r->type = SNAPSHOT_GET;
 	r->req = req;
 	r->req->cb = cb;
-	r->completion_time = *io->time + io->disk_latency;
+	r->completion_time =
+	    ioDiskCompletionTime(io, snapshotSize(io->snapshot));
 
 	queue_insert_tail(&io->requests, &r->queue);
 
@@ -852,8 +933,9 @@ static int ioMethodSend(struct raft_io *raft_io,
 	r->message = *message;
 	r->req->cb = cb;
 
+	/* A send to an unknown peer fails when flushed. */
 	peer = ioGetPeer(io, message->server_id);
-	r->completion_time = *io->time + peer->send_latency;
+	r->completion_time = *io->time + (peer != NULL ? peer->send_latency : 0);
 
 	queue_insert_tail(&io->requests, &r->queue);
 
@@ -906,6 +988,7 @@ static void ioConnect(struct raft_io *raft_io, struct raft_io *other)
 	io->peers[io->n_peers].connected = true;
 	io->peers[io->n_peers].saturated = false;
 	io->peers[io->n_peers].send_latency = SEND_LATENCY;
+	io->peers[io->n_peers].delivery_time = 0;
 	io->n_peers++;
 }
 
@@ -993,6 +1076,9 @@ static int ioInit(struct raft_io *raft_io, unsigned index, raft_time *time)
 	io->network_latency = NETWORK_LATENCY;
 	io->disk_latency = DISK_LATENCY;
 	io->work_duration = WORK_DURATION;
+	io->latency_fn = NULL;
+	io->latency_data = NULL;
+	io->disk_time = 0;
 	io->append_fault_countdown = -1;
 	io->vote_fault_countdown = -1;
 	io->term_fault_countdown = -1;
@@ -1119,6 +1205,7 @@ int raft_fixture_init(struct raft_fixture *f)
 	}
 	f->commit_index = 0;
 	f->hook = NULL;
+	f->skip_append_only = false;
 	f->event = raft_malloc(sizeof(*f->event));
 	if (f->event == NULL) {
 		return RAFT_NOMEM;
@@ -1569,13 +1656,15 @@ struct raft_fixture_event *raft_fixture_step(struct raft_fixture *f)
 
 	/* If the leader has not changed check the Leader Append-Only
 	 * guarantee. */
-	if (!updateLeaderAndCheckElectionSafety(f)) {
+	if (!updateLeaderAndCheckElectionSafety(f) && !f->skip_append_only) {
 		checkLeaderAppendOnly(f);
 	}
 
 	/* If we have a leader, update leader-related state . */
 	if (f->leader_id != 0) {
-		copyLeaderLog(f);
+		if (!f->skip_append_only) {
+			copyLeaderLog(f);
+		}
 		updateCommitIndex(f);
 	}
 
@@ -1705,6 +1794,18 @@ void raft_fixture_hook(struct raft_fixture *f, raft_fixture_event_cb hook)
 	f->hook = hook;
 }
 
+void raft_fixture_check_append_only(struct raft_fixture *f, bool enabled)
+{
+	if (!enabled) {
+		/* Drop the copy of the log, which would be stale if the check
+		 * was enabled again later. */
+		logClose(f->log);
+		f->log = logInit();
+		assert(f->log != NULL);
+	}
+	f->skip_append_only = !enabled;
+}
+
 void raft_fixture_start_elect(struct raft_fixture *f, unsigned i)
 {
 	struct raft *raft = raft_fixture_get(f, i);
@@ -2072,6 +2173,16 @@ void raft_fixture_set_send_latency(struct raft_fixture *f,
 	peer->send_latency = msecs;
 }
 
+void raft_fixture_set_latency_fn(struct raft_fixture *f,
+				 unsigned i,
+				 raft_fixture_latency_fn fn,
+				 void *data)
+{
+	struct io *io = f->servers[i]->io.impl;
+	io->latency_fn = fn;
+	io->latency_data = data;
+}
+
 void raft_fixture_set_term(struct raft_fixture *f, unsigned i, raft_term term)
 {
 	struct io *io = f->servers[i]->io.impl;
@@ -3,7 +3,14 @@
 
 #include "../raft.h"
 
+/* The server can receive AppendEntries messages with compressed entries. */
+#define RAFT_FEATURE_COMPRESSED_ENTRIES ((raft_flags)1 << 0)
+
+#ifdef LZ4_AVAILABLE
+#define RAFT_DEFAULT_FEATURE_FLAGS (RAFT_FEATURE_COMPRESSED_ENTRIES)
+#else
 #define RAFT_DEFAULT_FEATURE_FLAGS (0)
+#endif
 
 /* Adds the flags @flags to @in and returns the new flags. Multiple flags should
  * be combined using the `|` operator. */
@@ -311,6 +311,32 @@ static struct raft_entry_ref *refs_get(const struct raft_log *l,
 	return slot;
 }
 
+/* Return true if an entry with the given index, whatever its term, is still
+ * referenced and its payload is part of the given batch. */
+static bool refsHoldBatch(const struct raft_log *l,
+			  const raft_index index,
+			  const void *batch)
+{
+	struct raft_entry_ref *slot;
+
+	if (index == 0 || l->refs == NULL) {
+		return false;
+	}
+
+	slot = &l->refs[refsKey(index, l->refs_size)];
+	if (slot->count == 0 || slot->index != index) {
+		return false;
+	}
+
+	for (; slot != NULL; slot = slot->next) {
+		if (slot->batch == batch) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /* Increment the refcount of the entry with the given term and index. */
 static void refsIncr(struct raft_log *l,
 		     const raft_term term,
@@ -399,6 +425,10 @@ struct raft_log *logInit(void)
 	log->refs_size = 0;
 	log->snapshot.last_index = 0;
 	log->snapshot.last_term = 0;
+	log->cache.budget = 0;
+	log->cache.resident = 0;
+	log->cache.evicted = 0;
+	log->cache.io = NULL;
 
 	return log;
 }
@@ -576,6 +606,7 @@ int logReinstate(struct raft_log *l,
 			entry->type = type;
 			entry->buf = slot->buf;
 			entry->batch = slot->batch;
+			l->cache.resident += entry->buf.len;
 			*reinstated = true;
 			break;
 		}
@@ -620,6 +651,8 @@ int logAppend(struct raft_log *l,
 	entry->batch = batch;
 	entry->is_local = is_local;
 
+	l->cache.resident += buf.len;
+
 	l->back += 1;
 	l->back = l->back % l->size;
 
@@ -764,6 +797,224 @@ struct sm *log_get_entry_sm(const struct raft_log *l,
 	return &slot->sm;
 }
 
+void logSetCache(struct raft_log *l, size_t budget, struct raft_io *io)
+{
+	assert(l != NULL);
+	assert(budget == 0 || io != NULL);
+	l->cache.budget = budget;
+	l->cache.io = io;
+}
+
+/* Release the payload of the entry with the given index, which must be part of
+ * a batch that is about to be freed, or not be part of a batch at all. The
+ * payload of a #RAFT_CHANGE entry is replaced with the given copy instead. */
+static void evictEntry(struct raft_log *l, const raft_index index, void *copy)
+{
+	struct raft_entry *entry = &l->entries[locateEntry(l, index)];
+	struct raft_entry_ref *slot = refs_get(l, entry->term, index);
+
+	l->cache.resident -= entry->buf.len;
+	if (entry->type == RAFT_CHANGE) {
+		if (entry->batch != NULL) {
+			entry->buf.base = copy;
+			entry->batch = NULL;
+		}
+	} else {
+		if (entry->batch == NULL && entry->buf.base != NULL) {
+			raft_free(entry->buf.base);
+		}
+		entry->buf.base = NULL;
+		entry->batch = NULL;
+	}
+	slot->buf = entry->buf;
+	slot->batch = entry->batch;
+}
+
+/* Release the payloads of the entries from @first to @last (included), that are
+ * all the entries of the log sharing the given batch, if any. Return false if
+ * some of them are still referenced. */
+static bool evictRun(struct raft_log *l,
+		     const raft_index first,
+		     const raft_index last,
+		     void *batch)
+{
+	const struct raft_entry *entry;
+	raft_index index;
+	void **copies = NULL;
+	unsigned n_copies = 0;
+	unsigned i;
+
+	for (index = first; index <= last; index++) {
+		entry = logGet(l, index);
+		if (refs_get(l, entry->term, index)->count > 1) {
+			return false;
+		}
+		if (batch != NULL && entry->type == RAFT_CHANGE) {
+			n_copies++;
+		}
+	}
+
+	/* Entries that were removed from the log may still be on their way to
+	 * disk or to other servers, using the same batch. */
+	if (batch != NULL &&
+	    (refsHoldBatch(l, first - 1, batch) ||
+	     refsHoldBatch(l, last + 1, batch))) {
+		return false;
+	}
+
+	/* Copy configuration entries out of the batch first, so that running
+	 * out of memory leaves all entries untouched. */
+	if (n_copies > 0) {
+		copies = raft_calloc(n_copies, sizeof *copies);
+		if (copies == NULL) {
+			return false;
+		}
+		i = 0;
+		for (index = first; index <= last; index++) {
+			entry = logGet(l, index);
+			if (entry->type != RAFT_CHANGE) {
+				continue;
+			}
+			copies[i] = raft_malloc(entry->buf.len);
+			if (copies[i] == NULL) {
+				goto oom;
+			}
+			memcpy(copies[i], entry->buf.base, entry->buf.len);
+			i++;
+		}
+	}
+
+	i = 0;
+	for (index = first; index <= last; index++) {
+		entry = logGet(l, index);
+		if (batch != NULL && entry->type == RAFT_CHANGE) {
+			evictEntry(l, index, copies[i++]);
+		} else {
+			evictEntry(l, index, NULL);
+		}
+	}
+	if (batch != NULL) {
+		raft_free(batch);
+	}
+	if (copies != NULL) {
+		raft_free(copies);
+	}
+
+	return true;
+
+oom:
+	while (i > 0) {
+		raft_free(copies[--i]);
+	}
+	raft_free(copies);
+	return false;
+}
+
+void logEvict(struct raft_log *l, raft_index index)
+{
+	raft_index last_index = logLastIndex(l);
+
+	assert(l != NULL);
+
+	if (l->cache.budget == 0) {
+		return;
+	}
+	if (index > last_index) {
+		index = last_index;
+	}
+	if (l->cache.evicted < l->offset) {
+		l->cache.evicted = l->offset;
+	}
+
+	while (l->cache.resident > l->cache.budget &&
+	       l->cache.evicted < index) {
+		raft_index first = l->cache.evicted + 1;
+		raft_index last = first;
+		void *batch = logGet(l, first)->batch;
+
+		/* Entries sharing a batch are contiguous, and the batch can be
+		 * freed only once all of them are evicted. */
+		if (batch != NULL) {
+			while (last < last_index &&
+			       logGet(l, last + 1)->batch == batch) {
+				last++;
+			}
+		}
+		if (last > index || !evictRun(l, first, last, batch)) {
+			break;
+		}
+		l->cache.evicted = last;
+	}
+}
+
+/* Read back from disk the payloads of evicted entries, starting at the given
+ * index. */
+static int acquireEvicted(struct raft_log *l,
+			  const raft_index index,
+			  struct raft_entry *entries[],
+			  unsigned *n)
+{
+	struct raft_io *io = l->cache.io;
+	size_t size = 0;
+	unsigned i;
+	int rv;
+
+	assert(io != NULL);
+
+	/* Don't bring back more than a budget's worth of payloads at once, a
+	 * lagging follower will ask for the following entries later. */
+	*n = 0;
+	while (index + *n <= l->cache.evicted) {
+		size_t len = logGet(l, index + *n)->buf.len;
+		if (*n > 0 && size + len > l->cache.budget) {
+			break;
+		}
+		size += len;
+		(*n)++;
+	}
+	assert(*n > 0);
+
+	*entries = raft_calloc(*n, sizeof **entries);
+	if (*entries == NULL) {
+		rv = RAFT_NOMEM;
+		goto err;
+	}
+
+	rv = io->read_entries(io, index, *n, *entries);
+	if (rv != 0) {
+		goto err_after_alloc;
+	}
+
+	for (i = 0; i < *n; i++) {
+		const struct raft_entry *entry = logGet(l, index + i);
+		if ((*entries)[i].term != entry->term ||
+		    (*entries)[i].buf.len != entry->buf.len) {
+			rv = RAFT_CORRUPT;
+			goto err_after_read;
+		}
+		(*entries)[i].is_local = entry->is_local;
+	}
+
+	for (i = 0; i < *n; i++) {
+		refsIncr(l, (*entries)[i].term, index + i);
+	}
+
+	return 0;
+
+err_after_read:
+	/* All entries read back share the same batch. */
+	if ((*entries)[0].batch != NULL) {
+		raft_free((*entries)[0].batch);
+	}
+err_after_alloc:
+	raft_free(*entries);
+err:
+	*entries = NULL;
+	*n = 0;
+	assert(rv != 0);
+	return rv;
+}
+
 int logAcquire(struct raft_log *l,
 	       const raft_index index,
 	       struct raft_entry *entries[],
@@ -800,6 +1051,10 @@ int logAcquire(struct raft_log *l,
 
 	assert(*n > 0);
 
+	if (index <= l->cache.evicted) {
+		return acquireEvicted(l, index, entries, n);
+	}
+
 	*entries = raft_calloc(*n, sizeof **entries);
 	if (*entries == NULL) {
 		return RAFT_NOMEM;
@@ -851,6 +1106,17 @@ void logRelease(struct raft_log *l,
 
 		unref = refsDecr(l, entry->term, index + i, -1);
 
+		/* Entries whose payload was read back from disk have a batch of
+		 * their own, not shared with the log. */
+		if (!unref) {
+			if (entry->batch != NULL && entry->batch != batch &&
+			    !refsHoldBatch(l, index + i, entry->batch)) {
+				batch = entry->batch;
+				raft_free(batch);
+			}
+			continue;
+		}
+
 		/* If there are no outstanding references to this entry, free
 		 * its payload if it's not part of a batch, or check if we can
 		 * free the batch itself. */
@@ -923,6 +1189,7 @@ static void removeSuffix(struct raft_log *l,
 
 	for (i = 0; i < n; i++) {
 		struct raft_entry *entry;
+		bool evicted;
 		bool unref;
 
 		if (l->back == 0) {
@@ -932,13 +1199,23 @@ static void removeSuffix(struct raft_log *l,
 		}
 
 		entry = &l->entries[l->back];
+		evicted = start + n - i - 1 <= l->cache.evicted;
+		if (!evicted) {
+			l->cache.resident -= entry->buf.len;
+		}
 		unref = refsDecr(l, entry->term, start + n - i - 1, state);
 
-		if (unref && destroy) {
+		/* Outstanding references to an evicted entry hold a copy of
+		 * its payload read back from disk, not the log's one. */
+		if ((unref || evicted) && destroy) {
 			destroyEntry(l, entry);
 		}
 	}
 
+	if (l->cache.evicted >= start) {
+		l->cache.evicted = start - 1;
+	}
+
 	clearIfEmpty(l);
 }
 
@@ -970,6 +1247,7 @@ static void removePrefix(struct raft_log *l, const raft_index index)
 
 	for (i = 0; i < n; i++) {
 		struct raft_entry *entry;
+		bool evicted;
 		bool unref;
 
 		entry = &l->entries[l->front];
@@ -981,9 +1259,13 @@ static void removePrefix(struct raft_log *l, const raft_index index)
 		}
 		l->offset++;
 
+		evicted = l->offset <= l->cache.evicted;
+		if (!evicted) {
+			l->cache.resident -= entry->buf.len;
+		}
 		unref = refsDecr(l, entry->term, l->offset, ENTRY_SNAPSHOTTED);
 
-		if (unref) {
+		if (unref || evicted) {
 			destroyEntry(l, entry);
 		}
 	}
@@ -1022,4 +1304,5 @@ void logRestore(struct raft_log *l, raft_index last_index, raft_term last_term)
 	l->snapshot.last_index = last_index;
 	l->snapshot.last_term = last_term;
 	l->offset = last_index;
+	l->cache.evicted = last_index;
 }
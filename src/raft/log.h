@@ -81,6 +81,13 @@ struct raft_log
 		    last_index; /* Snapshot replaces all entries up to here. */
 		raft_term last_term; /* Term of last index. */
 	} snapshot;
+	struct /* Bound on the memory used by entry payloads. */
+	{
+		size_t budget;      /* Max bytes of resident payloads, or 0. */
+		size_t resident;    /* Bytes of payloads currently in memory. */
+		raft_index evicted; /* Payloads up to here were released. */
+		struct raft_io *io; /* Reads released payloads back. */
+	} cache;
 };
 
 /* Initialize an empty in-memory log of raft entries. */
@@ -158,9 +165,28 @@ int logAppendConfiguration(struct raft_log *l,
 			   const raft_term term,
 			   const struct raft_configuration *configuration);
 
+/* Limit the memory used by the payloads of the entries in the log to about
+ * @budget bytes, or lift the limit if @budget is 0. The payloads released by
+ * logEvict() are read back using the read_entries method of @io, which must be
+ * implemented. */
+void logSetCache(struct raft_log *l, size_t budget, struct raft_io *io);
+
+/* Release the payloads of the oldest entries, up to @index (included), until
+ * the resident payloads fit in the cache budget. The entries themselves stay in
+ * the log, but logGet() returns them with a NULL @buf.base, except for
+ * #RAFT_CHANGE entries, whose payload is always kept. Entries that are
+ * currently acquired are never released, so eviction stops at the first one.
+ *
+ * The caller must make sure that all entries up to @index are durable. */
+void logEvict(struct raft_log *l, raft_index index);
+
 /* Acquire an array of entries from the given index onwards. The payload
  * memory referenced by the @buf attribute of the returned entries is guaranteed
- * to be valid until logRelease() is called. */
+ * to be valid until logRelease() is called.
+ *
+ * If the payload of the entry at @index was released by logEvict(), the
+ * payloads are read back from disk instead, and only up to a cache budget's
+ * worth of released entries is returned. */
 int logAcquire(struct raft_log *l,
 	       raft_index index,
 	       struct raft_entry *entries[],
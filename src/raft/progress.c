@@ -13,8 +13,13 @@
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
-/* Initialize a single progress object. */
-static void initProgress(struct raft_progress *p, raft_index last_index)
+/* Initialize a single progress object.
+ *
+ * The last_recv timestamp starts at the given time, so that servers are not
+ * reported offline before they had a chance to respond to the new leader. */
+static void initProgress(struct raft_progress *p,
+			 raft_index last_index,
+			 raft_time now)
 {
 	p->next_index = last_index + 1;
 	p->match_index = 0;
@@ -24,6 +29,10 @@ static void initProgress(struct raft_progress *p, raft_index last_index)
 	p->recent_recv = false;
 	p->state = PROGRESS__PROBE;
 	p->features = 0;
+	p->last_recv = now;
+	p->has_metadata = false;
+	p->failure_domain = 0;
+	p->weight = 0;
 }
 
 int progressBuildArray(struct raft *r)
@@ -36,7 +45,7 @@ int progressBuildArray(struct raft *r)
 		return RAFT_NOMEM;
 	}
 	for (i = 0; i < r->configuration.n; i++) {
-		initProgress(&progress[i], last_index);
+		initProgress(&progress[i], last_index, r->io->time(r->io));
 		if (r->configuration.servers[i].id == r->id) {
 			progress[i].match_index = r->last_stored;
 		}
@@ -84,7 +93,7 @@ int progressRebuildArray(struct raft *r,
 			continue;
 		}
 		assert(j == r->configuration.n);
-		initProgress(&progress[i], last_index);
+		initProgress(&progress[i], last_index, r->io->time(r->io));
 	}
 
 	raft_free(r->leader_state.progress);
@@ -107,11 +116,18 @@ bool progressPersistedIsUpToDate(struct raft *r, unsigned i)
 	return p->match_index == last_index;
 }
 
+bool progressNeedsHeartbeat(struct raft *r, unsigned i)
+{
+	struct raft_progress *p = &r->leader_state.progress[i];
+	raft_time now = r->io->time(r->io);
+	return now - p->last_send >= r->heartbeat_timeout;
+}
+
 bool progressShouldReplicate(struct raft *r, unsigned i)
 {
 	struct raft_progress *p = &r->leader_state.progress[i];
 	raft_time now = r->io->time(r->io);
-	bool needs_heartbeat = now - p->last_send >= r->heartbeat_timeout;
+	bool needs_heartbeat = progressNeedsHeartbeat(r, i);
 	raft_index last_index = logLastIndex(r->log);
 	bool result = false;
 
@@ -182,6 +198,7 @@ bool progressResetRecentRecv(struct raft *r, const unsigned i)
 void progressMarkRecentRecv(struct raft *r, const unsigned i)
 {
 	r->leader_state.progress[i].recent_recv = true;
+	r->leader_state.progress[i].last_recv = r->io->time(r->io);
 }
 
 inline void progressSetFeatures(struct raft *r,
@@ -322,3 +339,16 @@ bool progressSnapshotDone(struct raft *r, const unsigned i)
 	return p->match_index >= p->snapshot_index;
 }
 
+
+void progressSetMetadata(struct raft *r,
+			 const unsigned i,
+			 const struct raft_append_entries_result *result)
+{
+	struct raft_progress *p = &r->leader_state.progress[i];
+	if (result->version < 2) {
+		return;
+	}
+	p->has_metadata = true;
+	p->failure_domain = result->failure_domain;
+	p->weight = result->weight;
+}
@@ -28,6 +28,10 @@ struct raft_progress
 	    snapshot_last_send; /* Timestamp of last InstallSnaphot RPC. */
 	bool recent_recv;    /* A msg was received within election timeout. */
 	raft_flags features; /* What the server is capable of. */
+	raft_time last_recv; /* Timestamp of last AppendEntries result. */
+	bool has_metadata;   /* Whether the server reported its metadata. */
+	uint64_t failure_domain; /* Reported failure domain. */
+	uint64_t weight;         /* Reported weight. */
 };
 
 /* Create and initialize the array of progress objects used by the leader to *
@@ -60,6 +64,10 @@ bool progressPersistedIsUpToDate(struct raft *r, unsigned i);
  * is taken. */
 bool progressShouldReplicate(struct raft *r, unsigned i);
 
+/* Return true if nothing was sent to the i'th server in the last heartbeat
+ * interval. */
+bool progressNeedsHeartbeat(struct raft *r, unsigned i);
+
 /* Return the index of the next entry that should be sent to the i'th server. */
 raft_index progressNextIndex(struct raft *r, unsigned i);
 
@@ -136,4 +144,9 @@ void progressSetFeatures(struct raft *r, const unsigned i, raft_flags features);
 /* Gets the feature flags of a node. */
 raft_flags progressGetFeatures(struct raft *r, const unsigned i);
 
+/* Record the metadata reported by a node in an AppendEntries result. */
+void progressSetMetadata(struct raft *r,
+			 const unsigned i,
+			 const struct raft_append_entries_result *result);
+
 #endif /* PROGRESS_H_ */
@@ -17,6 +17,7 @@
 #include "heap.h"
 #include "log.h"
 #include "membership.h"
+#include "progress.h"
 #include "snapshot.h"
 
 #define DEFAULT_ELECTION_TIMEOUT 1000          /* One second */
@@ -102,6 +103,7 @@ int raft_init(struct raft *r,
 	r->pre_vote = false;
 	r->max_catch_up_rounds = DEFAULT_MAX_CATCH_UP_ROUNDS;
 	r->max_catch_up_round_duration = DEFAULT_MAX_CATCH_UP_ROUND_DURATION;
+	r->request_timings = false;
 	rv = r->io->init(r->io, r->id, r->address);
 	if (rv != 0) {
 		ErrMsgTransfer(r->io->errmsg, r->errmsg, "io");
@@ -174,6 +176,19 @@ void raft_set_snapshot_trailing(struct raft *r, unsigned n)
 	r->snapshot.trailing = n;
 }
 
+void raft_set_log_cache_size(struct raft *r, size_t size)
+{
+	if (r->io->version < 4 || r->io->read_entries == NULL) {
+		return;
+	}
+	logSetCache(r->log, size, r->io);
+}
+
+void raft_set_request_timings(struct raft *r, bool enabled)
+{
+	r->request_timings = enabled;
+}
+
 void raft_set_snapshot_trailing_strategy(struct raft *r, int strategy)
 {
 	switch (strategy) {
@@ -217,6 +232,47 @@ int raft_voter_contacts(struct raft *r)
 	return ret;
 }
 
+void raft_set_metadata(struct raft *r, uint64_t failure_domain, uint64_t weight)
+{
+	struct raft_callbacks *cbs = raftGetCallbacks(r);
+	cbs->failure_domain = failure_domain;
+	cbs->weight = weight;
+}
+
+int raft_peer_info(struct raft *r, raft_id id, struct raft_peer_info *info)
+{
+	const struct raft_progress *p;
+	struct raft_callbacks *cbs;
+	raft_time now;
+	unsigned i;
+
+	if (r->state != RAFT_LEADER) {
+		return RAFT_NOTLEADER;
+	}
+	i = configurationIndexOf(&r->configuration, id);
+	if (i == r->configuration.n) {
+		return RAFT_BADID;
+	}
+
+	if (id == r->id) {
+		cbs = raftGetCallbacks(r);
+		info->online = true;
+		info->has_metadata = true;
+		info->failure_domain = cbs->failure_domain;
+		info->weight = cbs->weight;
+		return 0;
+	}
+
+	p = &r->leader_state.progress[i];
+	now = r->io->time(r->io);
+	info->online = now <= p->last_recv ||
+		       now - p->last_recv < r->election_timeout;
+	info->has_metadata = p->has_metadata;
+	info->failure_domain = p->failure_domain;
+	info->weight = p->weight;
+	return 0;
+}
+
 int raft_bootstrap(struct raft *r, const struct raft_configuration *conf)
 {
 	int rv;
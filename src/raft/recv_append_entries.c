@@ -2,6 +2,7 @@
 
 #include "../tracing.h"
 #include "assert.h"
+#include "callbacks.h"
 #include "convert.h"
 #include "entry.h"
 #include "flags.h"
@@ -41,8 +42,7 @@ int recvAppendEntries(struct raft *r,
 
 	result->rejected = args->prev_log_index;
 	result->last_log_index = logLastIndex(r->log);
-	result->version = RAFT_APPEND_ENTRIES_RESULT_VERSION;
-	result->features = RAFT_DEFAULT_FEATURE_FLAGS;
+	raftFillAppendEntriesResult(r, result);
 
 	rv = recvEnsureMatchingTerms(r, args->term, &match);
 	if (rv != 0) {
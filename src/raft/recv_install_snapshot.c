@@ -4,6 +4,7 @@
 
 #include "../tracing.h"
 #include "assert.h"
+#include "callbacks.h"
 #include "convert.h"
 #include "flags.h"
 #include "log.h"
@@ -42,8 +43,7 @@ int recvInstallSnapshot(struct raft *r,
 
 	result->rejected = args->last_index;
 	result->last_log_index = logLastIndex(r->log);
-	result->version = RAFT_APPEND_ENTRIES_RESULT_VERSION;
-	result->features = RAFT_DEFAULT_FEATURE_FLAGS;
+	raftFillAppendEntriesResult(r, result);
 
 	rv = recvEnsureMatchingTerms(r, args->term, &match);
 	if (rv != 0) {
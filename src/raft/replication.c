@@ -1,6 +1,8 @@
 #include <string.h>
+#include <time.h>
 
 #include "assert.h"
+#include "callbacks.h"
 #include "configuration.h"
 #include "convert.h"
 #include "entry.h"
@@ -75,6 +77,13 @@ static int sendAppendEntries(struct raft *r,
 	raft_index next_index = prev_index + 1;
 	int rv;
 
+	/* Only allow the I/O backend to compress the entries if the follower
+	 * told us it can handle them. */
+	args->version = 0;
+	if (flagsIsSet(progressGetFeatures(r, i),
+		       RAFT_FEATURE_COMPRESSED_ENTRIES)) {
+		args->version = RAFT_APPEND_ENTRIES_VERSION;
+	}
 	args->term = r->current_term;
 	args->prev_log_index = prev_index;
 	args->prev_log_term = prev_term;
@@ -365,6 +374,19 @@ send_snapshot:
 	}
 }
 
+/* Send an empty AppendEntries message to a spare server, at most once per
+ * heartbeat interval. Nothing is ever replicated to spares: the only purpose of
+ * the message is to get back a result, telling that the spare is online along
+ * with its metadata (see raft_peer_info). */
+static int heartbeatSpare(struct raft *r, unsigned i)
+{
+	if (!progressNeedsHeartbeat(r, i)) {
+		return 0;
+	}
+	return sendAppendEntries(r, i, logLastIndex(r->log),
+				 logLastTerm(r->log));
+}
+
 /* Possibly trigger I/O requests for newly appended log entries or heartbeats.
  *
  * This function loops through all followers and triggers replication on them.
@@ -383,12 +405,14 @@ static int triggerAll(struct raft *r)
 		if (server->id == r->id) {
 			continue;
 		}
-		/* Skip spare servers, unless they're being promoted. */
+		/* Only send heartbeats to spare servers, unless they're being
+		 * promoted. */
 		if (server->role == RAFT_SPARE &&
 		    server->id != r->leader_state.promotee_id) {
-			continue;
+			rv = heartbeatSpare(r, i);
+		} else {
+			rv = replicationProgress(r, i);
 		}
-		rv = replicationProgress(r, i);
 		if (rv != 0 && rv != RAFT_NOCONNECTION) {
 			/* This is not a critical failure, let's just log it. */
 			tracef(
@@ -474,6 +498,41 @@ static struct request *getRequest(struct raft *r,
 	return NULL;
 }
 
+static uint64_t requestNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/* Record the current time as the given timing of the outstanding requests
+ * whose first entry has an index in the range [from, to]. */
+static void stampRequests(struct raft *r,
+			  raft_index from,
+			  raft_index to,
+			  int timing)
+{
+	queue *head;
+	struct request *req;
+	uint64_t now = 0;
+
+	if (!r->request_timings || r->state != RAFT_LEADER) {
+		return;
+	}
+	QUEUE_FOREACH(head, &r->leader_state.requests)
+	{
+		req = QUEUE_DATA(head, struct request, queue);
+		if (req->type != RAFT_COMMAND || req->index < from ||
+		    req->index > to || req->timings[timing] != 0) {
+			continue;
+		}
+		if (now == 0) {
+			now = requestNow();
+		}
+		req->timings[timing] = now;
+	}
+}
+
 /* Invoked once a disk write request for new entries has been completed. */
 static void appendLeaderCb(struct raft_io_append *append, int status)
 {
@@ -553,6 +612,9 @@ static void appendLeaderCb(struct raft_io_append *append, int status)
 		goto out;
 	}
 
+	stampRequests(r, request->index, request->index + request->n - 1,
+		      REQUEST_TIMING_STORED);
+
 	/* Only update the next index if we are part of the current
 	 * configuration. The only case where this is not true is when we were
 	 * asked to remove ourselves from the cluster.
@@ -747,6 +809,13 @@ int replicationUpdate(struct raft *r,
 	progressMarkRecentRecv(r, i);
 
 	progressSetFeatures(r, i, result->features);
+	progressSetMetadata(r, i, result);
+
+	/* A spare only answers heartbeats, there's nothing to replicate. */
+	if (server->role == RAFT_SPARE &&
+	    server->id != r->leader_state.promotee_id) {
+		return 0;
+	}
 
 	/* If the RPC failed because of a log mismatch, retry.
 	 *
@@ -958,8 +1027,7 @@ static void appendFollowerCb(struct raft_io_append *req, int status)
 	r->follower_state.append_in_flight_count -= 1;
 
 	result.term = r->current_term;
-	result.version = RAFT_APPEND_ENTRIES_RESULT_VERSION;
-	result.features = RAFT_DEFAULT_FEATURE_FLAGS;
+	raftFillAppendEntriesResult(r, &result);
 	if (status != 0) {
 		ErrMsgTransfer(r->io->errmsg, r->errmsg, "io");
 		result.rejected = args->prev_log_index + 1;
@@ -1397,8 +1465,7 @@ static void installSnapshotCb(struct raft_io_snapshot_put *req, int status)
 	r->snapshot.put.data = NULL;
 
 	result.term = r->current_term;
-	result.version = RAFT_APPEND_ENTRIES_RESULT_VERSION;
-	result.features = RAFT_DEFAULT_FEATURE_FLAGS;
+	raftFillAppendEntriesResult(r, &result);
 	result.rejected = 0;
 
 	/* If we are shutting down, let's discard the result. */
@@ -1550,35 +1617,106 @@ err:
 	return rv;
 }
 
-/* Apply a RAFT_COMMAND entry that has been committed. */
-static int applyCommand(struct raft *r,
-			const raft_index index,
-			const struct raft_buffer *buf)
+/* Maximum number of entries passed to the apply_batch hook of the FSM in a
+ * single call. */
+#define APPLY_BATCH_MAX 64
+
+/* Mark a RAFT_COMMAND entry that the FSM has applied as such, and fire the
+ * callback of its request, if any. */
+static void applyCommandDone(struct raft *r,
+			     const raft_index index,
+			     void *result)
 {
 	struct raft_apply *req;
-	void *result;
-	int rv;
-
-	rv = r->fsm->apply(r->fsm, buf, &result);
-	if (rv != 0) {
-		return rv;
-	}
 
 	r->last_applied = index;
 
 	req = (struct raft_apply *)getRequest(r, index, RAFT_COMMAND);
 	if (req == NULL) {
-		return 0;
+		return;
 	}
 	queue_remove(&req->queue);
+	if (r->request_timings) {
+		req->timings[REQUEST_TIMING_APPLIED] = requestNow();
+	}
 	sm_move(&req->sm, REQUEST_COMPLETE);
 	sm_fini(&req->sm);
 	if (req->cb != NULL) {
 		req->cb(req, 0, result);
 	}
+}
+
+/* Apply a RAFT_COMMAND entry that has been committed. */
+static int applyCommand(struct raft *r,
+			const raft_index index,
+			const struct raft_buffer *buf)
+{
+	void *result;
+	int rv;
+
+	rv = r->fsm->apply(r->fsm, buf, &result);
+	if (rv != 0) {
+		return rv;
+	}
+
+	applyCommandDone(r, index, result);
 	return 0;
 }
 
+/* Whether the FSM can apply several RAFT_COMMAND entries in a single call. */
+static bool applyCanBatch(struct raft *r)
+{
+	return r->fsm->version > 4 && r->fsm->apply_batch != NULL;
+}
+
+/* Apply the run of consecutive committed RAFT_COMMAND entries starting at the
+ * given index with a single call to the apply_batch hook of the FSM. The number
+ * of entries that were applied is stored in n. */
+static int applyCommandBatch(struct raft *r, const raft_index index, unsigned *n)
+{
+	struct raft_buffer bufs[APPLY_BATCH_MAX];
+	raft_term terms[APPLY_BATCH_MAX];
+	void *results[APPLY_BATCH_MAX];
+	unsigned n_bufs = 0;
+	unsigned applied = 0;
+	unsigned i;
+	int rv;
+
+	while (n_bufs < APPLY_BATCH_MAX && index + n_bufs <= r->commit_index) {
+		const struct raft_entry *entry = logGet(r->log, index + n_bufs);
+		struct sm *entry_sm;
+		if (entry == NULL || entry->type != RAFT_COMMAND) {
+			break;
+		}
+		entry_sm = log_get_entry_sm(r->log, entry->term, index + n_bufs);
+		assert(entry_sm != NULL);
+		sm_move(entry_sm, ENTRY_COMMITTED);
+		bufs[n_bufs] = entry->buf;
+		terms[n_bufs] = entry->term;
+		results[n_bufs] = NULL;
+		n_bufs++;
+	}
+	assert(n_bufs > 0);
+
+	tracef("apply batch of %u entries from %llu", n_bufs, index);
+	rv = r->fsm->apply_batch(r->fsm, bufs, n_bufs, results, &applied);
+	assert(applied <= n_bufs);
+	assert(rv != 0 || applied == n_bufs);
+
+	for (i = 0; i < applied; i++) {
+		struct sm *entry_sm;
+		applyCommandDone(r, index + i, results[i]);
+		/* The request callback may change the raft log, look the
+		 * entry up again. */
+		entry_sm = log_get_entry_sm(r->log, terms[i], index + i);
+		assert(entry_sm != NULL);
+		sm_move(entry_sm, ENTRY_APPLIED);
+	}
+
+	*n = applied;
+	return rv;
+}
+
 /* Fire the callback of a barrier request whose entry has been committed. */
 static void applyBarrier(struct raft *r, const raft_index index)
 {
@@ -1674,8 +1812,14 @@ static bool shouldTakeSnapshot(struct raft *r)
  * When taking a snapshot, ownership of the snapshot data is with raft if
  * `snapshot_finalize` is NULL.
  */
-static void takeSnapshotClose(struct raft *r, struct raft_snapshot *s)
+static void takeSnapshotClose(struct raft *r,
+			      struct raft_snapshot *s,
+			      int status)
 {
+	if (r->fsm->version > 3 && r->fsm->snapshot_done != NULL) {
+		r->fsm->snapshot_done(r->fsm, status);
+	}
+
 	if (r->fsm->version == 1 ||
 	    (r->fsm->version > 1 && r->fsm->snapshot_finalize == NULL)) {
 		snapshotClose(s);
@@ -1760,7 +1904,7 @@ static void takeSnapshotCb(struct raft_io_snapshot_put *req, int status)
 	}
 	logSnapshot(r->log, snapshot->index, trailingSize(r, snapshot));
 out:
-	takeSnapshotClose(r, snapshot);
+	takeSnapshotClose(r, snapshot, status);
 	r->snapshot.pending.term = 0;
 }
 
@@ -1771,10 +1915,13 @@ static int putSnapshot(struct raft *r,
 	int rv;
 	assert(r->snapshot.put.data == NULL);
 	r->snapshot.put.data = r;
+	/* An incremental snapshot builds on the last one that was persisted. */
+	r->snapshot.put.base_term = r->log->snapshot.last_term;
+	r->snapshot.put.base_index = r->log->snapshot.last_index;
 	rv = r->io->snapshot_put(r->io, r->snapshot.trailing, &r->snapshot.put,
 				 snapshot, cb);
 	if (rv != 0) {
-		takeSnapshotClose(r, snapshot);
+		takeSnapshotClose(r, snapshot, rv);
 		r->snapshot.pending.term = 0;
 		r->snapshot.put.data = NULL;
 	}
@@ -1792,7 +1939,7 @@ static void takeSnapshotDoneCb(struct raft_io_async_work *take, int status)
 
 	if (status != 0) {
 		tracef("take snapshot failed %s", raft_strerror(status));
-		takeSnapshotClose(r, snapshot);
+		takeSnapshotClose(r, snapshot, status);
 		r->snapshot.pending.term = 0;
 		r->snapshot.put.data = NULL;
 		return;
@@ -1868,7 +2015,7 @@ static int takeSnapshot(struct raft *r)
 
 abort_after_snapshot:
 	/* Closes config and finalizes snapshot */
-	takeSnapshotClose(r, snapshot);
+	takeSnapshotClose(r, snapshot, rv);
 abort:
 	r->snapshot.pending.term = 0;
 	return rv;
@@ -1905,6 +2052,16 @@ int replicationApply(struct raft *r)
 		       entry->type == RAFT_BARRIER ||
 		       entry->type == RAFT_CHANGE);
 
+		if (entry->type == RAFT_COMMAND && applyCanBatch(r)) {
+			unsigned n;
+			rv = applyCommandBatch(r, index, &n);
+			if (rv != 0) {
+				break;
+			}
+			index += n - 1;
+			continue;
+		}
+
 		sm_move(entry_sm, ENTRY_COMMITTED);
 		switch (entry->type) {
 			case RAFT_COMMAND:
@@ -1936,6 +2093,11 @@ int replicationApply(struct raft *r)
 		}
 	}
 
+	/* Entries that are both applied and durable are only needed to catch
+	 * up lagging followers, which can read them back from disk. */
+	logEvict(r->log, r->last_applied < r->last_stored ? r->last_applied
+							  : r->last_stored);
+
 	if (shouldTakeSnapshot(r)) {
 		rv = takeSnapshot(r);
 	} else if (rv == RAFT_BUSY) {
@@ -1983,6 +2145,8 @@ void replicationQuorum(struct raft *r, const raft_index index)
 	}
 
 	if (votes > configurationVoterCount(&r->configuration) / 2) {
+		stampRequests(r, r->commit_index + 1, index,
+			      REQUEST_TIMING_COMMITTED);
 		r->commit_index = index;
 		tracef("new commit index %llu", r->commit_index);
 	}
@@ -52,7 +52,15 @@ struct request {
 	uint8_t req_id[16];
 	uint8_t client_id[16];
 	uint8_t unique_id[16];
-	uint64_t reserved[4];
+	uint64_t timings[3];
+	uint64_t reserved[1];
+};
+
+/* Indexes of the request timings. */
+enum {
+	REQUEST_TIMING_STORED,
+	REQUEST_TIMING_COMMITTED,
+	REQUEST_TIMING_APPLIED,
 };
 
 #endif /* REQUEST_H_ */
@@ -27,8 +27,9 @@
  * TODO: implement an exponential backoff instead.  */
 #define CONNECT_RETRY_DELAY 1000
 
-/* Cleans up files that are no longer used by the system */
-static int uvMaintenance(const char *dir, char *errmsg)
+/* Cleans up files that are no longer used by the system and counts the
+ * segments in the recycled pool. */
+static int uvMaintenance(const char *dir, unsigned *n_recycled, char *errmsg)
 {
 	struct uv_fs_s req;
 	struct uv_dirent_s entry;
@@ -44,12 +45,19 @@ static int uvMaintenance(const char *dir, char *errmsg)
 	}
 
 	rv = 0;
+	*n_recycled = 0;
 	for (i = 0; i < n; i++) {
 		const char *filename;
 		rv = uv_fs_scandir_next(&req, &entry);
 		assert(rv == 0); /* Can't fail in libuv */
 
 		filename = entry.name;
+		if (strncmp(filename, UV__RECYCLE_PREFIX,
+			    strlen(UV__RECYCLE_PREFIX)) == 0) {
+			*n_recycled += 1;
+			continue;
+		}
+
 		/* Remove leftover tmp-files */
 		if (strncmp(filename, TMP_FILE_PREFIX,
 			    strlen(TMP_FILE_PREFIX)) == 0) {
@@ -104,7 +112,7 @@ static int uvInit(struct raft_io *io, raft_id id, const char *address)
 	uv->direct_io = direct_io != 0;
 	uv->block_size = direct_io != 0 ? direct_io : 4096;
 
-	rv = uvMaintenance(uv->dir, io->errmsg);
+	rv = uvMaintenance(uv->dir, &uv->recycle_count, io->errmsg);
 	if (rv != 0) {
 		return rv;
 	}
@@ -384,7 +392,7 @@ static int uvLoadSnapshotAndEntries(struct uv *uv,
 			rv = RAFT_NOMEM;
 			goto err;
 		}
-		rv = UvSnapshotLoad(uv, &snapshots[n_snapshots - 1], *snapshot,
+		rv = UvSnapshotLoad(uv, snapshots, n_snapshots, *snapshot,
 				    uv->io->errmsg);
 		if (rv != 0) {
 			tracef("snapshot load failed: %d", rv);
@@ -708,11 +716,16 @@ int raft_uv_init(struct raft_io *io,
 #else
 	uv->snapshot_compression = false;
 #endif
+	uv->snapshot_chunks = false;
+	uv->entries_compression = 0;
 	uv->segment_size = UV__MAX_SEGMENT_SIZE;
 	uv->block_size = 0;
 	queue_init(&uv->clients);
 	queue_init(&uv->servers);
 	uv->connect_retry_delay = CONNECT_RETRY_DELAY;
+	uv->prepare_target = UV__PREPARED_SEGMENTS;
+	uv->recycle_target = 0;
+	uv->recycle_count = 0;
 	uv->prepare_inflight = NULL;
 	queue_init(&uv->prepare_reqs);
 	queue_init(&uv->prepare_pool);
@@ -739,7 +752,7 @@ int raft_uv_init(struct raft_io *io,
 	uvSeedRand(uv);
 
 	/* Set the raft_io implementation. */
-	io->version = 3;
+	io->version = 4;
 	io->impl = uv;
 	io->init = uvInit;
 	io->close = uvClose;
@@ -759,6 +772,7 @@ int raft_uv_init(struct raft_io *io,
 	io->random = uvRandom;
 	io->timer_start = UvTimerStart;
 	io->timer_stop = UvTimerStop;
+	io->read_entries = UvReadEntries;
 
 	return 0;
 
@@ -785,6 +799,16 @@ void raft_uv_set_segment_size(struct raft_io *io, size_t size)
 	uv->segment_size = size;
 }
 
+void raft_uv_set_segment_pool(struct raft_io *io,
+			      unsigned prepared,
+			      unsigned recycled)
+{
+	struct uv *uv;
+	uv = io->impl;
+	uv->prepare_target = prepared > 0 ? prepared : 1;
+	uv->recycle_target = recycled;
+}
+
 void raft_uv_set_block_size(struct raft_io *io, size_t size)
 {
 	struct uv *uv;
@@ -805,6 +829,26 @@ int raft_uv_set_snapshot_compression(struct raft_io *io, bool compressed)
 	return 0;
 }
 
+void raft_uv_set_snapshot_chunks(struct raft_io *io, bool chunked)
+{
+	struct uv *uv;
+	uv = io->impl;
+	uv->snapshot_chunks = chunked;
+}
+
+int raft_uv_set_entries_compression(struct raft_io *io, size_t threshold)
+{
+	struct uv *uv;
+	uv = io->impl;
+#ifndef LZ4_AVAILABLE
+	if (threshold > 0) {
+		return RAFT_INVALID;
+	}
+#endif
+	uv->entries_compression = threshold;
+	return 0;
+}
+
 void raft_uv_set_connect_retry_delay(struct raft_io *io, unsigned msecs)
 {
 	struct uv *uv;
@@ -20,6 +20,17 @@
 /* Template string for open segment filenames: incrementing counter. */
 #define UV__OPEN_TEMPLATE "open-%llu"
 
+/* Prefix of retired closed segments kept around to be reused as open
+ * segments. */
+#define UV__RECYCLE_PREFIX "recycle-"
+
+/* Template string for recycled segment filenames: start and end index of the
+ * retired closed segment. */
+#define UV__RECYCLE_TEMPLATE UV__RECYCLE_PREFIX UV__CLOSED_TEMPLATE
+
+/* Default number of open segments that we try to keep ready for writing. */
+#define UV__PREPARED_SEGMENTS 2
+
 /* Enough to hold a segment filename (either open or closed) */
 #define UV__SEGMENT_FILENAME_BUF_SIZE 34
 
@@ -63,6 +74,8 @@ struct uv
 	raft_id id;                          /* Server ID */
 	int state;                           /* Current state */
 	bool snapshot_compression;           /* If compression is enabled */
+	bool snapshot_chunks; /* If snapshots are compressed in chunks */
+	size_t entries_compression; /* Min size of compressed batches, or 0 */
 	bool errored;                        /* If a disk I/O error was hit */
 	bool direct_io;                 /* Whether direct I/O is supported */
 	bool async_io;                  /* Whether async I/O is supported */
@@ -72,6 +85,9 @@ struct uv
 	queue clients;                  /* Outbound connections */
 	queue servers;                  /* Inbound connections */
 	unsigned connect_retry_delay;   /* Client connection retry delay */
+	unsigned prepare_target;        /* Target size of prepare_pool */
+	unsigned recycle_target;        /* Max number of recycled segments */
+	unsigned recycle_count;         /* Recycled segments on disk */
 	void *prepare_inflight;         /* Segment being prepared */
 	queue prepare_reqs;             /* Pending prepare requests. */
 	queue prepare_pool;             /* Prepared open segments */
@@ -145,12 +161,18 @@ void uvSegmentSort(struct uvSegmentInfo *infos, size_t n_infos);
 
 /* Keep only the closed segments whose entries are within the given trailing
  * amount past the given snapshot last index. If the given trailing amount is 0,
- * unconditionally delete all closed segments. */
+ * unconditionally delete all closed segments.
+ *
+ * Up to @recycle of the segments that are no longer needed are renamed into
+ * the recycled segments pool instead of being deleted, the number of segments
+ * actually recycled is stored in @n_recycled. */
 int uvSegmentKeepTrailing(struct uv *uv,
 			  struct uvSegmentInfo *segments,
 			  size_t n,
 			  raft_index last_index,
 			  size_t trailing,
+			  unsigned recycle,
+			  unsigned *n_recycled,
 			  char *errmsg);
 
 /* Load all entries contained in the given closed segment. */
@@ -168,6 +190,13 @@ int uvSegmentLoadAll(struct uv *uv,
 		     struct raft_entry **entries,
 		     size_t *n_entries);
 
+/* Implementation of raft_io->read_entries. The segment holding the entries is
+ * mapped in memory and parsed synchronously. */
+int UvReadEntries(struct raft_io *io,
+		  raft_index index,
+		  unsigned n,
+		  struct raft_entry entries[]);
+
 /* Return the number of blocks in a segments. */
 #define uvSegmentBlocks(UV) (UV->segment_size / UV->block_size)
 
@@ -178,8 +207,10 @@ int uvSegmentLoadAll(struct uv *uv,
 struct uvSegmentBuffer
 {
 	size_t block_size; /* Disk block size for direct I/O */
+	uint32_t seed;     /* Initial value of batch checksums */
 	uv_buf_t arena;    /* Previously allocated memory that can be re-used */
 	size_t n;          /* Write offset */
+	size_t compression_threshold; /* Min size of compressed batches */
 };
 
 /* Initialize an empty buffer. */
@@ -189,8 +220,13 @@ void uvSegmentBufferInit(struct uvSegmentBuffer *b, size_t block_size);
 void uvSegmentBufferClose(struct uvSegmentBuffer *b);
 
 /* Encode the format version at the very beginning of the buffer. This function
- * must be called when the buffer is empty. */
-int uvSegmentBufferFormat(struct uvSegmentBuffer *b);
+ * must be called when the buffer is empty.
+ *
+ * If @salt is not zero, the segment is encoded using the salted format, which
+ * is used for recycled segments: the salt is written after the format version
+ * and used to seed the checksums of all batches, so stale batches left in the
+ * file by its previous use can't be mistaken for valid ones. */
+int uvSegmentBufferFormat(struct uvSegmentBuffer *b, uint64_t salt);
 
 /* Extend the segment's buffer by encoding the given entries.
  *
@@ -262,9 +298,11 @@ int UvSnapshotInfoAppendIfMatch(struct uv *uv,
  * snapshots will come first. */
 void UvSnapshotSort(struct uvSnapshotInfo *infos, size_t n_infos);
 
-/* Load the snapshot associated with the given metadata. */
+/* Load the most recent of the given sorted snapshots. If it's incremental, the
+ * data of all the snapshots it depends on is loaded too. */
 int UvSnapshotLoad(struct uv *uv,
-		   struct uvSnapshotInfo *meta,
+		   struct uvSnapshotInfo *infos,
+		   size_t n_infos,
 		   struct raft_snapshot *snapshot,
 		   char *errmsg);
 
@@ -303,18 +341,23 @@ struct uvPrepare
 	void *data;                 /* User data */
 	uv_file fd;                 /* Resulting segment file descriptor */
 	unsigned long long counter; /* Resulting segment counter */
+	uint64_t salt;              /* Resulting segment salt, if recycled */
 	uvPrepareCb cb;             /* Completion callback */
 	queue queue;                /* Links in uv_io->prepare_reqs */
 };
 
 /* Get a prepared open segment ready for writing. If a prepared open segment is
- * already available in the pool, it will be returned immediately using the fd
- * and counter pointers and the request callback won't be invoked. Otherwise the
- * request will be queued and its callback invoked once a newly prepared segment
- * is available. */
+ * already available in the pool, it will be returned immediately using the fd,
+ * counter and salt pointers and the request callback won't be invoked.
+ * Otherwise the request will be queued and its callback invoked once a newly
+ * prepared segment is available.
+ *
+ * The salt is zero for freshly allocated segments and non-zero for recycled
+ * ones, see uvSegmentBufferFormat(). */
 int UvPrepare(struct uv *uv,
 	      uv_file *fd,
 	      uvCounter *counter,
+	      uint64_t *salt,
 	      struct uvPrepare *req,
 	      uvPrepareCb cb);
 
@@ -402,6 +445,21 @@ int UvFinalize(struct uv *uv,
 	       raft_index first_index,
 	       raft_index last_index);
 
+/* Look for the open segment in use that holds the entry with the given index,
+ * and if found return its counter and the index of its first entry. */
+bool UvAppendLookup(struct uv *uv,
+		    raft_index index,
+		    uvCounter *counter,
+		    raft_index *first_index);
+
+/* Look for an open segment being finalized that holds the entry with the given
+ * index, and if found return its counter and the range of its entries. */
+bool UvFinalizeLookup(struct uv *uv,
+		      raft_index index,
+		      uvCounter *counter,
+		      raft_index *first_index,
+		      raft_index *last_index);
+
 /* Implementation of raft_io->send. */
 int UvSend(struct raft_io *io,
 	   struct raft_io_send *req,
@@ -79,6 +79,7 @@ struct uvAliveSegment
 	struct UvWriter writer;         /* Writer to perform async I/O */
 	struct UvWriterReq write;       /* Write request */
 	unsigned long long counter;     /* Open segment counter */
+	uint64_t salt;                  /* Salt of a recycled segment, or 0 */
 	raft_index first_index;         /* Index of the first entry written */
 	raft_index pending_last_index;  /* Index of the last entry written */
 	size_t size;                    /* Total number of bytes used */
@@ -210,7 +211,7 @@ static int uvAliveSegmentEncodeEntriesToWriteBuf(struct uvAliveSegment *segment,
 	/* If this is the very first write to the segment, we need to include
 	 * the format version */
 	if (segment->pending.n == 0 && segment->next_block == 0) {
-		rv = uvSegmentBufferFormat(&segment->pending);
+		rv = uvSegmentBufferFormat(&segment->pending, segment->salt);
 		if (rv != 0) {
 			return rv;
 		}
@@ -477,6 +478,7 @@ err:
 static int uvAliveSegmentReady(struct uv *uv,
 			       uv_file fd,
 			       uvCounter counter,
+			       uint64_t salt,
 			       struct uvAliveSegment *segment)
 {
 	int rv;
@@ -488,6 +490,7 @@ static int uvAliveSegmentReady(struct uv *uv,
 		return rv;
 	}
 	segment->counter = counter;
+	segment->salt = salt;
 	return 0;
 }
 
@@ -523,7 +526,8 @@ static void uvAliveSegmentPrepareCb(struct uvPrepare *req, int status)
 	 * requests. */
 	assert(!queue_empty(&uv->append_pending_reqs));
 
-	rv = uvAliveSegmentReady(uv, req->fd, req->counter, segment);
+	rv = uvAliveSegmentReady(uv, req->fd, req->counter, req->salt,
+				 segment);
 	if (rv != 0) {
 		tracef("prepare segment ready failed (%d)", rv);
 		goto err;
@@ -552,12 +556,17 @@ static void uvAliveSegmentInit(struct uvAliveSegment *s, struct uv *uv)
 	s->writer.data = s;
 	s->write.data = s;
 	s->counter = 0;
+	s->salt = 0;
 	s->first_index = uv->append_next_index;
 	s->pending_last_index = s->first_index - 1;
 	s->last_index = 0;
 	s->size = sizeof(uint64_t) /* Format version */;
+	if (uv->recycle_target > 0) {
+		s->size += sizeof(uint64_t) /* Salt of recycled segments */;
+	}
 	s->next_block = 0;
 	uvSegmentBufferInit(&s->pending, uv->block_size);
+	s->pending.compression_threshold = uv->entries_compression;
 	s->written = 0;
 	s->barrier = NULL;
 	s->finalize = false;
@@ -571,6 +580,7 @@ static int uvAppendPushAliveSegment(struct uv *uv)
 	struct uvAliveSegment *segment;
 	uv_file fd;
 	uvCounter counter;
+	uint64_t salt;
 	int rv;
 
 	segment = RaftHeapMalloc(sizeof *segment);
@@ -582,7 +592,7 @@ static int uvAppendPushAliveSegment(struct uv *uv)
 
 	queue_insert_tail(&uv->append_segments, &segment->queue);
 
-	rv = UvPrepare(uv, &fd, &counter, &segment->prepare,
+	rv = UvPrepare(uv, &fd, &counter, &salt, &segment->prepare,
 		       uvAliveSegmentPrepareCb);
 	if (rv != 0) {
 		goto err_after_alloc;
@@ -591,7 +601,7 @@ static int uvAppendPushAliveSegment(struct uv *uv)
 	/* If we've been returned a ready prepared segment right away, start
 	 * writing to it immediately. */
 	if (fd != -1) {
-		rv = uvAliveSegmentReady(uv, fd, counter, segment);
+		rv = uvAliveSegmentReady(uv, fd, counter, salt, segment);
 		if (rv != 0) {
 			goto err_after_prepare;
 		}
@@ -637,12 +647,13 @@ static void uvAliveSegmentReserveSegmentCapacity(struct uvAliveSegment *s,
 }
 
 /* Return the number of bytes needed to store the batch of entries of this
- * append request on disk. */
+ * append request on disk. A compressed batch is only ever stored if it's
+ * smaller, so this is an upper bound. */
 static size_t uvAppendSize(struct uvAppend *a)
 {
 	size_t size = sizeof(uint32_t) * 2; /* CRC checksums */
 	unsigned i;
-	size += uvSizeofBatchHeader(a->n); /* Batch header */
+	size += uvSizeofBatchHeader(a->n, false); /* Batch header */
 	for (i = 0; i < a->n; i++) {       /* Entries data */
 		size += bytePad64(a->entries[i].buf.len);
 	}
@@ -817,6 +828,29 @@ static void uvFinalizeCurrentAliveSegmentOnceIdle(struct uv *uv)
 	}
 }
 
+bool UvAppendLookup(struct uv *uv,
+		    raft_index index,
+		    uvCounter *counter,
+		    raft_index *first_index)
+{
+	queue *head;
+	QUEUE_FOREACH(head, &uv->append_segments)
+	{
+		struct uvAliveSegment *segment;
+		segment = QUEUE_DATA(head, struct uvAliveSegment, queue);
+		if (segment->counter == 0 || segment->last_index == 0) {
+			continue;
+		}
+		if (index >= segment->first_index &&
+		    index <= segment->last_index) {
+			*counter = segment->counter;
+			*first_index = segment->first_index;
+			return true;
+		}
+	}
+	return false;
+}
+
 bool UvBarrierReady(struct uv *uv)
 {
 	if (uv->barrier == NULL) {
@@ -6,7 +6,9 @@
 #include "../raft.h"
 #include "assert.h"
 #include "byte.h"
+#include "compress.h"
 #include "configuration.h"
+#include "heap.h"
 
 /**
  * Size of the request preamble.
@@ -42,15 +44,15 @@ static size_t sizeofRequestVoteResult(void)
 	       sizeof(uint64_t) /* Flags. */;
 }
 
-static size_t sizeofAppendEntries(const struct raft_append_entries *p)
+static size_t sizeofAppendEntries(const struct raft_append_entries *p,
+				  bool compressed)
 {
 	return sizeof(uint64_t) + /* Leader's term. */
 	       sizeof(uint64_t) + /* Leader ID */
 	       sizeof(uint64_t) + /* Previous log entry index */
 	       sizeof(uint64_t) + /* Previous log entry term */
 	       sizeof(uint64_t) + /* Leader's commit index */
-	       sizeof(uint64_t) + /* Number of entries in the batch */
-	       16 * p->n_entries /* One header per entry */;
+	       uvSizeofBatchHeader(p->n_entries, compressed);
 }
 
 static size_t sizeofAppendEntriesResultV0(void)
@@ -60,12 +62,19 @@ static size_t sizeofAppendEntriesResultV0(void)
 	       sizeof(uint64_t) /* Last log index. */;
 }
 
-static size_t sizeofAppendEntriesResult(void)
+static size_t sizeofAppendEntriesResultV1(void)
 {
 	return sizeofAppendEntriesResultV0() +
 	       sizeof(uint64_t) /* 64 bit Flags. */;
 }
 
+static size_t sizeofAppendEntriesResult(void)
+{
+	return sizeofAppendEntriesResultV1() +
+	       sizeof(uint64_t) + /* Failure domain. */
+	       sizeof(uint64_t) /* Weight. */;
+}
+
 static size_t sizeofInstallSnapshot(const struct raft_install_snapshot *p)
 {
 	size_t conf_size = configurationEncodedSize(&p->conf);
@@ -86,10 +95,13 @@ static size_t sizeofTimeoutNow(void)
 	       sizeof(uint64_t) /* Last log term. */;
 }
 
-size_t uvSizeofBatchHeader(size_t n)
+size_t uvSizeofBatchHeader(size_t n, bool compressed)
 {
 	size_t res = 8 + /* Number of entries in the batch, little endian */
 		16 * n; /* One header per entry */;
+	if (compressed) {
+		res += 8; /* Size of the compressed data */
+	}
 	return res;
 }
 
@@ -127,7 +139,9 @@ static void encodeRequestVoteResult(const struct raft_request_vote_result *p,
 	bytePut64(&cursor, flags);
 }
 
-static void encodeAppendEntries(const struct raft_append_entries *p, void *buf)
+static void encodeAppendEntries(const struct raft_append_entries *p,
+				size_t compressed_len,
+				void *buf)
 {
 	void *cursor;
 
@@ -138,7 +152,7 @@ static void encodeAppendEntries(const struct raft_append_entries *p, void *buf)
 	bytePut64(&cursor, p->prev_log_term);  /* Previous term. */
 	bytePut64(&cursor, p->leader_commit);  /* Commit index. */
 
-	uvEncodeBatchHeader(p->entries, p->n_entries, cursor);
+	uvEncodeBatchHeader(p->entries, p->n_entries, compressed_len, cursor);
 }
 
 static void encodeAppendEntriesResult(
@@ -151,6 +165,8 @@ static void encodeAppendEntriesResult(
 	bytePut64(&cursor, p->rejected);
 	bytePut64(&cursor, p->last_log_index);
 	bytePut64(&cursor, p->features);
+	bytePut64(&cursor, p->failure_domain);
+	bytePut64(&cursor, p->weight);
 }
 
 static void encodeInstallSnapshot(const struct raft_install_snapshot *p,
@@ -180,12 +196,51 @@ static void encodeTimeoutNow(const struct raft_timeout_now *p, void *buf)
 	bytePut64(&cursor, p->last_log_term);
 }
 
+/* Compress the entries of an AppendEntries message right after its header,
+ * which is then grown to include them. Leave the header untouched if the
+ * entries are not worth compressing. */
+static int encodeAppendEntriesCompressed(const struct raft_append_entries *p,
+					 size_t threshold,
+					 uv_buf_t *header,
+					 size_t *compressed_len)
+{
+	size_t bound;
+	size_t offset;
+	void *base;
+
+	*compressed_len = 0;
+	if (threshold == 0 || p->version < 1 || p->n_entries == 0) {
+		return 0;
+	}
+	bound = uvCompressEntriesBound(p->entries, p->n_entries);
+	if (bound == 0) {
+		return 0;
+	}
+
+	/* The compressed header is one word larger than the plain one. */
+	offset = header->len + sizeof(uint64_t);
+	base = raft_realloc(header->base, offset + bound);
+	if (base == NULL) {
+		return RAFT_NOMEM;
+	}
+	header->base = base;
+	*compressed_len = uvCompressEntriesBatch(
+	    p->entries, p->n_entries, threshold, (uint8_t *)base + offset);
+	if (*compressed_len > 0) {
+		header->len = offset;
+	}
+	return 0;
+}
+
 int uvEncodeMessage(const struct raft_message *message,
+		    size_t compression_threshold,
 		    uv_buf_t **bufs,
 		    unsigned *n_bufs)
 {
 	uv_buf_t header;
+	size_t compressed_len = 0;
 	void *cursor;
+	int rv;
 
 	/* Figure out the length of the header for this request and allocate a
 	 * buffer for it. */
@@ -198,8 +253,8 @@ int uvEncodeMessage(const struct raft_message *message,
 			header.len += sizeofRequestVoteResult();
 			break;
 		case RAFT_IO_APPEND_ENTRIES:
-			header.len +=
-			    sizeofAppendEntries(&message->append_entries);
+			header.len += sizeofAppendEntries(
+			    &message->append_entries, false);
 			break;
 		case RAFT_IO_APPEND_ENTRIES_RESULT:
 			header.len += sizeofAppendEntriesResult();
@@ -220,6 +275,17 @@ int uvEncodeMessage(const struct raft_message *message,
 		goto oom;
 	}
 
+	/* If the entries get compressed, the compressed data is placed right
+	 * after the header, in the same buffer. */
+	if (message->type == RAFT_IO_APPEND_ENTRIES) {
+		rv = encodeAppendEntriesCompressed(&message->append_entries,
+						   compression_threshold,
+						   &header, &compressed_len);
+		if (rv != 0) {
+			goto oom_after_header_alloc;
+		}
+	}
+
 	cursor = header.base;
 
 	/* Encode the request preamble, with message type and message size. */
@@ -236,7 +302,8 @@ int uvEncodeMessage(const struct raft_message *message,
 						cursor);
 			break;
 		case RAFT_IO_APPEND_ENTRIES:
-			encodeAppendEntries(&message->append_entries, cursor);
+			encodeAppendEntries(&message->append_entries,
+					    compressed_len, cursor);
 			break;
 		case RAFT_IO_APPEND_ENTRIES_RESULT:
 			encodeAppendEntriesResult(
@@ -253,8 +320,9 @@ int uvEncodeMessage(const struct raft_message *message,
 
 	*n_bufs = 1;
 
-	/* For AppendEntries request we also send the entries payload. */
-	if (message->type == RAFT_IO_APPEND_ENTRIES) {
+	/* For AppendEntries request we also send the entries payload, unless
+	 * it was compressed along with the header. */
+	if (message->type == RAFT_IO_APPEND_ENTRIES && compressed_len == 0) {
 		*n_bufs += message->append_entries.n_entries;
 	}
 
@@ -269,8 +337,9 @@ int uvEncodeMessage(const struct raft_message *message,
 	}
 
 	(*bufs)[0] = header;
+	(*bufs)[0].len += compressed_len;
 
-	if (message->type == RAFT_IO_APPEND_ENTRIES) {
+	if (message->type == RAFT_IO_APPEND_ENTRIES && compressed_len == 0) {
 		unsigned i;
 		for (i = 0; i < message->append_entries.n_entries; i++) {
 			const struct raft_entry *entry =
@@ -296,13 +365,19 @@ oom:
 
 void uvEncodeBatchHeader(const struct raft_entry *entries,
 			 unsigned n,
+			 size_t compressed_len,
 			 void *buf)
 {
 	unsigned i;
 	void *cursor = buf;
 
 	/* Number of entries in the batch, little endian */
-	bytePut64(&cursor, n);
+	if (compressed_len > 0) {
+		bytePut64(&cursor, n | UV__BATCH_COMPRESSED);
+		bytePut64(&cursor, compressed_len);
+	} else {
+		bytePut64(&cursor, n);
+	}
 
 	for (i = 0; i < n; i++) {
 		const struct raft_entry *entry = &entries[i];
@@ -364,13 +439,24 @@ static void decodeRequestVoteResult(const uv_buf_t *buf,
 
 int uvDecodeBatchHeader(const void *batch,
 			struct raft_entry **entries,
-			unsigned *n)
+			unsigned *n,
+			size_t *compressed_len)
 {
 	const void *cursor = batch;
+	uint64_t count;
 	size_t i;
 	int rv;
 
-	*n = (unsigned)byteGet64(&cursor);
+	count = byteGet64(&cursor);
+	*compressed_len = 0;
+	if (count & UV__BATCH_COMPRESSED) {
+		count &= ~UV__BATCH_COMPRESSED;
+		*compressed_len = (size_t)byteGet64(&cursor);
+		if (*compressed_len == 0) {
+			return RAFT_MALFORMED;
+		}
+	}
+	*n = (unsigned)count;
 
 	if (*n == 0) {
 		*entries = NULL;
@@ -415,7 +501,8 @@ err:
 }
 
 static int decodeAppendEntries(const uv_buf_t *buf,
-			       struct raft_append_entries *args)
+			       struct raft_append_entries *args,
+			       size_t *compressed_len)
 {
 	const void *cursor;
 	int rv;
@@ -431,11 +518,17 @@ static int decodeAppendEntries(const uv_buf_t *buf,
 	args->prev_log_term = byteGet64(&cursor);
 	args->leader_commit = byteGet64(&cursor);
 
-	rv = uvDecodeBatchHeader(cursor, &args->entries, &args->n_entries);
+	rv = uvDecodeBatchHeader(cursor, &args->entries, &args->n_entries,
+				 compressed_len);
 	if (rv != 0) {
 		return rv;
 	}
 
+	/* Compressed entries can only have been sent with version 1. */
+	if (*compressed_len > 0) {
+		args->version = 1;
+	}
+
 	return 0;
 }
 
@@ -451,10 +544,17 @@ static void decodeAppendEntriesResult(const uv_buf_t *buf,
 	p->rejected = byteGet64(&cursor);
 	p->last_log_index = byteGet64(&cursor);
 	p->features = 0;
+	p->failure_domain = 0;
+	p->weight = 0;
 	if (buf->len > sizeofAppendEntriesResultV0()) {
 		p->version = 1;
 		p->features = byteGet64(&cursor);
 	}
+	if (buf->len >= sizeofAppendEntriesResult()) {
+		p->version = 2;
+		p->failure_domain = byteGet64(&cursor);
+		p->weight = byteGet64(&cursor);
+	}
 }
 
 static int decodeInstallSnapshot(const uv_buf_t *buf,
@@ -504,6 +604,7 @@ int uvDecodeMessage(uint16_t type,
 		    struct raft_message *message,
 		    size_t *payload_len)
 {
+	size_t compressed_len;
 	unsigned i;
 	int rv = 0;
 
@@ -522,8 +623,15 @@ int uvDecodeMessage(uint16_t type,
 						&message->request_vote_result);
 			break;
 		case RAFT_IO_APPEND_ENTRIES:
-			rv = decodeAppendEntries(header,
-						 &message->append_entries);
+			rv = decodeAppendEntries(
+			    header, &message->append_entries, &compressed_len);
+			if (rv != 0) {
+				break;
+			}
+			if (compressed_len > 0) {
+				*payload_len = compressed_len;
+				break;
+			}
 			for (i = 0; i < message->append_entries.n_entries;
 			     i++) {
 				*payload_len +=
@@ -576,3 +684,98 @@ int uvDecodeEntriesBatch(uint8_t *batch,
 	}
 	return 0;
 }
+
+size_t uvCompressEntriesBound(const struct raft_entry *entries, unsigned n)
+{
+	size_t size = 0;
+	unsigned i;
+
+	for (i = 0; i < n; i++) {
+		size += entries[i].buf.len;
+	}
+	return CompressBound(size);
+}
+
+size_t uvCompressEntriesBatch(const struct raft_entry *entries,
+			      unsigned n,
+			      size_t threshold,
+			      void *buf)
+{
+	struct raft_buffer *bufs;
+	size_t size = 0;
+	size_t len;
+	char errmsg[RAFT_ERRMSG_BUF_SIZE];
+	unsigned i;
+	int rv;
+
+	for (i = 0; i < n; i++) {
+		/* The decompressed data must keep the 8-byte alignment of the
+		 * entries, which is then only guaranteed without padding. */
+		if (entries[i].buf.len % sizeof(uint64_t) != 0) {
+			return 0;
+		}
+		size += entries[i].buf.len;
+	}
+	if (threshold == 0 || size < threshold) {
+		return 0;
+	}
+
+	bufs = raft_malloc(n * sizeof *bufs);
+	if (bufs == NULL) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		bufs[i] = entries[i].buf;
+	}
+	rv = CompressInto(bufs, n, buf, uvCompressEntriesBound(entries, n),
+			  &len, errmsg);
+	raft_free(bufs);
+	if (rv != 0) {
+		return 0;
+	}
+
+	/* The compressed data comes with one more header word. */
+	if (bytePad64(len) + sizeof(uint64_t) >= size) {
+		return 0;
+	}
+	return len;
+}
+
+int uvDecompressEntriesBatch(const void *data,
+			     size_t len,
+			     struct raft_entry *entries,
+			     unsigned n,
+			     uint8_t **batch)
+{
+	struct raft_buffer buf;
+	size_t size = 0;
+	char errmsg[RAFT_ERRMSG_BUF_SIZE];
+	unsigned i;
+	int rv;
+
+	for (i = 0; i < n; i++) {
+		if (entries[i].buf.len % sizeof(uint64_t) != 0) {
+			return RAFT_MALFORMED;
+		}
+		size += entries[i].buf.len;
+	}
+	if (size == 0) {
+		return RAFT_MALFORMED;
+	}
+
+	*batch = RaftHeapMalloc(size);
+	if (*batch == NULL) {
+		return RAFT_NOMEM;
+	}
+
+	buf.base = (void *)data;
+	buf.len = len;
+	rv = DecompressInto(buf, *batch, size, errmsg);
+	if (rv != 0) {
+		RaftHeapFree(*batch);
+		*batch = NULL;
+		return RAFT_MALFORMED;
+	}
+
+	return uvDecodeEntriesBatch(*batch, 0, entries, n);
+}
@@ -10,7 +10,23 @@
 /* Current disk format version. */
 #define UV__DISK_FORMAT 1
 
+/* Format version of recycled open segments: the format version is followed by
+ * a 64-bit salt, whose lower 32 bits seed the checksums of every batch. */
+#define UV__DISK_FORMAT_SALTED 2
+
+/* Format version of the metadata of incremental snapshots, whose data only
+ * makes sense on top of the snapshot preceding them. */
+#define UV__DISK_FORMAT_INCREMENTAL 3
+
+/* Flag set in the entries count of a batch header when the data of the batch
+ * is compressed. */
+#define UV__BATCH_COMPRESSED ((uint64_t)1 << 63)
+
+/* Encode the given message. The entries of AppendEntries messages with version
+ * 1 or greater are compressed if their data is at least @compression_threshold
+ * bytes large, unless @compression_threshold is 0. */
 int uvEncodeMessage(const struct raft_message *message,
+		    size_t compression_threshold,
 		    uv_buf_t **bufs,
 		    unsigned *n_bufs);
 
@@ -19,15 +35,27 @@ int uvDecodeMessage(uint16_t type,
 		    struct raft_message *message,
 		    size_t *payload_len);
 
+/* Decode the given batch header, allocating the entries array. If the batch
+ * data is compressed, its size is returned in @compressed_len, which is set to
+ * 0 otherwise. */
 int uvDecodeBatchHeader(const void *batch,
 			struct raft_entry **entries,
-			unsigned *n);
+			unsigned *n,
+			size_t *compressed_len);
 
 int uvDecodeEntriesBatch(uint8_t *batch,
 			 size_t offset,
 			 struct raft_entry *entries,
 			 unsigned n);
 
+/* Decompress the @len bytes of compressed batch data held in @data into a newly
+ * allocated batch, returned in @batch, and make @entries point to it. */
+int uvDecompressEntriesBatch(const void *data,
+			     size_t len,
+			     struct raft_entry *entries,
+			     unsigned n,
+			     uint8_t **batch);
+
 /**
  * The layout of the memory pointed at by a @batch pointer is the following:
  *
@@ -49,11 +77,33 @@ int uvDecodeEntriesBatch(uint8_t *batch,
  * A payload data section for an entry is simply a sequence of bytes of
  * arbitrary lengths, possibly padded with extra bytes to reach 8-byte boundary
  * (which means that all entry data pointers are 8-byte aligned).
+ *
+ * If the number of entries has the UV__BATCH_COMPRESSED flag set, it is
+ * followed by 8 more bytes holding the size of the compressed data, and the
+ * payload data sections of all entries are replaced by a single LZ4 frame
+ * holding them. The sizes in the entry headers are still the uncompressed
+ * ones.
  */
-size_t uvSizeofBatchHeader(size_t n);
+size_t uvSizeofBatchHeader(size_t n, bool compressed);
 
+/* Encode the header of a batch, whose data is compressed into @compressed_len
+ * bytes, or not compressed if @compressed_len is 0. */
 void uvEncodeBatchHeader(const struct raft_entry *entries,
 			 unsigned n,
+			 size_t compressed_len,
 			 void *buf);
 
+/* Return the size of the buffer needed by uvCompressEntriesBatch. */
+size_t uvCompressEntriesBound(const struct raft_entry *entries, unsigned n);
+
+/* Compress the data of the given entries into @buf, which must be at least
+ * uvCompressEntriesBound() bytes large, and return the size of the compressed
+ * data. Return 0 if the data is smaller than @threshold, if compressing it
+ * doesn't save space or if it can't be compressed at all, in which case the
+ * batch should be encoded uncompressed. */
+size_t uvCompressEntriesBatch(const struct raft_entry *entries,
+			      unsigned n,
+			      size_t threshold,
+			      void *buf);
+
 #endif /* UV_ENCODING_H_ */
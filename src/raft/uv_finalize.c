@@ -132,6 +132,46 @@ static int uvFinalizeStart(struct uvDyingSegment *segment)
 	return 0;
 }
 
+/* Return true if the given dying segment holds the entry with the given
+ * index. */
+static bool uvDyingSegmentHolds(const struct uvDyingSegment *segment,
+				raft_index index)
+{
+	return segment->used > 0 && index >= segment->first_index &&
+	       index <= segment->last_index;
+}
+
+bool UvFinalizeLookup(struct uv *uv,
+		      raft_index index,
+		      uvCounter *counter,
+		      raft_index *first_index,
+		      raft_index *last_index)
+{
+	struct uvDyingSegment *segment = uv->finalize_work.data;
+	queue *head;
+
+	if (segment == NULL || !uvDyingSegmentHolds(segment, index)) {
+		segment = NULL;
+		QUEUE_FOREACH(head, &uv->finalize_reqs)
+		{
+			struct uvDyingSegment *s;
+			s = QUEUE_DATA(head, struct uvDyingSegment, queue);
+			if (uvDyingSegmentHolds(s, index)) {
+				segment = s;
+				break;
+			}
+		}
+	}
+	if (segment == NULL) {
+		return false;
+	}
+
+	*counter = segment->counter;
+	*first_index = segment->first_index;
+	*last_index = segment->last_index;
+	return true;
+}
+
 int UvFinalize(struct uv *uv,
 	       unsigned long long counter,
 	       size_t used,
@@ -1,7 +1,9 @@
 #include "uv_fs.h"
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 
@@ -275,26 +277,132 @@ err:
 	return rv;
 }
 
-static int uvFsWriteFile(const char *dir,
-			 const char *filename,
-			 int flags,
-			 struct raft_buffer *bufs,
-			 unsigned n_bufs,
-			 char *errmsg)
+int UvFsReuseFile(const char *dir,
+		  const char *filename1,
+		  const char *filename2,
+		  size_t size,
+		  struct raft_buffer *header,
+		  UvFsHeaderCb cb,
+		  void *arg,
+		  uv_file *fd,
+		  bool fallocate,
+		  char *errmsg)
 {
-	uv_file fd;
+	char path1[UV__PATH_SZ];
+	char path2[UV__PATH_SZ];
+	uv_buf_t buf;
+	off_t current;
 	int rv;
+
+	rv = UvOsJoin(dir, filename1, path1);
+	if (rv != 0) {
+		return RAFT_INVALID;
+	}
+	rv = UvOsJoin(dir, filename2, path2);
+	if (rv != 0) {
+		return RAFT_INVALID;
+	}
+
+	rv = UvFsFileSize(dir, filename1, &current, errmsg);
+	if (rv != 0) {
+		return rv;
+	}
+
+	/* TODO: use RWF_DSYNC instead, if available. */
+	rv = UvOsOpen(path1, O_RDWR | O_DSYNC, 0, fd);
+	if (rv != 0) {
+		UvOsErrMsg(errmsg, "open", rv);
+		return RAFT_IOERR;
+	}
+
+	if ((size_t)current < header->len) {
+		memset(header->base, 0, header->len);
+	} else {
+		rv = UvFsReadInto(*fd, header, errmsg);
+		if (rv != 0) {
+			goto err_after_open;
+		}
+	}
+
+	/* Only allocate the missing tail, without touching existing data. */
+	if ((size_t)current < size) {
+		if (fallocate) {
+			rv = UvOsFallocate(*fd, current,
+					   (off_t)size - current);
+		} else {
+			rv = UvOsFallocateEmulation(*fd, current,
+						    (off_t)size - current);
+		}
+		if (rv == UV_ENOSPC) {
+			ErrMsgPrintf(errmsg,
+				     "not enough space to allocate %zu bytes",
+				     size);
+			rv = RAFT_NOSPACE;
+			goto err_after_open;
+		} else if (rv != 0) {
+			UvOsErrMsg(errmsg, "posix_allocate", rv);
+			rv = RAFT_IOERR;
+			goto err_after_open;
+		}
+	}
+
+	/* Overwrite the old header before the file shows up under its new
+	 * name, otherwise a crash before the first write would leave the old
+	 * content looking valid. */
+	cb(header, arg);
+	buf.base = header->base;
+	buf.len = header->len;
+	rv = UvOsWrite(*fd, &buf, 1, 0);
+	if (rv != (int)buf.len) {
+		if (rv < 0) {
+			UvOsErrMsg(errmsg, "write", rv);
+		} else {
+			ErrMsgPrintf(errmsg,
+				     "short write: %d only bytes written", rv);
+		}
+		rv = RAFT_IOERR;
+		goto err_after_open;
+	}
+	rv = UvOsFsync(*fd);
+	if (rv != 0) {
+		UvOsErrMsg(errmsg, "fsync", rv);
+		rv = RAFT_IOERR;
+		goto err_after_open;
+	}
+
+	rv = UvOsRename(path1, path2);
+	if (rv != 0) {
+		UvOsErrMsg(errmsg, "rename", rv);
+		rv = RAFT_IOERR;
+		goto err_after_open;
+	}
+
+	return 0;
+
+err_after_open:
+	UvOsClose(*fd);
+	*fd = -1;
+	assert(rv != 0);
+	return rv;
+}
+
+struct uvFsBufs
+{
+	struct raft_buffer *bufs;
+	unsigned n_bufs;
+};
+
+static int uvFsWriteBufs(uv_file fd, void *arg, char *errmsg)
+{
+	struct uvFsBufs *b = arg;
 	size_t size;
 	unsigned i;
+	int rv;
 	size = 0;
-	for (i = 0; i < n_bufs; i++) {
-		size += bufs[i].len;
-	}
-	rv = uvFsOpenFile(dir, filename, flags, S_IRUSR | S_IWUSR, &fd, errmsg);
-	if (rv != 0) {
-		goto err;
+	for (i = 0; i < b->n_bufs; i++) {
+		size += b->bufs[i].len;
 	}
-	rv = UvOsWrite(fd, (const uv_buf_t *)bufs, n_bufs, 0);
+	rv = UvOsWrite(fd, (const uv_buf_t *)b->bufs, b->n_bufs, 0);
 	if (rv != (int)(size)) {
 		if (rv < 0) {
 			UvOsErrMsg(errmsg, "write", rv);
@@ -302,6 +410,26 @@ static int uvFsWriteFile(const char *dir,
 			ErrMsgPrintf(errmsg,
 				     "short write: %d only bytes written", rv);
 		}
+		return rv;
+	}
+	return 0;
+}
+
+static int uvFsWriteFile(const char *dir,
+			 const char *filename,
+			 int flags,
+			 UvFsWriteCb cb,
+			 void *arg,
+			 char *errmsg)
+{
+	uv_file fd;
+	int rv;
+	rv = uvFsOpenFile(dir, filename, flags, S_IRUSR | S_IWUSR, &fd, errmsg);
+	if (rv != 0) {
+		goto err;
+	}
+	rv = cb(fd, arg, errmsg);
+	if (rv != 0) {
 		goto err_after_file_open;
 	}
 	rv = UvOsFsync(fd);
@@ -327,6 +455,16 @@ int UvFsMakeFile(const char *dir,
 		 struct raft_buffer *bufs,
 		 unsigned n_bufs,
 		 char *errmsg)
+{
+	struct uvFsBufs b = {bufs, n_bufs};
+	return UvFsMakeFileWith(dir, filename, uvFsWriteBufs, &b, errmsg);
+}
+
+int UvFsMakeFileWith(const char *dir,
+		     const char *filename,
+		     UvFsWriteCb cb,
+		     void *arg,
+		     char *errmsg)
 {
 	int rv;
 	char tmp_filename[UV__FILENAME_LEN + 1] = {0};
@@ -341,7 +479,7 @@ int UvFsMakeFile(const char *dir,
 		return rv;
 	}
 	int flags = UV_FS_O_WRONLY | UV_FS_O_CREAT | UV_FS_O_EXCL;
-	rv = uvFsWriteFile(dir, tmp_filename, flags, bufs, n_bufs, errmsg);
+	rv = uvFsWriteFile(dir, tmp_filename, flags, cb, arg, errmsg);
 	if (rv != 0) {
 		goto err_after_tmp_create;
 	}
@@ -578,6 +716,57 @@ err:
 	return rv;
 }
 
+int UvFsMapFile(const char *dir,
+		const char *filename,
+		struct raft_buffer *buf,
+		char *errmsg)
+{
+	uv_stat_t sb;
+	char path[UV__PATH_SZ];
+	uv_file fd;
+	void *addr;
+	int rv;
+
+	rv = UvOsJoin(dir, filename, path);
+	if (rv != 0) {
+		return RAFT_INVALID;
+	}
+
+	rv = UvOsStat(path, &sb);
+	if (rv != 0) {
+		UvOsErrMsg(errmsg, "stat", rv);
+		return rv == UV_ENOENT ? RAFT_NOTFOUND : RAFT_IOERR;
+	}
+	if (sb.st_size == 0) {
+		ErrMsgPrintf(errmsg, "file is empty");
+		return RAFT_IOERR;
+	}
+
+	rv = uvFsOpenFile(dir, filename, O_RDONLY, 0, &fd, errmsg);
+	if (rv != 0) {
+		return rv;
+	}
+
+	addr = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	UvOsClose(fd);
+	if (addr == MAP_FAILED) {
+		UvOsErrMsg(errmsg, "mmap", -errno);
+		return RAFT_IOERR;
+	}
+
+	buf->base = addr;
+	buf->len = (size_t)sb.st_size;
+
+	return 0;
+}
+
+void UvFsUnmapFile(struct raft_buffer *buf)
+{
+	munmap(buf->base, buf->len);
+	buf->base = NULL;
+	buf->len = 0;
+}
+
 int UvFsRemoveFile(const char *dir, const char *filename, char *errmsg)
 {
 	char path[UV__PATH_SZ];
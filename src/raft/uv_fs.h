@@ -44,6 +44,25 @@ int UvFsAllocateFile(const char *dir,
 		     bool fallocate,
 		     char *errmsg);
 
+/* Callback replacing the first bytes of a reused file with new ones. */
+typedef void (*UvFsHeaderCb)(struct raft_buffer *header, void *arg);
+
+/* Rename the given existing file and make sure that at least the given size is
+ * allocated to it, returning its file descriptor. The current content of the
+ * file is not zeroed, except for its first @header->len bytes: they are read
+ * into @header (or zeroed if the file is shorter), passed to @cb to fill in the
+ * new ones, and written back and synced before the file is renamed. */
+int UvFsReuseFile(const char *dir,
+		  const char *filename1,
+		  const char *filename2,
+		  size_t size,
+		  struct raft_buffer *header,
+		  UvFsHeaderCb cb,
+		  void *arg,
+		  uv_file *fd,
+		  bool fallocate,
+		  char *errmsg);
+
 /* Create a file and write the given content into it. */
 int UvFsMakeFile(const char *dir,
 		 const char *filename,
@@ -51,6 +70,16 @@ int UvFsMakeFile(const char *dir,
 		 unsigned n_bufs,
 		 char *errmsg);
 
+/* Callback writing the content of a file created by UvFsMakeFileWith. */
+typedef int (*UvFsWriteCb)(uv_file fd, void *arg, char *errmsg);
+
+/* Create a file and let the given callback write its content. */
+int UvFsMakeFileWith(const char *dir,
+		     const char *filename,
+		     UvFsWriteCb cb,
+		     void *arg,
+		     char *errmsg);
+
 /* Create or overwrite a file.
  *
  * If the file does not exists yet, it gets created, the given content written
@@ -88,6 +117,16 @@ int UvFsReadFileInto(const char *dir,
 		     struct raft_buffer *buf,
 		     char *errmsg);
 
+/* Map all the content of the given file in memory, read-only. Return
+ * #RAFT_NOTFOUND if the file does not exist. */
+int UvFsMapFile(const char *dir,
+		const char *filename,
+		struct raft_buffer *buf,
+		char *errmsg);
+
+/* Release a mapping created by UvFsMapFile(). */
+void UvFsUnmapFile(struct raft_buffer *buf);
+
 /* Synchronously remove a file, calling the unlink() system call. */
 int UvFsRemoveFile(const char *dir, const char *filename, char *errmsg);
 
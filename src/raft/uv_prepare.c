@@ -2,8 +2,10 @@
 #include <unistd.h>
 
 #include "assert.h"
+#include "byte.h"
 #include "heap.h"
 #include "uv.h"
+#include "uv_encoding.h"
 #include "uv_os.h"
 
 /* The happy path for UvPrepare is:
@@ -15,6 +17,11 @@
  *   possibly kicking off the creation logic if no segment is being created
  *   currently.
  *
+ * - If closed segments were retired into the recycled pool, the new open segment
+ *   is created by renaming one of them and allocating only its missing tail,
+ *   instead of allocating and zeroing a brand new file. Such segments use the
+ *   salted disk format, so their stale content is never loaded back.
+ *
  * Possible failure modes are:
  *
  * - The create file request fails, in that case we fail all pending prepare
@@ -28,9 +35,6 @@
  *   created segment.
  */
 
-/* Number of open segments that we try to keep ready for writing. */
-#define UV__TARGET_POOL_SIZE 2
-
 /* An open segment being prepared or sitting in the pool */
 struct uvIdleSegment
 {
@@ -41,22 +45,114 @@ struct uvIdleSegment
 	char errmsg[RAFT_ERRMSG_BUF_SIZE]; /* Error of threadpool callback */
 	unsigned long long counter;        /* Segment counter */
 	char filename[UV__FILENAME_LEN];   /* Filename of the segment */
-	uv_file fd;  /* File descriptor of prepared file */
-	queue queue; /* Pool */
+	bool recycle;  /* Whether to try to reuse a recycled segment */
+	uint64_t salt; /* Salt of a reused segment, or 0 */
+	uv_file fd;    /* File descriptor of prepared file */
+	queue queue;   /* Pool */
 };
 
+/* Find the name of a segment in the recycled pool. */
+static bool uvPrepareFindRecycled(struct uv *uv, char *filename)
+{
+	struct uv_fs_s req;
+	struct uv_dirent_s entry;
+	bool found = false;
+	int n;
+	int i;
+
+	n = uv_fs_scandir(NULL, &req, uv->dir, 0, NULL);
+	if (n < 0) {
+		return false;
+	}
+	for (i = 0; i < n; i++) {
+		if (uv_fs_scandir_next(&req, &entry) != 0) {
+			break;
+		}
+		if (found || strlen(entry.name) >= UV__FILENAME_LEN) {
+			continue;
+		}
+		if (strncmp(entry.name, UV__RECYCLE_PREFIX,
+			    strlen(UV__RECYCLE_PREFIX)) == 0) {
+			strcpy(filename, entry.name);
+			found = true;
+		}
+	}
+	/* Reach the end of the list, so that libuv frees the last entry. */
+	if (i == n) {
+		uv_fs_scandir_next(&req, &entry);
+	}
+	uv_fs_req_cleanup(&req);
+	return found;
+}
+
+/* Write the header of a reused segment, picking a salt that differs from the
+ * one used by the previous incarnation of the file. */
+static void uvPrepareReuseHeader(struct raft_buffer *header, void *arg)
+{
+	struct uvIdleSegment *segment = arg;
+	uint64_t *words = header->base;
+	uint32_t old_seed = 0;
+
+	if (byteFlip64(words[0]) == UV__DISK_FORMAT_SALTED) {
+		old_seed = (uint32_t)byteFlip64(words[1]);
+	}
+
+	segment->salt = uv_hrtime() ^ ((uint64_t)segment->counter << 32);
+	while ((uint32_t)segment->salt == 0 ||
+	       (uint32_t)segment->salt == old_seed) {
+		segment->salt++;
+	}
+
+	words[0] = byteFlip64(UV__DISK_FORMAT_SALTED);
+	words[1] = byteFlip64(segment->salt);
+}
+
+/* Try to turn a segment from the recycled pool into the new open segment. */
+static int uvPrepareReuse(struct uvIdleSegment *segment)
+{
+	struct uv *uv = segment->uv;
+	char filename[UV__FILENAME_LEN];
+	uint64_t header[2];
+	struct raft_buffer buf = {.base = header, .len = sizeof header};
+	int rv;
+
+	if (!uvPrepareFindRecycled(uv, filename)) {
+		return RAFT_NOTFOUND;
+	}
+
+	rv = UvFsReuseFile(uv->dir, filename, segment->filename, segment->size,
+			   &buf, uvPrepareReuseHeader, segment, &segment->fd,
+			   uv->fallocate, segment->errmsg);
+	if (rv != 0) {
+		tracef("reuse %s: %s", filename, segment->errmsg);
+		segment->salt = 0;
+		return rv;
+	}
+
+	tracef("reuse %s as %s", filename, segment->filename);
+	return 0;
+}
+
 static void uvPrepareWorkCb(uv_work_t *work)
 {
 	struct uvIdleSegment *segment = work->data;
 	struct uv *uv = segment->uv;
 	int rv;
 
+	if (segment->recycle) {
+		rv = uvPrepareReuse(segment);
+		if (rv == 0) {
+			goto sync;
+		}
+	}
+
 	rv = UvFsAllocateFile(uv->dir, segment->filename, segment->size,
 			      &segment->fd, uv->fallocate, segment->errmsg);
 	if (rv != 0) {
 		goto err;
 	}
 
+sync:
 	rv = UvFsSyncDir(uv->dir, segment->errmsg);
 	if (rv != 0) {
 		goto err_after_allocate;
@@ -89,7 +185,10 @@ static void uvPrepareFinishAllRequests(struct uv *uv, int status)
 
 /* Pop the oldest prepared segment in the pool and return its fd and counter
  * through the given pointers. */
-static void uvPrepareConsume(struct uv *uv, uv_file *fd, uvCounter *counter)
+static void uvPrepareConsume(struct uv *uv,
+			     uv_file *fd,
+			     uvCounter *counter,
+			     uint64_t *salt)
 {
 	queue *head;
 	struct uvIdleSegment *segment;
@@ -100,6 +199,7 @@ static void uvPrepareConsume(struct uv *uv, uv_file *fd, uvCounter *counter)
 	queue_remove(&segment->queue);
 	*fd = segment->fd;
 	*counter = segment->counter;
+	*salt = segment->salt;
 	RaftHeapFree(segment);
 }
 
@@ -120,7 +220,7 @@ static void uvPrepareFinishOldestRequest(struct uv *uv)
 	queue_remove(&req->queue);
 
 	/* Finish the request */
-	uvPrepareConsume(uv, &req->fd, &req->counter);
+	uvPrepareConsume(uv, &req->fd, &req->counter, &req->salt);
 	req->cb(req, 0);
 }
 
@@ -146,7 +246,7 @@ static int uvPrepareStart(struct uv *uv)
 	int rv;
 
 	assert(uv->prepare_inflight == NULL);
-	assert(uvPrepareCount(uv) < UV__TARGET_POOL_SIZE);
+	assert(uvPrepareCount(uv) < uv->prepare_target);
 
 	segment = RaftHeapMalloc(sizeof *segment);
 	if (segment == NULL) {
@@ -159,6 +259,8 @@ static int uvPrepareStart(struct uv *uv)
 	segment->counter = uv->prepare_next_counter;
 	segment->work.data = segment;
 	segment->fd = -1;
+	segment->recycle = uv->recycle_target > 0 && uv->recycle_count > 0;
+	segment->salt = 0;
 	segment->size = uv->block_size * uvSegmentBlocks(uv);
 	sprintf(segment->filename, UV__OPEN_TEMPLATE, segment->counter);
 
@@ -196,6 +298,12 @@ static void uvPrepareAfterWorkCb(uv_work_t *work, int status)
 	uv->prepare_inflight =
 	    NULL; /* Reset the creation in-progress marker. */
 
+	/* Either a recycled segment was consumed, or the pool turned out to be
+	 * empty or unusable. */
+	if (segment->recycle && uv->recycle_count > 0) {
+		uv->recycle_count--;
+	}
+
 	/* If we are closing, let's discard the segment. All pending requests
 	 * have already being fired with RAFT_CANCELED. */
 	if (uv->closing) {
@@ -248,7 +356,7 @@ static void uvPrepareAfterWorkCb(uv_work_t *work, int status)
 	 * was not empty, we would have called uvPrepareFinishOldestRequest()
 	 * above, thus reducing the pool size and making it smaller than the
 	 * target size. */
-	if (uvPrepareCount(uv) >= UV__TARGET_POOL_SIZE) {
+	if (uvPrepareCount(uv) >= uv->prepare_target) {
 		assert(queue_empty(&uv->prepare_reqs));
 		return;
 	}
@@ -277,6 +385,7 @@ static void uvPrepareDiscard(struct uv *uv, uv_file fd, uvCounter counter)
 int UvPrepare(struct uv *uv,
 	      uv_file *fd,
 	      uvCounter *counter,
+	      uint64_t *salt,
 	      struct uvPrepare *req,
 	      uvPrepareCb cb)
 {
@@ -285,12 +394,13 @@ int UvPrepare(struct uv *uv,
 	assert(!uv->closing);
 
 	if (!queue_empty(&uv->prepare_pool)) {
-		uvPrepareConsume(uv, fd, counter);
+		uvPrepareConsume(uv, fd, counter, salt);
 		goto maybe_start;
 	}
 
 	*fd = -1;
 	*counter = 0;
+	*salt = 0;
 	req->cb = cb;
 	queue_insert_tail(&uv->prepare_reqs, &req->queue);
 
@@ -201,6 +201,25 @@ static void uvFireRecvCb(struct uvServer *s)
 	s->payload.len = 0;
 }
 
+/* Decompress the entries of an AppendEntries message into a new batch, which
+ * replaces the payload buffer. */
+static int uvServerDecompressEntries(struct uvServer *s)
+{
+	struct raft_append_entries *args = &s->message.append_entries;
+	uint8_t *batch;
+	int rv;
+
+	rv = uvDecompressEntriesBatch(s->payload.base, s->payload.len,
+				      args->entries, args->n_entries, &batch);
+	if (rv != 0) {
+		tracef("decompress entries: %s", errCodeToString(rv));
+		return rv;
+	}
+	RaftHeapFree(s->payload.base);
+	s->payload.base = (char *)batch;
+	return 0;
+}
+
 /* Callback invoked when data has been read from the socket. */
 static void uvServerReadCb(uv_stream_t *stream,
 			   ssize_t nread,
@@ -288,6 +307,17 @@ static void uvServerReadCb(uv_stream_t *stream,
 
 			switch (s->message.type) {
 				case RAFT_IO_APPEND_ENTRIES:
+					/* Version 1 messages carry compressed
+					 * entries. */
+					if (s->message.append_entries.version >=
+					    1) {
+						rv = uvServerDecompressEntries(
+						    s);
+						if (rv != 0) {
+							goto abort;
+						}
+						break;
+					}
 					payload.base = s->payload.base;
 					payload.len = s->payload.len;
 					(void)uvDecodeEntriesBatch(
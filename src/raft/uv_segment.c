@@ -119,8 +119,11 @@ int uvSegmentKeepTrailing(struct uv *uv,
 			  size_t n,
 			  raft_index last_index,
 			  size_t trailing,
+			  unsigned recycle,
+			  unsigned *n_recycled,
 			  char *errmsg)
 {
+	char filename[UV__FILENAME_LEN];
 	raft_index retain_index;
 	size_t i;
 	int rv;
@@ -128,6 +131,8 @@ int uvSegmentKeepTrailing(struct uv *uv,
 	assert(last_index > 0);
 	assert(n > 0);
 
+	*n_recycled = 0;
+
 	if (last_index <= trailing) {
 		return 0;
 	}
@@ -141,6 +146,22 @@ int uvSegmentKeepTrailing(struct uv *uv,
 			break;
 		}
 		if (trailing == 0 || segment->end_index < retain_index) {
+			if (*n_recycled < recycle) {
+				sprintf(filename, UV__RECYCLE_TEMPLATE,
+					segment->first_index,
+					segment->end_index);
+				rv = UvFsRenameFile(uv->dir, segment->filename,
+						    filename, errmsg);
+				if (rv == 0) {
+					tracef("recycle closed segment %s",
+					       segment->filename);
+					*n_recycled += 1;
+					continue;
+				}
+				/* Fall back to deleting the segment. */
+				tracef("recycle closed segment %s: %s",
+				       segment->filename, errmsg);
+			}
 			rv = UvFsRemoveFile(uv->dir, segment->filename, errmsg);
 			if (rv != 0) {
 				ErrMsgWrapf(errmsg, "delete closed segment %s",
@@ -178,6 +199,37 @@ static int uvReadSegmentFile(struct uv *uv,
 	return 0;
 }
 
+/* Parse the segment header following the format version, returning the seed
+ * of the batch checksums and the offset of the first batch. */
+static int uvSegmentParseHeader(struct uv *uv,
+				const struct raft_buffer *buf,
+				uint64_t format,
+				uint32_t *seed,
+				size_t *offset)
+{
+	switch (format) {
+		case UV__DISK_FORMAT:
+			*seed = 0;
+			*offset = sizeof format;
+			return 0;
+		case UV__DISK_FORMAT_SALTED:
+			if (buf->len < sizeof format * 2) {
+				ErrMsgPrintf(uv->io->errmsg,
+					     "file has only %zu bytes",
+					     buf->len);
+				return RAFT_CORRUPT;
+			}
+			*seed = (uint32_t)byteFlip64(
+			    ((uint64_t *)buf->base)[1]);
+			*offset = sizeof format * 2;
+			return 0;
+		default:
+			ErrMsgPrintf(uv->io->errmsg,
+				     "unexpected format version %ju", format);
+			return RAFT_CORRUPT;
+	}
+}
+
 /* Consume the content buffer, returning a pointer to the current position and
  * advancing the offset of n bytes. Return an error if not enough bytes are
  * available. */
@@ -205,6 +257,7 @@ static int uvConsumeContent(const struct raft_buffer *content,
  * Set @last to #true if the loaded batch is the last one. */
 static int uvLoadEntriesBatch(struct uv *uv,
 			      const struct raft_buffer *content,
+			      uint32_t seed, /* Initial checksum value */
 			      struct raft_entry **entries,
 			      unsigned *n_entries,
 			      size_t *offset, /* Offset of last batch */
@@ -213,6 +266,9 @@ static int uvLoadEntriesBatch(struct uv *uv,
 	void *checksums;           /* CRC32 checksums */
 	void *batch;               /* Entries batch */
 	unsigned long n;           /* Number of entries in the batch */
+	bool compressed;           /* Whether the batch data is compressed */
+	size_t compressed_len;     /* Size of the compressed batch data */
+	uint8_t *decompressed;     /* Batch holding the decompressed data */
 	unsigned max_n;            /* Maximum number of entries we expect */
 	unsigned i;                /* Iterate through the entries */
 	struct raft_buffer header; /* Batch header */
@@ -244,6 +300,8 @@ static int uvLoadEntriesBatch(struct uv *uv,
 	}
 
 	n = (size_t)byteFlip64(*(uint64_t *)batch);
+	compressed = (n & UV__BATCH_COMPRESSED) != 0;
+	n &= ~UV__BATCH_COMPRESSED;
 	if (n == 0) {
 		ErrMsgPrintf(uv->io->errmsg,
 			     "entries count in preamble is zero");
@@ -266,12 +324,11 @@ static int uvLoadEntriesBatch(struct uv *uv,
 
 	/* Consume the batch header, excluding the first 8 bytes containing the
 	 * number of entries, which we have already read. */
-	header.len = uvSizeofBatchHeader(n);
+	header.len = uvSizeofBatchHeader(n, compressed);
 	header.base = batch;
 
-	rv = uvConsumeContent(content, offset,
-			      uvSizeofBatchHeader(n) - sizeof(uint64_t), NULL,
-			      errmsg);
+	rv = uvConsumeContent(content, offset, header.len - sizeof(uint64_t),
+			      NULL, errmsg);
 	if (rv != 0) {
 		ErrMsgTransfer(errmsg, uv->io->errmsg, "read header");
 		rv = RAFT_IOERR;
@@ -280,7 +337,7 @@ static int uvLoadEntriesBatch(struct uv *uv,
 
 	/* Check batch header integrity. */
 	crc1 = byteFlip32(((uint32_t *)checksums)[0]);
-	crc2 = byteCrc32(header.base, header.len, 0);
+	crc2 = byteCrc32(header.base, header.len, seed);
 	if (crc1 != crc2) {
 		ErrMsgPrintf(uv->io->errmsg, "header checksum mismatch");
 		rv = RAFT_CORRUPT;
@@ -288,7 +345,8 @@ static int uvLoadEntriesBatch(struct uv *uv,
 	}
 
 	/* Decode the batch header, allocating the entries array. */
-	rv = uvDecodeBatchHeader(header.base, entries, n_entries);
+	rv = uvDecodeBatchHeader(header.base, entries, n_entries,
+				 &compressed_len);
 	if (rv != 0) {
 		goto err;
 	}
@@ -296,8 +354,12 @@ static int uvLoadEntriesBatch(struct uv *uv,
 	/* Calculate the total size of the batch data. TODO this computation
 	 * should be rolled into the actual parsing part somehow. */
 	data.len = 0;
-	for (i = 0; i < n; i++) {
-		data.len += (*entries)[i].buf.len;
+	if (compressed) {
+		data.len = bytePad64(compressed_len);
+	} else {
+		for (i = 0; i < n; i++) {
+			data.len += (*entries)[i].buf.len;
+		}
 	}
 	data.base = (uint8_t *)content->base + *offset;
 
@@ -311,7 +373,7 @@ static int uvLoadEntriesBatch(struct uv *uv,
 
 	/* Check batch data integrity. */
 	crc1 = byteFlip32(((uint32_t *)checksums)[1]);
-	crc2 = byteCrc32(data.base, data.len, 0);
+	crc2 = byteCrc32(data.base, data.len, seed);
 	if (crc1 != crc2) {
 		tracef("batch is bad");
 		ErrMsgPrintf(uv->io->errmsg, "data checksum mismatch");
@@ -319,10 +381,25 @@ static int uvLoadEntriesBatch(struct uv *uv,
 		goto err_after_header_decode;
 	}
 
-	rv = uvDecodeEntriesBatch(content->base, *offset - data.len, *entries,
-				  *n_entries);
-	if (rv != 0) {
-		goto err_after_header_decode;
+	/* Entries of compressed batches get a batch of their own. */
+	if (compressed) {
+		rv = uvDecompressEntriesBatch(data.base, compressed_len,
+					      *entries, *n_entries,
+					      &decompressed);
+		if (rv != 0) {
+			ErrMsgPrintf(uv->io->errmsg, "decompress data: %s",
+				     errCodeToString(rv));
+			if (rv != RAFT_NOMEM) {
+				rv = RAFT_CORRUPT;
+			}
+			goto err_after_header_decode;
+		}
+	} else {
+		rv = uvDecodeEntriesBatch(content->base, *offset - data.len,
+					  *entries, *n_entries);
+		if (rv != 0) {
+			goto err_after_header_decode;
+		}
 	}
 
 	*last = *offset == content->len;
@@ -339,6 +416,70 @@ err:
 	return rv;
 }
 
+/* Release the batches of the given entries that were decompressed, instead of
+ * pointing into the segment @content. */
+static void uvReleaseDecompressedEntries(struct raft_entry *entries,
+					 size_t n,
+					 const void *content)
+{
+	void *batch = NULL;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (entries[i].batch != content && entries[i].batch != batch) {
+			batch = entries[i].batch;
+			RaftHeapFree(batch);
+		}
+	}
+}
+
+/* If some of the given entries loaded from a segment were decompressed, move
+ * all of them to a single new batch, releasing the decompressed batches and the
+ * segment @content, so that entries from the same segment keep sharing the same
+ * batch. */
+static int uvConsolidateEntries(struct raft_entry *entries,
+				size_t n,
+				void *content)
+{
+	uint8_t *batch;
+	uint8_t *cursor;
+	size_t size = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (entries[i].batch != content) {
+			break;
+		}
+	}
+	if (i == n) {
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		size += bytePad64(entries[i].buf.len);
+	}
+	batch = RaftHeapMalloc(size);
+	if (batch == NULL) {
+		return RAFT_NOMEM;
+	}
+	cursor = batch;
+	for (i = 0; i < n; i++) {
+		if (entries[i].buf.len > 0) {
+			memcpy(cursor, entries[i].buf.base, entries[i].buf.len);
+			entries[i].buf.base = cursor;
+		}
+		cursor += bytePad64(entries[i].buf.len);
+	}
+
+	uvReleaseDecompressedEntries(entries, n, content);
+	RaftHeapFree(content);
+	for (i = 0; i < n; i++) {
+		entries[i].batch = batch;
+	}
+
+	return 0;
+}
+
 /* Append to @entries2 all entries in @entries1. */
 static int extendEntries(const struct raft_entry *entries1,
 			 const size_t n_entries1,
@@ -371,6 +512,7 @@ int uvSegmentLoadClosed(struct uv *uv,
 {
 	bool empty;                     /* Whether the file is empty */
 	uint64_t format;                /* Format version */
+	uint32_t seed;                  /* Initial value of batch checksums */
 	bool last;                      /* Whether the last batch was reached */
 	struct raft_entry *tmp_entries; /* Entries in current batch */
 	struct raft_buffer buf;         /* Segment file content */
@@ -401,10 +543,8 @@ int uvSegmentLoadClosed(struct uv *uv,
 	if (rv != 0) {
 		goto err;
 	}
-	if (format != UV__DISK_FORMAT) {
-		ErrMsgPrintf(uv->io->errmsg, "unexpected format version %ju",
-			     format);
-		rv = RAFT_CORRUPT;
+	rv = uvSegmentParseHeader(uv, &buf, format, &seed, &offset);
+	if (rv != 0) {
 		goto err_after_read;
 	}
 
@@ -413,10 +553,9 @@ int uvSegmentLoadClosed(struct uv *uv,
 	*n = 0;
 
 	last = false;
-	offset = sizeof format;
 	for (i = 1; !last; i++) {
-		rv = uvLoadEntriesBatch(uv, &buf, &tmp_entries, &tmp_n, &offset,
-					&last);
+		rv = uvLoadEntriesBatch(uv, &buf, seed, &tmp_entries, &tmp_n,
+					&offset, &last);
 		if (rv != 0) {
 			ErrMsgWrapf(uv->io->errmsg,
 				    "entries batch %u starting at byte %zu", i,
@@ -441,14 +580,22 @@ int uvSegmentLoadClosed(struct uv *uv,
 	assert(i > 1);  /* At least one batch was loaded. */
 	assert(*n > 0); /* At least one entry was loaded. */
 
+	rv = uvConsolidateEntries(*entries, *n, buf.base);
+	if (rv != 0) {
+		goto err_after_extend_entries;
+	}
+
 	return 0;
 
 err_after_batch_load:
-	raft_free(tmp_entries[0].batch);
+	if (tmp_entries[0].batch != buf.base) {
+		raft_free(tmp_entries[0].batch);
+	}
 	raft_free(tmp_entries);
 
 err_after_extend_entries:
 	if (*entries != NULL) {
+		uvReleaseDecompressedEntries(*entries, *n, buf.base);
 		RaftHeapFree(*entries);
 	}
 
@@ -490,7 +637,9 @@ static int uvSegmentLoadOpen(struct uv *uv,
 	bool remove = false;            /* Whether to remove this segment */
 	bool last = false;              /* Whether the last batch was reached */
 	uint64_t format;                /* Format version */
+	uint32_t seed;                  /* Initial value of batch checksums */
 	size_t n_batches = 0;           /* Number of loaded batches */
+	size_t n_loaded = *n;           /* Entries loaded from other segments */
 	struct raft_entry *tmp_entries; /* Entries in current batch */
 	struct raft_buffer buf = {0};   /* Segment file content */
 	size_t offset;                  /* Content read cursor */
@@ -523,7 +672,7 @@ static int uvSegmentLoadOpen(struct uv *uv,
 	/* Check that the format is the expected one, or perhaps 0, indicating
 	 * that the segment was allocated but never written. */
 	offset = sizeof format;
-	if (format != UV__DISK_FORMAT) {
+	if (format != UV__DISK_FORMAT && format != UV__DISK_FORMAT_SALTED) {
 		if (format == 0) {
 			all_zeros = uvContentHasOnlyTrailingZeros(&buf, offset);
 			if (all_zeros) {
@@ -542,12 +691,23 @@ static int uvSegmentLoadOpen(struct uv *uv,
 		rv = RAFT_CORRUPT;
 		goto err_after_read;
 	}
+	rv = uvSegmentParseHeader(uv, &buf, format, &seed, &offset);
+	if (rv != 0) {
+		goto err_after_read;
+	}
 
 	/* Load all batches in the segment. */
 	for (i = 1; !last; i++) {
-		rv = uvLoadEntriesBatch(uv, &buf, &tmp_entries, &tmp_n_entries,
-					&offset, &last);
+		rv = uvLoadEntriesBatch(uv, &buf, seed, &tmp_entries,
+					&tmp_n_entries, &offset, &last);
 		if (rv != 0) {
+			/* A recycled segment is never zeroed, so stale data
+			 * past the last valid batch might look like a
+			 * truncated batch: treat it as a decoding error. */
+			if (rv == RAFT_IOERR &&
+			    format == UV__DISK_FORMAT_SALTED) {
+				rv = RAFT_CORRUPT;
+			}
 			/* If this isn't a decoding error, just bail out. */
 			if (rv != RAFT_CORRUPT) {
 				ErrMsgWrapf(
@@ -592,6 +752,14 @@ static int uvSegmentLoadOpen(struct uv *uv,
 		RaftHeapFree(buf.base);
 		buf.base = NULL;
 		remove = true;
+	} else {
+		/* On failure the caller releases the entries loaded so far,
+		 * along with their batches. */
+		rv = uvConsolidateEntries(*entries + n_loaded, *n - n_loaded,
+					  buf.base);
+		if (rv != 0) {
+			goto err;
+		}
 	}
 
 done:
@@ -644,7 +812,9 @@ done:
 	return 0;
 
 err_after_batch_load:
-	raft_free(tmp_entries[0].batch);
+	if (tmp_entries[0].batch != buf.base) {
+		raft_free(tmp_entries[0].batch);
+	}
 	raft_free(tmp_entries);
 
 err_after_read:
@@ -700,9 +870,11 @@ static int uvEnsureSegmentBufferIsLargeEnough(struct uvSegmentBuffer *b,
 void uvSegmentBufferInit(struct uvSegmentBuffer *b, size_t block_size)
 {
 	b->block_size = block_size;
+	b->seed = 0;
 	b->arena.base = NULL;
 	b->arena.len = 0;
 	b->n = 0;
+	b->compression_threshold = 0;
 }
 
 void uvSegmentBufferClose(struct uvSegmentBuffer *b)
@@ -712,41 +884,89 @@ void uvSegmentBufferClose(struct uvSegmentBuffer *b)
 	}
 }
 
-int uvSegmentBufferFormat(struct uvSegmentBuffer *b)
+int uvSegmentBufferFormat(struct uvSegmentBuffer *b, uint64_t salt)
 {
 	int rv;
 	void *cursor;
 	size_t n;
 	assert(b->n == 0);
 	n = sizeof(uint64_t);
+	if (salt != 0) {
+		n += sizeof salt;
+	}
 	rv = uvEnsureSegmentBufferIsLargeEnough(b, n);
 	if (rv != 0) {
 		return rv;
 	}
 	b->n = n;
 	cursor = b->arena.base;
-	bytePut64(&cursor, UV__DISK_FORMAT);
+	if (salt != 0) {
+		bytePut64(&cursor, UV__DISK_FORMAT_SALTED);
+		bytePut64(&cursor, salt);
+		b->seed = (uint32_t)salt;
+	} else {
+		bytePut64(&cursor, UV__DISK_FORMAT);
+		b->seed = 0;
+	}
 	return 0;
 }
 
+/* Try to compress the data of the given batch into the segment buffer, right
+ * after the space taken by its compressed header. Return the size of the
+ * compressed data, or 0 if the batch is to be stored uncompressed. */
+static size_t uvSegmentBufferCompress(struct uvSegmentBuffer *b,
+				      const struct raft_entry entries[],
+				      unsigned n_entries)
+{
+	size_t offset;
+	size_t bound;
+
+	if (b->compression_threshold == 0) {
+		return 0;
+	}
+	bound = uvCompressEntriesBound(entries, n_entries);
+	if (bound == 0) {
+		return 0;
+	}
+	offset = b->n + sizeof(uint32_t) * 2 +
+		 uvSizeofBatchHeader(n_entries, true);
+	if (uvEnsureSegmentBufferIsLargeEnough(b, offset + bytePad64(bound)) !=
+	    0) {
+		return 0;
+	}
+	return uvCompressEntriesBatch(entries, n_entries,
+				      b->compression_threshold,
+				      b->arena.base + offset);
+}
+
 int uvSegmentBufferAppend(struct uvSegmentBuffer *b,
 			  const struct raft_entry entries[],
 			  unsigned n_entries)
 {
-	size_t size;   /* Total size of the batch */
-	uint32_t crc1; /* Header checksum */
-	uint32_t crc2; /* Data checksum */
-	void *crc1_p;  /* Pointer to header checksum slot */
-	void *crc2_p;  /* Pointer to data checksum slot */
-	void *header;  /* Pointer to the header section */
+	size_t size;           /* Total size of the batch */
+	size_t compressed_len; /* Size of the compressed data, if any */
+	size_t header_len;     /* Size of the batch header */
+	uint32_t crc1;         /* Header checksum */
+	uint32_t crc2;         /* Data checksum */
+	void *crc1_p;          /* Pointer to header checksum slot */
+	void *crc2_p;          /* Pointer to data checksum slot */
+	void *header;          /* Pointer to the header section */
 	void *cursor;
 	unsigned i;
 	int rv;
 
-	size = sizeof(uint32_t) * 2;            /* CRC checksums */
-	size += uvSizeofBatchHeader(n_entries); /* Batch header */
-	for (i = 0; i < n_entries; i++) {       /* Entries data */
-		size += bytePad64(entries[i].buf.len);
+	/* Compression happens in place, so check it first. */
+	compressed_len = uvSegmentBufferCompress(b, entries, n_entries);
+	header_len = uvSizeofBatchHeader(n_entries, compressed_len > 0);
+
+	size = sizeof(uint32_t) * 2; /* CRC checksums */
+	size += header_len;          /* Batch header */
+	if (compressed_len > 0) {    /* Compressed data */
+		size += bytePad64(compressed_len);
+	} else {
+		for (i = 0; i < n_entries; i++) { /* Entries data */
+			size += bytePad64(entries[i].buf.len);
+		}
 	}
 
 	rv = uvEnsureSegmentBufferIsLargeEnough(b, b->n + size);
@@ -763,18 +983,26 @@ int uvSegmentBufferAppend(struct uvSegmentBuffer *b,
 
 	/* Batch header */
 	header = cursor;
-	uvEncodeBatchHeader(entries, n_entries, cursor);
-	crc1 = byteCrc32(header, uvSizeofBatchHeader(n_entries), 0);
-	cursor = (uint8_t *)cursor + uvSizeofBatchHeader(n_entries);
-
-	/* Batch data */
-	crc2 = 0;
-	for (i = 0; i < n_entries; i++) {
-		const struct raft_entry *entry = &entries[i];
-		assert(entry->buf.len % sizeof(uint64_t) == 0);
-		memcpy(cursor, entry->buf.base, entry->buf.len);
-		crc2 = byteCrc32(cursor, entry->buf.len, crc2);
-		cursor = (uint8_t *)cursor + entry->buf.len;
+	uvEncodeBatchHeader(entries, n_entries, compressed_len, cursor);
+	crc1 = byteCrc32(header, header_len, b->seed);
+	cursor = (uint8_t *)cursor + header_len;
+
+	/* Batch data, either already compressed in place or copied now. The
+	 * padding of compressed data is zeroed since the arena might hold stale
+	 * bytes. */
+	crc2 = b->seed;
+	if (compressed_len > 0) {
+		memset((uint8_t *)cursor + compressed_len, 0,
+		       bytePad64(compressed_len) - compressed_len);
+		crc2 = byteCrc32(cursor, bytePad64(compressed_len), crc2);
+	} else {
+		for (i = 0; i < n_entries; i++) {
+			const struct raft_entry *entry = &entries[i];
+			assert(entry->buf.len % sizeof(uint64_t) == 0);
+			memcpy(cursor, entry->buf.base, entry->buf.len);
+			crc2 = byteCrc32(cursor, entry->buf.len, crc2);
+			cursor = (uint8_t *)cursor + entry->buf.len;
+		}
 	}
 
 	bytePut32(&crc1_p, crc1);
@@ -992,6 +1220,239 @@ err:
 	return rv;
 }
 
+/* Copy into @entries up to @n entries of the segment @filename, whose first
+ * entry has index @first_index, starting at @index. Their payloads are appended
+ * to the given @batch of @size bytes, which is grown as needed, and the number
+ * of copied entries is stored in @n_read. */
+static int uvSegmentReadInto(struct uv *uv,
+			     const char *filename,
+			     raft_index first_index,
+			     raft_index index,
+			     unsigned n,
+			     struct raft_entry entries[],
+			     unsigned *n_read,
+			     uint8_t **batch,
+			     size_t *size)
+{
+	struct raft_entry *tmp_entries; /* Entries in current batch */
+	struct raft_buffer buf;         /* Mapped segment file content */
+	uint64_t format;                /* Format version */
+	uint32_t seed;                  /* Initial value of batch checksums */
+	size_t offset;                  /* Content read cursor */
+	unsigned tmp_n;                 /* Number of entries in current batch */
+	bool last = false;              /* Whether the last batch was reached */
+	char errmsg[RAFT_ERRMSG_BUF_SIZE];
+	unsigned i;
+	int rv;
+
+	*n_read = 0;
+
+	rv = UvFsMapFile(uv->dir, filename, &buf, errmsg);
+	if (rv != 0) {
+		if (rv != RAFT_NOTFOUND) {
+			ErrMsgTransfer(errmsg, uv->io->errmsg, "map file");
+		}
+		return rv;
+	}
+	if (buf.len < sizeof format) {
+		ErrMsgPrintf(uv->io->errmsg, "file has only %zu bytes",
+			     buf.len);
+		rv = RAFT_IOERR;
+		goto out;
+	}
+	format = byteFlip64(*(uint64_t *)buf.base);
+	rv = uvSegmentParseHeader(uv, &buf, format, &seed, &offset);
+	if (rv != 0) {
+		goto out;
+	}
+
+	/* Batches preceding the requested entries are decoded too, since the
+	 * size of each batch is only known from its header. The requested
+	 * entries are durable, so the open segment being written can't end
+	 * before them. */
+	while (!last && *n_read < n) {
+		size_t len = 0;
+		uint8_t *grown;
+		uint8_t *cursor;
+
+		rv = uvLoadEntriesBatch(uv, &buf, seed, &tmp_entries, &tmp_n,
+					&offset, &last);
+		if (rv != 0) {
+			goto out;
+		}
+
+		for (i = 0; i < tmp_n; i++) {
+			raft_index k = first_index + i;
+			if (k >= index + *n_read && k < index + n) {
+				len += bytePad64(tmp_entries[i].buf.len);
+			}
+		}
+		grown = len > 0 ? RaftHeapRealloc(*batch, *size + len) : *batch;
+		if (grown == NULL) {
+			rv = RAFT_NOMEM;
+			goto err_after_batch_load;
+		}
+		*batch = grown;
+		cursor = *batch + *size;
+		*size += len;
+
+		for (i = 0; i < tmp_n; i++) {
+			raft_index k = first_index + i;
+			struct raft_entry *entry;
+			if (k < index + *n_read || k >= index + n) {
+				continue;
+			}
+			entry = &entries[*n_read];
+			entry->term = tmp_entries[i].term;
+			entry->type = tmp_entries[i].type;
+			entry->buf.len = tmp_entries[i].buf.len;
+			entry->buf.base = NULL;
+			entry->batch = NULL;
+			if (entry->buf.len > 0) {
+				memcpy(cursor, tmp_entries[i].buf.base,
+				       entry->buf.len);
+			}
+			cursor += bytePad64(entry->buf.len);
+			(*n_read)++;
+		}
+
+		first_index += tmp_n;
+		uvReleaseDecompressedEntries(tmp_entries, tmp_n, buf.base);
+		raft_free(tmp_entries);
+	}
+
+	goto out;
+
+err_after_batch_load:
+	uvReleaseDecompressedEntries(tmp_entries, tmp_n, buf.base);
+	raft_free(tmp_entries);
+out:
+	UvFsUnmapFile(&buf);
+	return rv;
+}
+
+/* Find the segment holding the entry with the given index, and copy entries
+ * from it. Open segments are looked up in memory, while closed segments need a
+ * directory listing. */
+static int uvReadEntriesFromSegment(struct uv *uv,
+				    raft_index index,
+				    unsigned n,
+				    struct raft_entry entries[],
+				    unsigned *n_read,
+				    uint8_t **batch,
+				    size_t *size)
+{
+	struct uvSnapshotInfo *snapshots;
+	struct uvSegmentInfo *segments;
+	size_t n_snapshots;
+	size_t n_segments;
+	char filename[UV__FILENAME_LEN];
+	char errmsg[RAFT_ERRMSG_BUF_SIZE];
+	uvCounter counter;
+	raft_index first_index;
+	raft_index last_index;
+	size_t i;
+	int rv;
+
+	if (UvAppendLookup(uv, index, &counter, &first_index)) {
+		sprintf(filename, UV__OPEN_TEMPLATE, counter);
+		return uvSegmentReadInto(uv, filename, first_index, index, n,
+					 entries, n_read, batch, size);
+	}
+
+	/* A segment being finalized might have been renamed already. */
+	if (UvFinalizeLookup(uv, index, &counter, &first_index, &last_index)) {
+		sprintf(filename, UV__OPEN_TEMPLATE, counter);
+		rv = uvSegmentReadInto(uv, filename, first_index, index, n,
+				       entries, n_read, batch, size);
+		if (rv != RAFT_NOTFOUND) {
+			return rv;
+		}
+		sprintf(filename, UV__CLOSED_TEMPLATE, first_index,
+			last_index);
+		return uvSegmentReadInto(uv, filename, first_index, index, n,
+					 entries, n_read, batch, size);
+	}
+
+	rv = UvList(uv, &snapshots, &n_snapshots, &segments, &n_segments,
+		    errmsg);
+	if (rv != 0) {
+		ErrMsgTransfer(errmsg, uv->io->errmsg, "list data directory");
+		return rv;
+	}
+	rv = RAFT_NOTFOUND;
+	for (i = 0; i < n_segments; i++) {
+		struct uvSegmentInfo *info = &segments[i];
+		if (info->is_open || index < info->first_index ||
+		    index > info->end_index) {
+			continue;
+		}
+		rv = uvSegmentReadInto(uv, info->filename, info->first_index,
+				       index, n, entries, n_read, batch, size);
+		break;
+	}
+	if (snapshots != NULL) {
+		RaftHeapFree(snapshots);
+	}
+	if (segments != NULL) {
+		RaftHeapFree(segments);
+	}
+	return rv;
+}
+
+int UvReadEntries(struct raft_io *io,
+		  raft_index index,
+		  unsigned n,
+		  struct raft_entry entries[])
+{
+	struct uv *uv = io->impl;
+	uint8_t *batch = NULL;
+	uint8_t *cursor;
+	size_t size = 0;
+	unsigned n_read = 0;
+	unsigned i;
+	int rv;
+
+	assert(n > 0);
+
+	while (n_read < n) {
+		unsigned tmp_n;
+		rv = uvReadEntriesFromSegment(uv, index + n_read, n - n_read,
+					      &entries[n_read], &tmp_n, &batch,
+					      &size);
+		if (rv == 0 && tmp_n == 0) {
+			rv = RAFT_NOTFOUND;
+		}
+		if (rv != 0) {
+			if (rv == RAFT_NOTFOUND) {
+				ErrMsgPrintf(io->errmsg,
+					     "no segment holds entry %llu",
+					     index + n_read);
+			}
+			goto err;
+		}
+		n_read += tmp_n;
+	}
+
+	/* The batch was possibly moved while growing, so point the entries to
+	 * their payloads only now. */
+	cursor = batch;
+	for (i = 0; i < n; i++) {
+		entries[i].batch = batch;
+		entries[i].buf.base = entries[i].buf.len > 0 ? cursor : NULL;
+		entries[i].is_local = false;
+		cursor += bytePad64(entries[i].buf.len);
+	}
+
+	return 0;
+
+err:
+	if (batch != NULL) {
+		RaftHeapFree(batch);
+	}
+	return rv;
+}
+
 /* Write a closed segment */
 static int uvWriteClosedSegment(struct uv *uv,
 				raft_index first_index,
@@ -1015,14 +1476,14 @@ static int uvWriteClosedSegment(struct uv *uv,
 	 * block */
 	cap = uv->block_size -
 	      (sizeof(uint64_t) /* Format version */ +
-	       sizeof(uint64_t) /* Checksums */ + uvSizeofBatchHeader(1));
+	       sizeof(uint64_t) /* Checksums */ + uvSizeofBatchHeader(1, false));
 	if (conf->len > cap) {
 		return RAFT_TOOBIG;
 	}
 
 	uvSegmentBufferInit(&buf, uv->block_size);
 
-	rv = uvSegmentBufferFormat(&buf);
+	rv = uvSegmentBufferFormat(&buf, 0);
 	if (rv != 0) {
 		return rv;
 	}
@@ -1126,7 +1587,7 @@ int uvSegmentTruncate(struct uv *uv,
 
 	uvSegmentBufferInit(&buf, uv->block_size);
 
-	rv = uvSegmentBufferFormat(&buf);
+	rv = uvSegmentBufferFormat(&buf, 0);
 	if (rv != 0) {
 		goto out_after_buffer_init;
 	}
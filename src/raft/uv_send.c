@@ -476,7 +476,8 @@ int UvSend(struct raft_io *io,
 	send->req = req;
 	req->cb = cb;
 
-	rv = uvEncodeMessage(message, &send->bufs, &send->n_bufs);
+	rv = uvEncodeMessage(message, uv->entries_compression, &send->bufs,
+			     &send->n_bufs);
 	if (rv != 0) {
 		send->bufs = NULL;
 		goto err_after_send_alloc;
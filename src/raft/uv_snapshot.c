@@ -1,5 +1,7 @@
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "array.h"
 #include "assert.h"
@@ -212,6 +214,31 @@ void UvSnapshotSort(struct uvSnapshotInfo *infos, size_t n_infos)
 	qsort(infos, n_infos, sizeof *infos, uvSnapshotCompare);
 }
 
+/* Read the format version of the metadata file of a snapshot to tell whether
+ * the snapshot is incremental. */
+static int uvSnapshotIsIncremental(struct uv *uv,
+				   struct uvSnapshotInfo *info,
+				   bool *incremental,
+				   char *errmsg)
+{
+	uint64_t format;
+	struct raft_buffer buf = {&format, sizeof format};
+	uv_file fd;
+	int rv;
+
+	rv = UvFsOpenFileForReading(uv->dir, info->filename, &fd, errmsg);
+	if (rv != 0) {
+		return RAFT_IOERR;
+	}
+	rv = UvFsReadInto(fd, &buf, errmsg);
+	UvOsClose(fd);
+	if (rv != 0) {
+		return RAFT_IOERR;
+	}
+	*incremental = byteFlip64(format) == UV__DISK_FORMAT_INCREMENTAL;
+	return 0;
+}
+
 /* Parse the metadata file of a snapshot and populate the metadata portion of
  * the given snapshot object accordingly. */
 static int uvSnapshotLoadMeta(struct uv *uv,
@@ -249,7 +276,7 @@ static int uvSnapshotLoadMeta(struct uv *uv,
 	}
 
 	format = byteFlip64(header[0]);
-	if (format != UV__DISK_FORMAT) {
+	if (format != UV__DISK_FORMAT && format != UV__DISK_FORMAT_INCREMENTAL) {
 		tracef("load %s: unsupported format %ju", info->filename,
 		       format);
 		rv = RAFT_MALFORMED;
@@ -315,36 +342,161 @@ err:
 	return rv;
 }
 
-/* Load the snapshot data file and populate the data portion of the given
- * snapshot object accordingly. */
-static int uvSnapshotLoadData(struct uv *uv,
+/* Read compressed snapshot data at the given offset. */
+static int uvSnapshotReadFrame(void *arg,
+			       size_t offset,
+			       void *buf,
+			       size_t len,
+			       char *errmsg)
+{
+	uv_file fd = *(uv_file *)arg;
+	ssize_t rv;
+
+	while (len > 0) {
+		rv = pread(fd, buf, len, (off_t)offset);
+		if (rv == -1) {
+			UvOsErrMsg(errmsg, "pread", -errno);
+			return RAFT_IOERR;
+		}
+		if (rv == 0) {
+			ErrMsgPrintf(errmsg, "short read: %zu bytes missing",
+				     len);
+			return RAFT_IOERR;
+		}
+		buf = (char *)buf + rv;
+		offset += (size_t)rv;
+		len -= (size_t)rv;
+	}
+	return 0;
+}
+
+/* Read the data file of a snapshot, decompressing it if needed. Chunked data is
+ * read and decompressed one chunk at a time on several threads, but the whole
+ * decompressed data is returned at once. */
+static int uvSnapshotReadData(struct uv *uv,
 			      struct uvSnapshotInfo *info,
-			      struct raft_snapshot *snapshot,
+			      struct raft_buffer *buf,
 			      char *errmsg)
 {
 	char filename[UV__FILENAME_LEN];
-	struct raft_buffer buf;
+	uint8_t magic[4];
+	off_t size;
+	uv_file fd;
 	int rv;
 
 	uvSnapshotFilenameOf(info, filename);
 
-	rv = UvFsReadFile(uv->dir, filename, &buf, errmsg);
+	rv = UvFsFileSize(uv->dir, filename, &size, errmsg);
 	if (rv != 0) {
 		tracef("stat %s: %s", filename, errmsg);
-		goto err;
+		return rv;
+	}
+	rv = UvFsOpenFileForReading(uv->dir, filename, &fd, errmsg);
+	if (rv != 0) {
+		return rv;
 	}
 
-	if (IsCompressed(buf.base, buf.len)) {
-		struct raft_buffer decompressed = {0};
+	if ((size_t)size >= sizeof magic &&
+	    uvSnapshotReadFrame(&fd, 0, magic, sizeof magic, errmsg) == 0 &&
+	    IsCompressed(magic, sizeof magic)) {
 		tracef("snapshot decompress start");
-		rv = Decompress(buf, &decompressed, errmsg);
+		rv = DecompressStream((size_t)size, uvSnapshotReadFrame, &fd,
+				      buf, errmsg);
 		tracef("snapshot decompress end %d", rv);
 		if (rv != 0) {
 			tracef("decompress failed rv:%d", rv);
-			goto err_after_read_file;
+			buf->base = NULL;
+		}
+		goto out;
+	}
+
+	buf->len = (size_t)size;
+	buf->base = RaftHeapMalloc(buf->len);
+	if (buf->base == NULL) {
+		ErrMsgOom(errmsg);
+		rv = RAFT_NOMEM;
+		goto out;
+	}
+	rv = uvSnapshotReadFrame(&fd, 0, buf->base, buf->len, errmsg);
+	if (rv != 0) {
+		RaftHeapFree(buf->base);
+		buf->base = NULL;
+	}
+
+out:
+	UvOsClose(fd);
+	return rv;
+}
+
+/* Load the data files of the chain of snapshots ending with the last of the
+ * given ones and populate the data portion of the given snapshot object with
+ * their concatenation. */
+static int uvSnapshotLoadData(struct uv *uv,
+			      struct uvSnapshotInfo *infos,
+			      size_t n_infos,
+			      struct raft_snapshot *snapshot,
+			      char *errmsg)
+{
+	struct raft_buffer *chain;
+	struct raft_buffer buf;
+	size_t first = n_infos - 1;
+	size_t i;
+	bool incremental;
+	int rv;
+
+	/* Walk back to the last full snapshot. */
+	for (;;) {
+		rv = uvSnapshotIsIncremental(uv, &infos[first], &incremental,
+					     errmsg);
+		if (rv != 0) {
+			goto err;
+		}
+		if (!incremental) {
+			break;
+		}
+		if (first == 0) {
+			ErrMsgPrintf(errmsg, "load %s: missing base snapshot",
+				     infos[n_infos - 1].filename);
+			rv = RAFT_CORRUPT;
+			goto err;
+		}
+		first--;
+	}
+
+	if (first == n_infos - 1) {
+		rv = uvSnapshotReadData(uv, &infos[first], &buf, errmsg);
+		if (rv != 0) {
+			goto err;
+		}
+	} else {
+		chain = RaftHeapCalloc(n_infos - first, sizeof *chain);
+		if (chain == NULL) {
+			rv = RAFT_NOMEM;
+			goto err;
 		}
-		RaftHeapFree(buf.base);
-		buf = decompressed;
+		buf.len = 0;
+		for (i = first; i < n_infos; i++) {
+			rv = uvSnapshotReadData(uv, &infos[i],
+						&chain[i - first], errmsg);
+			if (rv != 0) {
+				goto err_after_chain_read;
+			}
+			buf.len += chain[i - first].len;
+		}
+		tracef("snapshot chain of %zu", n_infos - first);
+		buf.base = RaftHeapMalloc(buf.len);
+		if (buf.base == NULL) {
+			rv = RAFT_NOMEM;
+			goto err_after_chain_read;
+		}
+		buf.len = 0;
+		for (i = 0; i < n_infos - first; i++) {
+			memcpy((uint8_t *)buf.base + buf.len, chain[i].base,
+			       chain[i].len);
+			buf.len += chain[i].len;
+			RaftHeapFree(chain[i].base);
+		}
+		RaftHeapFree(chain);
 	}
 
 	snapshot->bufs = RaftHeapMalloc(sizeof *snapshot->bufs);
@@ -357,6 +509,12 @@ static int uvSnapshotLoadData(struct uv *uv,
 	snapshot->bufs[0] = buf;
 	return 0;
 
+err_after_chain_read:
+	for (i = 0; i < n_infos - first; i++) {
+		RaftHeapFree(chain[i].base);
+	}
+	RaftHeapFree(chain);
+	goto err;
 err_after_read_file:
 	RaftHeapFree(buf.base);
 err:
@@ -365,16 +523,18 @@ err:
 }
 
 int UvSnapshotLoad(struct uv *uv,
-		   struct uvSnapshotInfo *meta,
+		   struct uvSnapshotInfo *infos,
+		   size_t n_infos,
 		   struct raft_snapshot *snapshot,
 		   char *errmsg)
 {
 	int rv;
-	rv = uvSnapshotLoadMeta(uv, meta, snapshot, errmsg);
+	assert(n_infos > 0);
+	rv = uvSnapshotLoadMeta(uv, &infos[n_infos - 1], snapshot, errmsg);
 	if (rv != 0) {
 		return rv;
 	}
-	rv = uvSnapshotLoadData(uv, meta, snapshot, errmsg);
+	rv = uvSnapshotLoadData(uv, infos, n_infos, snapshot, errmsg);
 	if (rv != 0) {
 		return rv;
 	}
@@ -387,6 +547,9 @@ struct uvSnapshotPut
 	size_t trailing;
 	struct raft_io_snapshot_put *req;
 	const struct raft_snapshot *snapshot;
+	unsigned recycle;    /* Max number of segments to recycle */
+	unsigned n_recycled; /* Number of segments actually recycled */
+	bool incremental;    /* The snapshot depends on the previous one */
 	struct
 	{
 		unsigned long long timestamp;
@@ -417,12 +580,30 @@ static int uvSnapshotKeepLastTwo(struct uv *uv,
 	char errmsg[RAFT_ERRMSG_BUF_SIZE];
 	int rv;
 
+	size_t keep;
+	bool incremental;
+
 	/* Leave at least two snapshots, for safety. */
 	if (n <= 2) {
 		return 0;
 	}
 
-	for (i = 0; i < n - 2; i++) {
+	/* Also leave all the snapshots the oldest of the two depends on. */
+	keep = n - 2;
+	while (keep > 0) {
+		rv = uvSnapshotIsIncremental(uv, &snapshots[keep], &incremental,
+					     errmsg);
+		if (rv != 0) {
+			tracef("read %s: %s", snapshots[keep].filename, errmsg);
+			return rv;
+		}
+		if (!incremental) {
+			break;
+		}
+		keep--;
+	}
+
+	for (i = 0; i < keep; i++) {
 		struct uvSnapshotInfo *snapshot = &snapshots[i];
 		char filename[UV__FILENAME_LEN];
 		rv = UvFsRemoveFile(uv->dir, snapshot->filename, errmsg);
@@ -446,6 +627,8 @@ static int uvSnapshotKeepLastTwo(struct uv *uv,
 static int uvRemoveOldSegmentsAndSnapshots(struct uv *uv,
 					   raft_index last_index,
 					   size_t trailing,
+					   unsigned recycle,
+					   unsigned *n_recycled,
 					   char *errmsg)
 {
 	struct uvSnapshotInfo *snapshots;
@@ -465,7 +648,8 @@ static int uvRemoveOldSegmentsAndSnapshots(struct uv *uv,
 	}
 	if (segments != NULL) {
 		rv = uvSegmentKeepTrailing(uv, segments, n_segments, last_index,
-					   trailing, errmsg);
+					   trailing, recycle, n_recycled,
+					   errmsg);
 		if (rv != 0) {
 			goto out;
 		}
@@ -482,24 +666,119 @@ out:
 	return rv;
 }
 
+struct uvSnapshotCompress
+{
+	uv_file fd;
+	int64_t offset;
+	struct raft_buffer *bufs;
+	unsigned n_bufs;
+	bool chunked;
+};
+
+/* Append a compressed frame to the snapshot file. */
+static int uvSnapshotWriteFrame(void *arg,
+				const void *data,
+				size_t len,
+				char *errmsg)
+{
+	struct uvSnapshotCompress *c = arg;
+	uv_buf_t buf = uv_buf_init((char *)data, (unsigned)len);
+	int rv;
+
+	rv = UvOsWrite(c->fd, &buf, 1, c->offset);
+	if (rv != (int)len) {
+		if (rv < 0) {
+			UvOsErrMsg(errmsg, "write", rv);
+		} else {
+			ErrMsgPrintf(errmsg,
+				     "short write: %d only bytes written", rv);
+		}
+		return RAFT_IOERR;
+	}
+	c->offset += (int64_t)len;
+	return 0;
+}
+
+static int uvSnapshotCompress(uv_file fd, void *arg, char *errmsg)
+{
+	struct uvSnapshotCompress *c = arg;
+	c->fd = fd;
+	c->offset = 0;
+	return CompressStream(c->bufs, c->n_bufs, c->chunked,
+			      uvSnapshotWriteFrame, c, errmsg);
+}
+
+/* Compress the snapshot data, on several threads if it's chunked, writing the
+ * compressed data to disk as soon as it's ready, so that it's never held in
+ * memory as a whole. */
 static int makeFileCompressed(const char *dir,
 			      const char *filename,
 			      struct raft_buffer *bufs,
 			      unsigned n_bufs,
+			      bool chunked,
 			      char *errmsg)
 {
+	struct uvSnapshotCompress c = {0};
 	int rv;
 
-	struct raft_buffer compressed = {0};
-	rv = Compress(bufs, n_bufs, &compressed, errmsg);
+	c.bufs = bufs;
+	c.n_bufs = n_bufs;
+	c.chunked = chunked;
+	rv = UvFsMakeFileWith(dir, filename, uvSnapshotCompress, &c, errmsg);
 	if (rv != 0) {
 		ErrMsgWrapf(errmsg, "compress %s", filename);
 		return RAFT_IOERR;
 	}
 
-	rv = UvFsMakeFile(dir, filename, &compressed, 1, errmsg);
-	raft_free(compressed.base);
-	return rv;
+	return 0;
+}
+
+/* Check that the newest snapshot is the one an incremental snapshot is based
+ * on. */
+static int uvSnapshotHasBase(struct uv *uv,
+			     raft_term term,
+			     raft_index index,
+			     char *errmsg)
+{
+	struct uvSnapshotInfo *snapshots;
+	struct uvSegmentInfo *segments;
+	size_t n_snapshots;
+	size_t n_segments;
+	bool found;
+	int rv;
+
+	rv = UvList(uv, &snapshots, &n_snapshots, &segments, &n_segments,
+		    errmsg);
+	if (rv != 0) {
+		return rv;
+	}
+	found = n_snapshots > 0 && snapshots[n_snapshots - 1].term == term &&
+		snapshots[n_snapshots - 1].index == index;
+	if (snapshots != NULL) {
+		RaftHeapFree(snapshots);
+	}
+	if (segments != NULL) {
+		RaftHeapFree(segments);
+	}
+	if (!found) {
+		ErrMsgPrintf(errmsg,
+			     "incremental snapshot base %llu/%llu not found",
+			     term, index);
+		return RAFT_INVALID;
+	}
+	return 0;
+}
+
+/* Whether the data of the given snapshot starts with the incremental marker. */
+static bool uvSnapshotDataIsIncremental(const struct raft_snapshot *snapshot)
+{
+	const void *cursor;
+
+	if (snapshot->n_bufs == 0 || snapshot->bufs[0].len < sizeof(uint64_t)) {
+		return false;
+	}
+	cursor = snapshot->bufs[0].base;
+	return byteGet64(&cursor) == RAFT_SNAPSHOT_INCREMENTAL;
 }
 
 static void uvSnapshotPutWorkCb(uv_work_t *work)
@@ -511,6 +790,15 @@ static void uvSnapshotPutWorkCb(uv_work_t *work)
 	char errmsg[RAFT_ERRMSG_BUF_SIZE];
 	int rv;
 
+	if (put->incremental) {
+		rv = uvSnapshotHasBase(uv, put->req->base_term,
+				       put->req->base_index, put->errmsg);
+		if (rv != 0) {
+			put->status = rv;
+			return;
+		}
+	}
+
 	sprintf(metadata, UV__SNAPSHOT_META_TEMPLATE, put->snapshot->term,
 		put->snapshot->index, put->meta.timestamp);
 
@@ -528,7 +816,8 @@ static void uvSnapshotPutWorkCb(uv_work_t *work)
 	tracef("snapshot write start");
 	if (uv->snapshot_compression) {
 		rv = makeFileCompressed(uv->dir, snapshot, put->snapshot->bufs,
-					put->snapshot->n_bufs, put->errmsg);
+					put->snapshot->n_bufs,
+					uv->snapshot_chunks, put->errmsg);
 	} else {
 		rv = UvFsMakeFile(uv->dir, snapshot, put->snapshot->bufs,
 				  put->snapshot->n_bufs, put->errmsg);
@@ -551,7 +840,8 @@ static void uvSnapshotPutWorkCb(uv_work_t *work)
 	}
 
 	rv = uvRemoveOldSegmentsAndSnapshots(uv, put->snapshot->index,
-					     put->trailing, put->errmsg);
+					     put->trailing, put->recycle,
+					     &put->n_recycled, put->errmsg);
 	if (rv != 0) {
 		put->status = rv;
 		return;
@@ -581,6 +871,7 @@ static void uvSnapshotPutAfterWorkCb(uv_work_t *work, int status)
 	struct uv *uv = put->uv;
 	assert(status == 0);
 	uv->snapshot_put_work.data = NULL;
+	uv->recycle_count += put->n_recycled;
 	uvSnapshotPutFinish(put);
 	UvUnblock(uv);
 }
@@ -597,6 +888,10 @@ static void uvSnapshotPutStart(struct uvSnapshotPut *put)
 		assert(put->barrier.data == NULL);
 	}
 
+	put->recycle = uv->recycle_target > uv->recycle_count
+			   ? uv->recycle_target - uv->recycle_count
+			   : 0;
+	put->n_recycled = 0;
 	uv->snapshot_put_work.data = put;
 	rv = uv_queue_work(uv->loop, &uv->snapshot_put_work,
 			   uvSnapshotPutWorkCb, uvSnapshotPutAfterWorkCb);
@@ -660,6 +955,9 @@ int UvSnapshotPut(struct raft_io *io,
 	put->snapshot = snapshot;
 	put->meta.timestamp = uv_now(uv->loop);
 	put->trailing = trailing;
+	put->recycle = 0;
+	put->n_recycled = 0;
+	put->incremental = uvSnapshotDataIsIncremental(snapshot);
 	put->barrier.data = put;
 	put->barrier.blocking = trailing == 0;
 	put->barrier.cb = uvSnapshotPutBarrierCb;
@@ -676,7 +974,8 @@ int UvSnapshotPut(struct raft_io *io,
 	}
 
 	cursor = put->meta.header;
-	bytePut64(&cursor, UV__DISK_FORMAT);
+	bytePut64(&cursor, put->incremental ? UV__DISK_FORMAT_INCREMENTAL
+					    : UV__DISK_FORMAT);
 	bytePut64(&cursor, 0);
 	bytePut64(&cursor, snapshot->configuration_index);
 	bytePut64(&cursor, put->meta.bufs[1].len);
@@ -729,8 +1028,8 @@ static void uvSnapshotGetWorkCb(uv_work_t *work)
 		goto out;
 	}
 	if (snapshots != NULL) {
-		rv = UvSnapshotLoad(uv, &snapshots[n_snapshots - 1],
-				    get->snapshot, get->errmsg);
+		rv = UvSnapshotLoad(uv, snapshots, n_snapshots, get->snapshot,
+				    get->errmsg);
 		if (rv != 0) {
 			get->status = rv;
 		}
@@ -5,11 +5,15 @@
 #include "lib/assert.h"
 
 #include "registry.h"
+#include "utils.h"
 
 void registry__init(struct registry *r, struct config *config)
 {
 	r->config = config;
 	queue_init(&r->dbs);
+	hash__init(&r->index);
+	sched_init(&r->sched, config);
+	r->raft = NULL;
 }
 
 void registry__close(struct registry *r)
@@ -23,14 +27,21 @@ void registry__close(struct registry *r)
 		db__close(db);
 		sqlite3_free(db);
 	}
+	hash__close(&r->index);
 }
 
 int registry__db_get(struct registry *r, const char *filename, struct db **db)
 {
-	queue *head;
-	QUEUE_FOREACH(head, &r->dbs)
-	{
-		*db = QUEUE_DATA(head, struct db, queue);
+	struct hash_node *node;
+	uint32_t hash = hash__str(filename, strlen(filename));
+	int rv;
+
+	for (node = hash__bucket(&r->index, hash); node != NULL;
+	     node = node->next) {
+		if (node->hash != hash) {
+			continue;
+		}
+		*db = CONTAINER_OF(node, struct db, hash_node);
 		if (strcmp((*db)->filename, filename) == 0) {
 			return 0;
 		}
@@ -39,7 +50,23 @@ int registry__db_get(struct registry *r, const char *filename, struct db **db)
 	if (*db == NULL) {
 		return DQLITE_NOMEM;
 	}
-	db__init(*db, r->config, filename);
+	rv = db__init(*db, r->config, filename);
+	if (rv != 0) {
+		goto err;
+	}
+	assert((*db)->cookie == hash);
+	(*db)->sched = &r->sched;
+	rv = hash__insert(&r->index, &(*db)->hash_node, hash);
+	if (rv != 0) {
+		goto err_after_db_init;
+	}
 	queue_insert_tail(&r->dbs, &(*db)->queue);
 	return 0;
+
+err_after_db_init:
+	db__close(*db);
+err:
+	sqlite3_free(*db);
+	*db = NULL;
+	return rv;
 }
@@ -5,14 +5,20 @@
 
 #include <sqlite3.h>
 
+#include "lib/hash.h"
 #include "lib/queue.h"
 
 #include "db.h"
+#include "raft.h"
+#include "sched.h"
 
 struct registry
 {
 	struct config *config;
-	queue dbs;
+	queue dbs;         /* All registered databases, in creation order */
+	struct hash index; /* Databases indexed by filename hash */
+	struct sched sched; /* Admission control of leader statements */
+	struct raft *raft;  /* Tags the changes of the feeds, if set */
 };
 
 void registry__init(struct registry *r, struct config *config);
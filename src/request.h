@@ -42,6 +42,15 @@
 #define REQUEST_TRANSFER(X, ...) X(uint64, id, ##__VA_ARGS__)
 #define REQUEST_DESCRIBE(X, ...) X(uint64, format, ##__VA_ARGS__)
 #define REQUEST_WEIGHT(X, ...) X(uint64, weight, ##__VA_ARGS__)
+#define REQUEST_BACKUP(X, ...)           \
+	X(text, filename, ##__VA_ARGS__) \
+	X(uint64, position, ##__VA_ARGS__)
+#define REQUEST_TIMEOUT(X, ...)         \
+	X(uint64, db_id, ##__VA_ARGS__) \
+	X(uint64, msecs, ##__VA_ARGS__)
+#define REQUEST_SUBSCRIBE(X, ...)        \
+	X(text, filename, ##__VA_ARGS__) \
+	X(uint64, index, ##__VA_ARGS__)
 
 #define REQUEST__DEFINE(LOWER, UPPER, _) \
 	SERIALIZE__DEFINE(request_##LOWER, REQUEST_##UPPER);
@@ -64,7 +73,10 @@
 	X(cluster, CLUSTER, __VA_ARGS__)                     \
 	X(transfer, TRANSFER, __VA_ARGS__)                   \
 	X(describe, DESCRIBE, __VA_ARGS__)                   \
-	X(weight, WEIGHT, __VA_ARGS__)
+	X(weight, WEIGHT, __VA_ARGS__)                       \
+	X(backup, BACKUP, __VA_ARGS__)                       \
+	X(timeout, TIMEOUT, __VA_ARGS__)                     \
+	X(subscribe, SUBSCRIBE, __VA_ARGS__)
 
 REQUEST__TYPES(REQUEST__DEFINE);
 
@@ -4,3 +4,5 @@
 	SERIALIZE__IMPLEMENT(response_##LOWER, RESPONSE_##UPPER);
 
 RESPONSE__TYPES(RESPONSE__IMPLEMENT, );
+
+SERIALIZE__IMPLEMENT(response_change, RESPONSE_CHANGE);
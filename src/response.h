@@ -37,6 +37,17 @@
 #define RESPONSE_METADATA(X, ...)                \
 	X(uint64, failure_domain, ##__VA_ARGS__) \
 	X(uint64, weight, ##__VA_ARGS__)
+#define RESPONSE_PAGES(X, ...)                  \
+	X(uint64, eof, ##__VA_ARGS__)           \
+	X(uint64, position, ##__VA_ARGS__)      \
+	X(uint64, incremental, ##__VA_ARGS__)   \
+	X(uint64, database_size, ##__VA_ARGS__) \
+	X(uint64, page_size, ##__VA_ARGS__)     \
+	X(uint64, n, ##__VA_ARGS__)
+#define RESPONSE_CHANGES(X, ...)        \
+	X(uint64, eof, ##__VA_ARGS__)   \
+	X(uint64, index, ##__VA_ARGS__) \
+	X(uint64, n, ##__VA_ARGS__)
 
 #define RESPONSE__DEFINE(LOWER, UPPER, _) \
 	SERIALIZE__DEFINE(response_##LOWER, RESPONSE_##UPPER);
@@ -54,8 +65,19 @@
 	X(empty, EMPTY, __VA_ARGS__)                       \
 	X(files, FILES, __VA_ARGS__)                       \
 	X(servers, SERVERS, __VA_ARGS__)                   \
-	X(metadata, METADATA, __VA_ARGS__)
+	X(metadata, METADATA, __VA_ARGS__)                 \
+	X(pages, PAGES, __VA_ARGS__)                       \
+	X(changes, CHANGES, __VA_ARGS__)
 
 RESPONSE__TYPES(RESPONSE__DEFINE);
 
+/* Header of each of the changes in a CHANGES response, followed by n records
+ * made of a page number and the content of the page. */
+#define RESPONSE_CHANGE(X, ...)             \
+	X(uint64, index, ##__VA_ARGS__)     \
+	X(uint64, page_size, ##__VA_ARGS__) \
+	X(uint64, n, ##__VA_ARGS__)
+
+SERIALIZE__DEFINE(response_change, RESPONSE_CHANGE);
+
 #endif /* RESPONSE_H_ */
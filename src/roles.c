@@ -19,7 +19,12 @@
  * We implement two ingredients of role management: adjustments and handovers.
  * Adjustment runs on the cluster leader every tick (the frequency is defined
  * in server.c). The first step is to "poll" every server in the cluster to find
- * out whether it's online, and if so, its failure domain and weight. It demotes
+ * out whether it's online, and if so, its failure domain and weight. On the
+ * leader this information is available without any I/O: followers, and spares,
+ * which receive heartbeats only, report their failure domain and weight in
+ * every AppendEntries result, and raft tracks when each server was last heard
+ * from (see raft_peer_info). Servers that don't report metadata (i.e. running
+ * an older version) get the default failure domain and weight. It demotes
  * to spare any servers that appear to have gone offline, then, if the numbers
  * of (online) voters and standbys don't match the target values, chooses
  * servers that should be promoted or demoted. The preference ordering for
@@ -28,10 +33,7 @@
  *
  * The actual roles changes are computed in a batch each time adjustment
  * occurs, and are stored in a queue. Individual "change records" are taken
- * off this queue and applied asynchronously. Since we only have a blocking
- * client implementation available, the exchanges of requests and responses
- * that implements polling a single server happens on the libuv blocking
- * thread pool (see pollClusterAfterWorkCb). We don't start a new round of
+ * off this queue and applied asynchronously. We don't start a new round of
  * adjustment if a "tick" occurs while the queue of changes from the last
  * round is still nonempty.
  *
@@ -43,7 +45,11 @@
  * availability problems that can result if a privileged node (leader or
  * non-leader voter) crashes out of the cluster unceremoniously. The handover
  * task also needs to poll the cluster to figure out which nodes are good
- * candidates for promotion to voter.
+ * candidates for promotion to voter. When the handover runs on a node that is
+ * not the leader, which doesn't know the state of the other servers, they're
+ * polled over the network with the blocking client, on the libuv blocking
+ * thread pool (see pollClusterWorkCb). This only happens once, before the node
+ * shuts down.
  *
  * Unresolved
  * ----------
@@ -398,33 +404,62 @@ close:
 	clientClose(&proto);
 }
 
-/* Runs on the main thread after polling each server for roles adjustment. */
-static void pollClusterAfterWorkCb(uv_work_t *work, int status)
+/* Invoke the callback of a completed polling round and free the shared data.
+ * The given polling object and work request can be any of the round's ones. */
+static void pollClusterFinish(struct polling *polling, uv_work_t *work)
 {
-	struct polling *polling = work->data;
 	uv_work_t *work_objs;
 	struct polling *polling_objs;
 	unsigned i;
 
+	polling->cb(polling);
+	raft_free(polling->count);
+	for (i = 0; i < polling->n_cluster; i += 1) {
+		raft_free(polling->cluster[i].address);
+	}
+	raft_free(polling->cluster);
+	work_objs = work - polling->i;
+	raft_free(work_objs);
+	polling_objs = polling - polling->i;
+	raft_free(polling_objs);
+}
+
+/* Runs on the main thread after polling each server for roles adjustment. */
+static void pollClusterAfterWorkCb(uv_work_t *work, int status)
+{
+	struct polling *polling = work->data;
+
 	/* The only path to status != 0 involves calling uv_cancel on this task,
 	 * which we don't do. */
 	assert(status == 0);
 
 	*polling->count += 1;
-	/* If all nodes have been polled, invoke the callback. */
+	/* If all nodes have been polled, invoke the callback and free the
+	 * shared data, now that all tasks have finished. */
 	if (*polling->count == polling->n_cluster) {
-		polling->cb(polling);
-		/* Free the shared data, now that all tasks have finished. */
-		raft_free(polling->count);
-		for (i = 0; i < polling->n_cluster; i += 1) {
-			raft_free(polling->cluster[i].address);
-		}
-		raft_free(polling->cluster);
-		work_objs = work - polling->i;
-		raft_free(work_objs);
-		polling_objs = polling - polling->i;
-		raft_free(polling_objs);
+		pollClusterFinish(polling, work);
+	}
+}
+
+/* Fill in the state of a server using what the leader's raft instance knows
+ * about it, without performing any I/O. Spares are sent heartbeats too, so that
+ * they can be reported online. A server that is online but never reported its
+ * metadata, i.e. it's running an older version, gets the default failure
+ * domain and weight. */
+static void pollClusterFromRaft(struct dqlite_node *d,
+				struct all_node_info *info)
+{
+	struct raft_peer_info peer;
+	int rv;
+
+	rv = raft_peer_info(&d->raft, info->id, &peer);
+	if (rv != 0) {
+		info->online = false;
+		return;
 	}
+	info->online = peer.online;
+	info->failure_domain = peer.has_metadata ? peer.failure_domain : 0;
+	info->weight = peer.has_metadata ? peer.weight : 0;
 }
 
 /* Poll every node in the cluster to learn whether it's online, and if so, its
@@ -439,9 +474,11 @@ static void pollCluster(struct dqlite_node *d, void (*cb)(struct polling *))
 	struct uv_work_s *work;
 	unsigned *count;
 	unsigned n;
+	unsigned n_objs;
 	unsigned i;
 	unsigned j;
 	unsigned ii;
+	bool from_raft;
 	int rv;
 
 	n = d->raft.configuration.n;
@@ -465,15 +502,21 @@ static void pollCluster(struct dqlite_node *d, void (*cb)(struct polling *))
 		       strlen(server->address) + 1);
 		cluster[i].role = translateRaftRole(server->role);
 	}
-	polling_objs = raft_calloc(n, sizeof *polling_objs);
+	/* Allocate at least one polling object, so that an empty configuration
+	 * can be reported to the callback too. */
+	n_objs = n > 0 ? n : 1;
+	polling_objs = raft_calloc(n_objs, sizeof *polling_objs);
 	if (polling_objs == NULL) {
 		goto err_after_alloc_addrs;
 	}
-	work_objs = raft_calloc(n, sizeof *work_objs);
+	work_objs = raft_calloc(n_objs, sizeof *work_objs);
 	if (work_objs == NULL) {
 		goto err_after_alloc_polling;
 	}
-	for (j = 0; j < n; j += 1) {
+	/* Only the leader knows the state of the other servers. A handover
+	 * started on a follower polls them over the network instead. */
+	from_raft = raft_state(&d->raft) == RAFT_LEADER;
+	for (j = 0; j < n_objs; j += 1) {
 		polling = &polling_objs[j];
 		polling->cb = cb;
 		polling->node = d;
@@ -483,6 +526,22 @@ static void pollCluster(struct dqlite_node *d, void (*cb)(struct polling *))
 		polling->i = j;
 		work = &work_objs[j];
 		work->data = polling;
+		if (j < n && from_raft) {
+			pollClusterFromRaft(d, &cluster[j]);
+			work->data = NULL;
+			*count += 1;
+		}
+	}
+	/* Every server is known to raft, no need to hit the network. */
+	if (*count == n) {
+		pollClusterFinish(&polling_objs[0], &work_objs[0]);
+		return;
+	}
+	for (j = 0; j < n; j += 1) {
+		work = &work_objs[j];
+		if (work->data == NULL) {
+			continue;
+		}
 		rv = uv_queue_work(&d->loop, work, pollClusterWorkCb,
 				   pollClusterAfterWorkCb);
 		/* uv_queue_work can't fail unless a NULL callback is passed. */
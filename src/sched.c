@@ -0,0 +1,267 @@
+#include "sched.h"
+#include "tracing.h"
+#include "utils.h"
+
+/* Service time assumed for a class or connection before any request of it
+ * completes, in microseconds. */
+#define SCHED_DEFAULT_SERVICE 1000
+
+/* Update an average service time with a new sample, giving it a weight of
+ * 1/8, or initialize it with the first one. */
+static uint64_t schedAverage(uint64_t average, uint64_t sample)
+{
+	if (average == 0) {
+		return sample > 0 ? sample : 1;
+	}
+	return average - average / 8 + sample / 8;
+}
+
+/* Counters are only written by the main loop, so there is no need for atomic
+ * read-modify-write operations, only for atomic stores that other threads can
+ * load without tearing. */
+static void schedStatsMax(atomic_uint_least64_t *counter, uint64_t value)
+{
+	if (atomic_load_explicit(counter, memory_order_relaxed) < value) {
+		atomic_store_explicit(counter, value, memory_order_relaxed);
+	}
+}
+
+static void schedStatsAdd(atomic_uint_least64_t *counter, uint64_t value)
+{
+	atomic_store_explicit(
+	    counter, atomic_load_explicit(counter, memory_order_relaxed) + value,
+	    memory_order_relaxed);
+}
+
+static void schedStatsPublish(struct sched_class *c)
+{
+	atomic_store_explicit(&c->stats.running, c->running,
+			      memory_order_relaxed);
+	atomic_store_explicit(&c->stats.waiting, c->waiting,
+			      memory_order_relaxed);
+}
+
+/* Whether the given database has room for another request of the class,
+ * assuming that the node has. */
+static bool schedDbHasRoom(struct sched *s, int class, struct sched_db *db)
+{
+	unsigned limit = s->config->sched_db_limits[class];
+	return limit == 0 || db->running[class] < limit;
+}
+
+static bool schedNodeHasRoom(struct sched *s, int class)
+{
+	unsigned limit = s->config->sched_limits[class];
+	return limit == 0 || s->classes[class].running < limit;
+}
+
+/* Expected time in microseconds that a new request of the class would spend
+ * in the queue before starting, given the requests ahead of it and the rate at
+ * which each limit lets them drain. */
+static uint64_t schedExpectedWait(struct sched *s,
+				  int class,
+				  struct sched_db *db)
+{
+	struct sched_class *c = &s->classes[class];
+	uint64_t service = c->service > 0 ? c->service : SCHED_DEFAULT_SERVICE;
+	unsigned limit = s->config->sched_limits[class];
+	unsigned db_limit = s->config->sched_db_limits[class];
+	uint64_t wait = 0;
+	uint64_t db_wait;
+
+	if (limit != 0) {
+		wait = (uint64_t)(c->waiting + 1) * service / limit;
+	}
+	if (db_limit != 0) {
+		db_wait = (uint64_t)(db->waiting[class] + 1) * service / db_limit;
+		wait = db_wait > wait ? db_wait : wait;
+	}
+	return wait;
+}
+
+static void schedStart(struct sched *s, struct sched_req *req, uint64_t now)
+{
+	struct sched_class *c = &s->classes[req->class];
+	uint64_t wait;
+
+	c->running++;
+	req->db->running[req->class]++;
+	if (req->start > c->vtime) {
+		c->vtime = req->start;
+	}
+	req->started = now;
+
+	wait = (now - req->submitted) / 1000;
+	schedStatsAdd(&c->stats.admitted, 1);
+	schedStatsAdd(&c->stats.wait_total, wait);
+	schedStatsMax(&c->stats.wait_max, wait);
+}
+
+void sched_init(struct sched *s, struct config *config)
+{
+	int i;
+	s->config = config;
+	for (i = 0; i < SCHED_NR; i++) {
+		struct sched_class *c = &s->classes[i];
+		c->running = 0;
+		c->waiting = 0;
+		c->vtime = 0;
+		c->service = 0;
+		queue_init(&c->waiters);
+		atomic_init(&c->stats.admitted, 0);
+		atomic_init(&c->stats.rejected, 0);
+		atomic_init(&c->stats.wait_total, 0);
+		atomic_init(&c->stats.wait_max, 0);
+		atomic_init(&c->stats.running, 0);
+		atomic_init(&c->stats.waiting, 0);
+	}
+}
+
+void sched_db_init(struct sched_db *db)
+{
+	int i;
+	for (i = 0; i < SCHED_NR; i++) {
+		db->running[i] = 0;
+		db->waiting[i] = 0;
+	}
+}
+
+void sched_conn_init(struct sched_conn *conn)
+{
+	int i;
+	conn->weight = 1;
+	for (i = 0; i < SCHED_NR; i++) {
+		conn->finish[i] = 0;
+		conn->service[i] = 0;
+	}
+}
+
+int sched_submit(struct sched *s,
+		 struct sched_req *req,
+		 int class,
+		 struct sched_db *db,
+		 struct sched_conn *conn,
+		 uint64_t now,
+		 unsigned *retry_after)
+{
+	PRE(class == SCHED_READ || class == SCHED_WRITE);
+	PRE(conn->weight > 0);
+	struct sched_class *c = &s->classes[class];
+	uint64_t service;
+	uint64_t wait;
+	unsigned target = s->config->sched_target;
+	bool fits = schedNodeHasRoom(s, class) && schedDbHasRoom(s, class, db);
+
+	if (!fits && target != 0) {
+		wait = schedExpectedWait(s, class, db);
+		if (wait > (uint64_t)target * 1000) {
+			*retry_after = (unsigned)((wait + 999) / 1000);
+			tracef("sched reject class %d retry after %u ms", class,
+			       *retry_after);
+			schedStatsAdd(&c->stats.rejected, 1);
+			return SCHED_REJECTED;
+		}
+	}
+
+	req->class = class;
+	req->db = db;
+	req->conn = conn;
+	req->submitted = now;
+	req->started = 0;
+	queue_init(&req->queue);
+
+	/* The start tag is the virtual time at which the request would start
+	 * if each connection got its share of the node, and its finish tag adds
+	 * the expected service time of the request, scaled by the weight. */
+	service = conn->service[class];
+	if (service == 0) {
+		service = c->service > 0 ? c->service : SCHED_DEFAULT_SERVICE;
+	}
+	req->start = conn->finish[class] > c->vtime ? conn->finish[class]
+						    : c->vtime;
+	conn->finish[class] = req->start + service / conn->weight;
+
+	if (fits) {
+		schedStart(s, req, now);
+		schedStatsPublish(c);
+		return SCHED_STARTED;
+	}
+
+	queue_insert_tail(&c->waiters, &req->queue);
+	c->waiting++;
+	db->waiting[class]++;
+	schedStatsPublish(c);
+	return SCHED_QUEUED;
+}
+
+struct sched_req *sched_done(struct sched *s,
+			     struct sched_req *req,
+			     uint64_t now)
+{
+	struct sched_class *c = &s->classes[req->class];
+	struct sched_req *next = NULL;
+	uint64_t service = (now - req->started) / 1000;
+	queue *head;
+
+	PRE(c->running > 0 && req->db->running[req->class] > 0);
+	c->running--;
+	req->db->running[req->class]--;
+	c->service = schedAverage(c->service, service);
+	req->conn->service[req->class] =
+	    schedAverage(req->conn->service[req->class], service);
+
+	/* Pick the waiter with the lowest start tag among those whose database
+	 * has room. There is at most one waiter per connection, so the queue is
+	 * short enough for a scan. */
+	if (schedNodeHasRoom(s, req->class)) {
+		QUEUE_FOREACH(head, &c->waiters)
+		{
+			struct sched_req *other =
+			    QUEUE_DATA(head, struct sched_req, queue);
+			if (!schedDbHasRoom(s, req->class, other->db)) {
+				continue;
+			}
+			if (next == NULL || other->start < next->start) {
+				next = other;
+			}
+		}
+	}
+
+	if (next != NULL) {
+		sched_cancel(s, next);
+		schedStart(s, next, now);
+	}
+	schedStatsPublish(c);
+	return next;
+}
+
+void sched_cancel(struct sched *s, struct sched_req *req)
+{
+	struct sched_class *c = &s->classes[req->class];
+
+	PRE(!queue_empty(&req->queue));
+	queue_remove(&req->queue);
+	queue_init(&req->queue);
+	c->waiting--;
+	req->db->waiting[req->class]--;
+	schedStatsPublish(c);
+}
+
+void sched_stats(struct sched *s, int class, struct dqlite_sched_stats *stats)
+{
+	PRE(class == SCHED_READ || class == SCHED_WRITE);
+	struct sched_stats *src = &s->classes[class].stats;
+
+	stats->admitted =
+	    atomic_load_explicit(&src->admitted, memory_order_relaxed);
+	stats->rejected =
+	    atomic_load_explicit(&src->rejected, memory_order_relaxed);
+	stats->wait_total =
+	    atomic_load_explicit(&src->wait_total, memory_order_relaxed);
+	stats->wait_max =
+	    atomic_load_explicit(&src->wait_max, memory_order_relaxed);
+	stats->running =
+	    atomic_load_explicit(&src->running, memory_order_relaxed);
+	stats->waiting =
+	    atomic_load_explicit(&src->waiting, memory_order_relaxed);
+}
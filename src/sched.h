@@ -0,0 +1,134 @@
+/**
+ * Admission control for the statements executed by leader connections.
+ *
+ * Statements are split in a read and a write class. Each class has a limit on
+ * the statements running at the same time across the whole node and one on
+ * those running against the same database. Statements that don't fit wait in
+ * a queue shared by all the connections of the node, and are started in order
+ * of their start tag, following start-time fair queuing: each connection is
+ * charged the service time of its past statements, divided by its weight, so
+ * that a connection running expensive statements can't starve the others.
+ *
+ * When a target latency is set, a statement that would wait longer than that
+ * in the queue is rejected right away, along with an estimate of how long the
+ * client should wait before retrying.
+ *
+ * Everything runs in the thread of the main loop, except for reading the
+ * statistics.
+ */
+
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "../include/dqlite.h"
+
+#include "config.h"
+#include "lib/queue.h"
+
+enum {
+	SCHED_READ = DQLITE_SCHED_READ,
+	SCHED_WRITE = DQLITE_SCHED_WRITE,
+	SCHED_NR,
+};
+
+/* Result of sched_submit. */
+enum {
+	SCHED_STARTED,  /* The request can run right away */
+	SCHED_QUEUED,   /* The request will be returned by a later sched_done */
+	SCHED_REJECTED, /* The queue is too long, try again later */
+};
+
+/* Statistics of a class, which can be read from any thread. */
+struct sched_stats {
+	atomic_uint_least64_t admitted;   /* Requests started */
+	atomic_uint_least64_t rejected;   /* Requests rejected */
+	atomic_uint_least64_t wait_total; /* Microseconds spent in the queue */
+	atomic_uint_least64_t wait_max;   /* Longest wait, in microseconds */
+	atomic_uint running;              /* Requests running */
+	atomic_uint waiting;              /* Requests in the queue */
+};
+
+struct sched_class {
+	unsigned running;         /* Requests running across all databases */
+	unsigned waiting;         /* Requests in the queue */
+	uint64_t vtime;           /* Start tag of the last started request */
+	uint64_t service;         /* Average service time, in microseconds */
+	queue waiters;            /* Queued requests, in submission order */
+	struct sched_stats stats; /* Published counters */
+};
+
+struct sched {
+	struct config *config;                /* Limits and target */
+	struct sched_class classes[SCHED_NR]; /* Read and write classes */
+};
+
+/* Requests of a single database, embedded in struct db. */
+struct sched_db {
+	unsigned running[SCHED_NR];
+	unsigned waiting[SCHED_NR];
+};
+
+/* Client connection submitting requests, embedded in struct leader. */
+struct sched_conn {
+	unsigned weight;            /* Share of the node, 1 by default */
+	uint64_t finish[SCHED_NR];  /* Finish tag of the last request */
+	uint64_t service[SCHED_NR]; /* Average service time, in microseconds */
+};
+
+struct sched_req {
+	int class;              /* SCHED_READ or SCHED_WRITE */
+	struct sched_db *db;    /* Database the request runs against */
+	struct sched_conn *conn; /* Connection that submitted the request */
+	uint64_t start;         /* Start tag */
+	uint64_t submitted;     /* Time of submission, in nanoseconds */
+	uint64_t started;       /* Time the request started, in nanoseconds */
+	queue queue;            /* Entry in the waiters of the class */
+};
+
+void sched_init(struct sched *s, struct config *config);
+
+void sched_db_init(struct sched_db *db);
+
+void sched_conn_init(struct sched_conn *conn);
+
+/**
+ * Submit a request of the given class at time @now, in nanoseconds.
+ *
+ * Return SCHED_STARTED if the request fits the limits of its class, and
+ * SCHED_QUEUED if it was put in the queue. Return SCHED_REJECTED and set
+ * @retry_after to a number of milliseconds if the request would wait longer
+ * than the target latency.
+ */
+int sched_submit(struct sched *s,
+		 struct sched_req *req,
+		 int class,
+		 struct sched_db *db,
+		 struct sched_conn *conn,
+		 uint64_t now,
+		 unsigned *retry_after);
+
+/**
+ * Release the slot of a started request at time @now.
+ *
+ * Return the queued request that takes its place, if any, which the caller
+ * must then run.
+ */
+struct sched_req *sched_done(struct sched *s,
+			     struct sched_req *req,
+			     uint64_t now);
+
+/**
+ * Remove a queued request, which will never start.
+ */
+void sched_cancel(struct sched *s, struct sched_req *req);
+
+/**
+ * Copy the statistics of the given class.
+ */
+void sched_stats(struct sched *s, int class, struct dqlite_sched_stats *stats);
+
+#endif /* SCHED_H_ */
@@ -17,6 +17,7 @@
 #include "lib/fs.h"
 #include "lib/queue.h"
 #include "lib/threadpool.h"
+#include "local.h"
 #include "logger.h"
 #include "protocol.h"
 #include "roles.h"
@@ -114,6 +115,7 @@ int dqlite__init(struct dqlite_node *d,
 		rv = DQLITE_ERROR;
 		goto err;
 	}
+	d->registry.raft = &d->raft;
 	/* TODO: expose these values through some API */
 	raft_set_election_timeout(&d->raft, 3000);
 	raft_set_heartbeat_timeout(&d->raft, 500);
@@ -148,6 +150,9 @@ int dqlite__init(struct dqlite_node *d,
 	queue_init(&d->queue);
 	queue_init(&d->conns);
 	queue_init(&d->roles_changes);
+	queue_init(&d->locals);
+	queue_init(&d->local_ready);
+	atomic_init(&d->local_inbox, NULL);
 	d->raft_state = RAFT_UNAVAILABLE;
 	d->running = false;
 	d->listener = NULL;
@@ -459,6 +464,15 @@ int dqlite_node_enable_disk_mode(dqlite_node *n)
 	return 0;
 }
 
+int dqlite_node_enable_tiered_mode(dqlite_node *n, size_t memory_budget)
+{
+	if (n->running || n->config.disk) {
+		return DQLITE_MISUSE;
+	}
+
+	return VfsEnableTiered(&n->vfs, n->config.database_dir, memory_budget);
+}
+
 static int maybeBootstrap(dqlite_node *d,
 			  dqlite_node_id id,
 			  const char *address)
@@ -500,6 +514,7 @@ static void raftCloseCb(struct raft *raft)
 {
 	struct dqlite_node *s = raft->data;
 	raft_uv_close(&s->raft_io);
+	LocalClose(s);
 	uv_close((struct uv_handle_s *)&s->stop, NULL);
 	uv_close((struct uv_handle_s *)&s->handover, NULL);
 	uv_close((struct uv_handle_s *)&s->startup, NULL);
@@ -555,6 +570,7 @@ static void stopCb(uv_async_t *stop)
 		assert(rv == 0);
 		RolesCancelPendingChanges(d);
 	}
+	LocalStop(d);
 	d->running = false;
 
 	QUEUE_FOREACH(head, &d->conns)
@@ -700,6 +716,7 @@ static int taskRun(struct dqlite_node *d)
 	d->stop.data = d;
 	rv = uv_async_init(&d->loop, &d->stop, stopCb);
 	assert(rv == 0);
+	LocalStart(d);
 
 	/* Schedule startup_cb to be fired as soon as the loop starts. It will
 	 * unblock clients of taskReady. */
@@ -721,6 +738,8 @@ static int taskRun(struct dqlite_node *d)
 	}
 
 	d->raft.data = d;
+	raft_set_metadata(&d->raft, d->config.failure_domain,
+			  d->config.weight);
 	rv = raft_start(&d->raft);
 	if (rv != 0) {
 		snprintf(d->errmsg, DQLITE_ERRMSG_BUF_SIZE, "raft_start(): %s",
@@ -764,11 +783,114 @@ int dqlite_node_set_busy_timeout(dqlite_node *n, unsigned msecs)
 	return 0;
 }
 
+int dqlite_node_set_sched_limits(dqlite_node *n,
+				 int klass,
+				 unsigned limit,
+				 unsigned db_limit)
+{
+	if (klass != DQLITE_SCHED_READ && klass != DQLITE_SCHED_WRITE) {
+		return DQLITE_MISUSE;
+	}
+	n->config.sched_limits[klass] = limit;
+	n->config.sched_db_limits[klass] = db_limit;
+	return 0;
+}
+
+int dqlite_node_set_sched_target(dqlite_node *n, unsigned msecs)
+{
+	n->config.sched_target = msecs;
+	return 0;
+}
+
+int dqlite_node_get_sched_stats(dqlite_node *n,
+				int klass,
+				struct dqlite_sched_stats *stats)
+{
+	if (klass != DQLITE_SCHED_READ && klass != DQLITE_SCHED_WRITE) {
+		return DQLITE_MISUSE;
+	}
+	sched_stats(&n->registry.sched, klass, stats);
+	return 0;
+}
+
+int dqlite_node_set_query_slice(dqlite_node *n, unsigned steps, unsigned usecs)
+{
+	n->config.query_slice_steps = steps;
+	n->config.query_slice_usecs = usecs;
+	return 0;
+}
+
+int dqlite_node_set_change_feed(dqlite_node *n, size_t size)
+{
+	if (n->running) {
+		return DQLITE_MISUSE;
+	}
+	n->config.feed_size = size;
+	return 0;
+}
+
 int dqlite_node_set_snapshot_compression(dqlite_node *n, bool enabled)
 {
 	return raft_uv_set_snapshot_compression(&n->raft_io, enabled);
 }
 
+int dqlite_node_set_snapshot_chunks(dqlite_node *n, bool enabled)
+{
+	raft_uv_set_snapshot_chunks(&n->raft_io, enabled);
+	return 0;
+}
+
+int dqlite_node_set_entries_compression(dqlite_node *n, size_t threshold)
+{
+	return raft_uv_set_entries_compression(&n->raft_io, threshold);
+}
+
+int dqlite_node_set_log_cache_size(dqlite_node *n, size_t size)
+{
+	raft_set_log_cache_size(&n->raft, size);
+	return 0;
+}
+
+int dqlite_node_set_disk_checkpoint_sync(dqlite_node *n, bool enabled)
+{
+	return VfsDiskSetCheckpointSync(&n->vfs, enabled);
+}
+
+int dqlite_node_set_snapshot_chain(dqlite_node *n, unsigned length)
+{
+	n->config.snapshot_chain = length;
+	return 0;
+}
+
+int dqlite_node_set_frames_delta(dqlite_node *n, bool enabled)
+{
+	n->config.frames_delta = enabled;
+	return 0;
+}
+
+int dqlite_node_set_span_tracing(dqlite_node *n,
+				 unsigned rate,
+				 dqlite_span_cb cb,
+				 void *arg)
+{
+	if (rate > 0 && cb == NULL) {
+		return DQLITE_MISUSE;
+	}
+	n->config.span_rate = rate;
+	n->config.span_cb = cb;
+	n->config.span_arg = arg;
+	raft_set_request_timings(&n->raft, rate > 0);
+	return 0;
+}
+
+int dqlite_node_set_segment_pool(dqlite_node *n,
+				 unsigned prepared,
+				 unsigned recycled)
+{
+	raft_uv_set_segment_pool(&n->raft_io, prepared, recycled);
+	return 0;
+}
+
 int dqlite_node_set_auto_recovery(dqlite_node *n, bool enabled)
 {
 	raft_uv_set_auto_recovery(&n->raft_io, enabled);
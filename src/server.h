@@ -4,6 +4,7 @@
 #include <sqlite3.h>
 
 #include <semaphore.h>
+#include <stdatomic.h>
 
 #include "client/protocol.h"
 #include "config.h"
@@ -15,6 +16,8 @@
 
 #define DQLITE_ERRMSG_BUF_SIZE 300
 
+struct local_request;
+
 /**
  * A single dqlite server instance.
  */
@@ -44,6 +47,10 @@ struct dqlite_node {
 	int handover_status;
 	void (*handover_done_cb)(struct dqlite_node *, int);
 	struct uv_async_s stop;    /* Trigger UV loop stop */
+	struct uv_async_s local_wakeup; /* Serve requests of local connections */
+	_Atomic(struct local_request *) local_inbox; /* Newest request first */
+	queue locals;              /* Open local connections */
+	queue local_ready;         /* Local connections to serve again */
 	struct uv_timer_s startup; /* Unblock ready sem */
 	struct uv_timer_s timer;
 	int raft_state;     /* Previous raft state */
@@ -0,0 +1,73 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "span.h"
+
+/* Phases of a request, delimited by two points. */
+static const struct
+{
+	const char *name;
+	int from;
+	int to;
+} spanPhases[] = {
+    {"request", SPAN_SUBMITTED, SPAN_DONE},
+    {"prepare", SPAN_SUBMITTED, SPAN_PREPARED},
+    {"queue", SPAN_PREPARED, SPAN_DEQUEUED},
+    {"barrier", SPAN_DEQUEUED, SPAN_STARTED},
+    {"step", SPAN_STARTED, SPAN_STEPPED},
+    {"poll", SPAN_STEPPED, SPAN_POLLED},
+    {"encode", SPAN_POLLED, SPAN_ENCODED},
+    {"propose", SPAN_ENCODED, SPAN_PROPOSED},
+    {"disk", SPAN_PROPOSED, SPAN_STORED},
+    {"quorum", SPAN_PROPOSED, SPAN_COMMITTED},
+    {"apply", SPAN_COMMITTED, SPAN_APPLIED},
+    {"reply", SPAN_APPLIED, SPAN_DONE},
+};
+
+uint64_t span_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+size_t span_encode(const struct span *s, uint64_t node_id, char *buf, size_t size)
+{
+	size_t offset = 0;
+	uint64_t start;
+	uint64_t end;
+	unsigned i;
+	int from;
+	int rv;
+
+	rv = snprintf(buf, size, "[");
+	offset += (size_t)rv;
+	for (i = 0; i < sizeof spanPhases / sizeof spanPhases[0]; i++) {
+		/* Phases starting at a skipped point start at the last point
+		 * that was reached before it. */
+		for (from = spanPhases[i].from;
+		     from > SPAN_SUBMITTED && s->times[from] == 0; from--) {
+		}
+		start = s->times[from];
+		end = s->times[spanPhases[i].to];
+		if (start == 0 || end < start) {
+			continue;
+		}
+		rv = snprintf(buf + (offset < size ? offset : size),
+			      offset < size ? size - offset : 0,
+			      "%s{\"name\":\"%s\",\"cat\":\"dqlite\",\"ph\":\"X\","
+			      "\"pid\":%" PRIu64 ",\"tid\":%" PRIu64 ","
+			      "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64
+			      ".%03u,\"args\":{\"index\":%" PRIu64 "}}",
+			      offset > 1 ? "," : "", spanPhases[i].name,
+			      node_id, s->index, start / 1000,
+			      (unsigned)(start % 1000), (end - start) / 1000,
+			      (unsigned)((end - start) % 1000), s->index);
+		offset += (size_t)rv;
+	}
+	rv = snprintf(buf + (offset < size ? offset : size),
+		      offset < size ? size - offset : 0, "]");
+	offset += (size_t)rv;
+	return offset;
+}
@@ -0,0 +1,73 @@
+/**
+ * Timeline of a write request on the leader, used to break down its latency.
+ */
+
+#ifndef SPAN_H_
+#define SPAN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "utils.h"
+
+/* Points in the life of a request, in the order they are normally reached. A
+ * point that is skipped (e.g. no barrier was needed) keeps a zero time. */
+enum {
+	SPAN_SUBMITTED, /* Handed over by the gateway */
+	SPAN_PREPARED,  /* Statement prepared, after the prepare barrier */
+	SPAN_DEQUEUED,  /* Out of the pending queue of the database */
+	SPAN_STARTED,   /* Run barrier done, about to step the statement */
+	SPAN_STEPPED,   /* sqlite3_step done */
+	SPAN_POLLED,    /* Transaction pages collected by VfsPoll */
+	SPAN_ENCODED,   /* Raft command encoded */
+	SPAN_PROPOSED,  /* raft_apply returned, disk write started */
+	SPAN_STORED,    /* Entry persisted by the leader */
+	SPAN_COMMITTED, /* Entry acknowledged by a quorum */
+	SPAN_APPLIED,   /* Entry applied to the FSM, checkpoint included */
+	SPAN_DONE,      /* Result handed back to the gateway */
+	SPAN_NR,
+};
+
+struct span
+{
+	bool enabled;            /* Whether times are being recorded */
+	uint64_t index;          /* Raft index of the entry, if any */
+	uint64_t times[SPAN_NR]; /* Monotonic times in nanoseconds */
+};
+
+/* Current monotonic time in nanoseconds. */
+uint64_t span_now(void);
+
+/* Start recording the times of a new request, if enabled. */
+static inline void span_init(struct span *s, bool enabled)
+{
+	s->enabled = enabled;
+	s->index = 0;
+	if (UNLIKELY(enabled)) {
+		memset(s->times, 0, sizeof s->times);
+		s->times[SPAN_SUBMITTED] = span_now();
+	}
+}
+
+/* Record the current time as the given point. */
+static inline void span_mark(struct span *s, int point)
+{
+	if (UNLIKELY(s->enabled)) {
+		s->times[point] = span_now();
+	}
+}
+
+/**
+ * Encode the span as a JSON array of events in the Trace Event Format, which
+ * can be loaded in chrome://tracing or Perfetto. Each phase of the request is
+ * a complete event nested in one covering the whole request, and the events
+ * of all requests of a node share its ID as process ID.
+ *
+ * Returns the length of the encoded string, which is truncated if longer than
+ * @size - 1, like snprintf.
+ */
+size_t span_encode(const struct span *s, uint64_t node_id, char *buf, size_t size);
+
+#endif /* SPAN_H_ */
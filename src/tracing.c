@@ -1,4 +1,8 @@
 #include "tracing.h"
+#include <pthread.h>     /* pthread_mutex_t */
+#include <stdarg.h>      /* va_list */
+#include <stdatomic.h>   /* atomic_uint_least64_t */
+#include <stddef.h>      /* ptrdiff_t */
 #include <stdio.h> /* stderr */
 #include <stdlib.h>
 #include <string.h>      /* strstr, strlen */
@@ -8,23 +12,88 @@
 #include "lib/byte.h"    /* ARRAY_SIZE */
 
 #define LIBDQLITE_TRACE "LIBDQLITE_TRACE"
+#define LIBDQLITE_TRACE_RING "LIBDQLITE_TRACE_RING"
+
+/* Maximum number of arguments and of bytes of string arguments saved in a
+ * ring buffer record. Extra arguments are dropped and strings truncated. */
+#define TRACER_ARGS_MAX 8
+#define TRACER_STRINGS_SIZE 48
 
 bool _dqliteTracingEnabled = false;
 static unsigned tracer__level;
 static pid_t tracerPidCached;
 
+/* A trace recorded in a ring buffer. The format string is not copied, it's
+ * only decoded when the ring is dumped. */
+struct tracerRecord
+{
+	/* Index of the record in the ring plus one, or zero while the record
+	 * is being written. */
+	atomic_uint_least64_t seq;
+	uint64_t time;
+	const char *file;
+	const char *func;
+	const char *fmt;
+	unsigned line;
+	unsigned level;
+	uint64_t args[TRACER_ARGS_MAX];
+	char strings[TRACER_STRINGS_SIZE];
+};
+
+/* Ring buffer of the traces of a single thread. Only the owning thread writes
+ * records, so recording a trace takes no lock. */
+struct tracerRing
+{
+	struct tracerRing *next;
+	pid_t tid;
+	atomic_uint_least64_t head; /* Index of the next record to write */
+	uint64_t tail;              /* Index of the next record to dump */
+	uint64_t mask;
+	struct tracerRecord records[];
+};
+
+static size_t tracerRingSize;
+static __thread struct tracerRing *tracerRingLocal;
+static struct tracerRing *tracerRings;
+static pthread_mutex_t tracerRingsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tracerAtExitOnce = PTHREAD_ONCE_INIT;
+
+static void tracerAtExit(void)
+{
+	dqliteTracingDump(stderr);
+}
+
+static void tracerRegisterAtExit(void)
+{
+	atexit(tracerAtExit);
+}
+
 void dqliteTracingMaybeEnable(bool enable)
 {
 	const char *trace_level = getenv(LIBDQLITE_TRACE);
+	const char *trace_ring = getenv(LIBDQLITE_TRACE_RING);
+	size_t size;
 
-	if (trace_level != NULL) {
+	if (trace_level != NULL || trace_ring != NULL) {
 		tracerPidCached = getpid();
 		_dqliteTracingEnabled = enable;
 
-		tracer__level = (unsigned)atoi(trace_level);
+		tracer__level =
+		    trace_level != NULL ? (unsigned)atoi(trace_level) : 0;
 		tracer__level =
 		    tracer__level < TRACE_NR ? tracer__level : TRACE_NONE;
 	}
+
+	/* The size of the rings can't change once they are allocated. */
+	if (trace_ring != NULL && tracerRingSize == 0) {
+		size = (size_t)strtoul(trace_ring, NULL, 10);
+		if (size > 0) {
+			for (tracerRingSize = 1; tracerRingSize < size;) {
+				tracerRingSize <<= 1;
+			}
+			pthread_once(&tracerAtExitOnce, tracerRegisterAtExit);
+		}
+	}
 }
 
 static inline const char *tracerShortFileName(const char *fname)
@@ -45,8 +114,6 @@ static inline const char *tracerTraceLevelName(unsigned int level)
 	return level < ARRAY_SIZE(levels) ? levels[level] : levels[0];
 }
 
-static pid_t tracerPidCached;
-
 /* NOTE: on i386 and other platforms there're no specifically imported gettid()
    functions in unistd.h
 */
@@ -55,31 +122,39 @@ static inline pid_t gettidImpl(void)
 	return (pid_t)syscall(SYS_gettid);
 }
 
-static inline void tracerEmit(const char *file,
-			      unsigned int line,
-			      const char *func,
-			      unsigned int level,
-			      const char *message)
+static inline uint64_t tracerNow(void)
 {
 	struct timespec ts = {0};
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline void tracerEmitTo(FILE *f,
+				uint64_t time,
+				pid_t tid,
+				const char *file,
+				unsigned int line,
+				const char *func,
+				unsigned int level,
+				const char *message)
+{
+	time_t sec = (time_t)(time / 1000000000);
 	struct tm tm;
-	pid_t tid = gettidImpl();
 
-	clock_gettime(CLOCK_REALTIME, &ts);
-	gmtime_r(&ts.tv_sec, &tm);
+	gmtime_r(&sec, &tm);
 
 	/*
 	  Example:
 	  LIBDQLITE[182942] 2023-11-27T14:46:24.912050507 001132 INFO
 	  uvClientSend  src/uv_send.c:218 connection available...
 	*/
-	fprintf(stderr,
+	fprintf(f,
 		"LIBDQLITE[%6.6u] %04d-%02d-%02dT%02d:%02d:%02d.%09lu "
 		"%6.6u %-7s %-20s %s:%-3i %s\n",
 		tracerPidCached,
 
 		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
-		tm.tm_min, tm.tm_sec, (unsigned long)ts.tv_nsec,
+		tm.tm_min, tm.tm_sec, (unsigned long)(time % 1000000000),
 
 		(unsigned)tid, tracerTraceLevelName(level), func,
 		tracerShortFileName(file), line, message);
@@ -94,17 +169,410 @@ void stderrTracerEmit(const char *file,
 	assert(tracer__level < TRACE_NR);
 
 	if (level >= tracer__level)
-		tracerEmit(file, line, func, level, message);
+		tracerEmitTo(stderr, tracerNow(), gettidImpl(), file, line,
+			     func, level, message);
+}
+
+/* Kinds of the arguments consumed by a printf conversion. */
+enum {
+	TRACER_ARG_NONE,
+	TRACER_ARG_INT,
+	TRACER_ARG_LONG,
+	TRACER_ARG_LLONG,
+	TRACER_ARG_SIZE,
+	TRACER_ARG_INTMAX,
+	TRACER_ARG_PTRDIFF,
+	TRACER_ARG_DOUBLE,
+	TRACER_ARG_LDOUBLE,
+	TRACER_ARG_POINTER,
+	TRACER_ARG_STRING,
+};
+
+/* A conversion specification of a printf format string. */
+struct tracerSpec
+{
+	const char *start; /* The '%' character */
+	size_t len;        /* Up to and including the conversion character */
+	int star_width;    /* The width is passed as an int argument */
+	int star_precision;
+	int kind;
+};
+
+/* Find the next conversion of the format string, returning false if there's
+ * none left. Literal "%%" are treated as conversions without arguments. */
+static bool tracerNextSpec(const char **fmt, struct tracerSpec *spec)
+{
+	const char *p = strchr(*fmt, '%');
+	int length = 0;
+
+	if (p == NULL) {
+		return false;
+	}
+	*spec = (struct tracerSpec){ .start = p++ };
+	while (*p != '\0' && strchr("-+ #0'", *p) != NULL) {
+		p++;
+	}
+	if (*p == '*') {
+		spec->star_width = 1;
+		p++;
+	}
+	while (*p >= '0' && *p <= '9') {
+		p++;
+	}
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->star_precision = 1;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9') {
+			p++;
+		}
+	}
+	for (; *p != '\0' && strchr("hlzjtLq", *p) != NULL; p++) {
+		length = *p == 'l' && length == 'l' ? 'q' : *p;
+	}
+	switch (*p) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+			switch (length) {
+				case 'l':
+					spec->kind = TRACER_ARG_LONG;
+					break;
+				case 'q':
+					spec->kind = TRACER_ARG_LLONG;
+					break;
+				case 'z':
+					spec->kind = TRACER_ARG_SIZE;
+					break;
+				case 'j':
+					spec->kind = TRACER_ARG_INTMAX;
+					break;
+				case 't':
+					spec->kind = TRACER_ARG_PTRDIFF;
+					break;
+				default:
+					spec->kind = TRACER_ARG_INT;
+					break;
+			}
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			spec->kind = length == 'L' ? TRACER_ARG_LDOUBLE
+						   : TRACER_ARG_DOUBLE;
+			break;
+		case 'p':
+			spec->kind = TRACER_ARG_POINTER;
+			break;
+		case 's':
+			spec->kind = TRACER_ARG_STRING;
+			break;
+		case '%':
+			spec->kind = TRACER_ARG_NONE;
+			break;
+		default:
+			/* Unknown conversion: stop parsing here. */
+			return false;
+	}
+	p++;
+	spec->len = (size_t)(p - spec->start);
+	*fmt = p;
+	return true;
+}
+
+static struct tracerRing *tracerRingGet(void)
+{
+	struct tracerRing *r = tracerRingLocal;
+
+	if (LIKELY(r != NULL)) {
+		return r;
+	}
+	r = calloc(1, sizeof *r + tracerRingSize * sizeof r->records[0]);
+	if (r == NULL) {
+		return NULL;
+	}
+	r->tid = gettidImpl();
+	r->mask = tracerRingSize - 1;
+	pthread_mutex_lock(&tracerRingsLock);
+	r->next = tracerRings;
+	tracerRings = r;
+	pthread_mutex_unlock(&tracerRingsLock);
+	tracerRingLocal = r;
+	return r;
+}
+
+/* Save the arguments of a trace in a record of the ring, without formatting
+ * them. */
+static void tracerRingRecord(const char *file,
+			     unsigned int line,
+			     const char *func,
+			     unsigned int level,
+			     const char *fmt,
+			     va_list args)
+{
+	struct tracerRing *ring = tracerRingGet();
+	struct tracerRecord *r;
+	struct tracerSpec spec;
+	const char *s;
+	uint64_t head;
+	size_t offset = 0;
+	size_t len;
+	unsigned n = 0;
+	double d;
+
+	if (ring == NULL) {
+		return;
+	}
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	r = &ring->records[head & ring->mask];
+	atomic_store_explicit(&r->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	r->time = tracerNow();
+	r->file = file;
+	r->func = func;
+	r->fmt = fmt;
+	r->line = line;
+	r->level = level;
+	while (tracerNextSpec(&fmt, &spec) && n < TRACER_ARGS_MAX) {
+		if (spec.star_width) {
+			r->args[n++] = (uint64_t)va_arg(args, int);
+		}
+		if (spec.star_precision && n < TRACER_ARGS_MAX) {
+			r->args[n++] = (uint64_t)va_arg(args, int);
+		}
+		if (n == TRACER_ARGS_MAX) {
+			break;
+		}
+		switch (spec.kind) {
+			case TRACER_ARG_NONE:
+				continue;
+			case TRACER_ARG_INT:
+				r->args[n] = (uint64_t)va_arg(args, int);
+				break;
+			case TRACER_ARG_LONG:
+				r->args[n] = (uint64_t)va_arg(args, long);
+				break;
+			case TRACER_ARG_LLONG:
+				r->args[n] = (uint64_t)va_arg(args, long long);
+				break;
+			case TRACER_ARG_SIZE:
+				r->args[n] = (uint64_t)va_arg(args, size_t);
+				break;
+			case TRACER_ARG_INTMAX:
+				r->args[n] = (uint64_t)va_arg(args, intmax_t);
+				break;
+			case TRACER_ARG_PTRDIFF:
+				r->args[n] = (uint64_t)va_arg(args, ptrdiff_t);
+				break;
+			case TRACER_ARG_DOUBLE:
+			case TRACER_ARG_LDOUBLE:
+				d = spec.kind == TRACER_ARG_DOUBLE
+					? va_arg(args, double)
+					: (double)va_arg(args, long double);
+				memcpy(&r->args[n], &d, sizeof d);
+				break;
+			case TRACER_ARG_POINTER:
+				r->args[n] = (uint64_t)(uintptr_t)va_arg(args,
+									 void *);
+				break;
+			case TRACER_ARG_STRING:
+				/* The string might not outlive the call, so
+				 * save its offset in the strings area. */
+				s = va_arg(args, const char *);
+				s = s != NULL ? s : "(null)";
+				len = strnlen(s, sizeof r->strings - offset - 1);
+				memcpy(&r->strings[offset], s, len);
+				r->strings[offset + len] = '\0';
+				r->args[n] = offset;
+				offset += len + 1;
+				if (offset > sizeof r->strings - 1) {
+					/* Further strings will be empty. */
+					offset = sizeof r->strings - 1;
+				}
+				break;
+		}
+		n++;
+	}
+
+	atomic_store_explicit(&r->seq, head + 1, memory_order_release);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* The format of each conversion is only known when decoding the record, so it
+ * can't be a literal. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+/* Format the conversion of a single argument saved in a record. */
+static int tracerFormatSpec(char *buf,
+			    size_t size,
+			    const struct tracerSpec *spec,
+			    const struct tracerRecord *r,
+			    const uint64_t *args)
+{
+	char conv[32];
+	int star[2];
+	int n_star = 0;
+	double d;
+
+	if (spec->len >= sizeof conv) {
+		return snprintf(buf, size, "?");
+	}
+	memcpy(conv, spec->start, spec->len);
+	conv[spec->len] = '\0';
+	if (spec->star_width) {
+		star[n_star++] = (int)*args++;
+	}
+	if (spec->star_precision) {
+		star[n_star++] = (int)*args++;
+	}
+
+#define TRACER_FORMAT(VALUE)                                               \
+	(n_star == 0 ? snprintf(buf, size, conv, VALUE)                    \
+	 : n_star == 1 ? snprintf(buf, size, conv, star[0], VALUE)         \
+		       : snprintf(buf, size, conv, star[0], star[1], VALUE))
+
+	switch (spec->kind) {
+		case TRACER_ARG_INT:
+			return TRACER_FORMAT((int)*args);
+		case TRACER_ARG_LONG:
+			return TRACER_FORMAT((long)*args);
+		case TRACER_ARG_LLONG:
+			return TRACER_FORMAT((long long)*args);
+		case TRACER_ARG_SIZE:
+			return TRACER_FORMAT((size_t)*args);
+		case TRACER_ARG_INTMAX:
+			return TRACER_FORMAT((intmax_t)*args);
+		case TRACER_ARG_PTRDIFF:
+			return TRACER_FORMAT((ptrdiff_t)*args);
+		case TRACER_ARG_DOUBLE:
+			memcpy(&d, args, sizeof d);
+			return TRACER_FORMAT(d);
+		case TRACER_ARG_LDOUBLE:
+			memcpy(&d, args, sizeof d);
+			return TRACER_FORMAT((long double)d);
+		case TRACER_ARG_POINTER:
+			return TRACER_FORMAT((void *)(uintptr_t)*args);
+		case TRACER_ARG_STRING:
+			return TRACER_FORMAT(&r->strings[*args]);
+		default:
+			return snprintf(buf, size, "%%");
+	}
+
+#undef TRACER_FORMAT
+}
+#pragma GCC diagnostic pop
+
+/* Decode a record into a message, like vsnprintf would have done when the
+ * trace was recorded. */
+static void tracerRecordDecode(const struct tracerRecord *r,
+			       char *msg,
+			       size_t size)
+{
+	const char *fmt = r->fmt;
+	const char *prev = fmt;
+	struct tracerSpec spec;
+	size_t offset = 0;
+	unsigned n = 0;
+	unsigned needed;
+	int rv;
+
+#define TRACER_APPEND(SRC, LEN)                                         \
+	{                                                               \
+		size_t len_ = (LEN);                                    \
+		if (len_ > size - 1 - offset) {                         \
+			len_ = size - 1 - offset;                       \
+		}                                                       \
+		memcpy(&msg[offset], SRC, len_);                        \
+		offset += len_;                                         \
+	}
+
+	while (tracerNextSpec(&fmt, &spec)) {
+		TRACER_APPEND(prev, (size_t)(spec.start - prev));
+		prev = fmt;
+		needed = (unsigned)(spec.kind != TRACER_ARG_NONE) +
+			 (unsigned)spec.star_width +
+			 (unsigned)spec.star_precision;
+		if (n + needed > TRACER_ARGS_MAX) {
+			TRACER_APPEND("...", 3);
+			prev = "";
+			break;
+		}
+		rv = tracerFormatSpec(&msg[offset], size - offset, &spec, r,
+				      &r->args[n]);
+		if (rv > 0) {
+			offset += (size_t)rv < size - offset
+				      ? (size_t)rv
+				      : size - 1 - offset;
+		}
+		n += needed;
+	}
+	TRACER_APPEND(prev, strlen(prev));
+	msg[offset] = '\0';
+
+#undef TRACER_APPEND
+}
+
+void dqliteTracingDump(FILE *f)
+{
+	struct tracerRing *ring;
+	struct tracerRecord *slot;
+	struct tracerRecord r;
+	uint64_t head;
+	uint64_t i;
+	char msg[1024];
+
+	pthread_mutex_lock(&tracerRingsLock);
+	for (ring = tracerRings; ring != NULL; ring = ring->next) {
+		head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		i = head - ring->tail > ring->mask + 1 ? head - ring->mask - 1
+						       : ring->tail;
+		for (; i < head; i++) {
+			slot = &ring->records[i & ring->mask];
+			if (atomic_load_explicit(&slot->seq,
+						 memory_order_acquire) != i + 1) {
+				continue;
+			}
+			memcpy(&r, slot, sizeof r);
+			atomic_thread_fence(memory_order_acquire);
+			/* Skip the record if it was overwritten meanwhile. */
+			if (atomic_load_explicit(&slot->seq,
+						 memory_order_relaxed) != i + 1) {
+				continue;
+			}
+			tracerRecordDecode(&r, msg, sizeof msg);
+			tracerEmitTo(f, r.time, ring->tid, r.file, r.line,
+				     r.func, r.level, msg);
+		}
+		ring->tail = head;
+	}
+	pthread_mutex_unlock(&tracerRingsLock);
+	fflush(f);
 }
 
 void _tracef0(const char *file, unsigned int line, const char *func, unsigned int level, const char *fmt, ...)
 {
 	va_list args;
 	char msg[1024];
-	if (UNLIKELY(_dqliteTracingEnabled)) {
+	if (UNLIKELY(_dqliteTracingEnabled) && level >= tracer__level) {
 		va_start (args, fmt);
-		vsnprintf(msg, sizeof msg, fmt, args);
+		if (tracerRingSize > 0) {
+			tracerRingRecord(file, line, func, level, fmt, args);
+		} else {
+			vsnprintf(msg, sizeof msg, fmt, args);
+			stderrTracerEmit(file, line, func, level, msg);
+		}
 		va_end (args);
-		stderrTracerEmit(file, line, func, level, msg);
 	}
 }
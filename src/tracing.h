@@ -26,7 +26,26 @@ DQLITE_VISIBLE_TO_TESTS void stderrTracerEmit(const char *file,
 DQLITE_VISIBLE_TO_TESTS NOINLINE
 void _tracef0(const char *file, unsigned int line, const char *func, unsigned int level, const char *fmt, ...);
 
-#define tracef0(LEVEL, ...) _tracef0(__FILE__, __LINE__, __func__, LEVEL, __VA_ARGS__)
+/* The enabled check is inlined at every call site, so that the arguments are
+ * not even evaluated when tracing is off. Building with DQLITE_NO_TRACING
+ * compiles the trace points out altogether. */
+#ifdef DQLITE_NO_TRACING
+#define tracef0(LEVEL, ...)                                                   \
+	do {                                                                  \
+		if (0) {                                                      \
+			_tracef0(__FILE__, __LINE__, __func__, LEVEL,         \
+				 __VA_ARGS__);                                \
+		}                                                             \
+	} while (0)
+#else
+#define tracef0(LEVEL, ...)                                                   \
+	do {                                                                  \
+		if (UNLIKELY(_dqliteTracingEnabled)) {                        \
+			_tracef0(__FILE__, __LINE__, __func__, LEVEL,         \
+				 __VA_ARGS__);                                \
+		}                                                             \
+	} while (0)
+#endif
 
 enum dqlite_trace_level {
 	/** Represents an invalid trace level */
@@ -49,7 +68,17 @@ enum dqlite_trace_level {
 
 #define tracef(...) tracef0(TRACE_DEBUG, __VA_ARGS__)
 
-/* Enable tracing if the appropriate env variable is set, or disable tracing. */
+/* Enable tracing if the appropriate env variable is set, or disable tracing.
+ *
+ * LIBDQLITE_TRACE=<level> emits formatted traces to stderr as they happen.
+ * LIBDQLITE_TRACE_RING=<records> instead records them in a binary ring buffer
+ * of the given size per thread, holding the format string pointer and the raw
+ * arguments. The rings are only decoded by dqliteTracingDump, which also runs
+ * at exit. */
 DQLITE_VISIBLE_TO_TESTS void dqliteTracingMaybeEnable(bool enabled);
 
+/* Decode the traces recorded in the ring buffers of all threads since the last
+ * dump, oldest first within each thread, and write them to the given file. */
+DQLITE_VISIBLE_TO_TESTS void dqliteTracingDump(FILE *f);
+
 #endif /* DQLITE_TRACING_H_ */
@@ -24,10 +24,12 @@
 #include "../include/dqlite.h"
 
 #include "lib/byte.h"
+#include "lib/hash.h"
 
 #include "format.h"
 #include "raft.h"
 #include "tracing.h"
+#include "utils.h"
 #include "vfs.h"
 
 /* tinycc doesn't have this builtin, nor the warning that it's meant to silence.
@@ -66,6 +68,10 @@ const int vfsOne = 1;
 #define VFS__WAL_WRITE_LOCK 0
 #define VFS__WAL_CKPT_LOCK  1
 #define VFS__WAL_RECOVER_LOCK  2
+#define VFS__WAL_READ_LOCK(I) (3 + (I))
+
+/* Number of read marks in the WAL index. */
+#define VFS__WAL_NREADER (SQLITE_SHM_NLOCK - 3)
 
 /* Write ahead log header size. */
 #define VFS__WAL_HEADER_SIZE 32
@@ -194,6 +200,7 @@ struct vfsFrame
 {
 	uint8_t header[VFS__FRAME_HEADER_SIZE];
 	uint8_t *page; /* Content of the page. */
+	bool moved;    /* The page was moved to the database by a checkpoint. */
 };
 
 /* Create a new frame of a WAL file. */
@@ -215,6 +222,7 @@ static struct vfsFrame *vfsFrameCreate(unsigned size)
 
 	memset(f->header, 0, FORMAT__WAL_FRAME_HDR_SIZE);
 	memset(f->page, 0, (size_t)size);
+	f->moved = false;
 
 	return f;
 
@@ -249,13 +257,15 @@ static void vfsFrameFill(struct vfsFrame *f,
 	memcpy(f->page, page, page_size);
 }
 
-/* Destroy a WAL frame */
+/* Destroy a WAL frame. A page moved to the database is owned by it. */
 static void vfsFrameDestroy(struct vfsFrame *f)
 {
 	assert(f != NULL);
 	assert(f->page != NULL);
 
-	sqlite3_free(f->page);
+	if (!f->moved) {
+		sqlite3_free(f->page);
+	}
 	sqlite3_free(f);
 }
 
@@ -356,6 +366,8 @@ struct vfsWal
 	mtx_t mtx;                /* Lock for fields below. */
 	struct vfsFrame **frames; /* All frames committed. */
 	unsigned n_frames;        /* Number of committed frames. */
+	unsigned n_taken;         /* Frames already part of a snapshot. */
+	unsigned n_backfilled;    /* Frames already moved to the database. */
 };
 
 /* Initialize a new WAL object. */
@@ -437,6 +449,8 @@ static void vfsWalTruncate(struct vfsWal *w)
 
 	w->frames = NULL;
 	w->n_frames = 0;
+	w->n_taken = 0;
+	w->n_backfilled = 0;
 	mtx_unlock(&w->mtx);
 }
 
@@ -454,17 +468,96 @@ static void vfsWalClose(struct vfsWal *w)
 	mtx_destroy(&w->mtx);
 }
 
+/* Set of modified database pages, one bit per page. */
+struct vfsDirty
+{
+	uint8_t *bits; /* Bitmap, bit i-1 is set if page i was modified. */
+	unsigned cap;  /* Number of pages the bitmap can hold. */
+	bool all;      /* Every page must be considered modified. */
+};
+
+/* Memory replaced by a checkpoint while readers might still use it. */
+struct vfsRetired
+{
+	void *ptr;
+	struct vfsRetired *next;
+};
+
+/* Memory holding the pages of restored databases, see VfsAdopt. */
+struct vfsAdopted
+{
+	uint8_t *base;
+	size_t len;
+	unsigned refs; /* The owner's, plus one per database using it. */
+	void (*release)(void *base);
+};
+
+/* State of the background checkpoint of a database. */
+enum {
+	VFS__CHECKPOINT_IDLE,
+	VFS__CHECKPOINT_QUEUED,
+	VFS__CHECKPOINT_RUNNING,
+};
+
+/* Size of the mappings of a backing file. */
+#define VFS__SPILL_CHUNK_SIZE (64 * 1024 * 1024)
+
+/* In tiered mode, pages evicted from memory are stored in a backing file. The
+ * file is mapped in chunks that never move, so the address of an evicted page
+ * takes the place of the page in the page array, and is used by readers,
+ * xFetch and snapshots like any other page. Pages are only evicted or brought
+ * back while holding all locks exclusively. */
+struct vfsSpill
+{
+	int fd;              /* Backing file, -1 if not created yet. */
+	uint8_t **chunks;    /* Mappings of the backing file. */
+	unsigned n_chunks;   /* Number of mappings. */
+	unsigned cap;        /* Number of pages covered by the bitmaps. */
+	uint8_t *spilled;    /* Pages stored in the backing file. */
+	uint8_t *clean;      /* Pages in memory with an up to date copy there. */
+	uint8_t *referenced; /* Pages read since the clock hand passed. */
+	unsigned n_spilled;  /* Number of pages stored in the backing file. */
+	unsigned hand;       /* Clock hand, as a page number. */
+};
+
 /* Database-specific content */
 struct vfsDatabase
 {
-	char *name;         /* Database name. Read only. */
-	unsigned page_size; /* Only used for on-disk db */
-	struct vfsShm shm;  /* Shared memory. */
-	struct vfsWal wal;  /* Associated WAL. */
+	char *name;            /* Database name. Read only. */
+	struct hash_node node; /* Entry in the VFS database index. */
+	unsigned page_size;    /* Only used for on-disk db */
+	struct vfsShm shm;     /* Shared memory. */
+	struct vfsWal wal;     /* Associated WAL. */
 
 	mtx_t mtx;
 	void **pages;       /* All database. */
 	unsigned n_pages;   /* Number of pages. */
+
+	/* A checkpoint moves the page of a WAL frame to the page array instead
+	 * of copying it, and the frame keeps pointing to it until the WAL is
+	 * reset. The page belongs to the array, unless a later frame replaces
+	 * it there, in which case it goes back to its frame. */
+	struct vfsFrame **sources;  /* Frame each page was moved from. */
+	unsigned n_sources;         /* Length of the sources array. */
+	struct vfsRetired *retired; /* Released when the WAL is reset. */
+	uint32_t generation;        /* Changed whenever the WAL is reset. */
+
+	/* In disk mode, frames are written to the database file by a
+	 * background thread, see struct vfsCheckpointer. */
+	sqlite3_file *file;        /* Database file used by checkpoints. */
+	int checkpoint;            /* State of the background checkpoint. */
+	struct vfsDatabase *checkpoint_next; /* Next in the queue. */
+
+	struct vfsSpill spill; /* Pages evicted from memory. */
+
+	/* Pages restored from a snapshot point into its buffer until they are
+	 * modified, instead of being copied. */
+	struct vfsAdopted *adopted; /* Memory the pages point into, if any. */
+	unsigned n_adopted;         /* Number of those pages. */
+
+	bool tracking;         /* Whether page modifications are tracked. */
+	struct vfsDirty dirty;   /* Pages modified since the last snapshot. */
+	struct vfsDirty pending; /* Pages of a snapshot not yet persisted. */
 };
 
 /*
@@ -496,14 +589,18 @@ DQLITE_VISIBLE_TO_TESTS unsigned dq_sqlite_pending_byte = 0x40000000;
 /* Initialize a new database object. */
 static int vfsDatabaseInit(struct vfsDatabase *d, const char *name)
 {
-	char *dbname = sqlite3_malloc((int)strlen(name) + 1);
+	/* The name is double-NUL terminated, as the base VFS expects for
+	 * database filenames. */
+	char *dbname = sqlite3_malloc((int)strlen(name) + 2);
 	if (dbname == NULL) {
 		return SQLITE_NOMEM;
 	}
 	strcpy(dbname, name);
+	dbname[strlen(name) + 1] = '\0';
 
 	*d = (struct vfsDatabase){
 		.name = dbname,
+		.spill = { .fd = -1 },
 	};
 	int rv = vfsShmInit(&d->shm);
 	if (rv != SQLITE_OK) {
@@ -513,7 +610,286 @@ static int vfsDatabaseInit(struct vfsDatabase *d, const char *name)
 	vfsWalInit(&d->wal);
 	rv = mtx_init(&d->mtx, mtx_plain);
 	assert(rv == 0);
+	/* Backup positions from another process or node must not match. */
+	sqlite3_randomness(sizeof d->generation, &d->generation);
+	return SQLITE_OK;
+}
+
+/* Make room for at least n pages in the given dirty set. */
+static int vfsDirtyGrow(struct vfsDirty *s, unsigned n)
+{
+	unsigned cap;
+	uint8_t *bits;
+
+	if (n <= s->cap) {
+		return SQLITE_OK;
+	}
+	cap = s->cap > 0 ? s->cap : 64;
+	while (cap < n) {
+		cap *= 2;
+	}
+	bits = sqlite3_realloc64(s->bits, cap / 8);
+	if (bits == NULL) {
+		return SQLITE_NOMEM;
+	}
+	memset(bits + s->cap / 8, 0, (cap - s->cap) / 8);
+	s->bits = bits;
+	s->cap = cap;
+	return SQLITE_OK;
+}
+
+/* Add the given page to the set. If memory is exhausted, fall back to
+ * considering all pages modified. */
+static void vfsDirtyAdd(struct vfsDirty *s, unsigned pgno)
+{
+	assert(pgno > 0);
+	if (s->all) {
+		return;
+	}
+	if (vfsDirtyGrow(s, pgno) != SQLITE_OK) {
+		s->all = true;
+		return;
+	}
+	s->bits[(pgno - 1) / 8] |= (uint8_t)(1 << ((pgno - 1) % 8));
+}
+
+/* Add all the pages of src to dst. */
+static void vfsDirtyMerge(struct vfsDirty *dst, const struct vfsDirty *src)
+{
+	if (dst->all) {
+		return;
+	}
+	if (src->all || vfsDirtyGrow(dst, src->cap) != SQLITE_OK) {
+		dst->all = true;
+		return;
+	}
+	for (unsigned i = 0; i < src->cap / 8; i++) {
+		dst->bits[i] |= src->bits[i];
+	}
+}
+
+static void vfsDirtyClose(struct vfsDirty *s)
+{
+	sqlite3_free(s->bits);
+	*s = (struct vfsDirty){};
+}
+
+static bool vfsBitGet(const uint8_t *bits, unsigned pgno)
+{
+	return (bits[(pgno - 1) / 8] & (1 << ((pgno - 1) % 8))) != 0;
+}
+
+static void vfsBitSet(uint8_t *bits, unsigned pgno)
+{
+	bits[(pgno - 1) / 8] |= (uint8_t)(1 << ((pgno - 1) % 8));
+}
+
+static void vfsBitClear(uint8_t *bits, unsigned pgno)
+{
+	bits[(pgno - 1) / 8] &= (uint8_t)~(1 << ((pgno - 1) % 8));
+}
+
+/* Keep the given memory around until the WAL is reset. */
+static void vfsDatabaseRetire(struct vfsDatabase *d,
+			      struct vfsRetired **retired,
+			      void *ptr)
+{
+	assert(*retired != NULL);
+	(*retired)->ptr = ptr;
+	(*retired)->next = d->retired;
+	d->retired = *retired;
+	*retired = NULL;
+}
+
+/* Make the bitmaps of the backing file of the given database cover at least n
+ * pages. When readers are active, which might still be recording references
+ * in the old bitmaps, these are retired instead of being released. */
+static int vfsSpillGrow(struct vfsDatabase *d, unsigned n, bool readers)
+{
+	struct vfsSpill *s = &d->spill;
+	uint8_t **maps[] = { &s->spilled, &s->clean, &s->referenced };
+	struct vfsRetired *retired[3] = { NULL, NULL, NULL };
+	uint8_t *bits[3] = { NULL, NULL, NULL };
+	unsigned cap;
+	unsigned i;
+
+	if (n <= s->cap) {
+		return SQLITE_OK;
+	}
+	cap = s->cap > 0 ? s->cap : 64;
+	while (cap < n) {
+		cap *= 2;
+	}
+	for (i = 0; i < 3; i++) {
+		bits[i] = sqlite3_malloc64(cap / 8);
+		if (readers) {
+			retired[i] = sqlite3_malloc(sizeof *retired[i]);
+		}
+		if (bits[i] == NULL || (readers && retired[i] == NULL)) {
+			goto oom;
+		}
+		if (s->cap > 0) {
+			memcpy(bits[i], *maps[i], s->cap / 8);
+		}
+		memset(bits[i] + s->cap / 8, 0, (cap - s->cap) / 8);
+	}
+
+	mtx_lock(&d->mtx);
+	for (i = 0; i < 3; i++) {
+		uint8_t *old = *maps[i];
+		*maps[i] = bits[i];
+		bits[i] = old;
+	}
+	s->cap = cap;
+	mtx_unlock(&d->mtx);
+
+	for (i = 0; i < 3; i++) {
+		if (bits[i] != NULL && readers) {
+			vfsDatabaseRetire(d, &retired[i], bits[i]);
+		} else {
+			sqlite3_free(bits[i]);
+			sqlite3_free(retired[i]);
+		}
+	}
 	return SQLITE_OK;
+
+oom:
+	for (i = 0; i < 3; i++) {
+		sqlite3_free(bits[i]);
+		sqlite3_free(retired[i]);
+	}
+	return SQLITE_NOMEM;
+}
+
+/* Whether the given page is stored in the backing file. */
+static bool vfsSpillIsEvicted(const struct vfsSpill *s, unsigned pgno)
+{
+	return pgno <= s->cap && vfsBitGet(s->spilled, pgno);
+}
+
+/* Record that the given page was read. Races between readers can only lose a
+ * reference, which is just a hint. */
+static void vfsSpillReference(struct vfsSpill *s, unsigned pgno)
+{
+	if (pgno <= s->cap) {
+		vfsBitSet(s->referenced, pgno);
+	}
+}
+
+/* Record that the copy of the given page in the backing file, if any, is out
+ * of date. */
+static void vfsSpillTouch(struct vfsSpill *s, unsigned pgno)
+{
+	if (pgno <= s->cap) {
+		vfsBitClear(s->clean, pgno);
+	}
+}
+
+static void vfsSpillClose(struct vfsSpill *s)
+{
+	for (unsigned i = 0; i < s->n_chunks; i++) {
+		munmap(s->chunks[i], VFS__SPILL_CHUNK_SIZE);
+	}
+	sqlite3_free(s->chunks);
+	if (s->fd != -1) {
+		close(s->fd);
+	}
+	sqlite3_free(s->spilled);
+	sqlite3_free(s->clean);
+	sqlite3_free(s->referenced);
+	*s = (struct vfsSpill){ .fd = -1 };
+}
+
+/* Record that the given page was modified. */
+static void vfsDatabaseMarkDirty(struct vfsDatabase *d, unsigned pgno)
+{
+	if (!d->tracking) {
+		return;
+	}
+	vfsDirtyAdd(&d->dirty, pgno);
+}
+
+static void vfsAdoptedUnref(struct vfsAdopted *a)
+{
+	assert(a->refs > 0);
+	a->refs--;
+	if (a->refs == 0) {
+		a->release(a->base);
+		sqlite3_free(a);
+	}
+}
+
+/* Whether the given page points into memory adopted by the database. */
+static bool vfsDatabaseIsAdopted(const struct vfsDatabase *d, const void *page)
+{
+	const uint8_t *p = page;
+	return d->adopted != NULL && p >= d->adopted->base &&
+	       p < d->adopted->base + d->adopted->len;
+}
+
+/* Free the given page, or stop using it if it's adopted memory. */
+static void vfsDatabaseFreePage(struct vfsDatabase *d, void *page)
+{
+	if (!vfsDatabaseIsAdopted(d, page)) {
+		sqlite3_free(page);
+		return;
+	}
+	assert(d->n_adopted > 0);
+	d->n_adopted--;
+	if (d->n_adopted == 0) {
+		vfsAdoptedUnref(d->adopted);
+		d->adopted = NULL;
+	}
+}
+
+/* Release the given page of the array, handing it back to the WAL frame it
+ * was moved from, or leaving it in the backing file, if any. */
+static void vfsDatabaseReleasePage(struct vfsDatabase *d,
+				   unsigned pgno,
+				   void *page)
+{
+	vfsSpillTouch(&d->spill, pgno);
+	if (vfsSpillIsEvicted(&d->spill, pgno)) {
+		vfsBitClear(d->spill.spilled, pgno);
+		d->spill.n_spilled--;
+		return;
+	}
+	if (pgno <= d->n_sources && d->sources[pgno - 1] != NULL) {
+		assert(d->sources[pgno - 1]->page == page);
+		d->sources[pgno - 1]->moved = false;
+		d->sources[pgno - 1] = NULL;
+		return;
+	}
+	vfsDatabaseFreePage(d, page);
+}
+
+/* Free the pages kept alive for readers that might still be using them. All
+ * locks must be held exclusively. */
+static void vfsDatabaseFreeRetired(struct vfsDatabase *d)
+{
+	struct vfsRetired *retired;
+
+	while (d->retired != NULL) {
+		retired = d->retired;
+		d->retired = retired->next;
+		vfsDatabaseFreePage(d, retired->ptr);
+		sqlite3_free(retired);
+	}
+}
+
+/* Forget where pages were moved from once the WAL frames are gone, and
+ * release the memory that readers could have been using. Either all locks
+ * must be held exclusively, or all read locks but READ(0): readers holding it
+ * only read the database and started after the last backfill, which kept
+ * READ(0) exclusively, so they don't use retired memory. */
+static void vfsDatabaseWalReset(struct vfsDatabase *d)
+{
+	sqlite3_free(d->sources);
+	d->sources = NULL;
+	d->n_sources = 0;
+	d->generation++;
+
+	vfsDatabaseFreeRetired(d);
 }
 
 /* Get a page from the given database, possibly creating a new one. */
@@ -676,10 +1052,8 @@ static int vfsDatabaseTruncate(struct vfsDatabase *d, sqlite_int64 size)
 
 	mtx_lock(&d->mtx);
 	/* Destroy pages beyond pages_len. */
-	void **cursor = d->pages + n_pages;
-	for (unsigned i = 0; i < (d->n_pages - n_pages); i++) {
-		sqlite3_free(*cursor);
-		cursor++;
+	for (unsigned i = n_pages; i < d->n_pages; i++) {
+		vfsDatabaseReleasePage(d, i + 1, d->pages[i]);
 	}
 
 	/* Shrink the page array, possibly to 0. */
@@ -702,23 +1076,51 @@ static int vfsDatabaseTruncate(struct vfsDatabase *d, sqlite_int64 size)
 static void vfsDatabaseClose(struct vfsDatabase *d)
 {
 	for (unsigned i = 0; d->pages != NULL && i < d->n_pages; i++) {
-		sqlite3_free(d->pages[i]);
+		if (!vfsSpillIsEvicted(&d->spill, i + 1)) {
+			vfsDatabaseFreePage(d, d->pages[i]);
+		}
 	}
 	sqlite3_free(d->pages);
+	vfsSpillClose(&d->spill);
 	sqlite3_free(d->name);
+	vfsDirtyClose(&d->dirty);
+	vfsDirtyClose(&d->pending);
 	vfsWalClose(&d->wal);
+	vfsDatabaseWalReset(d);
+	assert(d->adopted == NULL);
+	if (d->file != NULL) {
+		d->file->pMethods->xClose(d->file);
+		sqlite3_free(d->file);
+	}
 	vfsShmClose(&d->shm);
 	mtx_destroy(&d->mtx);
 }
 
+/* Background checkpoints of on-disk databases. A single thread writes the
+ * frames of the queued databases to their database file, while transactions
+ * keep being appended to the WAL. */
+struct vfsCheckpointer
+{
+	thrd_t thread;
+	bool started;             /* Whether the thread is running. */
+	mtx_t mtx;                /* Lock for fields below. */
+	cnd_t cond;               /* Signaled when a checkpoint is queued or done. */
+	struct vfsDatabase *head; /* Databases waiting for a checkpoint. */
+	struct vfsDatabase *tail;
+	bool stop;                /* Whether the thread should exit. */
+	bool sync;                /* Whether to sync the database file. */
+};
+
 /* Custom dqlite VFS. Contains pointers to all databases that were created. */
 struct vfs
 {
-	struct vfsDatabase **databases; /* Database objects */
-	unsigned n_databases;           /* Number of databases */
+	struct hash databases; /* Database objects, indexed by name */
 	int error;                      /* Last error occurred. */
 	bool disk; /* True if the database is kept on disk. */
 	struct sqlite3_vfs *base_vfs; /* Base VFS. */
+	struct vfsCheckpointer checkpointer;
+	size_t budget;   /* Memory for database pages in tiered mode, or 0. */
+	char *spill_dir; /* Directory of the backing files in tiered mode. */
 };
 
 /* Create a new vfs object. */
@@ -734,49 +1136,126 @@ static struct vfs *vfsCreate(void)
 	*v = (struct vfs) {
 		.base_vfs = sqlite3_vfs_find("unix"),
 	};
+	hash__init(&v->databases);
 	assert(v->base_vfs != NULL);
+	int rv = mtx_init(&v->checkpointer.mtx, mtx_plain);
+	assert(rv == thrd_success);
+	rv = cnd_init(&v->checkpointer.cond);
+	assert(rv == thrd_success);
 	return v;
 }
 
-/* Create a database object and add it to the databases array. */
-static struct vfsDatabase *vfsCreateDatabase(struct vfs *v, const char *name)
+/* Remove the given database from the checkpoint queue, or wait for its
+ * checkpoint to complete if it's already running. */
+static void vfsCheckpointerCancel(struct vfsCheckpointer *c,
+				  struct vfsDatabase *d)
+{
+	mtx_lock(&c->mtx);
+	if (d->checkpoint == VFS__CHECKPOINT_QUEUED) {
+		struct vfsDatabase **cur = &c->head;
+		struct vfsDatabase *prev = NULL;
+		while (*cur != d) {
+			prev = *cur;
+			cur = &prev->checkpoint_next;
+		}
+		*cur = d->checkpoint_next;
+		if (c->tail == d) {
+			c->tail = prev;
+		}
+		d->checkpoint_next = NULL;
+		d->checkpoint = VFS__CHECKPOINT_IDLE;
+	}
+	while (d->checkpoint == VFS__CHECKPOINT_RUNNING) {
+		cnd_wait(&c->cond, &c->mtx);
+	}
+	mtx_unlock(&c->mtx);
+}
+
+/* Stop the checkpoint thread, dropping the queued checkpoints. */
+static void vfsCheckpointerStop(struct vfsCheckpointer *c)
 {
-	unsigned n = v->n_databases + 1;
-	struct vfsDatabase **databases;
 	struct vfsDatabase *d;
 
-	assert(name != NULL);
+	if (!c->started) {
+		return;
+	}
 
-	/* Create a new entry. */
-	databases = sqlite3_realloc64(v->databases, sizeof *databases * n);
-	if (databases == NULL) {
-		return NULL;
+	mtx_lock(&c->mtx);
+	c->stop = true;
+	cnd_broadcast(&c->cond);
+	mtx_unlock(&c->mtx);
+	thrd_join(c->thread, NULL);
+	c->started = false;
+
+	while (c->head != NULL) {
+		d = c->head;
+		c->head = d->checkpoint_next;
+		d->checkpoint_next = NULL;
+		d->checkpoint = VFS__CHECKPOINT_IDLE;
 	}
-	v->databases = databases;
+	c->tail = NULL;
+}
+
+/* Create a database object and add it to the databases index. */
+static struct vfsDatabase *vfsCreateDatabase(struct vfs *v, const char *name)
+{
+	struct vfsDatabase *d;
+	int rv;
+
+	assert(name != NULL);
 
 	d = sqlite3_malloc(sizeof *d);
 	if (d == NULL) {
 		return NULL;
 	}
 
-	int rv = vfsDatabaseInit(d, name);
+	rv = vfsDatabaseInit(d, name);
 	if (rv != SQLITE_OK) {
 		sqlite3_free(d);
 		return NULL;
 	}
 
-	v->databases[n - 1] = d;
-	v->n_databases = n;
+	rv = hash__insert(&v->databases, &d->node,
+			  hash__str(name, strlen(name)));
+	if (rv != 0) {
+		vfsDatabaseClose(d);
+		sqlite3_free(d);
+		return NULL;
+	}
 
 	return d;
 }
 
+/* Find the database object whose name matches the first n bytes of the given
+ * filename. */
+static struct vfsDatabase *vfsDatabaseFind(struct vfs *v,
+					   const char *filename,
+					   size_t n)
+{
+	struct hash_node *node;
+	uint32_t hash = hash__str(filename, n);
+
+	for (node = hash__bucket(&v->databases, hash); node != NULL;
+	     node = node->next) {
+		struct vfsDatabase *database;
+		if (node->hash != hash) {
+			continue;
+		}
+		database = CONTAINER_OF(node, struct vfsDatabase, node);
+		if (strlen(database->name) == n &&
+		    strncmp(database->name, filename, n) == 0) {
+			return database;
+		}
+	}
+
+	return NULL;
+}
+
 /* Find the database object associated with the given filename. */
 static struct vfsDatabase *vfsDatabaseLookup(struct vfs *v,
 					     const char *filename)
 {
 	size_t n = strlen(filename);
-	unsigned i;
 
 	assert(v != NULL);
 	assert(filename != NULL);
@@ -788,41 +1267,25 @@ static struct vfsDatabase *vfsDatabaseLookup(struct vfs *v,
 		n -= strlen("-journal");
 	}
 
-	for (i = 0; i < v->n_databases; i++) {
-		struct vfsDatabase *database = v->databases[i];
-		if (strlen(database->name) == n &&
-		    strncmp(database->name, filename, n) == 0) {
-			return database;
-		}
-	}
-
-	return NULL;
+	return vfsDatabaseFind(v, filename, n);
 }
 
 static int vfsDeleteDatabase(struct vfs *r, const char *name)
 {
-	for (unsigned i = 0; i < r->n_databases; i++) {
-		struct vfsDatabase *database = r->databases[i];
-		unsigned j;
-
-		if (strcmp(database->name, name) != 0) {
-			continue;
-		}
-
-		vfsDatabaseClose(database);
-		sqlite3_free(database);
-
-		/* Shift all other contents objects. */
-		for (j = i + 1; j < r->n_databases; j++) {
-			r->databases[j - 1] = r->databases[j];
-		}
-		r->n_databases--;
+	struct vfsDatabase *database;
 
-		return SQLITE_OK;
+	database = vfsDatabaseFind(r, name, strlen(name));
+	if (database == NULL) {
+		r->error = ENOENT;
+		return SQLITE_IOERR_DELETE_NOENT;
 	}
 
-	r->error = ENOENT;
-	return SQLITE_IOERR_DELETE_NOENT;
+	vfsCheckpointerCancel(&r->checkpointer, database);
+	hash__remove(&r->databases, &database->node);
+	vfsDatabaseClose(database);
+	sqlite3_free(database);
+
+	return SQLITE_OK;
 }
 
 /* Release the memory used internally by the VFS object.
@@ -832,12 +1295,21 @@ static int vfsDeleteDatabase(struct vfs *r, const char *name)
  */
 static void vfsDestroy(struct vfs *r)
 {
-	for (unsigned i = 0; i < r->n_databases; i++) {
-		struct vfsDatabase *database = r->databases[i];
-		vfsDatabaseClose(database);
-		sqlite3_free(database);
+	vfsCheckpointerStop(&r->checkpointer);
+	for (size_t i = 0; i < r->databases.n_buckets; i++) {
+		struct hash_node *node = r->databases.buckets[i];
+		while (node != NULL) {
+			struct vfsDatabase *database =
+			    CONTAINER_OF(node, struct vfsDatabase, node);
+			node = node->next;
+			vfsDatabaseClose(database);
+			sqlite3_free(database);
+		}
 	}
-	sqlite3_free(r->databases);
+	hash__close(&r->databases);
+	sqlite3_free(r->spill_dir);
+	cnd_destroy(&r->checkpointer.cond);
+	mtx_destroy(&r->checkpointer.mtx);
 }
 
 /******************************************************************************/
@@ -1162,6 +1634,7 @@ static int vfsWalFileTruncate(sqlite3_file* file, sqlite3_int64 size)
 	}
 
 	vfsWalTruncate(&f->database->wal);
+	vfsDatabaseWalReset(f->database);
 	return SQLITE_OK;
 }
 
@@ -1188,8 +1661,6 @@ static const sqlite3_io_methods vfsWalFileMethods = {
 	.xDeviceCharacteristics = vfsNoopDeviceCharacteristics,
 };
 
-#define VFS__CHECKPOINT_MASK 0xff
-
 /* Implementation of the abstract sqlite3_file base class.
  * for the main database file */
 struct vfsMainFile {
@@ -1201,13 +1672,13 @@ struct vfsMainFile {
 			connection that is polled is the one applied or aborted.
 		      */
 	uint16_t sharedMask; /* Mask of shared locks held */
-	uint16_t exclMask;   /* Mask of exclusive locks held. The special value
-		     `VFS__CHECKPOINT_MASK` is used during a
-		     checkpoint. See VfsCheckpoint for details. */
+	uint16_t exclMask;   /* Mask of exclusive locks held. */
 	struct {
 		void **ptr;
 		int len, cap;
 	} mappedShmRegions;
+	sqlite3_int64 mmap_size; /* Limit set with SQLITE_FCNTL_MMAP_SIZE */
+	unsigned n_fetched;      /* Pages handed out by xFetch */
 };
 
 static int vfsMainFileRead(sqlite3_file *file,
@@ -1230,11 +1701,12 @@ static int vfsMainFileRead(sqlite3_file *file,
 	 *   each page in f->database->pages can be considered constant, the
 	 *   array holding each page might change. The resizing of this array
 	 *   and/or the overwriting of unread pages is always done during a
-	 *   checkpoint, holding the checkpoint lock. On top of these guarantees
-	 *   from SQLite, dqlite adds a more strict behaviour: only TRUNCATE
-	 *   checkpoint are allowed and they always block all readers (i.e. they
-	 *   hold all locks exclusively). This means that during this call it is
-	 *   not necessary to synchronize at all.
+	 *   checkpoint, holding the checkpoint lock. dqlite's own checkpoint
+	 *   (see VfsCheckpoint) follows the same rules when readers are
+	 *   active: it only swaps pointers of pages that no reader reads from
+	 *   the database, and it never frees the page array or the first page
+	 *   in place, until it can hold all locks exclusively. This means that
+	 *   during this call it is not necessary to synchronize at all.
 	 *
 	 * Regarding reading values from memory shared across multiple threads,
 	 * it is guaranteed that after all checkpoints, a full memory barrier is
@@ -1302,6 +1774,7 @@ static int vfsMainFileRead(sqlite3_file *file,
 	}
 
 	memcpy(buf, pgno == 1 ? page + offset : page, (size_t)amount);
+	vfsSpillReference(&f->database->spill, pgno);
 	return SQLITE_OK;
 }
 
@@ -1372,7 +1845,28 @@ static int vfsMainFileWrite(sqlite3_file *file,
 	}
 
 	assert(page != NULL);
+
+	/* A page moved from a WAL frame is still visible through the frame,
+	 * and a page of a restored snapshot belongs to its buffer, they can't
+	 * be changed in place. */
+	if ((pgno <= f->database->n_sources &&
+	     f->database->sources[pgno - 1] != NULL) ||
+	    vfsDatabaseIsAdopted(f->database, page)) {
+		void *copy = sqlite3_malloc64(page_size);
+		if (copy == NULL) {
+			return SQLITE_NOMEM;
+		}
+		memcpy(copy, page, page_size);
+		vfsDatabaseReleasePage(f->database, pgno, page);
+		mtx_lock(&f->database->mtx);
+		f->database->pages[pgno - 1] = copy;
+		mtx_unlock(&f->database->mtx);
+		page = copy;
+	}
+
 	memcpy(page, buf, (size_t)amount);
+	vfsSpillTouch(&f->database->spill, pgno);
+	vfsDatabaseMarkDirty(f->database, pgno);
 	return SQLITE_OK;
 }
 
@@ -1469,11 +1963,78 @@ static int vfsMainFileControl(sqlite3_file *file, int op, void *arg)
 			 * last connection is closed. */
 			*(int *)(arg) = 1;
 			return SQLITE_OK;
+		case SQLITE_FCNTL_MMAP_SIZE: {
+			/* Same semantics as the unix VFS: return the current
+			 * limit and change it if no page is fetched. */
+			sqlite3_int64 limit = *(sqlite3_int64 *)arg;
+			*(sqlite3_int64 *)arg = f->mmap_size;
+			if (limit >= 0 && f->n_fetched == 0) {
+				f->mmap_size = limit;
+			}
+			return SQLITE_OK;
+		}
 		default:
 			return SQLITE_OK;
 	}
 }
 
+static int vfsMainFileFetch(sqlite3_file *file,
+			    sqlite3_int64 offset,
+			    int amount,
+			    void **pp)
+{
+	struct vfsMainFile *f = (struct vfsMainFile *)file;
+
+	/* == Safety==
+	 * SQLite only fetches pages while holding a shared memory read-lock,
+	 * and it unfetches them at the latest when the read transaction ends.
+	 * Pages are only ever freed or overwritten with new content while
+	 * holding all locks exclusively (see vfsMainFileRead and
+	 * vfsMainFileWrite), so the page handed out here is guaranteed to stay
+	 * valid and unchanged until it's unfetched, just like a page of a
+	 * memory-mapped file would. Since each page is a separate allocation,
+	 * resizing the page array does not move it either. */
+	uint32_t page_size;
+	unsigned pgno;
+
+	*pp = NULL;
+
+	if (f->database->n_pages == 0 || offset + amount > f->mmap_size) {
+		return SQLITE_OK;
+	}
+
+	/* SQLite fetches a page at a time, anything else falls back to
+	 * xRead. */
+	page_size = vfsDatabaseGetPageSize(f->database);
+	if (amount != (int)page_size || (offset % page_size) != 0) {
+		return SQLITE_OK;
+	}
+
+	pgno = (unsigned)(offset / page_size) + 1;
+	*pp = vfsDatabasePageLookup(f->database, pgno);
+	if (*pp != NULL) {
+		vfsSpillReference(&f->database->spill, pgno);
+		f->n_fetched++;
+	}
+	return SQLITE_OK;
+}
+
+static int vfsMainFileUnfetch(sqlite3_file *file,
+			      sqlite3_int64 offset,
+			      void *p)
+{
+	struct vfsMainFile *f = (struct vfsMainFile *)file;
+	(void)offset;
+
+	/* A NULL pointer asks to unmap the whole file, which is a no-op since
+	 * nothing is actually mapped. */
+	if (p != NULL) {
+		assert(f->n_fetched > 0);
+		f->n_fetched--;
+	}
+	return SQLITE_OK;
+}
+
 /* Simulate shared memory by allocating on the C heap. */
 static int vfsMainFileShmMap(sqlite3_file *file, /* Handle open on database file */
 			 int region_index,   /* Region to retrieve */
@@ -1712,6 +2273,19 @@ static int vfsRollbackShm(struct vfsMainFile *f) {
 	return SQLITE_OK;
 }
 
+/* Whether the given exclusive lock request is the one SQLite makes to restart
+ * the WAL on the next write, once all of its frames were checkpointed. That's
+ * what a writer does, while a checkpointer holds the CKPT lock. In-memory
+ * databases can't let SQLite overwrite frames whose pages were moved to the
+ * database. */
+static bool vfsMainFileIsRestartingWal(struct vfsMainFile *f, int ofst, int n)
+{
+	return !f->vfs->disk && ofst == VFS__WAL_READ_LOCK(1) &&
+	       n == VFS__WAL_NREADER - 1 &&
+	       (f->exclMask & (1 << VFS__WAL_WRITE_LOCK)) &&
+	       !(f->exclMask & (1 << VFS__WAL_CKPT_LOCK));
+}
+
 static int vfsMainFileShmLock(sqlite3_file *file, int ofst, int n, int flags)
 {
 	struct vfsMainFile *f = (struct vfsMainFile *)file;
@@ -1733,13 +2307,6 @@ static int vfsMainFileShmLock(sqlite3_file *file, int ofst, int n, int flags)
 
 	PRE((f->exclMask & f->sharedMask) == 0);
 
-	/* In case a checkpoint is running, the locking logic is overridden, to
-	 * make sure nothing can happen concurrently. As such, it is just enough
-	 * to always return SQLITE_OK in this case. */
-	if (f->exclMask == VFS__CHECKPOINT_MASK) {
-		return SQLITE_OK;
-	}
-
 	int rv = SQLITE_OK;
 	if (
 		((flags & SQLITE_SHM_UNLOCK) && ((f->exclMask | f->sharedMask) & mask)) ||
@@ -1782,6 +2349,11 @@ static int vfsMainFileShmLock(sqlite3_file *file, int ofst, int n, int flags)
 			if (ofst == VFS__WAL_WRITE_LOCK &&
 			    f->database->wal.n_tx > 0) {
 				rv = SQLITE_BUSY;
+			} else if (vfsMainFileIsRestartingWal(f, ofst, n)) {
+				/* Only the VFS restarts the WAL, see
+				 * vfsCheckpointRestart. SQLite keeps appending
+				 * frames when it can't. */
+				rv = SQLITE_BUSY;
 			} else {
 				rv = vfsShmLock(&f->database->shm, ofst, n,
 						true);
@@ -1832,7 +2404,7 @@ static int vfsMainFileShmUnmap(sqlite3_file *file, int delete_flag)
 }
 
 static const sqlite3_io_methods vfsMainFileMethods = {
-	.iVersion = 2,
+	.iVersion = 3,
 	.xClose = vfsNoopClose,
 	.xRead = vfsMainFileRead,
 	.xWrite = vfsMainFileWrite,
@@ -1849,6 +2421,8 @@ static const sqlite3_io_methods vfsMainFileMethods = {
 	.xShmLock = vfsMainFileShmLock,
 	.xShmBarrier = vfsMainFileShmBarrier,
 	.xShmUnmap = vfsMainFileShmUnmap,
+	.xFetch = vfsMainFileFetch,
+	.xUnfetch = vfsMainFileUnfetch,
 };
 
 /* Implementation of the abstract sqlite3_file base class.
@@ -2473,16 +3047,20 @@ int VfsPoll(sqlite3 *conn, struct vfsTransaction *transaction)
 	return SQLITE_OK;
 }
 
-/* Append the given pages as new frames. */
+/* Append the pages of the given transactions as new frames, chaining the
+ * checksums of all of them in a single pass. */
 static int vfsWalAppend(struct vfsDatabase *d,
-	const struct vfsTransaction *transaction)
+	const struct vfsTransaction *transactions,
+	unsigned n)
 {
 	struct vfsWal *w = &d->wal;
 	struct vfsFrame **frames; /* New frames array. */
 	uint32_t page_size;
 	uint32_t database_size;
+	uint64_t n_pages = 0;
 	unsigned i;
 	unsigned j;
+	unsigned k = 0; /* Number of frames created so far. */
 	uint32_t salt[2];
 	uint32_t checksum[2];
 
@@ -2492,6 +3070,10 @@ static int vfsWalAppend(struct vfsDatabase *d,
 	page_size = vfsWalGetPageSize(w);
 	assert(page_size > 0);
 
+	for (i = 0; i < n; i++) {
+		n_pages += transactions[i].n_pages;
+	}
+
 	/* Get the salt from the WAL header. */
 	salt[0] = vfsWalGetSalt1(w);
 	salt[1] = vfsWalGetSalt2(w);
@@ -2514,7 +3096,7 @@ static int vfsWalAppend(struct vfsDatabase *d,
 
 	mtx_lock(&w->mtx);
 	frames = sqlite3_realloc64(
-	    w->frames, sizeof(*frames) * (w->n_frames + transaction->n_pages));
+	    w->frames, sizeof(*frames) * (w->n_frames + n_pages));
 	if (frames == NULL) {
 		mtx_unlock(&w->mtx);
 		goto oom;
@@ -2522,42 +3104,46 @@ static int vfsWalAppend(struct vfsDatabase *d,
 	w->frames = frames;
 	mtx_unlock(&w->mtx);
 
-	for (i = 0; i < transaction->n_pages; i++) {
-		struct vfsFrame *frame = vfsFrameCreate(page_size);
-		uint32_t page_number = (uint32_t)transaction->page_numbers[i];
-		uint32_t commit = 0;
-		uint8_t *page = transaction->pages[i];
+	for (j = 0; j < n; j++) {
+		const struct vfsTransaction *transaction = &transactions[j];
+		for (i = 0; i < transaction->n_pages; i++) {
+			struct vfsFrame *frame = vfsFrameCreate(page_size);
+			uint32_t page_number = (uint32_t)transaction->page_numbers[i];
+			uint32_t commit = 0;
+			uint8_t *page = transaction->pages[i];
 
-		if (frame == NULL) {
-			goto oom_after_frames_alloc;
-		}
+			if (frame == NULL) {
+				goto oom_after_frames_alloc;
+			}
 
-		/* When writing the SQLite database header, make sure to sync 
-		 * the file size to the logical database size. */
-		if (page_number == 1) {
-			database_size = ByteGetBe32(&page[VFS__IN_HEADER_DATABASE_SIZE_OFFSET]);
-		}
+			/* When writing the SQLite database header, make sure to sync
+			 * the file size to the logical database size. */
+			if (page_number == 1) {
+				database_size = ByteGetBe32(&page[VFS__IN_HEADER_DATABASE_SIZE_OFFSET]);
+			}
 
-		/* For commit records, the size of the database file in pages
-		 * after the commit. For all other records, zero. */
-		if (i == transaction->n_pages - 1) {
-			commit = database_size;
-		}
+			/* For commit records, the size of the database file in pages
+			 * after the commit. For all other records, zero. */
+			if (i == transaction->n_pages - 1) {
+				commit = database_size;
+			}
 
-		vfsFrameFill(frame, page_number, commit, salt, checksum, page,
-			     page_size);
+			vfsFrameFill(frame, page_number, commit, salt, checksum, page,
+				     page_size);
 
-		frames[w->n_frames + i] = frame;
+			frames[w->n_frames + k] = frame;
+			k++;
+		}
 	}
 
 	mtx_lock(&w->mtx);
-	w->n_frames += transaction->n_pages;
+	w->n_frames += k;
 	mtx_unlock(&w->mtx);
 
 	return 0;
 
 oom_after_frames_alloc:
-	for (j = 0; j < i; j++) {
+	for (j = 0; j < k; j++) {
 		vfsFrameDestroy(frames[w->n_frames + j]);
 	}
 oom:
@@ -2595,14 +3181,12 @@ static void vfsWalStartHeader(struct vfsWal *w, uint32_t page_size)
 /* Invalidate the WAL index header, forcing the next connection that tries to
  * start a read transaction to rebuild the WAL index by reading the WAL.
  *
- * No read or write lock must be currently held. */
+ * The write lock must be held. */
 static void vfsInvalidateWalIndexHeader(struct vfsDatabase *d)
 {
 	struct vfsShm *shm = &d->shm;
 
 	PRE(shm->lock[VFS__WAL_WRITE_LOCK] < 0);
-	PRE(shm->lock[VFS__WAL_CKPT_LOCK] >= 0);
-	PRE(shm->lock[VFS__WAL_RECOVER_LOCK] >= 0);
 	PRE(shm->size >= VFS__WAL_INDEX_HEADER_SIZE * 2);
 
 	/* The walIndexTryHdr function in sqlite/wal.c (which is indirectly
@@ -2620,6 +3204,13 @@ static void vfsInvalidateWalIndexHeader(struct vfsDatabase *d)
 }
 
 int VfsApply(sqlite3 *conn, const struct vfsTransaction *transaction)
+{
+	return VfsApplyBatch(conn, transaction, 1);
+}
+
+int VfsApplyBatch(sqlite3 *conn,
+		  const struct vfsTransaction *transactions,
+		  unsigned n)
 {
 	sqlite3_file *file;
 	struct vfsMainFile *f;
@@ -2628,9 +3219,12 @@ int VfsApply(sqlite3 *conn, const struct vfsTransaction *transaction)
 	rv = sqlite3_file_control(conn, NULL, SQLITE_FCNTL_FILE_POINTER, &file);
 	assert(rv == SQLITE_OK);
 	f = (struct vfsMainFile*)file;
-	tracef("vfs apply on %s %u pages", f->database->name, transaction->n_pages);
+	tracef("vfs apply on %s %u transactions", f->database->name, n);
+	PRE(n > 0);
+	/* A polled connection holds the write lock for its own transaction,
+	 * which can't be applied along with others. */
+	PRE(n == 1 || !f->polled);
 
-	
 	if (!f->polled) {
 		/* If this connection wasn't the one originating the transaction and there is 
 		* another on-going write transaction it is not possible to change the underlying 
@@ -2649,10 +3243,13 @@ int VfsApply(sqlite3 *conn, const struct vfsTransaction *transaction)
 		vfsWalStartHeader(&f->database->wal, vfsDatabaseGetPageSize(f->database));
 	}
 
-	rv = vfsWalAppend(f->database, transaction);
+	rv = vfsWalAppend(f->database, transactions, n);
 	if (rv != 0) {
 		tracef("wal append failed rv:%d n_pages:%u n:%u", rv,
-		       f->database->n_pages, transaction->n_pages);
+		       f->database->n_pages, n);
+		if (!f->polled) {
+			vfsShmUnlock(&f->database->shm, VFS__WAL_WRITE_LOCK, 1, true);
+		}
 		return rv;
 	}
 
@@ -2710,49 +3307,1180 @@ int VfsAbort(sqlite3 *conn)
 	return SQLITE_OK;
 }
 
+int VfsCommittedPage(sqlite3 *conn,
+		     uint32_t pgno,
+		     void *buf,
+		     const void **page)
+{
+	sqlite3_file *file;
+	struct vfsMainFile *f;
+	struct vfsDatabase *d;
+	struct vfsWal *w;
+	uint32_t n_pages;
+	uint32_t page_size;
+	unsigned i;
+	int rv;
+
+	rv = sqlite3_file_control(conn, NULL, SQLITE_FCNTL_FILE_POINTER, &file);
+	assert(rv == SQLITE_OK);
+	f = (struct vfsMainFile *)file;
+	d = f->database;
+	w = &d->wal;
+	PRE(pgno > 0);
+
+	*page = NULL;
+
+	/* Frames are only appended from this thread and the WAL only holds
+	 * committed transactions, the last frame being a commit one. */
+	if (w->n_frames > 0) {
+		n_pages = vfsFrameGetDatabaseSize(w->frames[w->n_frames - 1]);
+	} else {
+		n_pages = d->n_pages;
+	}
+	if (pgno > n_pages) {
+		return SQLITE_OK;
+	}
+
+	for (i = w->n_frames; i > 0; i--) {
+		struct vfsFrame *frame = w->frames[i - 1];
+		if (vfsFrameGetPageNumber(frame) != pgno) {
+			continue;
+		}
+		/* The page of a moved frame is the one of the database, unless
+		 * a truncation released it. */
+		if (!frame->moved) {
+			*page = frame->page;
+			return SQLITE_OK;
+		}
+		break;
+	}
+
+	if (f->vfs->disk) {
+		sqlite3_file *underlying = ((struct vfsDiskMainFile *)f)->underlying;
+		page_size = vfsDatabaseGetPageSize(d);
+		rv = underlying->pMethods->xRead(underlying, buf, (int)page_size,
+						 (sqlite3_int64)(pgno - 1) * page_size);
+		if (rv != SQLITE_OK) {
+			return rv;
+		}
+		*page = buf;
+		return SQLITE_OK;
+	}
+
+	*page = vfsDatabasePageLookup(d, pgno);
+	return SQLITE_OK;
+}
+
+/* Maximum number of frames moved to the database by a checkpoint that runs
+ * alongside readers. */
+#define VFS__CHECKPOINT_BATCH 4096
+
+/* Offsets of the checkpoint information in the WAL index. */
+#define VFS__WAL_INDEX_BACKFILL_OFFSET (VFS__WAL_INDEX_HEADER_SIZE * 2)
+#define VFS__WAL_INDEX_READ_MARK_OFFSET (VFS__WAL_INDEX_BACKFILL_OFFSET + 4)
+#define VFS__WAL_INDEX_BACKFILL_ATTEMPTED_OFFSET \
+	(VFS__WAL_INDEX_BACKFILL_OFFSET + 32)
+
+/* Value of a read mark that no reader uses. */
+#define VFS__WAL_READ_MARK_NOT_USED 0xffffffff
+
+/* Move the pages of the WAL frames in (from, to] to the page array, which is
+ * resized to the given number of pages. Frame `to` must be a commit frame.
+ *
+ * Readers of older snapshots might be running: a page of the array is only
+ * released if it is superseded by a frame that all of them see, and the
+ * array itself and the first page, which are accessed without read lock, are
+ * retired instead. */
+static int vfsDatabaseBackfill(struct vfsDatabase *d,
+			       unsigned from,
+			       unsigned to,
+			       unsigned n_pages)
+{
+	struct vfsWal *w = &d->wal;
+	struct vfsRetired *retired[2];
+	uint32_t page_size;
+	void **pages;
+	unsigned i;
+
+	PRE(from < to && to <= w->n_frames);
+	PRE(n_pages > 0);
+
+	page_size = vfsWalGetPageSize(w);
+	assert(page_size > 0);
+
+	if (n_pages > d->n_sources) {
+		struct vfsFrame **sources = sqlite3_realloc64(
+		    d->sources, sizeof *sources * n_pages);
+		if (sources == NULL) {
+			goto oom;
+		}
+		memset(sources + d->n_sources, 0,
+		       sizeof *sources * (n_pages - d->n_sources));
+		d->sources = sources;
+		d->n_sources = n_pages;
+	}
+
+	retired[0] = sqlite3_malloc(sizeof *retired[0]);
+	retired[1] = sqlite3_malloc(sizeof *retired[1]);
+	if (retired[0] == NULL || retired[1] == NULL) {
+		goto oom_after_retired_alloc;
+	}
+
+	pages = d->pages;
+	if (n_pages > d->n_pages) {
+		pages = sqlite3_malloc64(sizeof *pages * n_pages);
+		if (pages == NULL) {
+			goto oom_after_retired_alloc;
+		}
+		for (i = 0; i < n_pages; i++) {
+			pages[i] = i < d->n_pages ? d->pages[i] : NULL;
+		}
+
+		/* New pages that no frame fills, like the pending byte page,
+		 * are zero-filled. */
+		for (i = from; i < to; i++) {
+			unsigned pgno = vfsFrameGetPageNumber(w->frames[i]);
+			if (pgno > d->n_pages && pgno <= n_pages) {
+				pages[pgno - 1] = w->frames[i]->page;
+			}
+		}
+		for (i = d->n_pages; i < n_pages; i++) {
+			if (pages[i] != NULL) {
+				pages[i] = NULL;
+				continue;
+			}
+			pages[i] = sqlite3_malloc64(page_size);
+			if (pages[i] == NULL) {
+				goto oom_after_pages_alloc;
+			}
+			memset(pages[i], 0, page_size);
+		}
+	}
+
+	for (i = from; i < to; i++) {
+		struct vfsFrame *frame = w->frames[i];
+		unsigned pgno = vfsFrameGetPageNumber(frame);
+		void *page;
+
+		if (pgno > n_pages) {
+			/* Truncated by a later transaction. */
+			continue;
+		}
+
+		page = pages[pgno - 1];
+		if (pgno == 1 && d->sources[0] == NULL) {
+			vfsDatabaseRetire(d, &retired[1], page);
+		} else if (page != NULL) {
+			vfsDatabaseReleasePage(d, pgno, page);
+		}
+		pages[pgno - 1] = frame->page;
+		frame->moved = true;
+		d->sources[pgno - 1] = frame;
+		vfsDatabaseMarkDirty(d, pgno);
+	}
+
+	for (i = n_pages; i < d->n_pages; i++) {
+		vfsDatabaseReleasePage(d, i + 1, pages[i]);
+	}
+
+	atomic_thread_fence(memory_order_release);
+	mtx_lock(&d->mtx);
+	if (pages != d->pages) {
+		if (d->pages != NULL) {
+			vfsDatabaseRetire(d, &retired[0], d->pages);
+		}
+		d->pages = pages;
+	}
+	d->n_pages = n_pages;
+	mtx_unlock(&d->mtx);
+
+	sqlite3_free(retired[0]);
+	sqlite3_free(retired[1]);
+	return SQLITE_OK;
+
+oom_after_pages_alloc:
+	while (i > d->n_pages) {
+		sqlite3_free(pages[--i]);
+	}
+	sqlite3_free(pages);
+oom_after_retired_alloc:
+	sqlite3_free(retired[0]);
+	sqlite3_free(retired[1]);
+oom:
+	return SQLITE_NOMEM;
+}
+
+/* Return the address of the given page in the backing file of the database,
+ * creating and growing the file as needed. */
+static int vfsSpillSlot(struct vfs *v,
+			struct vfsDatabase *d,
+			uint32_t page_size,
+			unsigned pgno,
+			uint8_t **slot)
+{
+	struct vfsSpill *s = &d->spill;
+	unsigned per_chunk = VFS__SPILL_CHUNK_SIZE / page_size;
+	unsigned chunk = (pgno - 1) / per_chunk;
+
+	if (s->fd == -1) {
+		char *path = sqlite3_mprintf("%s/%s-spill", v->spill_dir,
+					     d->name);
+		if (path == NULL) {
+			return SQLITE_NOMEM;
+		}
+		s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+			     0600);
+		/* The file is only used while the database is open. */
+		if (s->fd != -1) {
+			unlink(path);
+		}
+		sqlite3_free(path);
+		if (s->fd == -1) {
+			tracef("open backing file failed: %d", errno);
+			return SQLITE_CANTOPEN;
+		}
+	}
+
+	while (s->n_chunks <= chunk) {
+		off_t offset = (off_t)s->n_chunks * VFS__SPILL_CHUNK_SIZE;
+		uint8_t **chunks;
+		void *addr;
+
+		chunks = sqlite3_realloc64(s->chunks,
+					   sizeof *chunks * (s->n_chunks + 1));
+		if (chunks == NULL) {
+			return SQLITE_NOMEM;
+		}
+		s->chunks = chunks;
+
+		/* Allocate the space up front, so that running out of disk
+		 * space is an error here rather than a SIGBUS later. */
+		if (posix_fallocate(s->fd, offset, VFS__SPILL_CHUNK_SIZE) !=
+		    0) {
+			return SQLITE_FULL;
+		}
+		addr = mmap(NULL, VFS__SPILL_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, s->fd, offset);
+		if (addr == MAP_FAILED) {
+			return SQLITE_IOERR_MMAP;
+		}
+		s->chunks[s->n_chunks++] = addr;
+	}
+
+	*slot = s->chunks[chunk] + (size_t)((pgno - 1) % per_chunk) * page_size;
+	return SQLITE_OK;
+}
+
+/* Move the given page to the backing file. */
+static int vfsSpillEvict(struct vfs *v,
+			 struct vfsDatabase *d,
+			 uint32_t page_size,
+			 unsigned pgno,
+			 bool retire)
+{
+	struct vfsSpill *s = &d->spill;
+	struct vfsRetired *retired = NULL;
+	void *page = d->pages[pgno - 1];
+	uint8_t *slot;
+	int rv;
+
+	if (retire) {
+		retired = sqlite3_malloc(sizeof *retired);
+		if (retired == NULL) {
+			return SQLITE_NOMEM;
+		}
+	}
+	rv = vfsSpillSlot(v, d, page_size, pgno, &slot);
+	if (rv != SQLITE_OK) {
+		sqlite3_free(retired);
+		return rv;
+	}
+	if (!vfsBitGet(s->clean, pgno)) {
+		memcpy(slot, page, page_size);
+	}
+
+	mtx_lock(&d->mtx);
+	d->pages[pgno - 1] = slot;
+	mtx_unlock(&d->mtx);
+	if (retire) {
+		vfsDatabaseRetire(d, &retired, page);
+	} else {
+		vfsDatabaseFreePage(d, page);
+	}
+
+	vfsBitSet(s->spilled, pgno);
+	vfsBitClear(s->clean, pgno);
+	s->n_spilled++;
+	return SQLITE_OK;
+}
+
+/* Bring the given page back in memory from the backing file, where it stays
+ * as a clean copy. */
+static int vfsSpillLoad(struct vfsDatabase *d, uint32_t page_size, unsigned pgno)
+{
+	struct vfsSpill *s = &d->spill;
+	void *page;
+
+	page = sqlite3_malloc64(page_size);
+	if (page == NULL) {
+		return SQLITE_NOMEM;
+	}
+	memcpy(page, d->pages[pgno - 1], page_size);
+
+	mtx_lock(&d->mtx);
+	d->pages[pgno - 1] = page;
+	mtx_unlock(&d->mtx);
+
+	vfsBitClear(s->spilled, pgno);
+	vfsBitClear(s->referenced, pgno);
+	vfsBitSet(s->clean, pgno);
+	s->n_spilled--;
+	return SQLITE_OK;
+}
+
+/* Return the size of the database pages of all databases held in memory. */
+static uint64_t vfsResidentSize(struct vfs *v)
+{
+	uint64_t size = 0;
+
+	for (size_t i = 0; i < v->databases.n_buckets; i++) {
+		struct hash_node *node;
+		for (node = v->databases.buckets[i]; node != NULL;
+		     node = node->next) {
+			struct vfsDatabase *d =
+			    CONTAINER_OF(node, struct vfsDatabase, node);
+			if (d->n_pages == 0) {
+				continue;
+			}
+			size += (uint64_t)(d->n_pages - d->spill.n_spilled) *
+				vfsDatabaseGetPageSize(d);
+		}
+	}
+	return size;
+}
+
+/* Keep the database pages held in memory by the VFS within its budget, with
+ * a CLOCK sweep over the pages of the given database: pages that weren't read
+ * since the hand last passed are evicted to the backing file, and evicted
+ * pages that were read since are brought back while there's room. The first
+ * page and pages still visible in the WAL are never evicted. All locks must be
+ * held exclusively.
+ *
+ * Otherwise, when readers are active, READ(0) must be held exclusively, as
+ * when moving frames. Pages are then only evicted, and their memory is
+ * retired, as readers might still use it, and released once the WAL is reset.
+ * No reader can use the copy in the backing file of a page in memory: pages
+ * are only brought back while holding all locks. */
+static void vfsSpillEnforce(struct vfs *v, struct vfsDatabase *d, bool readers)
+{
+	struct vfsSpill *s = &d->spill;
+	uint64_t resident;
+	uint32_t page_size;
+	unsigned pgno;
+	unsigned n;
+	int rv;
+
+	if (v->budget == 0 || d->n_pages < 2) {
+		return;
+	}
+	if (vfsSpillGrow(d, d->n_pages, readers) != SQLITE_OK) {
+		return;
+	}
+	page_size = vfsDatabaseGetPageSize(d);
+	resident = vfsResidentSize(v);
+
+	for (n = 0; resident > v->budget && n < 2 * d->n_pages; n++) {
+		pgno = s->hand >= 2 && s->hand <= d->n_pages ? s->hand : 2;
+		s->hand = pgno + 1;
+		if (vfsBitGet(s->spilled, pgno) ||
+		    (pgno <= d->n_sources && d->sources[pgno - 1] != NULL)) {
+			continue;
+		}
+		if (vfsBitGet(s->referenced, pgno)) {
+			vfsBitClear(s->referenced, pgno);
+			continue;
+		}
+		rv = vfsSpillEvict(v, d, page_size, pgno, readers);
+		if (rv != SQLITE_OK) {
+			tracef("[database %p] evict page %u: %d", d, pgno, rv);
+			return;
+		}
+		resident -= page_size;
+	}
+
+	if (readers) {
+		return;
+	}
+	for (pgno = 2; s->n_spilled > 0 && pgno <= d->n_pages &&
+		       resident + page_size <= v->budget;
+	     pgno++) {
+		if (!vfsBitGet(s->spilled, pgno) ||
+		    !vfsBitGet(s->referenced, pgno)) {
+			continue;
+		}
+		rv = vfsSpillLoad(d, page_size, pgno);
+		if (rv != SQLITE_OK) {
+			return;
+		}
+		resident += page_size;
+	}
+}
+
+/* Reset the checkpoint information of the WAL index after the WAL was emptied,
+ * and invalidate its header. Connections rebuild their WAL index from the
+ * empty WAL, but in a private mapping that doesn't publish the checkpoint
+ * information, so reset it here as SQLite does when restarting the WAL. The
+ * write lock and all read locks but READ(0) must be held exclusively. */
+static void vfsWalIndexReset(struct vfsDatabase *d)
+{
+	uint32_t info[1 + VFS__WAL_NREADER] = { 0 };
+	ssize_t n;
+
+	if (d->shm.size == 0) {
+		return;
+	}
+
+	for (int i = 1; i < VFS__WAL_NREADER; i++) {
+		info[1 + i] = VFS__WAL_READ_MARK_NOT_USED;
+	}
+	n = pwrite(d->shm.fd, info, sizeof info,
+		   VFS__WAL_INDEX_BACKFILL_OFFSET);
+	assert(n == sizeof info);
+	n = pwrite(d->shm.fd, info, sizeof info[0],
+		   VFS__WAL_INDEX_BACKFILL_ATTEMPTED_OFFSET);
+	assert(n == sizeof info[0]);
+	vfsInvalidateWalIndexHeader(d);
+}
+
+/* Move all frames to the database and reset the WAL. All locks must be held
+ * exclusively, so no reader can be using the memory released here. */
+static int vfsCheckpointFull(struct vfsDatabase *d)
+{
+	struct vfsWal *w = &d->wal;
+	struct vfsFrame *last;
+	int rv;
+
+	PRE(w->n_tx == 0);
+
+	if (w->n_frames == 0) {
+		return SQLITE_OK;
+	}
+
+	if (w->n_backfilled < w->n_frames) {
+		last = w->frames[w->n_frames - 1];
+		rv = vfsDatabaseBackfill(d, w->n_backfilled, w->n_frames,
+					 vfsFrameGetDatabaseSize(last));
+		if (rv != SQLITE_OK) {
+			return rv;
+		}
+	}
+
+	vfsWalTruncate(w);
+	vfsDatabaseWalReset(d);
+	vfsWalIndexReset(d);
+
+	return SQLITE_OK;
+}
+
+/* Start moving frames to the database while readers are active, the same way
+ * as SQLite's PASSIVE checkpoint does: only frames that all current readers
+ * see are moved, and readers that only use the database file are kept out.
+ * The WAL is left untouched. Unless whole is set, the last transaction is
+ * always left out, as SQLite would otherwise restart the WAL by itself on the
+ * next write, which only in-memory databases prevent, see
+ * vfsCheckpointRestart.
+ *
+ * On success, READ(0) is held and the first region of the WAL index is mapped
+ * until vfsCheckpointEnd is called, and the frames after the backfilled ones
+ * up to the commit frame mx can be moved, at most limit of them. */
+static int vfsCheckpointBegin(struct vfsDatabase *d,
+			      unsigned limit,
+			      bool whole,
+			      uint8_t **region,
+			      unsigned *mx)
+{
+	struct vfsShm *shm = &d->shm;
+	struct vfsWal *w = &d->wal;
+	uint8_t hdr[2][VFS__WAL_INDEX_HEADER_SIZE];
+	unsigned n_frames;
+	unsigned n_backfilled;
+	int i;
+	int rv;
+
+	rv = vfsShmLock(shm, VFS__WAL_READ_LOCK(0), 1, true);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+
+	mtx_lock(&shm->mtx);
+	bool mapped = shm->size > 0;
+	mtx_unlock(&shm->mtx);
+	if (!mapped) {
+		rv = SQLITE_BUSY;
+		goto err_after_read_lock;
+	}
+
+	*region = mmap(NULL, VFS__WAL_INDEX_REGION_SIZE, PROT_READ | PROT_WRITE,
+		       MAP_SHARED, shm->fd, 0);
+	if (*region == MAP_FAILED) {
+		rv = SQLITE_IOERR_SHMMAP;
+		goto err_after_read_lock;
+	}
+
+	mtx_lock(&w->mtx);
+	n_frames = w->n_frames;
+	n_backfilled = w->n_backfilled;
+	mtx_unlock(&w->mtx);
+
+	/* Only frames published in the WAL index can be moved. The header is
+	 * read the same way as SQLite does, and can't be used if it's being
+	 * written or was invalidated. */
+	memcpy(hdr[0], *region, sizeof hdr[0]);
+	atomic_thread_fence(memory_order_seq_cst);
+	memcpy(hdr[1], *region + VFS__WAL_INDEX_HEADER_SIZE, sizeof hdr[1]);
+	if (memcmp(hdr[0], hdr[1], sizeof hdr[0]) != 0) {
+		rv = SQLITE_BUSY;
+		goto err_after_mmap;
+	}
+	*mx = *(uint32_t *)(hdr[0] + 16);
+	if (*mx > n_frames) {
+		*mx = n_frames;
+	}
+	if (!whole && *mx > 0) {
+		*mx -= 1;
+	}
+	if (*mx <= n_backfilled) {
+		rv = SQLITE_BUSY;
+		goto err_after_mmap;
+	}
+	if (*mx - n_backfilled > limit) {
+		*mx = n_backfilled + limit;
+	}
+
+	/* A reader holding a read mark sees all frames up to it. The mark
+	 * might be stale if its lock is free. A reader setting a mark from
+	 * now on uses the current WAL index header, which includes all frames
+	 * up to mx. */
+	for (i = 1; i < VFS__WAL_NREADER; i++) {
+		_Atomic uint32_t *mark =
+		    (void *)(*region + VFS__WAL_INDEX_READ_MARK_OFFSET +
+			     sizeof(uint32_t) * (size_t)i);
+		uint32_t y = atomic_load_explicit(mark, memory_order_relaxed);
+		if (*mx <= y) {
+			continue;
+		}
+		if (vfsShmLock(shm, VFS__WAL_READ_LOCK(i), 1, true) ==
+		    SQLITE_OK) {
+			vfsShmUnlock(shm, VFS__WAL_READ_LOCK(i), 1, true);
+		} else {
+			*mx = y;
+		}
+	}
+
+	/* Stop at a commit frame, so that the database is always consistent. */
+	mtx_lock(&w->mtx);
+	while (*mx > n_backfilled &&
+	       vfsFrameGetDatabaseSize(w->frames[*mx - 1]) == 0) {
+		(*mx)--;
+	}
+	mtx_unlock(&w->mtx);
+
+	if (*mx <= n_backfilled) {
+		rv = SQLITE_BUSY;
+		goto err_after_mmap;
+	}
+
+	return SQLITE_OK;
+
+err_after_mmap:
+	munmap(*region, VFS__WAL_INDEX_REGION_SIZE);
+err_after_read_lock:
+	vfsShmUnlock(shm, VFS__WAL_READ_LOCK(0), 1, true);
+	return rv;
+}
+
+/* Complete a checkpoint started with vfsCheckpointBegin. Readers starting
+ * from now on read the frames up to the backfilled one from the database. */
+static void vfsCheckpointEnd(struct vfsDatabase *d,
+			     uint8_t *region,
+			     unsigned backfilled)
+{
+	if (backfilled > 0) {
+		_Atomic uint32_t *backfill =
+		    (void *)(region + VFS__WAL_INDEX_BACKFILL_OFFSET);
+		atomic_store_explicit(backfill, backfilled,
+				      memory_order_release);
+		uint32_t *attempted =
+		    (void *)(region + VFS__WAL_INDEX_BACKFILL_ATTEMPTED_OFFSET);
+		*attempted = backfilled;
+	}
+	munmap(region, VFS__WAL_INDEX_REGION_SIZE);
+	vfsShmUnlock(&d->shm, VFS__WAL_READ_LOCK(0), 1, true);
+}
+
+/* Reset the WAL once all its frames were moved to the database, while readers
+ * are active, the same way as SQLite restarts it. Once the backfill of the
+ * whole WAL is published, readers starting a transaction only read the
+ * database and hold READ(0), so the WAL can be reset as soon as the readers
+ * holding the other read locks, which might be reading its frames, are done.
+ * SQLite itself is kept from doing it on the next write, as it would rewrite
+ * the frames in place, see vfsMainFileIsRestartingWal.
+ * The checkpoint lock must be held. */
+static int vfsCheckpointRestart(struct vfsDatabase *d)
+{
+	struct vfsShm *shm = &d->shm;
+	struct vfsWal *w = &d->wal;
+	int rv;
+
+	PRE(w->n_backfilled == w->n_frames);
+
+	rv = vfsShmLock(shm, VFS__WAL_WRITE_LOCK, 1, true);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+	rv = vfsShmLock(shm, VFS__WAL_READ_LOCK(1), VFS__WAL_NREADER - 1, true);
+	if (rv != SQLITE_OK) {
+		goto out;
+	}
+
+	vfsWalTruncate(w);
+	vfsDatabaseWalReset(d);
+	vfsWalIndexReset(d);
+	tracef("[database %p] restarted WAL", d);
+
+	vfsShmUnlock(shm, VFS__WAL_READ_LOCK(1), VFS__WAL_NREADER - 1, true);
+out:
+	vfsShmUnlock(shm, VFS__WAL_WRITE_LOCK, 1, true);
+	return rv;
+}
+
+/* Move a batch of frames to the database while readers are active, and reset
+ * the WAL when none of them can be using its frames anymore. */
+static int vfsCheckpointIncremental(struct vfs *v, struct vfsDatabase *d)
+{
+	struct vfsShm *shm = &d->shm;
+	struct vfsWal *w = &d->wal;
+	uint8_t *region;
+	unsigned mx;
+	int rv;
+
+	rv = vfsShmLock(shm, VFS__WAL_CKPT_LOCK, 1, true);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+	if (w->n_backfilled == w->n_frames) {
+		rv = vfsCheckpointRestart(d);
+		goto out;
+	}
+	rv = vfsCheckpointBegin(d, VFS__CHECKPOINT_BATCH, true, &region,
+				 &mx);
+	if (rv != SQLITE_OK) {
+		goto out;
+	}
+
+	rv = vfsDatabaseBackfill(d, w->n_backfilled, mx,
+				 vfsFrameGetDatabaseSize(w->frames[mx - 1]));
+	if (rv != SQLITE_OK) {
+		vfsCheckpointEnd(d, region, 0);
+		goto out;
+	}
+	w->n_backfilled = mx;
+	vfsSpillEnforce(v, d, true);
+	vfsCheckpointEnd(d, region, mx);
+
+	tracef("[database %p] checkpointed %u/%u frames", d, mx,
+	       w->n_frames);
+
+	if (mx == w->n_frames) {
+		rv = vfsCheckpointRestart(d);
+	} else {
+		rv = SQLITE_BUSY;
+	}
+
+out:
+	vfsShmUnlock(shm, VFS__WAL_CKPT_LOCK, 1, true);
+	return rv;
+}
+
+/* Size of the writes issued to the database file by a disk checkpoint. */
+#define VFS__DISK_CHECKPOINT_WRITE_SIZE (1024 * 1024)
+
+/* Frames besides the last transaction that a disk checkpoint writes
+ * synchronously instead of queueing a background pass. */
+#define VFS__DISK_CHECKPOINT_TAIL 64
+
+/* Number of times the checkpoint threshold the WAL can grow to before a disk
+ * checkpoint blocks waiting for the background pass. */
+#define VFS__DISK_CHECKPOINT_HARD_CAP 4
+
+/* A page to write to the database file. */
+struct vfsDiskPage
+{
+	uint32_t pgno;
+	const uint8_t *data;
+};
+
+static int vfsDiskPageCompare(const void *a, const void *b)
+{
+	const struct vfsDiskPage *pa = a;
+	const struct vfsDiskPage *pb = b;
+	return (pa->pgno > pb->pgno) - (pa->pgno < pb->pgno);
+}
+
+/* Open the database file used to write checkpointed pages, bypassing the
+ * connections' files. */
+static int vfsDiskOpenFile(struct vfs *v, struct vfsDatabase *d)
+{
+	sqlite3_file *file;
+	int flags;
+	int rv;
+
+	if (d->file != NULL) {
+		return SQLITE_OK;
+	}
+
+	file = sqlite3_malloc(v->base_vfs->szOsFile);
+	if (file == NULL) {
+		return SQLITE_NOMEM;
+	}
+	rv = v->base_vfs->xOpen(v->base_vfs, d->name, file,
+				SQLITE_OPEN_READWRITE | SQLITE_OPEN_MAIN_DB,
+				&flags);
+	if (rv != SQLITE_OK) {
+		sqlite3_free(file);
+		return rv;
+	}
+	d->file = file;
+	return SQLITE_OK;
+}
+
+/* Write the latest version of each page in the frames after from up to the
+ * commit frame to, in page order and coalescing adjacent pages into large
+ * writes. The database size at the commit frame is stored in n_pages. */
+static int vfsDiskBackfill(struct vfs *v,
+			   struct vfsDatabase *d,
+			   unsigned from,
+			   unsigned to,
+			   unsigned *n_pages)
+{
+	struct vfsWal *w = &d->wal;
+	uint32_t page_size = vfsWalGetPageSize(w);
+	struct vfsDiskPage *pages = NULL;
+	uint8_t *seen = NULL;
+	uint8_t *buf = NULL;
+	unsigned max;
+	unsigned n = 0;
+	unsigned i;
+	int rv;
+
+	PRE(from < to);
+
+	rv = vfsDiskOpenFile(v, d);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+
+	mtx_lock(&w->mtx);
+	*n_pages = vfsFrameGetDatabaseSize(w->frames[to - 1]);
+	mtx_unlock(&w->mtx);
+	POST(*n_pages > 0);
+
+	max = VFS__DISK_CHECKPOINT_WRITE_SIZE / page_size;
+	if (max == 0) {
+		max = 1;
+	}
+	pages = sqlite3_malloc64(sizeof *pages * (to - from));
+	seen = sqlite3_malloc64(*n_pages / 8 + 1);
+	buf = sqlite3_malloc64((uint64_t)max * page_size);
+	if (pages == NULL || seen == NULL || buf == NULL) {
+		rv = SQLITE_NOMEM;
+		goto out;
+	}
+	memset(seen, 0, *n_pages / 8 + 1);
+
+	/* Frames are immutable once committed, but the array holding them
+	 * grows while transactions are applied. */
+	mtx_lock(&w->mtx);
+	for (i = to; i > from; i--) {
+		struct vfsFrame *frame = w->frames[i - 1];
+		uint32_t pgno = vfsFrameGetPageNumber(frame);
+		if (pgno > *n_pages ||
+		    (seen[(pgno - 1) / 8] & (1 << ((pgno - 1) % 8))) != 0) {
+			continue;
+		}
+		seen[(pgno - 1) / 8] |= (uint8_t)(1 << ((pgno - 1) % 8));
+		pages[n++] = (struct vfsDiskPage){ pgno, frame->page };
+	}
+	mtx_unlock(&w->mtx);
+
+	qsort(pages, n, sizeof *pages, vfsDiskPageCompare);
+
+	for (i = 0; i < n;) {
+		const void *data = pages[i].data;
+		unsigned j = i + 1;
+		while (j < n && j - i < max &&
+		       pages[j].pgno == pages[j - 1].pgno + 1) {
+			j++;
+		}
+		if (j - i > 1) {
+			for (unsigned k = i; k < j; k++) {
+				memcpy(buf + (size_t)(k - i) * page_size,
+				       pages[k].data, page_size);
+			}
+			data = buf;
+		}
+		rv = d->file->pMethods->xWrite(
+		    d->file, data, (int)((j - i) * page_size),
+		    (sqlite3_int64)(pages[i].pgno - 1) * page_size);
+		if (rv != SQLITE_OK) {
+			goto out;
+		}
+		i = j;
+	}
+
+out:
+	sqlite3_free(buf);
+	sqlite3_free(seen);
+	sqlite3_free(pages);
+	return rv;
+}
+
+/* Sync the database file written by a checkpoint, if enabled. */
+static int vfsDiskSync(struct vfs *v, struct vfsDatabase *d)
+{
+	struct vfsCheckpointer *c = &v->checkpointer;
+	bool sync;
+
+	mtx_lock(&c->mtx);
+	sync = c->sync;
+	mtx_unlock(&c->mtx);
+	if (!sync) {
+		return SQLITE_OK;
+	}
+	return d->file->pMethods->xSync(d->file, SQLITE_SYNC_NORMAL |
+						     SQLITE_SYNC_DATAONLY);
+}
+
+/* Write frames to the database file while readers are active. This runs in the
+ * checkpoint thread, and doesn't take the CKPT lock, which connections need to
+ * recover the WAL index after a transaction is applied. Other checkpoints are
+ * excluded by the state of the background checkpoint instead. */
+static int vfsDiskCheckpointIncremental(struct vfs *v, struct vfsDatabase *d)
+{
+	struct vfsWal *w = &d->wal;
+	uint8_t *region;
+	unsigned n_backfilled;
+	unsigned n_pages;
+	unsigned mx;
+	int rv;
+
+	rv = vfsCheckpointBegin(d, UINT_MAX, false, &region, &mx);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+
+	mtx_lock(&w->mtx);
+	n_backfilled = w->n_backfilled;
+	mtx_unlock(&w->mtx);
+
+	rv = vfsDiskBackfill(v, d, n_backfilled, mx, &n_pages);
+	if (rv == SQLITE_OK) {
+		rv = vfsDiskSync(v, d);
+	}
+	if (rv != SQLITE_OK) {
+		vfsCheckpointEnd(d, region, 0);
+		return rv;
+	}
+
+	mtx_lock(&w->mtx);
+	w->n_backfilled = mx;
+	mtx_unlock(&w->mtx);
+	vfsCheckpointEnd(d, region, mx);
+
+	tracef("[database %p] checkpointed %u frames in background", d, mx);
+	return SQLITE_OK;
+}
+
+/* Write all frames to the database file and reset the WAL. All locks must be
+ * held exclusively and no background checkpoint must be queued. */
+static int vfsDiskCheckpointFull(struct vfs *v, struct vfsDatabase *d)
+{
+	struct vfsWal *w = &d->wal;
+	uint32_t page_size = vfsWalGetPageSize(w);
+	unsigned n_pages;
+	int rv;
+
+	PRE(w->n_tx == 0);
+	PRE(d->checkpoint == VFS__CHECKPOINT_IDLE);
+
+	if (w->n_frames == 0) {
+		return SQLITE_OK;
+	}
+
+	if (w->n_backfilled < w->n_frames) {
+		rv = vfsDiskBackfill(v, d, w->n_backfilled, w->n_frames,
+				     &n_pages);
+	} else {
+		n_pages = vfsFrameGetDatabaseSize(w->frames[w->n_frames - 1]);
+		rv = vfsDiskOpenFile(v, d);
+	}
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+
+	rv = d->file->pMethods->xTruncate(d->file,
+					  (sqlite3_int64)n_pages * page_size);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+	rv = vfsDiskSync(v, d);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+
+	mtx_lock(&d->mtx);
+	d->n_pages = n_pages;
+	mtx_unlock(&d->mtx);
+
+	vfsWalTruncate(w);
+	vfsWalIndexReset(d);
+
+	return SQLITE_OK;
+}
+
+/* Return the number of frames of the last transaction in the WAL. */
+static unsigned vfsWalLastTransactionSize(struct vfsWal *w)
+{
+	unsigned i;
+
+	if (w->n_frames == 0) {
+		return 0;
+	}
+	for (i = w->n_frames - 1; i > 0; i--) {
+		if (vfsFrameGetDatabaseSize(w->frames[i - 1]) != 0) {
+			break;
+		}
+	}
+	return w->n_frames - i;
+}
+
+static int vfsCheckpointerRun(void *arg)
+{
+	struct vfs *v = arg;
+	struct vfsCheckpointer *c = &v->checkpointer;
+	struct vfsDatabase *d;
+	int rv;
+
+	mtx_lock(&c->mtx);
+	for (;;) {
+		while (!c->stop && c->head == NULL) {
+			cnd_wait(&c->cond, &c->mtx);
+		}
+		if (c->stop) {
+			break;
+		}
+
+		d = c->head;
+		c->head = d->checkpoint_next;
+		if (c->head == NULL) {
+			c->tail = NULL;
+		}
+		d->checkpoint_next = NULL;
+		d->checkpoint = VFS__CHECKPOINT_RUNNING;
+		mtx_unlock(&c->mtx);
+
+		rv = vfsDiskCheckpointIncremental(v, d);
+		if (rv != SQLITE_OK) {
+			tracef("[database %p] background checkpoint: %d", d,
+			       rv);
+		}
+
+		mtx_lock(&c->mtx);
+		d->checkpoint = VFS__CHECKPOINT_IDLE;
+		cnd_broadcast(&c->cond);
+	}
+	mtx_unlock(&c->mtx);
+
+	return 0;
+}
+
+/* Checkpoint an on-disk database. Frames are written to the database file by
+ * the checkpoint thread, so applying transactions isn't blocked by disk I/O,
+ * unless the WAL grows past the hard cap. Only the last few frames are written
+ * synchronously, to reset the WAL. */
+static int vfsDiskCheckpoint(struct vfs *v,
+			     struct vfsDatabase *d,
+			     unsigned threshold)
+{
+	struct vfsCheckpointer *c = &v->checkpointer;
+	struct vfsWal *w = &d->wal;
+	bool over_cap =
+	    w->n_frames >= (uint64_t)threshold * VFS__DISK_CHECKPOINT_HARD_CAP;
+	int rv;
+
+	mtx_lock(&c->mtx);
+	if (d->checkpoint != VFS__CHECKPOINT_IDLE && !over_cap) {
+		mtx_unlock(&c->mtx);
+		tracef("[database %p] checkpoint in progress", d);
+		return SQLITE_BUSY;
+	}
+	while (d->checkpoint != VFS__CHECKPOINT_IDLE) {
+		cnd_wait(&c->cond, &c->mtx);
+	}
+	mtx_unlock(&c->mtx);
+
+	/* Frames are only appended from this thread. */
+	if (w->n_frames < threshold) {
+		tracef("[database %p] checkpoint below threshold (%u < %u)", d,
+		       w->n_frames, threshold);
+		return SQLITE_OK;
+	}
+
+	rv = vfsShmLock(&d->shm, 0, SQLITE_SHM_NLOCK, true);
+	if (rv == SQLITE_OK) {
+		unsigned left = w->n_frames - w->n_backfilled;
+		if (over_cap || left <= vfsWalLastTransactionSize(w) +
+					    VFS__DISK_CHECKPOINT_TAIL) {
+			rv = vfsDiskCheckpointFull(v, d);
+			tracef("[database %p] checkpointed %d", d, rv);
+			vfsShmUnlock(&d->shm, 0, SQLITE_SHM_NLOCK, true);
+			return rv;
+		}
+		vfsShmUnlock(&d->shm, 0, SQLITE_SHM_NLOCK, true);
+	}
+
+	mtx_lock(&c->mtx);
+	d->checkpoint = VFS__CHECKPOINT_QUEUED;
+	if (c->tail != NULL) {
+		c->tail->checkpoint_next = d;
+	} else {
+		c->head = d;
+	}
+	c->tail = d;
+	cnd_broadcast(&c->cond);
+	mtx_unlock(&c->mtx);
+
+	tracef("[database %p] checkpoint queued", d);
+	return SQLITE_BUSY;
+}
+
+/* Once the pages still pointing into adopted memory take less than this
+ * fraction of it, they are copied out so that it can be released. */
+#define VFS__ADOPTED_COPY_RATIO 4
+
+/* Return the size of the pages of all databases pointing into the given
+ * adopted memory. */
+static uint64_t vfsAdoptedUsedSize(struct vfs *v, const struct vfsAdopted *a)
+{
+	uint64_t size = 0;
+
+	for (size_t i = 0; i < v->databases.n_buckets; i++) {
+		struct hash_node *node;
+		for (node = v->databases.buckets[i]; node != NULL;
+		     node = node->next) {
+			struct vfsDatabase *d =
+			    CONTAINER_OF(node, struct vfsDatabase, node);
+			if (d->adopted != a) {
+				continue;
+			}
+			size += (uint64_t)d->n_adopted *
+				vfsDatabaseGetPageSize(d);
+		}
+	}
+	return size;
+}
+
+/* Copy out the pages of the database that still point into adopted memory,
+ * so that it stops using it. All locks must be held exclusively. */
+static int vfsDatabaseCopyAdopted(struct vfsDatabase *d)
+{
+	uint32_t page_size;
+	unsigned i;
+
+	if (d->adopted == NULL) {
+		return SQLITE_OK;
+	}
+
+	/* No reader can be using retired pages anymore. */
+	vfsDatabaseFreeRetired(d);
+
+	page_size = vfsDatabaseGetPageSize(d);
+	for (i = 0; i < d->n_pages && d->adopted != NULL; i++) {
+		void *page = d->pages[i];
+		void *copy;
+
+		if (!vfsDatabaseIsAdopted(d, page)) {
+			continue;
+		}
+		copy = sqlite3_malloc64(page_size);
+		if (copy == NULL) {
+			return SQLITE_NOMEM;
+		}
+		memcpy(copy, page, page_size);
+		mtx_lock(&d->mtx);
+		d->pages[i] = copy;
+		mtx_unlock(&d->mtx);
+		vfsDatabaseFreePage(d, page);
+	}
+	return SQLITE_OK;
+}
+
+/* Stop using adopted memory once the pages of all databases pointing into it
+ * only take a small part of it, so that a few pages that are never modified
+ * don't keep it all around. All locks must be held exclusively. */
+static void vfsDatabaseUnadopt(struct vfs *v, struct vfsDatabase *d)
+{
+	int rv;
+
+	if (d->adopted == NULL || vfsAdoptedUsedSize(v, d->adopted) *
+					  VFS__ADOPTED_COPY_RATIO >
+				      d->adopted->len) {
+		return;
+	}
+	rv = vfsDatabaseCopyAdopted(d);
+	if (rv != SQLITE_OK) {
+		tracef("[database %p] unadopt: %d", d, rv);
+	}
+}
+
 int VfsCheckpoint(sqlite3 *conn, unsigned int threshold)
 {
 	sqlite3_file *file;
 	int rv = sqlite3_file_control(conn, NULL, SQLITE_FCNTL_FILE_POINTER, &file);
 	assert(rv == SQLITE_OK);
 	struct vfsMainFile *f = (struct vfsMainFile*)file;
+	struct vfsDatabase *d = f->database;
 
 	PRE(f->sharedMask == 0);
 	PRE(f->exclMask == 0);
-	tracef("[database %p] checkpoint start", f->database);
+	tracef("[database %p] checkpoint start", d);
 
-	/* Try to lock everything, so that nothing can proceed. */
-	rv = vfsShmLock(&f->database->shm, 0, SQLITE_SHM_NLOCK, true);
-	if (rv != SQLITE_OK) {
-		tracef("[database %p] checkpoint busy", f->database);
-		return rv;
+	if (f->vfs->disk) {
+		return vfsDiskCheckpoint(f->vfs, d, threshold);
 	}
 
-	PRE(f->database->wal.n_tx == 0);
-	if (f->database->wal.n_frames < threshold) {
-		rv = vfsShmUnlock(&f->database->shm, 0, SQLITE_SHM_NLOCK, true);
-		assert(rv == SQLITE_OK);
-		tracef("[database %p] checkpoint below threshold (%d < %d)", f->database, f->database->wal.n_frames, threshold);
+	/* Frames are only appended from this thread. */
+	if (d->wal.n_frames < threshold) {
+		tracef("[database %p] checkpoint below threshold (%d < %d)", d, d->wal.n_frames, threshold);
 		return SQLITE_OK;
 	}
 
-	int wal_size;
-	int ckpt;
-	f->exclMask = VFS__CHECKPOINT_MASK;
-	rv = sqlite3_wal_checkpoint_v2(conn, NULL, SQLITE_CHECKPOINT_TRUNCATE,
-				       &wal_size, &ckpt);
-	/* Since no reader transaction is in progress, we must be able to
-	 * checkpoint the entire WAL */
-	assert(rv == SQLITE_OK);
-	assert(wal_size == 0);
-	assert(ckpt == 0);
-	tracef("[database %p] checkpointed");
+	/* Try to lock everything, so that nothing can proceed. */
+	rv = vfsShmLock(&d->shm, 0, SQLITE_SHM_NLOCK, true);
+	if (rv != SQLITE_OK) {
+		/* Make progress anyway, without blocking readers. */
+		return vfsCheckpointIncremental(f->vfs, d);
+	}
 
-	f->exclMask = 0;
-	rv = vfsShmUnlock(&f->database->shm, 0, SQLITE_SHM_NLOCK, true);
-	assert(rv == SQLITE_OK);
+	rv = vfsCheckpointFull(d);
+	tracef("[database %p] checkpointed %d", d, rv);
+	if (rv == SQLITE_OK) {
+		vfsSpillEnforce(f->vfs, d, false);
+		vfsDatabaseUnadopt(f->vfs, d);
+	}
 
-	return SQLITE_OK;
+	vfsShmUnlock(&d->shm, 0, SQLITE_SHM_NLOCK, true);
+	return rv;
 }
 
 /* Extract the number of pages field from the database header. */
@@ -2956,7 +4684,78 @@ int VfsShallowSnapshot(sqlite3_vfs *vfs,
 	return 0;
 }
 
+int VfsBackup(sqlite3_vfs *vfs,
+	      const char *filename,
+	      uint64_t *position,
+	      bool *incremental,
+	      struct dqlite_buffer **pages,
+	      uint32_t *n)
+{
+	tracef("vfs backup filename %s", filename);
+	struct vfs *v;
+	struct vfsDatabase *database;
+	struct vfsWal *wal;
+	struct dqlite_buffer *bufs;
+	uint32_t page_size;
+	uint32_t pgno;
+	unsigned since;
+	unsigned i;
+
+	v = (struct vfs *)(vfs->pAppData);
+	database = vfsDatabaseLookup(v, filename);
+	wal = database != NULL ? &database->wal : NULL;
+
+	*pages = NULL;
+	*n = 0;
+	*incremental = false;
+
+	if (database == NULL || vfsDatabaseNumPages(database, true) == 0) {
+		*position = 0;
+		return 0;
+	}
+
+	if (database->n_pages != vfsDatabaseGetNumberOfPages(database)) {
+		tracef("corrupt");
+		return SQLITE_CORRUPT;
+	}
+
+	*n = vfsDatabaseNumPages(database, true);
+	bufs = sqlite3_malloc64(sizeof *bufs * *n);
+	if (bufs == NULL) {
+		tracef("malloc");
+		return DQLITE_NOMEM;
+	}
+
+	/* The position is the generation of the WAL in the upper half, and the
+	 * number of its committed frames in the lower half. */
+	since = (unsigned)(*position & 0xffffffff);
+	if (*position != 0 &&
+	    (uint32_t)(*position >> 32) == database->generation &&
+	    since <= wal->n_frames) {
+		memset(bufs, 0, sizeof *bufs * *n);
+		for (i = since; i < wal->n_frames; i++) {
+			page_size = vfsWalGetPageSize(wal);
+			pgno = vfsFrameGetPageNumber(wal->frames[i]);
+			/* The database might have shrunk since. */
+			if (pgno > *n) {
+				continue;
+			}
+			bufs[pgno - 1].base = wal->frames[i]->page;
+			bufs[pgno - 1].len = page_size;
+		}
+		*incremental = true;
+	} else {
+		vfsDatabaseShallowSnapshot(database, bufs, *n);
+		vfsWalShallowSnapshot(wal, bufs, *n);
+	}
+
+	*pages = bufs;
+	*position = (uint64_t)database->generation << 32 | wal->n_frames;
+	return 0;
+}
+
 static int vfsDatabaseRestore(struct vfsDatabase *d,
+			      struct vfsAdopted *adopted,
 			      const uint8_t *data,
 			      size_t n)
 {
@@ -2984,6 +4783,16 @@ static int vfsDatabaseRestore(struct vfsDatabase *d,
 		goto oom;
 	}
 
+	if (adopted != NULL) {
+		assert(data >= adopted->base &&
+		       data + n <= adopted->base + adopted->len);
+		for (i = 0; i < n_pages; i++) {
+			offset = (size_t)i * (size_t)page_size;
+			pages[i] = (void *)&data[offset];
+		}
+		goto replace;
+	}
+
 	for (i = 0; i < n_pages; i++) {
 		void *page = sqlite3_malloc64(page_size);
 		if (page == NULL) {
@@ -2998,6 +4807,7 @@ static int vfsDatabaseRestore(struct vfsDatabase *d,
 		memcpy(page, &data[offset], page_size);
 	}
 
+replace:
 	/* Truncate any existing content. */
 	rv = vfsDatabaseTruncate(d, 0);
 	assert(rv == 0);
@@ -3005,6 +4815,13 @@ static int vfsDatabaseRestore(struct vfsDatabase *d,
 	d->pages = pages;
 	d->n_pages = n_pages;
 
+	if (adopted != NULL && n_pages > 0) {
+		assert(d->adopted == NULL);
+		adopted->refs++;
+		d->adopted = adopted;
+		d->n_adopted = n_pages;
+	}
+
 	return 0;
 
 oom_after_pages_alloc:
@@ -3074,10 +4891,65 @@ oom:
 	return DQLITE_NOMEM;
 }
 
-int VfsRestore(sqlite3_vfs *vfs,
-	       const char *filename,
-	       const void *data,
-	       size_t n)
+struct vfsAdopted *VfsAdopt(void *base, size_t len, void (*release)(void *base))
+{
+	struct vfsAdopted *a = sqlite3_malloc(sizeof *a);
+	if (a == NULL) {
+		return NULL;
+	}
+	a->base = base;
+	a->len = len;
+	a->refs = 1;
+	a->release = release;
+	return a;
+}
+
+void *VfsAdoptedPut(struct vfsAdopted *a)
+{
+	void *base = a->base;
+	if (a->refs == 1) {
+		sqlite3_free(a);
+		return base;
+	}
+	vfsAdoptedUnref(a);
+	return NULL;
+}
+
+void *VfsAdoptedDetach(sqlite3_vfs *vfs, struct vfsAdopted *a)
+{
+	struct vfs *v = vfs->pAppData;
+	int rv;
+
+	for (size_t i = 0; i < v->databases.n_buckets; i++) {
+		struct hash_node *node;
+		for (node = v->databases.buckets[i]; node != NULL;
+		     node = node->next) {
+			struct vfsDatabase *d =
+			    CONTAINER_OF(node, struct vfsDatabase, node);
+			if (d->adopted != a) {
+				continue;
+			}
+			rv = vfsShmLock(&d->shm, 0, SQLITE_SHM_NLOCK, true);
+			if (rv != SQLITE_OK) {
+				continue;
+			}
+			rv = vfsDatabaseCopyAdopted(d);
+			if (rv != SQLITE_OK) {
+				tracef("[database %p] detach: %d", d, rv);
+			}
+			vfsShmUnlock(&d->shm, 0, SQLITE_SHM_NLOCK, true);
+		}
+	}
+	return VfsAdoptedPut(a);
+}
+
+/* Restore a database snapshot, with the main database pages pointing into the
+ * given adopted memory, if any. */
+static int vfsRestore(sqlite3_vfs *vfs,
+		      const char *filename,
+		      struct vfsAdopted *adopted,
+		      const void *data,
+		      size_t n)
 {
 	tracef("vfs restore filename %s size %zd", filename, n);
 	struct vfs *v = vfs->pAppData;
@@ -3100,8 +4972,17 @@ int VfsRestore(sqlite3_vfs *vfs,
 		return rv;
 	}
 
+	/* No reader can be using retired pages anymore, release them now so
+	 * that they don't pin memory adopted by a previous restore. */
+	vfsDatabaseFreeRetired(database);
+
+	/* SQLite expects pages to be 8-byte aligned. */
+	if ((uintptr_t)data % 8 != 0) {
+		adopted = NULL;
+	}
+
 	/* Restore the content of the main database and of the WAL. */
-	rv = vfsDatabaseRestore(database, data, n);
+	rv = vfsDatabaseRestore(database, adopted, data, n);
 	if (rv != SQLITE_OK) {
 		tracef("database restore failed %d", rv);
 		goto err_locked;
@@ -3113,6 +4994,7 @@ int VfsRestore(sqlite3_vfs *vfs,
 
 	vfsWalClose(&database->wal);
 	vfsWalInit(&database->wal);
+	vfsDatabaseWalReset(database);
 
 	page_size = vfsDatabaseGetPageSize(database);
 	offset = (size_t)database->n_pages * (size_t)page_size;
@@ -3129,6 +5011,258 @@ int VfsRestore(sqlite3_vfs *vfs,
 		tracef("wal restore failed %d", rv);
 		goto err_locked;
 	}
+	vfsSpillEnforce(v, database, false);
+err_locked:
+	vfsShmUnlock(&database->shm, 0, SQLITE_SHM_NLOCK, true);
+	return rv;
+}
+
+int VfsRestore(sqlite3_vfs *vfs,
+	       const char *filename,
+	       const void *data,
+	       size_t n)
+{
+	return vfsRestore(vfs, filename, NULL, data, n);
+}
+
+int VfsRestoreAdopted(sqlite3_vfs *vfs,
+		      const char *filename,
+		      struct vfsAdopted *a,
+		      const void *data,
+		      size_t n)
+{
+	return vfsRestore(vfs, filename, a, data, n);
+}
+
+int VfsDirtyReset(sqlite3_vfs *vfs, const char *filename)
+{
+	struct vfs *v = vfs->pAppData;
+	struct vfsDatabase *database;
+
+	database = vfsDatabaseLookup(v, filename);
+	if (database == NULL) {
+		return -1;
+	}
+
+	vfsDirtyClose(&database->dirty);
+	vfsDirtyClose(&database->pending);
+	database->wal.n_taken = database->wal.n_frames;
+	database->tracking = true;
+	return 0;
+}
+
+int VfsDirtyTake(sqlite3_vfs *vfs,
+		 const char *filename,
+		 uint32_t n,
+		 const uint8_t **bitmap)
+{
+	struct vfs *v = vfs->pAppData;
+	struct vfsDatabase *database;
+	struct vfsDirty *pending;
+	struct vfsWal *wal;
+	unsigned i;
+
+	database = vfsDatabaseLookup(v, filename);
+	if (database == NULL) {
+		return -1;
+	}
+	pending = &database->pending;
+	wal = &database->wal;
+
+	/* A previous snapshot was never settled, consider its pages still
+	 * modified. */
+	vfsDirtyMerge(&database->dirty, pending);
+	vfsDirtyClose(pending);
+
+	if (!database->tracking) {
+		/* Nothing is known about the past modifications: start tracking
+		 * from now on and report everything as modified. */
+		database->tracking = true;
+		vfsDirtyClose(&database->dirty);
+		pending->all = true;
+		wal->n_taken = wal->n_frames;
+		*bitmap = NULL;
+		return 0;
+	}
+
+	*pending = database->dirty;
+	database->dirty = (struct vfsDirty){};
+
+	/* Pages in the WAL are part of the snapshot but have not been written
+	 * to the main file yet. Frames appended before the previous snapshot
+	 * were already taken then. */
+	for (i = wal->n_taken; i < wal->n_frames; i++) {
+		vfsDirtyAdd(pending, vfsFrameGetPageNumber(wal->frames[i]));
+	}
+	wal->n_taken = wal->n_frames;
+	if (!pending->all && n > 0 && vfsDirtyGrow(pending, n) != SQLITE_OK) {
+		pending->all = true;
+	}
+
+	*bitmap = pending->all ? NULL : pending->bits;
+	return 0;
+}
+
+void VfsDirtySettle(sqlite3_vfs *vfs, const char *filename, bool persisted)
+{
+	struct vfs *v = vfs->pAppData;
+	struct vfsDatabase *database;
+
+	database = vfsDatabaseLookup(v, filename);
+	if (database == NULL) {
+		return;
+	}
+
+	if (!persisted) {
+		vfsDirtyMerge(&database->dirty, &database->pending);
+	}
+	vfsDirtyClose(&database->pending);
+}
+
+/* Replace the content of the database with n_pages pages, taking the pages
+ * listed in pgnos from data and keeping the current content of the others. */
+static int vfsDatabaseRestorePages(struct vfsDatabase *d,
+				   uint32_t page_size,
+				   unsigned n_pages,
+				   const uint64_t *pgnos,
+				   unsigned n,
+				   const uint8_t *data)
+{
+	void **pages;
+	void **copies;
+	unsigned i;
+
+	pages = sqlite3_malloc64(sizeof *pages * (n_pages > 0 ? n_pages : 1));
+	if (pages == NULL) {
+		goto oom;
+	}
+	copies = sqlite3_malloc64(sizeof *copies * (n > 0 ? n : 1));
+	if (copies == NULL) {
+		goto oom_after_pages_alloc;
+	}
+
+	for (i = 0; i < n; i++) {
+		copies[i] = sqlite3_malloc64(page_size);
+		if (copies[i] == NULL) {
+			goto oom_after_copies;
+		}
+		memcpy(copies[i], data + (size_t)i * page_size, page_size);
+	}
+
+	/* Pages past the current end that are not part of the delta, like the
+	 * pending byte page, are zero-filled. */
+	for (i = 0; i < n_pages; i++) {
+		if (i < d->n_pages) {
+			pages[i] = d->pages[i];
+			continue;
+		}
+		pages[i] = sqlite3_malloc64(page_size);
+		if (pages[i] == NULL) {
+			while (i > d->n_pages) {
+				sqlite3_free(pages[--i]);
+			}
+			i = n;
+			goto oom_after_copies;
+		}
+		memset(pages[i], 0, page_size);
+	}
+
+	for (i = 0; i < n; i++) {
+		unsigned j = (unsigned)pgnos[i] - 1;
+		if (j < d->n_pages) {
+			vfsDatabaseReleasePage(d, j + 1, pages[j]);
+		} else {
+			sqlite3_free(pages[j]);
+		}
+		pages[j] = copies[i];
+	}
+	for (i = n_pages; i < d->n_pages; i++) {
+		vfsDatabaseReleasePage(d, i + 1, d->pages[i]);
+	}
+
+	mtx_lock(&d->mtx);
+	sqlite3_free(d->pages);
+	d->pages = pages;
+	d->n_pages = n_pages;
+	mtx_unlock(&d->mtx);
+
+	sqlite3_free(copies);
+	return 0;
+
+oom_after_copies:
+	while (i > 0) {
+		sqlite3_free(copies[--i]);
+	}
+	sqlite3_free(copies);
+oom_after_pages_alloc:
+	sqlite3_free(pages);
+oom:
+	return DQLITE_NOMEM;
+}
+
+int VfsRestorePages(sqlite3_vfs *vfs,
+		    const char *filename,
+		    uint32_t n_pages,
+		    const uint64_t *pgnos,
+		    uint32_t n,
+		    const void *data)
+{
+	tracef("vfs restore pages filename %s pages %u delta %u", filename,
+	       n_pages, n);
+	struct vfs *v = vfs->pAppData;
+	struct vfsDatabase *database;
+	uint32_t page_size;
+	unsigned i;
+	int rv;
+
+	database = vfsDatabaseLookup(v, filename);
+	assert(database != NULL);
+
+	for (i = 0; i < n; i++) {
+		if (pgnos[i] == 0 || pgnos[i] > n_pages) {
+			return DQLITE_ERROR;
+		}
+	}
+	if (n_pages > 0 && n_pages > database->n_pages) {
+		/* The first page must be present to know the page size. */
+		if (database->n_pages == 0 && (n == 0 || pgnos[0] != 1)) {
+			return DQLITE_ERROR;
+		}
+	}
+	if (n > 0 && pgnos[0] == 1) {
+		page_size = vfsParsePageSize(
+		    ByteGetBe16(&((const uint8_t *)data)[16]));
+	} else if (database->n_pages > 0) {
+		page_size = vfsDatabaseGetPageSize(database);
+	} else {
+		page_size = 0;
+	}
+	if (n > 0 && page_size == 0) {
+		return DQLITE_ERROR;
+	}
+
+	/* Same locking scheme as VfsRestore. */
+	rv = vfsShmLock(&database->shm, 0, SQLITE_SHM_NLOCK, true);
+	if (rv != SQLITE_OK) {
+		return rv;
+	}
+
+	rv = vfsDatabaseRestorePages(database, page_size, n_pages, pgnos, n,
+				     data);
+	if (rv != 0) {
+		tracef("database restore pages failed %d", rv);
+		goto err_locked;
+	}
+
+	rv = ftruncate(database->shm.fd, 0);
+	assert(rv == 0);
+	database->shm.size = 0;
+
+	vfsWalClose(&database->wal);
+	vfsWalInit(&database->wal);
+	vfsDatabaseWalReset(database);
+	vfsSpillEnforce(v, database, false);
+
 err_locked:
 	vfsShmUnlock(&database->shm, 0, SQLITE_SHM_NLOCK, true);
 	return rv;
@@ -3141,11 +5275,59 @@ int VfsEnableDisk(struct sqlite3_vfs *vfs)
 	}
 
 	struct vfs *v = vfs->pAppData;
+	if (v->budget > 0) {
+		return DQLITE_MISUSE;
+	}
+	struct vfsCheckpointer *c = &v->checkpointer;
+	if (!c->started) {
+		if (thrd_create(&c->thread, vfsCheckpointerRun, v) !=
+		    thrd_success) {
+			return DQLITE_ERROR;
+		}
+		c->started = true;
+	}
 	v->disk = true;
 
 	return 0;
 }
 
+int VfsEnableTiered(struct sqlite3_vfs *vfs, const char *dir, size_t budget)
+{
+	struct vfs *v = vfs->pAppData;
+	char *spill_dir;
+
+	if (v->disk || budget == 0) {
+		return DQLITE_MISUSE;
+	}
+
+	spill_dir = sqlite3_mprintf("%s", dir);
+	if (spill_dir == NULL) {
+		return DQLITE_NOMEM;
+	}
+	sqlite3_free(v->spill_dir);
+	v->spill_dir = spill_dir;
+	v->budget = budget;
+
+	return 0;
+}
+
+uint64_t VfsResidentSize(struct sqlite3_vfs *vfs)
+{
+	return vfsResidentSize(vfs->pAppData);
+}
+
+int VfsDiskSetCheckpointSync(struct sqlite3_vfs *vfs, bool enabled)
+{
+	struct vfs *v = vfs->pAppData;
+	struct vfsCheckpointer *c = &v->checkpointer;
+
+	mtx_lock(&c->mtx);
+	c->sync = enabled;
+	mtx_unlock(&c->mtx);
+
+	return 0;
+}
+
 int VfsDiskSnapshotWal(sqlite3_vfs *vfs,
 		       const char *path,
 		       struct dqlite_buffer *buf)
@@ -3165,6 +5347,15 @@ int VfsDiskSnapshotWal(sqlite3_vfs *vfs,
 		goto err;
 	}
 
+	/* The database file is being written by a background checkpoint. */
+	mtx_lock(&v->checkpointer.mtx);
+	bool idle = database->checkpoint == VFS__CHECKPOINT_IDLE;
+	mtx_unlock(&v->checkpointer.mtx);
+	if (!idle) {
+		rv = SQLITE_BUSY;
+		goto err;
+	}
+
 	/* Copy WAL to last buffer. */
 	wal = &database->wal;
 	buf->len = (size_t)vfsWalSize(wal);
@@ -3322,6 +5513,7 @@ int VfsDiskRestore(sqlite3_vfs *vfs,
 
 	database = vfsDatabaseLookup(v, path);
 	assert(database != NULL);
+	vfsCheckpointerCancel(&v->checkpointer, database);
 
 	/* Lock the database. The locking scheme here is similar to the one used
 	 * when transitioning from WAL to DELETE mode. The WAL-Index recovery is
@@ -3346,6 +5538,7 @@ int VfsDiskRestore(sqlite3_vfs *vfs,
 
 	vfsWalClose(&database->wal);
 	vfsWalInit(&database->wal);
+	vfsDatabaseWalReset(database);
 
 	page_size = vfsDatabaseGetPageSize(database);
 	rv = vfsWalRestore(&database->wal, data + main_size, wal_size, page_size);
@@ -11,6 +11,18 @@ int VfsInit(struct sqlite3_vfs *vfs, const char *name);
 
 int VfsEnableDisk(struct sqlite3_vfs *vfs);
 
+/* Keep at most budget bytes of database pages in memory, evicting the least
+ * recently read pages to a backing file in dir, while the WAL stays in memory.
+ * Pages are evicted and brought back when checkpointing or restoring. */
+int VfsEnableTiered(struct sqlite3_vfs *vfs, const char *dir, size_t budget);
+
+/* Return the size of the database pages held in memory. */
+uint64_t VfsResidentSize(struct sqlite3_vfs *vfs);
+
+/* Set whether the database files written by checkpoints in disk mode are
+ * synced. Syncing is disabled by default. */
+int VfsDiskSetCheckpointSync(struct sqlite3_vfs *vfs, bool enabled);
+
 /* Release all memory associated with the given dqlite in-memory VFS
  * implementation.
  *
@@ -31,10 +43,31 @@ int VfsPoll(sqlite3 *conn, struct vfsTransaction *transaction);
 /* Append the given transaction to the WAL. */
 int VfsApply(sqlite3 *conn, const struct vfsTransaction *transaction);
 
+/* Append the given n transactions to the WAL at once, in order. Either all of
+ * them are appended or none is. */
+int VfsApplyBatch(sqlite3 *conn,
+		  const struct vfsTransaction *transactions,
+		  unsigned n);
+
 /* Cancel a pending transaction. */
 int VfsAbort(sqlite3 *conn);
 
-/* Performs a controlled checkpoint on conn */
+/* Set page to the committed content of the given page of the database conn is
+ * open on, taken from the last WAL frame holding it or else from the database.
+ * In disk-mode the latter is read into buf, which must have room for a page.
+ * Set page to NULL if the database doesn't have that page yet. */
+int VfsCommittedPage(sqlite3 *conn,
+		     uint32_t pgno,
+		     void *buf,
+		     const void **page);
+
+/* Performs a controlled checkpoint on conn, if the WAL has at least threshold
+ * frames. In memory, pages are moved from the WAL to the database without
+ * copying them. If readers are active, only the frames they all see are moved
+ * and SQLITE_BUSY is returned, as the WAL can't be reset yet. On disk, frames
+ * are written to the database file by a background thread and SQLITE_BUSY is
+ * returned until the remaining frames can be written right away, unless the
+ * WAL grew to several times threshold, in which case the call blocks. */
 int VfsCheckpoint(sqlite3 *conn, unsigned int threshold);
 
 /* Make a full snapshot of a database. */
@@ -54,6 +87,51 @@ int VfsShallowSnapshot(sqlite3_vfs *vfs,
 		       struct dqlite_buffer bufs[],
 		       uint32_t n);
 
+/**
+ * Prepare a backup of the selected database, borrowing from the in-memory
+ * state of the VFS like VfsShallowSnapshot.
+ *
+ * The given position is either 0 or the one returned by a previous backup of
+ * the same database. If the WAL wasn't reset since, only the pages changed
+ * since then are set in the returned array and the other entries are NULL,
+ * otherwise all pages are set. The position is then updated to the current
+ * one. The array, to be released with sqlite3_free, has one entry per page
+ * of the database and is NULL if the database is empty. It's forbidden to
+ * checkpoint the database while the pointers are still in use.
+ */
+int VfsBackup(sqlite3_vfs *vfs,
+	      const char *filename,
+	      uint64_t *position,
+	      bool *incremental,
+	      struct dqlite_buffer **pages,
+	      uint32_t *n);
+
+/**
+ * Start tracking the pages modified in the given database, considering its
+ * current content as already part of a snapshot.
+ */
+int VfsDirtyReset(sqlite3_vfs *vfs, const char *filename);
+
+/**
+ * Move the set of pages modified since the previous snapshot into a pending
+ * set, which lasts until VfsDirtySettle is called.
+ *
+ * Upon success, `bitmap` points to at least n bits owned by the VFS, where bit
+ * i-1 is set if page i is modified, pages still in the WAL included. If
+ * modifications were not tracked, `bitmap` is NULL and all pages must be
+ * considered modified; tracking starts from this call on.
+ */
+int VfsDirtyTake(sqlite3_vfs *vfs,
+		 const char *filename,
+		 uint32_t n,
+		 const uint8_t **bitmap);
+
+/**
+ * Release the pending set of modified pages taken with VfsDirtyTake. If the
+ * snapshot was not persisted, its pages are considered modified again.
+ */
+void VfsDirtySettle(sqlite3_vfs *vfs, const char *filename, bool persisted);
+
 /* Copies the WAL into buf */
 int VfsDiskSnapshotWal(sqlite3_vfs *vfs,
 		       const char *path,
@@ -75,6 +153,46 @@ int VfsRestore(sqlite3_vfs *vfs,
 	       const void *data,
 	       size_t n);
 
+/* Memory that the pages of restored databases can point into. */
+struct vfsAdopted;
+
+/* Wrap the given memory, typically a snapshot buffer, so that the databases
+ * restored from it can use it in place instead of copying their pages. Once
+ * adopted by a database, it is released with the given function after
+ * VfsAdoptedPut was called and all the pages pointing into it were modified,
+ * removed, or copied out by a checkpoint, which happens once they only take a
+ * small part of it. */
+struct vfsAdopted *VfsAdopt(void *base, size_t len, void (*release)(void *base));
+
+/* Drop the reference returned by VfsAdopt. If no database adopted the memory,
+ * it's handed back to the caller, otherwise NULL is returned. */
+void *VfsAdoptedPut(struct vfsAdopted *a);
+
+/* Same as VfsAdoptedPut, but the databases of the given VFS that adopted the
+ * memory first copy their pages out of it, if no connection is using them. */
+void *VfsAdoptedDetach(sqlite3_vfs *vfs, struct vfsAdopted *a);
+
+/* Same as VfsRestore, but the pages of the database point into the given
+ * adopted memory, which must contain data, until they are first modified. The
+ * WAL part of the snapshot is still copied. */
+int VfsRestoreAdopted(sqlite3_vfs *vfs,
+		      const char *filename,
+		      struct vfsAdopted *a,
+		      const void *data,
+		      size_t n);
+
+/**
+ * Resize a database to n_pages pages and overwrite the n pages whose numbers
+ * are listed in pgnos with the ones stored consecutively in data. The other
+ * pages are left untouched and the WAL is reset.
+ */
+int VfsRestorePages(sqlite3_vfs *vfs,
+		    const char *filename,
+		    uint32_t n_pages,
+		    const uint64_t *pgnos,
+		    uint32_t n,
+		    const void *data);
+
 /* Restore a disk database snapshot. */
 int VfsDiskRestore(sqlite3_vfs *vfs,
 		   const char *path,
@@ -1,3 +1,6 @@
+#include <poll.h>
+
+#include "../../src/client/async.h"
 #include "../lib/client.h"
 #include "../lib/heap.h"
 #include "../lib/runner.h"
@@ -187,3 +190,326 @@ TEST(client, semicolons, setUp, tearDown, 0, NULL)
 
 	return MUNIT_OK;
 }
+
+/* Decode rows of mixed types into an arena, in both layouts. */
+TEST(client, queryArena, setUp, tearDown, 0, client_params)
+{
+	struct fixture *f = data;
+	uint64_t last_insert_id;
+	uint64_t rows_affected;
+	struct client_rows rows;
+	struct value value;
+	bool done;
+	unsigned i;
+	int rv;
+	(void)params;
+
+	EXEC_SQL("CREATE TABLE test (n INT, r REAL, t TEXT, b BLOB)",
+		 &last_insert_id, &rows_affected);
+	EXEC_SQL("INSERT INTO test VALUES (1, 1.5, 'one', x'0102'), "
+		 "(2, NULL, 'two', x'030405')",
+		 &last_insert_id, &rows_affected);
+
+	for (i = 0; i < 2; i++) {
+		bool columnar = i == 1;
+		rv = clientSendQuerySQL(f->client,
+					"SELECT n, r, t, b FROM test ORDER BY n",
+					NULL, 0, NULL);
+		munit_assert_int(rv, ==, 0);
+		rv = clientRecvRowsArena(f->client, &rows, columnar, &done,
+					 NULL);
+		munit_assert_int(rv, ==, 0);
+		munit_assert_true(done);
+		munit_assert_uint(rows.column_count, ==, 4);
+		munit_assert_uint(rows.row_count, ==, 2);
+		munit_assert_string_equal(rows.column_names[2], "t");
+		if (columnar) {
+			munit_assert_ptr_not_null(rows.columns);
+			munit_assert_int64(rows.columns[0].cells[1].integer, ==,
+					   2);
+		}
+
+		clientRowsGet(&rows, 0, 1, &value);
+		munit_assert_int(value.type, ==, SQLITE_FLOAT);
+		munit_assert_double_equal(value.real, 1.5, 9);
+		clientRowsGet(&rows, 1, 1, &value);
+		munit_assert_int(value.type, ==, SQLITE_NULL);
+		clientRowsGet(&rows, 1, 2, &value);
+		munit_assert_int(value.type, ==, SQLITE_TEXT);
+		munit_assert_string_equal(value.text, "two");
+		clientRowsGet(&rows, 1, 3, &value);
+		munit_assert_int(value.type, ==, SQLITE_BLOB);
+		munit_assert_size(value.blob.len, ==, 3);
+		munit_assert_memory_equal(3, value.blob.base, "\x03\x04\x05");
+
+		clientCloseRowsArena(&rows);
+	}
+
+	return MUNIT_OK;
+}
+
+/* State of the requests sent by an asynchronous client. */
+struct async
+{
+	unsigned n_results;
+	uint64_t rows_affected;
+	unsigned row_count;
+	unsigned n_batches;
+	int64_t sum;
+	int failure;
+	unsigned n_done;
+};
+
+static int asyncDbCb(struct client_async *c,
+		     void *arg,
+		     int status,
+		     const struct client_response *response)
+{
+	struct async *a = arg;
+	int rv;
+	munit_assert_int(status, ==, 0);
+	rv = clientAsyncRecvDb(c, response);
+	munit_assert_int(rv, ==, 0);
+	a->n_done++;
+	return 0;
+}
+
+static int asyncResultCb(struct client_async *c,
+			 void *arg,
+			 int status,
+			 const struct client_response *response)
+{
+	struct async *a = arg;
+	uint64_t rows_affected;
+	int rv;
+	munit_assert_int(status, ==, 0);
+	rv = clientAsyncRecvResult(c, response, NULL, &rows_affected);
+	if (rv == DQLITE_CLIENT_PROTO_RECEIVED_FAILURE) {
+		a->failure = (int)c->errcode;
+	} else {
+		munit_assert_int(rv, ==, 0);
+		a->n_results++;
+		a->rows_affected += rows_affected;
+	}
+	a->n_done++;
+	return 0;
+}
+
+static int asyncRowsCb(struct client_async *c,
+		       void *arg,
+		       int status,
+		       const struct client_response *response)
+{
+	struct async *a = arg;
+	struct client_rows rows;
+	struct value value;
+	bool done;
+	unsigned i;
+	int rv;
+	munit_assert_int(status, ==, 0);
+	rv = clientAsyncRecvRowsArena(c, response, &rows, false, &done);
+	munit_assert_int(rv, ==, 0);
+	for (i = 0; i < rows.row_count; i++) {
+		clientRowsGet(&rows, i, 0, &value);
+		a->sum += value.integer;
+	}
+	a->row_count += rows.row_count;
+	a->n_batches++;
+	clientCloseRowsArena(&rows);
+	if (!done) {
+		return CLIENT_ASYNC_MORE;
+	}
+	a->n_done++;
+	return 0;
+}
+
+/* Drive the given clients from a single poll loop until the given number of
+ * requests are done. */
+static void asyncWait(struct client_async *clients,
+		      unsigned n,
+		      struct async *a,
+		      unsigned n_done)
+{
+	struct pollfd fds[4];
+	unsigned i;
+	int rv;
+
+	munit_assert_uint(n, <=, 4);
+	while (a->n_done < n_done) {
+		for (i = 0; i < n; i++) {
+			fds[i].fd = clients[i].fd;
+			fds[i].events = clientAsyncEvents(&clients[i]);
+			fds[i].revents = 0;
+		}
+		rv = poll(fds, n, 5000);
+		munit_assert_int(rv, >, 0);
+		for (i = 0; i < n; i++) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			rv = clientAsyncProcess(&clients[i], fds[i].revents);
+			munit_assert_int(rv, ==, 0);
+		}
+	}
+}
+
+/* Requests are pipelined without waiting for their responses, and rows
+ * returned in several batches are all delivered to the same request. */
+TEST(client, asyncPipeline, setUp, tearDown, 0, client_params)
+{
+	struct fixture *f = data;
+	struct client_async client;
+	struct async a = {0};
+	struct value param;
+	unsigned n_done = 0;
+	unsigned i;
+	int rv;
+	(void)params;
+
+	rv = clientAsyncInit(&client, test_server_socket(&f->server));
+	munit_assert_int(rv, ==, 0);
+
+	rv = clientAsyncSendOpen(&client, "test", asyncDbCb, &a);
+	munit_assert_int(rv, ==, 0);
+	asyncWait(&client, 1, &a, ++n_done);
+
+	rv = clientAsyncSendExecSQL(&client, "CREATE TABLE test (n INT)", NULL,
+				    0, asyncResultCb, &a);
+	munit_assert_int(rv, ==, 0);
+	n_done++;
+	for (i = 1; i <= 1000; i++) {
+		param.type = SQLITE_INTEGER;
+		param.integer = i;
+		rv = clientAsyncSendExecSQL(&client,
+					    "INSERT INTO test VALUES (?)",
+					    &param, 1, asyncResultCb, &a);
+		munit_assert_int(rv, ==, 0);
+		n_done++;
+	}
+	rv = clientAsyncSendQuerySQL(&client, "SELECT n, zeroblob(1000) FROM test",
+				     NULL, 0, asyncRowsCb, &a);
+	munit_assert_int(rv, ==, 0);
+	n_done++;
+
+	asyncWait(&client, 1, &a, n_done);
+	munit_assert_uint(a.n_results, ==, 1001);
+	munit_assert_uint64(a.rows_affected, ==, 1000);
+	munit_assert_uint(a.row_count, ==, 1000);
+	munit_assert_uint(a.n_batches, >, 1);
+	munit_assert_int64(a.sum, ==, 1000 * 1001 / 2);
+
+	clientAsyncClose(&client);
+	return MUNIT_OK;
+}
+
+/* A failure fails only its own request, and a single thread can drive several
+ * connections. */
+TEST(client, asyncFailure, setUp, tearDown, 0, client_params)
+{
+	struct fixture *f = data;
+	struct client_async clients[2];
+	struct async a = {0};
+	unsigned i;
+	int rv;
+	(void)params;
+
+	for (i = 0; i < 2; i++) {
+		rv = clientAsyncInit(&clients[i],
+				     test_server_socket(&f->server));
+		munit_assert_int(rv, ==, 0);
+		rv = clientAsyncSendOpen(&clients[i], "test", asyncDbCb, &a);
+		munit_assert_int(rv, ==, 0);
+	}
+	asyncWait(clients, 2, &a, 2);
+
+	rv = clientAsyncSendExecSQL(&clients[0], "CREATE TABLE test (n INT)",
+				    NULL, 0, asyncResultCb, &a);
+	munit_assert_int(rv, ==, 0);
+	asyncWait(clients, 2, &a, 3);
+
+	rv = clientAsyncSendExecSQL(&clients[1], "INSERT INTO missing VALUES (1)",
+				    NULL, 0, asyncResultCb, &a);
+	munit_assert_int(rv, ==, 0);
+	rv = clientAsyncSendExecSQL(&clients[1], "INSERT INTO test VALUES (1)",
+				    NULL, 0, asyncResultCb, &a);
+	munit_assert_int(rv, ==, 0);
+	asyncWait(clients, 2, &a, 5);
+	munit_assert_int(a.failure, ==, SQLITE_ERROR);
+	munit_assert_string_equal(clients[1].errmsg, "no such table: missing");
+	munit_assert_uint(a.n_results, ==, 2);
+
+	for (i = 0; i < 2; i++) {
+		clientAsyncClose(&clients[i]);
+	}
+	return MUNIT_OK;
+}
+
+/* Requests and result sets larger than the rings of a shared memory channel
+ * flow through it in pieces. */
+TEST(client, shm, setUp, tearDown, 0, client_params)
+{
+	struct fixture *f = data;
+	struct client_proto client;
+	struct client_rows rows;
+	struct value param;
+	uint64_t last_insert_id;
+	uint64_t rows_affected;
+	unsigned row_count;
+	unsigned n_batches;
+	struct value value;
+	size_t blob_len = 2 * SHM__RING_SIZE + 17;
+	char *blob = munit_malloc(blob_len);
+	bool done;
+	int rv;
+	(void)params;
+
+	test_server_client_connect(&f->server, &client);
+	rv = clientSendHandshakeShm(&client, NULL);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_ptr_not_null(client.shm);
+	f->client = &client;
+	OPEN;
+
+	EXEC_SQL("CREATE TABLE test (n INT, b BLOB)", &last_insert_id,
+		 &rows_affected);
+	EXEC_SQL("WITH RECURSIVE seq(n) AS (SELECT 1 UNION ALL "
+		 "SELECT n + 1 FROM seq WHERE n < 3000) "
+		 "INSERT INTO test SELECT n, zeroblob(1000) FROM seq",
+		 &last_insert_id, &rows_affected);
+	munit_assert_uint64(rows_affected, ==, 3000);
+
+	memset(blob, 0xab, blob_len);
+	param.type = SQLITE_BLOB;
+	param.blob.base = blob;
+	param.blob.len = blob_len;
+	rv = clientSendExecSQL(&client, "INSERT INTO test VALUES (0, ?)",
+			       &param, 1, NULL);
+	munit_assert_int(rv, ==, 0);
+	rv = clientRecvResult(&client, &last_insert_id, &rows_affected, NULL);
+	munit_assert_int(rv, ==, 0);
+
+	rv = clientSendQuerySQL(&client, "SELECT n, b FROM test ORDER BY n",
+				NULL, 0, NULL);
+	munit_assert_int(rv, ==, 0);
+	row_count = 0;
+	n_batches = 0;
+	do {
+		rv = clientRecvRowsArena(&client, &rows, false, &done, NULL);
+		munit_assert_int(rv, ==, 0);
+		if (row_count == 0) {
+			clientRowsGet(&rows, 0, 1, &value);
+			munit_assert_size(value.blob.len, ==, blob_len);
+			munit_assert_memory_equal(blob_len, value.blob.base,
+						  blob);
+		}
+		row_count += rows.row_count;
+		n_batches++;
+		clientCloseRowsArena(&rows);
+	} while (!done);
+	munit_assert_uint(row_count, ==, 3001);
+	munit_assert_uint(n_batches, >, 1);
+
+	clientClose(&client);
+	free(blob);
+	return MUNIT_OK;
+}
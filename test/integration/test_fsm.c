@@ -1,5 +1,6 @@
 #include "../../src/client/protocol.h"
 #include "../../src/command.h"
+#include "../../src/lib/byte.h"
 #include "../../src/server.h"
 #include "../lib/client.h"
 #include "../lib/heap.h"
@@ -770,6 +771,95 @@ TEST(fsm, snapshotRestoreMultipleDBs, setUp, tearDown, 0, snapshot_params)
 	return MUNIT_OK;
 }
 
+/* Format code at the start of a snapshot. */
+static uint64_t snapshotFormat(const struct raft_buffer *buf)
+{
+	uint64_t format;
+	memcpy(&format, buf->base, sizeof format);
+	return ByteFlipLe64(format);
+}
+
+static MunitParameterEnum incremental_params[] = {
+    {SNAPSHOT_THRESHOLD_PARAM, snapshot_threshold},
+    {SNAPSHOT_COMPRESSION_PARAM, bools},
+    {NULL, NULL},
+};
+
+/* An incremental snapshot only contains the modified pages, and restoring it
+ * on top of the full snapshot it's based on yields the latest content. */
+TEST(fsm, snapshotRestoreIncremental, setUp, tearDown, 0, incremental_params)
+{
+	struct fixture *f = data;
+	struct raft_fsm *fsm = &f->servers[0].dqlite->raft_fsm;
+	struct raft_buffer *bufs;
+	struct raft_buffer chain[2];
+	struct raft_buffer snapshot;
+	unsigned n_bufs = 0;
+	unsigned n_full;
+	uint32_t stmt_id;
+	uint64_t last_insert_id;
+	uint64_t rows_affected;
+	struct rows rows;
+	int rv;
+
+	dqlite_node_set_snapshot_chain(f->servers[0].dqlite, 4);
+
+	/* Add enough data to span several pages. */
+	HANDSHAKE;
+	OPEN;
+	PREPARE("CREATE TABLE test (b BLOB)", &stmt_id);
+	EXEC(stmt_id, &last_insert_id, &rows_affected);
+	for (int i = 0; i < 100; ++i) {
+		PREPARE("INSERT INTO test(b) VALUES(zeroblob(1000))",
+			&stmt_id);
+		EXEC(stmt_id, &last_insert_id, &rows_affected);
+	}
+
+	/* The first snapshot is a full one. */
+	rv = fsm->snapshot(fsm, &bufs, &n_bufs);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_uint64(snapshotFormat(&bufs[0]), ==, 1);
+	n_full = n_bufs;
+	chain[0] = n_bufs_to_buf(bufs, n_bufs);
+	fsm->snapshot_done(fsm, 0);
+	rv = fsm->snapshot_finalize(fsm, &bufs, &n_bufs);
+	munit_assert_int(rv, ==, 0);
+
+	PREPARE("INSERT INTO test(b) VALUES(zeroblob(1000))", &stmt_id);
+	EXEC(stmt_id, &last_insert_id, &rows_affected);
+
+	/* The second one only has the modified pages. */
+	rv = fsm->snapshot(fsm, &bufs, &n_bufs);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_uint64(snapshotFormat(&bufs[0]), ==,
+			    RAFT_SNAPSHOT_INCREMENTAL);
+	munit_assert_uint(n_bufs, <, n_full);
+	chain[1] = n_bufs_to_buf(bufs, n_bufs);
+	fsm->snapshot_done(fsm, 0);
+	rv = fsm->snapshot_finalize(fsm, &bufs, &n_bufs);
+	munit_assert_int(rv, ==, 0);
+	clientClose(f->client);
+
+	/* Additionally frees snapshot.base */
+	snapshot = n_bufs_to_buf(chain, 2);
+	raft_free(chain[0].base);
+	raft_free(chain[1].base);
+	do {
+		rv = fsm->restore(fsm, &snapshot);
+	} while (rv == RAFT_BUSY);
+	munit_assert_int(rv, ==, 0);
+
+	test_server_client_connect(&f->servers[0], &f->servers[0].client);
+	HANDSHAKE;
+	OPEN;
+	PREPARE("SELECT COUNT(*) from test", &stmt_id);
+	QUERY(stmt_id, &rows);
+	munit_assert_long(rows.next->values->integer, ==, 101);
+	clientCloseRows(&rows);
+
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * apply
@@ -0,0 +1,233 @@
+#include <pthread.h>
+
+#include "../lib/heap.h"
+#include "../lib/runner.h"
+#include "../lib/server.h"
+#include "../lib/sqlite.h"
+
+#include "../../include/dqlite.h"
+
+/******************************************************************************
+ *
+ * In-process connections
+ *
+ ******************************************************************************/
+
+SUITE(local);
+
+static char *bools[] = { "0", "1", NULL };
+
+static MunitParameterEnum local_params[] = {
+	{ "disk_mode", bools },
+	{ NULL, NULL },
+};
+
+/* Results collected by callbacks, which run on the loop thread. */
+struct results
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned n_done;
+	unsigned n_failed;
+	int last_status;
+	unsigned stmt_id;
+	unsigned n_params;
+	unsigned long long rows_affected;
+	unsigned n_batches;
+	unsigned row_count;
+	long long sum;
+	char first_text[16];
+};
+
+struct fixture
+{
+	struct test_server server;
+	dqlite_local *local;
+	struct results results;
+};
+
+static void resultCb(void *arg, const dqlite_local_result *result)
+{
+	struct results *r = arg;
+	dqlite_local_value value;
+	unsigned i;
+
+	pthread_mutex_lock(&r->mutex);
+	if (result->status != 0) {
+		r->n_failed++;
+		r->last_status = result->status;
+	}
+	if (result->n_params != 0) {
+		r->stmt_id = result->stmt_id;
+		r->n_params = result->n_params;
+	}
+	r->rows_affected += result->rows_affected;
+	if (result->column_count > 0) {
+		r->n_batches++;
+		for (i = 0; i < result->row_count; i++) {
+			dqlite_local_result_value(result, i, 0, &value);
+			munit_assert_int(value.type, ==, SQLITE_INTEGER);
+			r->sum += value.integer;
+			if (r->row_count == 0 && result->column_count > 1) {
+				dqlite_local_result_value(result, i, 1, &value);
+				if (value.type == SQLITE_TEXT) {
+					snprintf(r->first_text,
+						 sizeof r->first_text, "%s",
+						 value.text);
+				}
+			}
+			r->row_count++;
+		}
+	}
+	if (result->done) {
+		r->n_done++;
+		pthread_cond_signal(&r->cond);
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+/* Wait until the given number of requests are done. */
+static void waitDone(struct results *r, unsigned n)
+{
+	pthread_mutex_lock(&r->mutex);
+	while (r->n_done < n) {
+		pthread_cond_wait(&r->cond, &r->mutex);
+	}
+	pthread_mutex_unlock(&r->mutex);
+}
+
+static void *setUp(const MunitParameter params[], void *user_data)
+{
+	struct fixture *f = munit_malloc(sizeof *f);
+	int rv;
+	test_heap_setup(params, user_data);
+	test_sqlite_setup(params);
+	test_server_setup(&f->server, 1, params);
+	test_server_start(&f->server, params);
+	f->results = (struct results){0};
+	pthread_mutex_init(&f->results.mutex, NULL);
+	pthread_cond_init(&f->results.cond, NULL);
+	rv = dqlite_local_open(f->server.dqlite, "test", resultCb, &f->results,
+			       &f->local);
+	munit_assert_int(rv, ==, 0);
+	return f;
+}
+
+static void tearDown(void *data)
+{
+	struct fixture *f = data;
+	test_server_tear_down(&f->server);
+	test_sqlite_tear_down();
+	test_heap_tear_down(data);
+	pthread_cond_destroy(&f->results.cond);
+	pthread_mutex_destroy(&f->results.mutex);
+	free(f);
+}
+
+/* Statements submitted back to back are served in order, without waiting for
+ * each other. */
+TEST(local, execAndQuery, setUp, tearDown, 0, local_params)
+{
+	struct fixture *f = data;
+	struct results *r = &f->results;
+	dqlite_local_value params_[2];
+	unsigned i;
+	int rv;
+	(void)params;
+
+	rv = dqlite_local_exec_sql(f->local, "CREATE TABLE test (n INT, t TEXT)",
+				   NULL, 0, resultCb, r);
+	munit_assert_int(rv, ==, 0);
+	for (i = 1; i <= 100; i++) {
+		params_[0].type = SQLITE_INTEGER;
+		params_[0].integer = i;
+		params_[1].type = SQLITE_TEXT;
+		params_[1].text = "hello";
+		rv = dqlite_local_exec_sql(f->local,
+					   "INSERT INTO test VALUES (?, ?)",
+					   params_, 2, resultCb, r);
+		munit_assert_int(rv, ==, 0);
+	}
+	rv = dqlite_local_query_sql(f->local, "SELECT n, t FROM test", NULL, 0,
+				    resultCb, r);
+	munit_assert_int(rv, ==, 0);
+
+	waitDone(r, 103);
+	munit_assert_uint(r->n_failed, ==, 0);
+	munit_assert_ullong(r->rows_affected, ==, 100);
+	munit_assert_uint(r->row_count, ==, 100);
+	munit_assert_llong(r->sum, ==, 5050);
+	munit_assert_string_equal(r->first_text, "hello");
+
+	dqlite_local_close(f->local);
+	return MUNIT_OK;
+}
+
+/* Prepared statements can be run many times, and a query returning many rows
+ * delivers them in several batches. */
+TEST(local, prepared, setUp, tearDown, 0, local_params)
+{
+	struct fixture *f = data;
+	struct results *r = &f->results;
+	dqlite_local_value param;
+	int rv;
+	(void)params;
+
+	rv = dqlite_local_exec_sql(f->local,
+				   "CREATE TABLE test (n INT, b BLOB); "
+				   "WITH RECURSIVE seq(n) AS (SELECT 1 UNION ALL "
+				   "SELECT n + 1 FROM seq WHERE n < 1000) "
+				   "INSERT INTO test SELECT n, zeroblob(1000) "
+				   "FROM seq",
+				   NULL, 0, resultCb, r);
+	munit_assert_int(rv, ==, 0);
+	rv = dqlite_local_prepare(f->local, "SELECT n, b FROM test WHERE n > ?",
+				  resultCb, r);
+	munit_assert_int(rv, ==, 0);
+	waitDone(r, 3);
+	munit_assert_uint(r->n_failed, ==, 0);
+	munit_assert_uint(r->n_params, ==, 1);
+
+	param.type = SQLITE_INTEGER;
+	param.integer = 500;
+	rv = dqlite_local_query(f->local, r->stmt_id, &param, 1, resultCb, r);
+	munit_assert_int(rv, ==, 0);
+	rv = dqlite_local_finalize(f->local, r->stmt_id, resultCb, r);
+	munit_assert_int(rv, ==, 0);
+	waitDone(r, 5);
+	munit_assert_uint(r->n_failed, ==, 0);
+	munit_assert_uint(r->row_count, ==, 500);
+	munit_assert_uint(r->n_batches, >, 1);
+	munit_assert_llong(r->sum, ==, (501 + 1000) * 500 / 2);
+
+	dqlite_local_close(f->local);
+	return MUNIT_OK;
+}
+
+/* Failures are reported to the callback of the request that caused them. */
+TEST(local, failure, setUp, tearDown, 0, local_params)
+{
+	struct fixture *f = data;
+	struct results *r = &f->results;
+	int rv;
+	(void)params;
+
+	rv = dqlite_local_exec_sql(f->local, "INSERT INTO missing VALUES (1)",
+				   NULL, 0, resultCb, r);
+	munit_assert_int(rv, ==, 0);
+	waitDone(r, 2);
+	munit_assert_uint(r->n_failed, ==, 1);
+	munit_assert_int(r->last_status, ==, SQLITE_ERROR);
+
+	dqlite_local_close(f->local);
+	return MUNIT_OK;
+}
+
+/* Connections left open are released when the node stops. */
+TEST(local, stop, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	(void)params;
+	waitDone(&f->results, 1);
+	return MUNIT_OK;
+}
@@ -57,6 +57,7 @@ struct server
 		for (_i = 0; _i < N_SERVERS; _i++) {                        \
 			SETUP_SERVER(_i, VERSION);                          \
 			raft_fixture_grow(&f->cluster, &f->fsms[_i]);       \
+			f->servers[_i].registry.raft = CLUSTER_RAFT(_i);    \
 		}                                                           \
 		_rv = raft_fixture_configuration(&f->cluster, N_SERVERS,    \
 						 &_configuration);          \
@@ -39,6 +39,7 @@
 		munit_assert_int(rv2, ==, 0);                            \
 		rv2 = raft_init(&f->raft, &f->raft_io, &f->fsm, 1, "1"); \
 		munit_assert_int(rv2, ==, 0);                            \
+		f->registry.raft = &f->raft;                             \
 	}
 
 #define TEAR_DOWN_RAFT                              \
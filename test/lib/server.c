@@ -171,6 +171,16 @@ void test_server_client_connect(struct test_server *s, struct client_proto *c)
 	c->fd = fd;
 }
 
+int test_server_socket(struct test_server *s)
+{
+	int rv;
+	int fd;
+
+	rv = endpointConnect(NULL, s->address, &fd);
+	munit_assert_int(rv, ==, 0);
+	return fd;
+}
+
 static void setOther(struct test_server *s, struct test_server *other)
 {
 	unsigned i = other->id - 1;
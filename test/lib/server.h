@@ -60,4 +60,7 @@ void test_server_client_reconnect(struct test_server *s,
 /* Opens a client connection to the server. */
 void test_server_client_connect(struct test_server *s, struct client_proto *c);
 
+/* Return a new socket connected to the server. */
+int test_server_socket(struct test_server *s);
+
 #endif /* TEST_SERVER_H */
@@ -133,6 +133,45 @@ TEST(raft_apply, two, setUp, tearDown, 0, NULL)
     return MUNIT_OK;
 }
 
+static char *fsm_version_5[] = {"5", NULL};
+
+static MunitParameterEnum batch_params[] = {
+    {CLUSTER_FSM_VERSION_PARAM, fsm_version_5},
+    {NULL, NULL},
+};
+
+/* With an FSM that implements apply_batch, commands committed together are
+ * applied in a single call, in log order. */
+TEST(raft_apply, batch, setUp, tearDown, 0, batch_params)
+{
+    struct fixture *f = data;
+    struct raft_buffer bufs[3];
+    struct raft_apply reqs[3];
+    struct result result = {0, false, raft_last_applied(CLUSTER_RAFT(0)),
+                            CLUSTER_RAFT(0)};
+    unsigned i;
+    int rv;
+
+    FsmEncodeSetX(1, &bufs[0]);
+    FsmEncodeAddX(2, &bufs[1]);
+    FsmEncodeAddX(3, &bufs[2]);
+    for (i = 0; i < 3; i++) {
+        reqs[i].data = &result;
+        rv = raft_apply(CLUSTER_RAFT(0), &reqs[i], &bufs[i], 1,
+                        i == 2 ? applyCbAssertResult : NULL);
+        munit_assert_int(rv, ==, 0);
+    }
+    CLUSTER_STEP_UNTIL(applyCbHasFired, &result, 2000);
+
+    munit_assert_int(FsmGetX(CLUSTER_FSM(0)), ==, 6);
+    munit_assert_uint(FsmGetBatches(CLUSTER_FSM(0)), >=, 1);
+    munit_assert_uint(FsmGetBatches(CLUSTER_FSM(0)), <=, 3);
+
+    CLUSTER_STEP_UNTIL_APPLIED(1, raft_last_applied(CLUSTER_RAFT(0)), 2000);
+    munit_assert_int(FsmGetX(CLUSTER_FSM(1)), ==, 6);
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * Failure scenarios
@@ -1,5 +1,6 @@
 #include "../../../src/raft/configuration.h"
 #include "../../../src/raft/flags.h"
+#include "../../../src/raft/log.h"
 #include "../../../src/raft/progress.h"
 #include "../lib/cluster.h"
 #include "../lib/runner.h"
@@ -161,6 +162,87 @@ TEST(replication, receiveFlags, setUp, tearDown, 0, NULL)
     return MUNIT_OK;
 }
 
+/* After receiving an AppendEntriesResult, a leader knows the metadata of a
+ * node and reports it as online. */
+TEST(replication, receiveMetadata, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    struct raft_peer_info info;
+    int rv;
+    CLUSTER_BOOTSTRAP;
+    raft_set_metadata(CLUSTER_RAFT(1), 3, 7);
+    CLUSTER_START;
+
+    /* Server 0 becomes leader and sends the initial heartbeat. */
+    CLUSTER_STEP_N(24);
+    ASSERT_LEADER(0);
+
+    rv = raft_peer_info(CLUSTER_RAFT(0), 2, &info);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_false(info.has_metadata);
+
+    /* Server 1 receives the first heartbeat and server 0 the reply. */
+    CLUSTER_STEP_N(6);
+    munit_assert_int(CLUSTER_N_RECV(0, RAFT_IO_APPEND_ENTRIES_RESULT), ==, 1);
+
+    rv = raft_peer_info(CLUSTER_RAFT(0), 2, &info);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_true(info.online);
+    munit_assert_true(info.has_metadata);
+    munit_assert_ullong(info.failure_domain, ==, 3);
+    munit_assert_ullong(info.weight, ==, 7);
+
+    /* Followers can't answer. */
+    rv = raft_peer_info(CLUSTER_RAFT(1), 1, &info);
+    munit_assert_int(rv, ==, RAFT_NOTLEADER);
+
+    return MUNIT_OK;
+}
+
+/* A leader sends heartbeats to spares, which lets it know whether they're
+ * online and their metadata, but it doesn't replicate entries to them. */
+TEST(replication, heartbeatSpare, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    struct raft_configuration configuration;
+    struct raft_peer_info info;
+    int rv;
+
+    rv = raft_fixture_configuration(&f->cluster, 1, &configuration);
+    munit_assert_int(rv, ==, 0);
+    configuration.servers[1].role = RAFT_SPARE;
+    rv = raft_fixture_bootstrap(&f->cluster, &configuration);
+    munit_assert_int(rv, ==, 0);
+    raft_configuration_close(&configuration);
+    raft_set_metadata(CLUSTER_RAFT(1), 3, 7);
+    CLUSTER_START;
+    CLUSTER_MAKE_PROGRESS;
+    ASSERT_LEADER(0);
+    CLUSTER_STEP_UNTIL_ELAPSED(500);
+
+    munit_assert_int(CLUSTER_N_RECV(1, RAFT_IO_APPEND_ENTRIES), >, 0);
+    rv = raft_peer_info(CLUSTER_RAFT(0), 2, &info);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_true(info.online);
+    munit_assert_true(info.has_metadata);
+    munit_assert_ullong(info.failure_domain, ==, 3);
+    munit_assert_ullong(info.weight, ==, 7);
+
+    /* The new entry was not sent to the spare. */
+    munit_assert_ullong(logLastIndex(CLUSTER_RAFT(0)->log), ==, 2);
+    munit_assert_ullong(logLastIndex(CLUSTER_RAFT(1)->log), ==, 1);
+
+    /* Once the spare stops answering, it's reported offline. */
+    CLUSTER_DISCONNECT(0, 1);
+    CLUSTER_DISCONNECT(1, 0);
+    CLUSTER_STEP_UNTIL_ELAPSED(2000);
+    rv = raft_peer_info(CLUSTER_RAFT(0), 2, &info);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_false(info.online);
+
+    return MUNIT_OK;
+}
+
 /* A leader keeps sending heartbeat messages at regular intervals to
  * maintain leadership. */
 TEST(replication, sendFollowupHeartbeat, setUp, tearDown, 0, NULL)
@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/runner.h"
+#include "../lib/sim.h"
+
+/******************************************************************************
+ *
+ * Helpers
+ *
+ *****************************************************************************/
+
+/* Workload of 200 writes and 200 reads per second of 1KiB, for 10 seconds. */
+#define SIM_DEFAULT_CONFIG(C)                                     \
+    SimConfigInit(C, 3);                                          \
+    (C)->workload.duration = 10000;                               \
+    (C)->workload.write_rate = 200;                               \
+    (C)->workload.read_rate = 200;                                \
+    (C)->workload.size = SIM_CONST(1024);                         \
+    SimSetDisks(C, (struct sim_disk){{{1, 2, 4, 10, 20}}, 0});    \
+    SimSetLinks(C, (struct sim_link){{{1, 1, 2, 5, 10}}, 100000})
+
+/******************************************************************************
+ *
+ * Simulated workloads
+ *
+ *****************************************************************************/
+
+SUITE(sim)
+
+/* The same configuration always produces the same report, while a different
+ * seed doesn't. */
+TEST(sim, deterministic, NULL, NULL, 0, NULL)
+{
+    struct sim_config c;
+    struct sim_report r1;
+    struct sim_report r2;
+    SIM_DEFAULT_CONFIG(&c);
+
+    SimRun(&c, &r1);
+    SimRun(&c, &r2);
+    munit_assert_int(memcmp(&r1, &r2, sizeof r1), ==, 0);
+    munit_assert_int(r1.n_failed, ==, 0);
+    munit_assert_int(r1.n_writes, >, 1800);
+    munit_assert_int(r1.n_reads, >, 1800);
+
+    c.seed = 2;
+    SimRun(&c, &r2);
+    munit_assert_int(memcmp(&r1, &r2, sizeof r1), !=, 0);
+
+    return MUNIT_OK;
+}
+
+/* Slower disks make writes slower. */
+TEST(sim, disk_latency, NULL, NULL, 0, NULL)
+{
+    struct sim_config c;
+    struct sim_report fast;
+    struct sim_report slow;
+    SIM_DEFAULT_CONFIG(&c);
+
+    SimRun(&c, &fast);
+    SimSetDisks(&c, (struct sim_disk){{{5, 10, 20, 50, 100}}, 0});
+    SimRun(&c, &slow);
+
+    munit_assert_int(slow.write_latency[SIM_P50], >,
+                     fast.write_latency[SIM_P50] + 5);
+    munit_assert_int(slow.write_latency[SIM_P99], >,
+                     fast.write_latency[SIM_P99]);
+
+    return MUNIT_OK;
+}
+
+/* A single slow follower doesn't hold back commits, since the leader and the
+ * other follower form a majority. */
+TEST(sim, slow_follower, NULL, NULL, 0, NULL)
+{
+    struct sim_config c;
+    struct sim_report fast;
+    struct sim_report slow;
+    SIM_DEFAULT_CONFIG(&c);
+
+    SimRun(&c, &fast);
+    c.disks[2].sync = SIM_CONST(200);
+    SimRun(&c, &slow);
+
+    munit_assert_int(slow.write_latency[SIM_P50], <=,
+                     fast.write_latency[SIM_P50] + 2);
+
+    return MUNIT_OK;
+}
+
+/* Writes that don't fit the bandwidth of the links queue up, and throughput
+ * saturates. */
+TEST(sim, bandwidth, NULL, NULL, 0, NULL)
+{
+    struct sim_config c;
+    struct sim_report r;
+    SIM_DEFAULT_CONFIG(&c);
+    c.workload.size = SIM_CONST(64 * 1024);
+    SimSetLinks(&c, (struct sim_link){SIM_CONST(1), 10000});
+
+    SimRun(&c, &r);
+
+    munit_assert_int(r.n_failed, ==, 0);
+    munit_assert_double(r.throughput, <, 160);
+    munit_assert_int(r.write_latency[SIM_P50], >, 1000);
+
+    return MUNIT_OK;
+}
+
+/* Limiting the number of outstanding requests to one caps throughput to one
+ * write per disk sync at most. */
+TEST(sim, max_inflight, NULL, NULL, 0, NULL)
+{
+    struct sim_config c;
+    struct sim_report r;
+    SIM_DEFAULT_CONFIG(&c);
+    c.workload.read_rate = 0;
+    c.workload.write_rate = 1000;
+    c.workload.duration = 2000;
+    SimSetDisks(&c, (struct sim_disk){SIM_CONST(5), 0});
+
+    SimRun(&c, &r);
+    munit_assert_double(r.throughput, >, 900);
+
+    c.workload.max_inflight = 1;
+    SimRun(&c, &r);
+    munit_assert_double(r.throughput, <, 200);
+
+    return MUNIT_OK;
+}
+
+/* Snapshots bound the memory used by the log, at the cost of taking them. */
+TEST(sim, snapshot, NULL, NULL, 0, NULL)
+{
+    struct sim_config c;
+    struct sim_report without;
+    struct sim_report with;
+    SIM_DEFAULT_CONFIG(&c);
+
+    c.snapshot_threshold = 100000;
+    SimRun(&c, &without);
+    munit_assert_int(without.n_snapshots, ==, 0);
+
+    c.snapshot_threshold = 256;
+    c.snapshot_trailing = 128;
+    SimRun(&c, &with);
+    munit_assert_int(with.n_snapshots, >=, 3 * 7);
+    munit_assert_int(with.log_memory, <, without.log_memory / 4);
+
+    return MUNIT_OK;
+}
+
+/* Splitting writes in smaller entries doesn't lose any of them. */
+TEST(sim, entry_limit, NULL, NULL, 0, NULL)
+{
+    struct sim_config c;
+    struct sim_report r;
+    SIM_DEFAULT_CONFIG(&c);
+    c.workload.size = (struct sim_dist){{100, 1000, 5000, 20000, 50000}};
+    c.workload.entry_limit = 4096;
+
+    SimRun(&c, &r);
+    munit_assert_int(r.n_failed, ==, 0);
+    munit_assert_int(r.n_writes, >, 1800);
+
+    return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * Simulation driven by command line parameters
+ *
+ *****************************************************************************/
+
+static unsigned paramUnsigned(const MunitParameter params[],
+                              const char *name,
+                              unsigned value)
+{
+    const char *s = munit_parameters_get(params, name);
+    return s != NULL ? (unsigned)atol(s) : value;
+}
+
+static double paramDouble(const MunitParameter params[],
+                          const char *name,
+                          double value)
+{
+    const char *s = munit_parameters_get(params, name);
+    return s != NULL ? atof(s) : value;
+}
+
+static MunitParameterEnum run_params[] = {
+    {"n", NULL},
+    {"seed", NULL},
+    {"duration", NULL},
+    {"write-rate", NULL},
+    {"read-rate", NULL},
+    {"size", NULL},
+    {"entry-limit", NULL},
+    {"max-inflight", NULL},
+    {"sync", NULL},
+    {"latency", NULL},
+    {"bandwidth", NULL},
+    {"heartbeat", NULL},
+    {"election", NULL},
+    {"snapshot-threshold", NULL},
+    {"snapshot-trailing", NULL},
+    {"snapshot-size", NULL},
+    {NULL, NULL},
+};
+
+/* Run the default workload, or the one given with --param, and log the report
+ * (visible with --show-stderr). Latencies are medians, with a tail of
+ * twice, 5 and 10 times as much at the 90th, 99th and 100th percentiles. */
+TEST(sim, run, NULL, NULL, 0, run_params)
+{
+    struct sim_config c;
+    struct sim_report r;
+    double sync;
+    double latency;
+    SIM_DEFAULT_CONFIG(&c);
+
+    c.n = paramUnsigned(params, "n", c.n);
+    munit_assert_int(c.n, <=, SIM_MAX_NODES);
+    c.seed = paramUnsigned(params, "seed", (unsigned)c.seed);
+    c.workload.duration =
+        paramUnsigned(params, "duration", c.workload.duration);
+    c.workload.write_rate =
+        paramDouble(params, "write-rate", c.workload.write_rate);
+    c.workload.read_rate =
+        paramDouble(params, "read-rate", c.workload.read_rate);
+    c.workload.size =
+        SIM_CONST(paramDouble(params, "size", c.workload.size.p[0]));
+    c.workload.entry_limit = paramUnsigned(params, "entry-limit", 0);
+    c.workload.max_inflight = paramUnsigned(params, "max-inflight", 0);
+    sync = paramDouble(params, "sync", c.disks[0].sync.p[1]);
+    SimSetDisks(&c, (struct sim_disk){
+                        {{sync / 2, sync, sync * 2, sync * 5, sync * 10}}, 0});
+    latency = paramDouble(params, "latency", c.links[0][0].latency.p[1]);
+    SimSetLinks(&c, (struct sim_link){{{latency / 2, latency, latency * 2,
+                                         latency * 5, latency * 10}},
+                                      paramDouble(params, "bandwidth",
+                                                  c.links[0][0].bandwidth)});
+    c.heartbeat_timeout =
+        paramUnsigned(params, "heartbeat", c.heartbeat_timeout);
+    c.election_timeout = paramUnsigned(params, "election", c.election_timeout);
+    c.snapshot_threshold =
+        paramUnsigned(params, "snapshot-threshold", c.snapshot_threshold);
+    c.snapshot_trailing =
+        paramUnsigned(params, "snapshot-trailing", c.snapshot_trailing);
+    c.snapshot_size =
+        paramUnsigned(params, "snapshot-size", (unsigned)c.snapshot_size);
+
+    SimRun(&c, &r);
+    SimLogReport(&r);
+    munit_assert_int(r.n_writes + r.n_reads, >, 0);
+
+    return MUNIT_OK;
+}
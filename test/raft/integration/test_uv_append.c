@@ -299,6 +299,64 @@ TEST(append, exceedBlock, setUp, tearDownDeps, 0, NULL)
     return MUNIT_OK;
 }
 
+#ifdef LZ4_AVAILABLE
+/* Batches whose data reaches the compression threshold are stored compressed,
+ * alongside uncompressed ones. */
+TEST(append, compressed, setUp, tearDownDeps, 0, NULL)
+{
+    struct fixture *f = data;
+    uint8_t buf[24];
+    int rv;
+
+    rv = raft_uv_set_entries_compression(&f->io, 256);
+    munit_assert_int(rv, ==, 0);
+
+    APPEND(2, SEGMENT_BLOCK_SIZE);
+    APPEND(1, 64);
+    APPEND(1, SEGMENT_BLOCK_SIZE);
+
+    /* The entries count of the first batch has the compression flag set. */
+    DirReadFile(f->dir, "open-1", buf, sizeof buf);
+    munit_assert_int(buf[23] & 0x80, !=, 0);
+
+    ASSERT_ENTRIES(4, 3 * SEGMENT_BLOCK_SIZE + 64);
+
+    return MUNIT_OK;
+}
+#endif
+
+/* Entries can be read back both from closed segments and from the open segment
+ * being written, in a single batch. */
+TEST(append, readEntries, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[3];
+    unsigned i;
+    int rv;
+
+    APPEND(MAX_SEGMENT_BLOCKS, SEGMENT_BLOCK_SIZE);
+    APPEND(2, 64);
+    while (!DirHasFile(f->dir, "0000000000000001-0000000000000004")) {
+        LOOP_RUN(1);
+    }
+
+    rv = f->io.read_entries(&f->io, 3, 3, entries);
+    munit_assert_int(rv, ==, 0);
+    for (i = 0; i < 3; i++) {
+        munit_assert_int(entries[i].term, ==, 1);
+        munit_assert_int(*(uint64_t *)entries[i].buf.base, ==, 2 + i);
+        munit_assert_ptr_equal(entries[i].batch, entries[0].batch);
+    }
+    munit_assert_int(entries[1].buf.len, ==, SEGMENT_BLOCK_SIZE);
+    munit_assert_int(entries[2].buf.len, ==, 64);
+    raft_free(entries[0].batch);
+
+    rv = f->io.read_entries(&f->io, 7, 1, entries);
+    munit_assert_int(rv, ==, RAFT_NOTFOUND);
+
+    return MUNIT_OK;
+}
+
 /* If an append request is submitted before the write operation of the previous
  * append request is started, then a single write will be performed for both
  * requests. */
@@ -345,6 +345,44 @@ TEST(recv, appendEntries, setUp, tearDown, 0, NULL)
     return MUNIT_OK;
 }
 
+#ifdef LZ4_AVAILABLE
+/* Receive an AppendEntries message whose entries were compressed by the
+ * sender. */
+TEST(recv, appendEntriesCompressed, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry entries[2];
+    struct raft_message message;
+    uint8_t data1[256];
+    uint8_t data2[1024];
+    int rv;
+
+    memset(data1, 1, sizeof data1);
+    memset(data2, 2, sizeof data2);
+
+    entries[0].type = RAFT_COMMAND;
+    entries[0].buf.base = data1;
+    entries[0].buf.len = sizeof data1;
+
+    entries[1].type = RAFT_COMMAND;
+    entries[1].buf.base = data2;
+    entries[1].buf.len = sizeof data2;
+
+    message.type = RAFT_IO_APPEND_ENTRIES;
+    message.append_entries.version = 1;
+    message.append_entries.entries = entries;
+    message.append_entries.n_entries = 2;
+
+    rv = raft_uv_set_entries_compression(&f->peer.io, 512);
+    munit_assert_int(rv, ==, 0);
+
+    PEER_SEND(&message);
+    RECV(&message);
+
+    return MUNIT_OK;
+}
+#endif
+
 /* Receive an AppendEntries message with no entries (i.e. an heartbeat). */
 TEST(recv, heartbeat, setUp, tearDown, 0, NULL)
 {
@@ -1,5 +1,6 @@
 #include <unistd.h>
 
+#include "../../../src/raft/byte.h"
 #include "../lib/runner.h"
 #include "../lib/tcp.h"
 #include "../lib/uv.h"
@@ -57,6 +58,31 @@ static void snapshotGetCbAssertResult(struct raft_io_snapshot_get *req,
     raft_free(snapshot);
 }
 
+struct snapshotData
+{
+    struct raft_buffer buf;
+    bool done;
+};
+
+/* Check that the loaded snapshot data matches the expected buffer. */
+static void snapshotGetCbAssertData(struct raft_io_snapshot_get *req,
+                                    struct raft_snapshot *snapshot,
+                                    int status)
+{
+    struct snapshotData *expect = req->data;
+    munit_assert_int(status, ==, 0);
+    munit_assert_ptr_not_null(snapshot);
+    munit_assert_uint(snapshot->n_bufs, ==, 1);
+    munit_assert_ulong(snapshot->bufs[0].len, ==, expect->buf.len);
+    munit_assert_memory_equal(expect->buf.len, snapshot->bufs[0].base,
+                              expect->buf.base);
+    expect->done = true;
+    raft_configuration_close(&snapshot->configuration);
+    raft_free(snapshot->bufs[0].base);
+    raft_free(snapshot->bufs);
+    raft_free(snapshot);
+}
+
 /* Submit a request to truncate the log at N */
 #define TRUNCATE(N)                      \
     {                                    \
@@ -97,6 +123,37 @@ static void snapshotGetCbAssertResult(struct raft_io_snapshot_get *req,
         raft_configuration_close(&_snapshot.configuration);            \
     } while (0)
 
+/* Put a snapshot at the given index whose data is a pair of 64-bit words, and
+ * wait for the operation to complete with the given status. If the data is
+ * incremental, it builds on the snapshot at BASE. */
+#define SNAPSHOT_PUT_DATA(INDEX, BASE, WORD0, WORD1, STATUS)               \
+    do {                                                                   \
+        struct raft_snapshot _snapshot;                                    \
+        struct raft_buffer _snapshot_buf;                                  \
+        uint64_t _data[2] = {byteFlip64(WORD0), byteFlip64(WORD1)};    \
+        struct raft_io_snapshot_put _req;                                  \
+        struct result _result = {STATUS, false, NULL};                     \
+        int _rv;                                                           \
+        _snapshot.term = 1;                                                \
+        _snapshot.index = INDEX;                                           \
+        raft_configuration_init(&_snapshot.configuration);                 \
+        _rv = raft_configuration_add(&_snapshot.configuration, 1, "1",     \
+                                     RAFT_STANDBY);                        \
+        munit_assert_int(_rv, ==, 0);                                      \
+        _snapshot.bufs = &_snapshot_buf;                                   \
+        _snapshot.n_bufs = 1;                                              \
+        _snapshot_buf.base = _data;                                        \
+        _snapshot_buf.len = sizeof _data;                                  \
+        _req.data = &_result;                                              \
+        _req.base_term = 1;                                                \
+        _req.base_index = BASE;                                            \
+        _rv = f->io.snapshot_put(&f->io, 10, &_req, &_snapshot,            \
+                                 snapshotPutCbAssertResult);               \
+        munit_assert_int(_rv, ==, 0);                                      \
+        LOOP_RUN_UNTIL(&_result.done);                                     \
+        raft_configuration_close(&_snapshot.configuration);                \
+    } while (0)
+
 /* Submit a snapshot put request and assert that it fails synchronously with the
  * given error code and message. */
 #define SNAPSHOT_PUT_ERROR(SNAPSHOT, TRAILING, RV, ERRMSG)           \
@@ -228,6 +285,162 @@ TEST(snapshot_put, entriesMoreThanTrailing, setUp, tearDown, 0, NULL)
     return MUNIT_OK;
 }
 
+/* If segment recycling is enabled, closed segments past the trailing amount are
+ * moved to the recycled pool and later reused as open segments. */
+TEST(snapshot_put, recycleSegments, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    unsigned i;
+    raft_uv_set_segment_size(
+        &f->io, 4096); /* Lower the number of block to force finalizing */
+    raft_uv_set_segment_pool(&f->io, 2, 1);
+
+    for (i = 0; i < 40; i++) {
+        APPEND(10, 8);
+    }
+
+    SNAPSHOT_PUT(128, /* trailing */
+                 280  /* index */
+    );
+
+    munit_assert_false(DirHasFile(f->dir, "0000000000000001-0000000000000150"));
+    munit_assert_true(
+        DirHasFile(f->dir, "recycle-0000000000000001-0000000000000150"));
+
+    for (i = 0; i < 40; i++) {
+        APPEND(10, 8);
+    }
+
+    munit_assert_false(
+        DirHasFile(f->dir, "recycle-0000000000000001-0000000000000150"));
+
+    return MUNIT_OK;
+}
+
+/* A recycled segment that was reused as an open segment but never written to
+ * doesn't yield its old entries when the log is loaded again after a crash. */
+TEST(snapshot_put, recycleSegmentsReload, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    const char *recycled = "recycle-0000000000000001-0000000000000150";
+    char filename[64];
+    char reused[64] = {0};
+    char content[4096];
+    raft_term term;
+    raft_id voted_for;
+    struct raft_snapshot *snapshot;
+    raft_index start_index;
+    struct raft_entry *entries;
+    size_t n;
+    void *batch = NULL;
+    unsigned i;
+    int rv;
+    raft_uv_set_segment_size(&f->io, 4096);
+    raft_uv_set_segment_pool(&f->io, 2, 1);
+
+    for (i = 0; i < 40; i++) {
+        APPEND(10, 8);
+    }
+    SNAPSHOT_PUT(128, /* trailing */
+                 280  /* index */
+    );
+    munit_assert_true(DirHasFile(f->dir, recycled));
+
+    /* The recycled segment is reused as the last prepared open segment, which
+     * is not written until the ones prepared before it are full. */
+    while (DirHasFile(f->dir, recycled)) {
+        APPEND(1, 8);
+    }
+    for (i = 1; i < 100; i++) {
+        sprintf(filename, "open-%u", i);
+        if (DirHasFile(f->dir, filename)) {
+            strcpy(reused, filename);
+        }
+    }
+    munit_assert_string_not_equal(reused, "");
+    DirReadFile(f->dir, reused, content, sizeof content);
+
+    /* Simulate a crash, which leaves the unused prepared segment behind. */
+    TEAR_DOWN_UV;
+    TEAR_DOWN_UV_TRANSPORT;
+    DirWriteFile(f->dir, reused, content, sizeof content);
+    SETUP_UV_TRANSPORT;
+    SETUP_UV;
+
+    rv = f->io.load(&f->io, &term, &voted_for, &snapshot, &start_index,
+                    &entries, &n);
+    munit_assert_int(rv, ==, 0);
+    munit_assert_ptr_not_null(snapshot);
+    munit_assert_int(start_index + n - 1, ==, f->count);
+    for (i = 0; i < n; i++) {
+        uint64_t value = *(uint64_t *)entries[i].buf.base;
+        munit_assert_int(value, ==, start_index + i - 1);
+    }
+    munit_assert_false(DirHasFile(f->dir, reused));
+
+    raft_configuration_close(&snapshot->configuration);
+    raft_free(snapshot->bufs[0].base);
+    raft_free(snapshot->bufs);
+    raft_free(snapshot);
+    for (i = 0; i < n; i++) {
+        if (entries[i].batch != batch) {
+            batch = entries[i].batch;
+            raft_free(batch);
+        }
+    }
+    raft_free(entries);
+
+    return MUNIT_OK;
+}
+
+/* Loading an incremental snapshot yields the data of the whole chain it
+ * belongs to. */
+TEST(snapshot_put, incrementalChain, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    struct raft_io_snapshot_get req;
+    uint64_t chain[6] = {
+        byteFlip64(1), byteFlip64(2),
+        byteFlip64(RAFT_SNAPSHOT_INCREMENTAL), byteFlip64(3),
+        byteFlip64(RAFT_SNAPSHOT_INCREMENTAL), byteFlip64(4),
+    };
+    struct snapshotData expect = {{chain, sizeof chain}, false};
+    int rv;
+
+    /* An incremental snapshot needs a base. */
+    SNAPSHOT_PUT_DATA(1, 0, RAFT_SNAPSHOT_INCREMENTAL, 0, RAFT_INVALID);
+
+    SNAPSHOT_PUT_DATA(1, 0, 1, 2, 0);
+    SNAPSHOT_PUT_DATA(2, 1, RAFT_SNAPSHOT_INCREMENTAL, 3, 0);
+    SNAPSHOT_PUT_DATA(3, 2, RAFT_SNAPSHOT_INCREMENTAL, 4, 0);
+
+    req.data = &expect;
+    rv = f->io.snapshot_get(&f->io, &req, snapshotGetCbAssertData);
+    munit_assert_int(rv, ==, 0);
+    LOOP_RUN_UNTIL(&expect.done);
+
+    return MUNIT_OK;
+}
+
+/* An incremental snapshot must build on the newest snapshot. */
+TEST(snapshot_put, incrementalStaleBase, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+
+    SNAPSHOT_PUT_DATA(1, 0, 1, 2, 0);
+    SNAPSHOT_PUT_DATA(2, 1, RAFT_SNAPSHOT_INCREMENTAL, 3, 0);
+
+    /* The base is not the newest snapshot anymore. */
+    SNAPSHOT_PUT_DATA(3, 1, RAFT_SNAPSHOT_INCREMENTAL, 4, RAFT_INVALID);
+
+    /* The base was never put. */
+    SNAPSHOT_PUT_DATA(3, 5, RAFT_SNAPSHOT_INCREMENTAL, 4, RAFT_INVALID);
+
+    SNAPSHOT_PUT_DATA(3, 2, RAFT_SNAPSHOT_INCREMENTAL, 4, 0);
+
+    return MUNIT_OK;
+}
+
 /* Request to install a snapshot. */
 TEST(snapshot_put, install, setUp, tearDown, 0, NULL)
 {
@@ -9,6 +9,7 @@ struct fsm
     int x;
     int y;
     int lock;
+    unsigned n_batches;
     void *data;
 };
 
@@ -53,6 +54,28 @@ static int fsmApply(struct raft_fsm *fsm,
     return 0;
 }
 
+/* For use with fsm->version >= 5 */
+static int fsmApplyBatch(struct raft_fsm *fsm,
+                         const struct raft_buffer bufs[],
+                         unsigned n,
+                         void *results[],
+                         unsigned *n_applied)
+{
+    struct fsm *f = fsm->data;
+    unsigned i;
+    int rv;
+
+    f->n_batches++;
+    for (i = 0; i < n; i++) {
+        rv = fsmApply(fsm, &bufs[i], &results[i]);
+        if (rv != 0) {
+            break;
+        }
+    }
+    *n_applied = i;
+    return i == n ? 0 : rv;
+}
+
 static int fsmRestore(struct raft_fsm *fsm, struct raft_buffer *buf)
 {
     struct fsm *f = fsm->data;
@@ -174,6 +197,7 @@ void FsmInit(struct raft_fsm *fsm, int version)
     f->x = 0;
     f->y = 0;
     f->lock = 0;
+    f->n_batches = 0;
     f->data = NULL;
 
     fsm->version = version;
@@ -186,6 +210,12 @@ void FsmInit(struct raft_fsm *fsm, int version)
         fsm->snapshot_finalize = fsmSnapshotFinalize;
         fsm->snapshot_async = NULL;
     }
+    if (version > 3) {
+        fsm->snapshot_done = NULL;
+    }
+    if (version > 4) {
+        fsm->apply_batch = fsmApplyBatch;
+    }
 }
 
 void FsmInitAsync(struct raft_fsm *fsm, int version)
@@ -197,6 +227,7 @@ void FsmInitAsync(struct raft_fsm *fsm, int version)
     f->x = 0;
     f->y = 0;
     f->lock = 0;
+    f->n_batches = 0;
     f->data = NULL;
 
     fsm->version = version;
@@ -206,6 +237,12 @@ void FsmInitAsync(struct raft_fsm *fsm, int version)
     fsm->snapshot_async = fsmSnapshotAsync;
     fsm->snapshot_finalize = fsmSnapshotFinalize;
     fsm->restore = fsmRestore;
+    if (version > 3) {
+        fsm->snapshot_done = NULL;
+    }
+    if (version > 4) {
+        fsm->apply_batch = fsmApplyBatch;
+    }
 }
 
 void FsmClose(struct raft_fsm *fsm)
@@ -291,3 +328,9 @@ int FsmGetY(struct raft_fsm *fsm)
     struct fsm *f = fsm->data;
     return f->y;
 }
+
+unsigned FsmGetBatches(struct raft_fsm *fsm)
+{
+    struct fsm *f = fsm->data;
+    return f->n_batches;
+}
@@ -36,4 +36,7 @@ void FsmEncodeSnapshot(int x,
 int FsmGetX(struct raft_fsm *fsm);
 int FsmGetY(struct raft_fsm *fsm);
 
+/* Return the number of calls to the apply_batch hook (version 5 and above). */
+unsigned FsmGetBatches(struct raft_fsm *fsm);
+
 #endif /* TEST_FSM_H */
@@ -0,0 +1,638 @@
+#include "sim.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../../src/raft/log.h"
+#include "munit.h"
+
+/* Milliseconds to wait for outstanding requests after the workload ended. */
+#define SIM_DRAIN_TIMEOUT 60000
+
+/* Request that arrived but wasn't submitted yet. */
+struct simArrival
+{
+    raft_time time;
+    size_t size; /* Bytes to write, or 0 for reads */
+};
+
+/* Request submitted to the leader. */
+struct simRequest
+{
+    union {
+        struct raft_apply apply;
+        struct raft_barrier barrier;
+    };
+    struct sim *sim;
+    raft_time arrival;
+};
+
+/* Growable array of latencies. */
+struct simSamples
+{
+    unsigned *items;
+    unsigned n;
+    unsigned cap;
+};
+
+struct sim
+{
+    const struct sim_config *config;
+    struct sim_report *report;
+    struct raft_fixture fixture;
+    struct raft_fsm fsms[SIM_MAX_NODES];
+    struct raft_timer timer;
+    uint64_t random;
+    raft_time start;      /* When the workload started */
+    raft_time last;       /* Last completed request */
+    raft_time last_write; /* Last completed write */
+    double disk_busy[SIM_MAX_NODES];  /* End of the write in progress */
+    double disk_batch[SIM_MAX_NODES]; /* End of the next write */
+    bool disk_batching[SIM_MAX_NODES]; /* Whether a next write is pending */
+    double link_idle[SIM_MAX_NODES][SIM_MAX_NODES]; /* When a link is idle */
+    double next_write;          /* Arrival of the next write */
+    double next_read;           /* Arrival of the next read */
+    struct simArrival *pending; /* FIFO of waiting requests */
+    unsigned pending_head;
+    unsigned pending_tail;
+    unsigned pending_cap;
+    unsigned n_inflight;
+    raft_index snapshots[SIM_MAX_NODES]; /* Last snapshot index of each node */
+    struct simSamples writes;
+    struct simSamples reads;
+};
+
+void SimConfigInit(struct sim_config *c, unsigned n)
+{
+    munit_assert_int(n, >, 0);
+    munit_assert_int(n, <=, SIM_MAX_NODES);
+    memset(c, 0, sizeof *c);
+    c->n = n;
+    SimSetDisks(c, (struct sim_disk){SIM_CONST(1), 0});
+    SimSetLinks(c, (struct sim_link){SIM_CONST(1), 0});
+    c->message_overhead = 64;
+    c->heartbeat_timeout = 100;
+    c->election_timeout = 1000;
+    c->snapshot_threshold = 1024;
+    c->snapshot_trailing = 2048;
+    c->snapshot_size = 4096;
+    c->seed = 1;
+}
+
+void SimSetDisks(struct sim_config *c, struct sim_disk disk)
+{
+    unsigned i;
+    for (i = 0; i < SIM_MAX_NODES; i++) {
+        c->disks[i] = disk;
+    }
+}
+
+void SimSetLinks(struct sim_config *c, struct sim_link link)
+{
+    unsigned i;
+    unsigned j;
+    for (i = 0; i < SIM_MAX_NODES; i++) {
+        for (j = 0; j < SIM_MAX_NODES; j++) {
+            c->links[i][j] = link;
+        }
+    }
+}
+
+/******************************************************************************
+ *
+ * Random numbers
+ *
+ *****************************************************************************/
+
+/* xorshift64*, so that runs don't depend on the C library. */
+static uint64_t simRandom(struct sim *s)
+{
+    s->random ^= s->random >> 12;
+    s->random ^= s->random << 25;
+    s->random ^= s->random >> 27;
+    return s->random * UINT64_C(2685821657736338717);
+}
+
+/* Return a number uniformly distributed in [0, 1). */
+static double simUniform(struct sim *s)
+{
+    return (double)(simRandom(s) >> 11) / (double)(UINT64_C(1) << 53);
+}
+
+static double simSample(struct sim *s, const struct sim_dist *dist)
+{
+    static const double q[5] = {0, 0.5, 0.9, 0.99, 1};
+    double u = simUniform(s);
+    unsigned i;
+    for (i = 1; i < 4 && u >= q[i]; i++) {
+    }
+    return dist->p[i - 1] +
+           (dist->p[i] - dist->p[i - 1]) * (u - q[i - 1]) / (q[i] - q[i - 1]);
+}
+
+/* Round to an integer, up with a probability equal to the fractional part, so
+ * that millisecond resolution doesn't skew averages. */
+static unsigned simRound(struct sim *s, double x)
+{
+    unsigned n;
+    if (x <= 0) {
+        return 0;
+    }
+    n = (unsigned)x;
+    if (simUniform(s) < x - (double)n) {
+        n++;
+    }
+    return n;
+}
+
+/******************************************************************************
+ *
+ * Disks and links
+ *
+ *****************************************************************************/
+
+/* Return when a write of @size bytes submitted now to the disk of the @i'th
+ * node completes. Like the libuv backend, the disk groups the requests that
+ * arrive while a write is in progress into the next one. */
+static double simDisk(struct sim *s, unsigned i, double now, size_t size)
+{
+    const struct sim_disk *disk = &s->config->disks[i];
+    double transfer = disk->bandwidth > 0 ? (double)size / disk->bandwidth : 0;
+
+    if (s->disk_batching[i] && now >= s->disk_busy[i]) {
+        s->disk_busy[i] = s->disk_batch[i];
+        s->disk_batching[i] = false;
+    }
+    if (now >= s->disk_busy[i]) {
+        s->disk_busy[i] = now + transfer + simSample(s, &disk->sync);
+        return s->disk_busy[i];
+    }
+    if (!s->disk_batching[i]) {
+        s->disk_batch[i] = s->disk_busy[i] + simSample(s, &disk->sync);
+        s->disk_batching[i] = true;
+    }
+    s->disk_batch[i] += transfer;
+    return s->disk_batch[i];
+}
+
+/* Return when a message of @size bytes sent now from the @i'th node to the
+ * @j'th one is delivered. A link can start sending a message as soon as the
+ * previous one is on the wire. */
+static double simLink(struct sim *s,
+                      unsigned i,
+                      unsigned j,
+                      double now,
+                      size_t size)
+{
+    const struct sim_link *link = &s->config->links[i][j];
+    double *idle = &s->link_idle[i][j];
+
+    if (*idle < now) {
+        *idle = now;
+    }
+    if (link->bandwidth > 0) {
+        *idle += (double)size / link->bandwidth;
+    }
+    return *idle + simSample(s, &link->latency);
+}
+
+static unsigned simLatency(void *data,
+                           int kind,
+                           unsigned i,
+                           unsigned j,
+                           size_t size)
+{
+    struct sim *s = data;
+    double now = (double)raft_fixture_time(&s->fixture);
+    double done;
+
+    if (kind == RAFT_FIXTURE_NETWORK) {
+        size += s->config->message_overhead;
+        s->report->n_messages++;
+        s->report->n_bytes += size;
+        done = simLink(s, i, j, now, size);
+    } else {
+        done = simDisk(s, i, now, size);
+    }
+
+    return simRound(s, done - now);
+}
+
+/******************************************************************************
+ *
+ * FSM whose commands are opaque and whose snapshots have a fixed size
+ *
+ *****************************************************************************/
+
+static int simFsmApply(struct raft_fsm *fsm,
+                       const struct raft_buffer *buf,
+                       void **result)
+{
+    (void)fsm;
+    (void)buf;
+    *result = NULL;
+    return 0;
+}
+
+static int simFsmSnapshot(struct raft_fsm *fsm,
+                          struct raft_buffer *bufs[],
+                          unsigned *n_bufs)
+{
+    struct sim *s = fsm->data;
+    size_t size = s->config->snapshot_size > 0 ? s->config->snapshot_size : 1;
+
+    *bufs = raft_malloc(sizeof **bufs);
+    munit_assert_ptr_not_null(*bufs);
+    (*bufs)[0].base = raft_calloc(1, size);
+    munit_assert_ptr_not_null((*bufs)[0].base);
+    (*bufs)[0].len = size;
+    *n_bufs = 1;
+
+    return 0;
+}
+
+static int simFsmSnapshotFinalize(struct raft_fsm *fsm,
+                                  struct raft_buffer *bufs[],
+                                  unsigned *n_bufs)
+{
+    unsigned i;
+    (void)fsm;
+    if (*bufs != NULL) {
+        for (i = 0; i < *n_bufs; i++) {
+            raft_free((*bufs)[i].base);
+        }
+        raft_free(*bufs);
+    }
+    *bufs = NULL;
+    *n_bufs = 0;
+    return 0;
+}
+
+static int simFsmRestore(struct raft_fsm *fsm, struct raft_buffer *buf)
+{
+    (void)fsm;
+    raft_free(buf->base);
+    return 0;
+}
+
+static void simFsmInit(struct sim *s, struct raft_fsm *fsm)
+{
+    memset(fsm, 0, sizeof *fsm);
+    fsm->version = 2;
+    fsm->data = s;
+    fsm->apply = simFsmApply;
+    fsm->snapshot = simFsmSnapshot;
+    fsm->snapshot_finalize = simFsmSnapshotFinalize;
+    fsm->restore = simFsmRestore;
+}
+
+/******************************************************************************
+ *
+ * Workload
+ *
+ *****************************************************************************/
+
+static void simRecord(struct sim *s, struct simSamples *samples, raft_time t)
+{
+    raft_time now = raft_fixture_time(&s->fixture);
+    if (samples->n == samples->cap) {
+        samples->cap = samples->cap == 0 ? 1024 : samples->cap * 2;
+        samples->items =
+            realloc(samples->items, samples->cap * sizeof *samples->items);
+        munit_assert_ptr_not_null(samples->items);
+    }
+    samples->items[samples->n++] = (unsigned)(now - t);
+    s->last = now;
+}
+
+static void simRequestDone(struct simRequest *req,
+                           struct simSamples *samples,
+                           int status)
+{
+    struct sim *s = req->sim;
+    s->n_inflight--;
+    if (status == 0) {
+        simRecord(s, samples, req->arrival);
+    } else {
+        s->report->n_failed++;
+    }
+    free(req);
+}
+
+static void simApplyCb(struct raft_apply *apply, int status, void *result)
+{
+    struct simRequest *req = apply->data;
+    struct sim *s = req->sim;
+    (void)result;
+    if (status == 0) {
+        s->last_write = raft_fixture_time(&s->fixture);
+    }
+    simRequestDone(req, &s->writes, status);
+}
+
+static void simBarrierCb(struct raft_barrier *barrier, int status)
+{
+    struct simRequest *req = barrier->data;
+    simRequestDone(req, &req->sim->reads, status);
+}
+
+/* Propose a write of @size bytes, split in entries no larger than the limit
+ * set by the workload. */
+static int simApply(struct sim *s, struct raft *r, struct simRequest *req,
+                    size_t size)
+{
+    size_t limit = s->config->workload.entry_limit;
+    struct raft_buffer *bufs;
+    unsigned n;
+    unsigned i;
+    int rv;
+
+    if (limit == 0 || limit > size) {
+        limit = size;
+    }
+    n = (unsigned)((size + limit - 1) / limit);
+    bufs = munit_calloc(n, sizeof *bufs);
+    for (i = 0; i < n; i++) {
+        bufs[i].len = i < n - 1 ? limit : size - limit * (n - 1);
+        bufs[i].base = raft_calloc(1, bufs[i].len);
+        munit_assert_ptr_not_null(bufs[i].base);
+    }
+
+    req->apply.data = req;
+    rv = raft_apply(r, &req->apply, bufs, n, simApplyCb);
+    if (rv != 0) {
+        for (i = 0; i < n; i++) {
+            raft_free(bufs[i].base);
+        }
+    }
+    free(bufs);
+    return rv;
+}
+
+/* Submit a request to the current leader. Like a dqlite node serving a query,
+ * the leader can read right away unless some entries aren't applied yet, in
+ * which case it needs a barrier first. */
+static void simSubmit(struct sim *s, const struct simArrival *arrival)
+{
+    unsigned i = raft_fixture_leader_index(&s->fixture);
+    struct simRequest *req;
+    struct raft *r;
+    int rv;
+
+    if (i == s->config->n) {
+        s->report->n_failed++;
+        return;
+    }
+    r = raft_fixture_get(&s->fixture, i);
+
+    if (arrival->size == 0 && raft_last_applied(r) == raft_last_index(r)) {
+        simRecord(s, &s->reads, arrival->time);
+        return;
+    }
+
+    req = munit_malloc(sizeof *req);
+    req->sim = s;
+    req->arrival = arrival->time;
+    if (arrival->size > 0) {
+        rv = simApply(s, r, req, arrival->size);
+    } else {
+        req->barrier.data = req;
+        rv = raft_barrier(r, &req->barrier, simBarrierCb);
+    }
+    if (rv != 0) {
+        s->report->n_failed++;
+        free(req);
+        return;
+    }
+    s->n_inflight++;
+}
+
+static void simEnqueue(struct sim *s, size_t size)
+{
+    if (s->pending_tail == s->pending_cap) {
+        if (s->pending_head > 0) {
+            memmove(s->pending, &s->pending[s->pending_head],
+                    (s->pending_tail - s->pending_head) * sizeof *s->pending);
+            s->pending_tail -= s->pending_head;
+            s->pending_head = 0;
+        }
+        if (s->pending_tail == s->pending_cap) {
+            s->pending_cap = s->pending_cap == 0 ? 64 : s->pending_cap * 2;
+            s->pending =
+                realloc(s->pending, s->pending_cap * sizeof *s->pending);
+            munit_assert_ptr_not_null(s->pending);
+        }
+    }
+    s->pending[s->pending_tail].time = raft_fixture_time(&s->fixture);
+    s->pending[s->pending_tail].size = size;
+    s->pending_tail++;
+}
+
+/* Return the time between two arrivals, averaging 1 second / @rate. */
+static double simInterval(struct sim *s, double rate)
+{
+    return simUniform(s) * 2000.0 / rate;
+}
+
+/* Queue the requests that arrived by now, and submit as many as the maximum
+ * number of outstanding requests allows. */
+static void simArrive(struct sim *s)
+{
+    const struct sim_workload *w = &s->config->workload;
+    double now = (double)(raft_fixture_time(&s->fixture) - s->start);
+    size_t size;
+
+    while (w->write_rate > 0 && s->next_write <= now &&
+           s->next_write < (double)w->duration) {
+        size = simRound(s, simSample(s, &w->size));
+        simEnqueue(s, size > 0 ? size : 1);
+        s->next_write += simInterval(s, w->write_rate);
+    }
+    while (w->read_rate > 0 && s->next_read <= now &&
+           s->next_read < (double)w->duration) {
+        simEnqueue(s, 0);
+        s->next_read += simInterval(s, w->read_rate);
+    }
+
+    while (s->pending_head < s->pending_tail &&
+           (w->max_inflight == 0 || s->n_inflight < w->max_inflight)) {
+        simSubmit(s, &s->pending[s->pending_head++]);
+    }
+}
+
+/* Track the log memory and the snapshots of all nodes. */
+static void simObserve(struct sim *s)
+{
+    unsigned i;
+    for (i = 0; i < s->config->n; i++) {
+        struct raft_log *log = raft_fixture_get(&s->fixture, i)->log;
+        size_t memory = log->cache.resident +
+                        logNumEntries(log) * sizeof(struct raft_entry);
+        raft_index snapshot = logSnapshotIndex(log);
+        if (memory > s->report->log_memory) {
+            s->report->log_memory = memory;
+        }
+        if (snapshot != s->snapshots[i]) {
+            s->snapshots[i] = snapshot;
+            s->report->n_snapshots++;
+        }
+    }
+}
+
+/* Wakes up the fixture at least once per millisecond, so that requests are
+ * submitted as soon as they arrive. */
+static void simTimerCb(struct raft_timer *timer)
+{
+    (void)timer;
+}
+
+/******************************************************************************
+ *
+ * Simulation
+ *
+ *****************************************************************************/
+
+static void simStart(struct sim *s)
+{
+    const struct sim_config *c = s->config;
+    struct raft_configuration configuration;
+    unsigned i;
+    int rv;
+
+    rv = raft_fixture_init(&s->fixture);
+    munit_assert_int(rv, ==, 0);
+    for (i = 0; i < c->n; i++) {
+        struct raft *r;
+        simFsmInit(s, &s->fsms[i]);
+        rv = raft_fixture_grow(&s->fixture, &s->fsms[i]);
+        munit_assert_int(rv, ==, 0);
+        r = raft_fixture_get(&s->fixture, i);
+        raft_set_heartbeat_timeout(r, c->heartbeat_timeout);
+        raft_set_election_timeout(r, c->election_timeout);
+        raft_set_snapshot_threshold(r, c->snapshot_threshold);
+        raft_set_snapshot_trailing(r, c->snapshot_trailing);
+    }
+    rv = raft_fixture_configuration(&s->fixture, c->n, &configuration);
+    munit_assert_int(rv, ==, 0);
+    rv = raft_fixture_bootstrap(&s->fixture, &configuration);
+    munit_assert_int(rv, ==, 0);
+    raft_configuration_close(&configuration);
+    rv = raft_fixture_start(&s->fixture);
+    munit_assert_int(rv, ==, 0);
+
+    /* Elect the first node with the fixture's fixed latencies, then switch
+     * to the simulated ones. Checking the whole log of the leader at every
+     * step would make long simulations quadratic. */
+    raft_fixture_elect(&s->fixture, 0);
+    raft_fixture_check_append_only(&s->fixture, false);
+    for (i = 0; i < c->n; i++) {
+        raft_fixture_set_latency_fn(&s->fixture, i, simLatency, s);
+        s->snapshots[i] = logSnapshotIndex(raft_fixture_get(&s->fixture, i)->log);
+    }
+    rv = raft_timer_start(raft_fixture_get(&s->fixture, 0), &s->timer, 1, 1,
+                          simTimerCb);
+    munit_assert_int(rv, ==, 0);
+
+    s->start = raft_fixture_time(&s->fixture);
+    s->last = s->start;
+    s->last_write = s->start;
+    s->next_write = c->workload.write_rate > 0
+                        ? simInterval(s, c->workload.write_rate)
+                        : 0;
+    s->next_read = c->workload.read_rate > 0
+                       ? simInterval(s, c->workload.read_rate)
+                       : 0;
+}
+
+static int simCompare(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a;
+    unsigned y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Fill @p with the percentiles of the given samples, using the nearest-rank
+ * method. */
+static void simPercentiles(struct simSamples *samples,
+                           unsigned p[SIM_N_PERCENTILES])
+{
+    static const unsigned q[SIM_N_PERCENTILES] = {50, 90, 99, 100};
+    unsigned rank;
+    unsigned i;
+    if (samples->n == 0) {
+        memset(p, 0, SIM_N_PERCENTILES * sizeof *p);
+        return;
+    }
+    qsort(samples->items, samples->n, sizeof *samples->items, simCompare);
+    for (i = 0; i < SIM_N_PERCENTILES; i++) {
+        rank = (samples->n * q[i] + 99) / 100;
+        p[i] = samples->items[rank > 0 ? rank - 1 : 0];
+    }
+}
+
+void SimRun(const struct sim_config *c, struct sim_report *report)
+{
+    struct sim *s = munit_calloc(1, sizeof *s);
+    raft_time elapsed;
+    int rv;
+
+    memset(report, 0, sizeof *report);
+    s->config = c;
+    s->report = report;
+    s->random = c->seed != 0 ? c->seed : 1;
+    simStart(s);
+
+    while (true) {
+        simArrive(s);
+        elapsed = raft_fixture_time(&s->fixture) - s->start;
+        if (elapsed >= c->workload.duration &&
+            s->pending_head == s->pending_tail && s->n_inflight == 0) {
+            break;
+        }
+        if (elapsed >= c->workload.duration + SIM_DRAIN_TIMEOUT) {
+            break;
+        }
+        raft_fixture_step(&s->fixture);
+        simObserve(s);
+    }
+
+    /* Requests still outstanding fail when the fixture is closed. */
+    report->n_failed += s->pending_tail - s->pending_head;
+    rv = raft_timer_stop(raft_fixture_get(&s->fixture, 0), &s->timer);
+    munit_assert_int(rv, ==, 0);
+    raft_fixture_close(&s->fixture);
+
+    report->elapsed = (unsigned)(s->last - s->start);
+    report->n_writes = s->writes.n;
+    report->n_reads = s->reads.n;
+    if (s->last_write > s->start) {
+        report->throughput = (double)s->writes.n * 1000.0 /
+                             (double)(s->last_write - s->start);
+    }
+    simPercentiles(&s->writes, report->write_latency);
+    simPercentiles(&s->reads, report->read_latency);
+
+    free(s->writes.items);
+    free(s->reads.items);
+    free(s->pending);
+    free(s);
+}
+
+void SimLogReport(const struct sim_report *report)
+{
+    munit_logf(MUNIT_LOG_INFO,
+               "%u writes (%.1f/s), %u reads, %u failed in %u ms",
+               report->n_writes, report->throughput, report->n_reads,
+               report->n_failed, report->elapsed);
+    munit_logf(MUNIT_LOG_INFO, "write latency p50/p90/p99/max: %u/%u/%u/%u ms",
+               report->write_latency[SIM_P50], report->write_latency[SIM_P90],
+               report->write_latency[SIM_P99], report->write_latency[SIM_MAX]);
+    munit_logf(MUNIT_LOG_INFO, "read latency p50/p90/p99/max: %u/%u/%u/%u ms",
+               report->read_latency[SIM_P50], report->read_latency[SIM_P90],
+               report->read_latency[SIM_P99], report->read_latency[SIM_MAX]);
+    munit_logf(MUNIT_LOG_INFO,
+               "log memory %zu bytes, %u snapshots, %u messages, %llu bytes",
+               report->log_memory, report->n_snapshots, report->n_messages,
+               (unsigned long long)report->n_bytes);
+}
@@ -0,0 +1,106 @@
+/* Deterministic performance simulation of a raft cluster.
+ *
+ * A simulation runs a cluster on top of raft_fixture, replacing its fixed disk
+ * and network latencies with random ones drawn from per-node and per-link
+ * distributions, and replays a synthetic workload of writes and reads against
+ * the leader. Disks and links serve one request at a time, so a bandwidth
+ * limit makes requests queue up behind each other.
+ *
+ * Simulated time advances only when the fixture steps, so minutes of cluster
+ * activity take a fraction of a second to run, and the same configuration and
+ * seed always produce the same report. */
+
+#ifndef TEST_SIM_H
+#define TEST_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "../../../src/raft.h"
+
+#define SIM_MAX_NODES RAFT_FIXTURE_MAX_SERVERS
+
+/* Random quantity, described by the values of its 0th, 50th, 90th, 99th and
+ * 100th percentiles. Samples are interpolated linearly between them. */
+struct sim_dist
+{
+    double p[5];
+};
+
+/* Distribution that always returns the given value. */
+#define SIM_CONST(X) ((struct sim_dist){{(X), (X), (X), (X), (X)}})
+
+/* Disk of a node. */
+struct sim_disk
+{
+    struct sim_dist sync; /* Milliseconds to persist a write, besides transfer */
+    double bandwidth;     /* Bytes per millisecond, or 0 for unlimited */
+};
+
+/* One-way link between two nodes. */
+struct sim_link
+{
+    struct sim_dist latency; /* Milliseconds to deliver a message */
+    double bandwidth;        /* Bytes per millisecond, or 0 for unlimited */
+};
+
+/* Requests submitted by clients. Writes and reads arrive independently, at
+ * uniformly distributed intervals averaging the given rates. */
+struct sim_workload
+{
+    unsigned duration;     /* Milliseconds during which requests arrive */
+    double write_rate;     /* Writes per second */
+    double read_rate;      /* Reads per second */
+    struct sim_dist size;  /* Bytes written by each write */
+    size_t entry_limit;    /* Max bytes per entry, or 0 for unlimited */
+    unsigned max_inflight; /* Max outstanding requests, or 0 for unlimited */
+};
+
+struct sim_config
+{
+    unsigned n; /* Number of voters */
+    struct sim_disk disks[SIM_MAX_NODES];
+    struct sim_link links[SIM_MAX_NODES][SIM_MAX_NODES];
+    size_t message_overhead; /* Bytes added to the payload of each message */
+    unsigned heartbeat_timeout;
+    unsigned election_timeout;
+    unsigned snapshot_threshold;
+    unsigned snapshot_trailing;
+    size_t snapshot_size; /* Bytes of each FSM snapshot */
+    uint64_t seed;
+    struct sim_workload workload;
+};
+
+/* Indexes of the percentiles of a latency report. */
+enum { SIM_P50, SIM_P90, SIM_P99, SIM_MAX, SIM_N_PERCENTILES };
+
+struct sim_report
+{
+    unsigned elapsed;  /* Milliseconds until the last request completed */
+    unsigned n_writes; /* Completed writes */
+    unsigned n_reads;  /* Completed reads */
+    unsigned n_failed; /* Requests that failed, e.g. for lack of a leader */
+    double throughput; /* Committed writes per second */
+    unsigned write_latency[SIM_N_PERCENTILES]; /* Milliseconds */
+    unsigned read_latency[SIM_N_PERCENTILES];  /* Milliseconds */
+    size_t log_memory;    /* Peak memory used by the in-memory log of a node */
+    unsigned n_snapshots; /* Snapshots taken or installed, across all nodes */
+    unsigned n_messages;  /* Messages sent, across all nodes */
+    uint64_t n_bytes;     /* Bytes sent, including message overhead */
+};
+
+/* Initialize a configuration of @n nodes with 1ms disks and 1ms links, raft's
+ * default settings and an empty workload. */
+void SimConfigInit(struct sim_config *c, unsigned n);
+
+/* Set the disks of all nodes or all the links between them. */
+void SimSetDisks(struct sim_config *c, struct sim_disk disk);
+void SimSetLinks(struct sim_config *c, struct sim_link link);
+
+/* Run a simulation of the given configuration and fill the report. */
+void SimRun(const struct sim_config *c, struct sim_report *report);
+
+/* Log the given report with munit_logf. */
+void SimLogReport(const struct sim_report *report);
+
+#endif /* TEST_SIM_H */
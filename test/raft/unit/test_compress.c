@@ -245,6 +245,133 @@ TEST(Compress, compressDecompressRandomTwo, NULL, NULL, 0, random_two_params)
     return MUNIT_OK;
 }
 
+static int readFromBuf(void *arg,
+                       size_t offset,
+                       void *buf,
+                       size_t len,
+                       char *errmsg)
+{
+    struct raft_buffer *src = arg;
+    (void)errmsg;
+    munit_assert_ulong(offset + len, <=, src->len);
+    memcpy(buf, (char *)src->base + offset, len);
+    return 0;
+}
+
+/* Data spanning several chunks is restored by the streaming decompressor. */
+TEST(Compress, decompressStream, NULL, NULL, 0, random_two_params)
+{
+    char errmsg[RAFT_ERRMSG_BUF_SIZE] = {0};
+    struct raft_buffer compressed = {0};
+    struct raft_buffer decompressed = {0};
+    uint8_t sha1_virgin[20] = {0};
+    uint8_t sha1_decompressed[20] = {1};
+
+    size_t len1 = strtoul(munit_parameters_get(params, "len_one"), NULL, 0);
+    size_t len2 = strtoul(munit_parameters_get(params, "len_two"), NULL, 0);
+    if (len1 + len2 == 0) {
+        return MUNIT_SKIP;
+    }
+    struct raft_buffer bufs[3] = {getBufWithRandom(len1),
+                                  getBufWithNonRandom(3 * 1048576 + 7),
+                                  getBufWithRandom(len2)};
+
+    sha1(bufs, 3, sha1_virgin);
+    munit_assert_int(Compress(bufs, 3, &compressed, errmsg), ==, 0);
+    munit_assert_true(IsCompressed(compressed.base, compressed.len));
+    munit_assert_int(DecompressStream(compressed.len, readFromBuf, &compressed,
+                                      &decompressed, errmsg),
+                     ==, 0);
+    munit_assert_ulong(decompressed.len, ==,
+                       bufs[0].len + bufs[1].len + bufs[2].len);
+    sha1(&decompressed, 1, sha1_decompressed);
+    munit_assert_int(memcmp(sha1_virgin, sha1_decompressed, 20), ==, 0);
+
+    for (unsigned i = 0; i < 3; i++) {
+        free(bufs[i].base);
+    }
+    raft_free(compressed.base);
+    raft_free(decompressed.base);
+    return MUNIT_OK;
+}
+
+static int appendToBuf(void *arg, const void *data, size_t len, char *errmsg)
+{
+    struct raft_buffer *dst = arg;
+    (void)errmsg;
+    dst->base = raft_realloc(dst->base, dst->len + len);
+    munit_assert_ptr_not_null(dst->base);
+    memcpy((char *)dst->base + dst->len, data, len);
+    dst->len += len;
+    return 0;
+}
+
+/* Without chunks, data larger than a chunk is streamed out as a single frame,
+ * which can be read by releases not supporting chunks. */
+TEST(Compress, compressStreamSingleFrame, NULL, NULL, 0, random_two_params)
+{
+    char errmsg[RAFT_ERRMSG_BUF_SIZE] = {0};
+    struct raft_buffer compressed = {0};
+    struct raft_buffer decompressed = {0};
+    uint8_t sha1_virgin[20] = {0};
+    uint8_t sha1_decompressed[20] = {1};
+
+    size_t len1 = strtoul(munit_parameters_get(params, "len_one"), NULL, 0);
+    size_t len2 = strtoul(munit_parameters_get(params, "len_two"), NULL, 0);
+    struct raft_buffer bufs[3] = {getBufWithRandom(len1),
+                                  getBufWithNonRandom(3 * 1048576 + 7),
+                                  getBufWithRandom(len2)};
+
+    sha1(bufs, 3, sha1_virgin);
+    munit_assert_int(
+        CompressStream(bufs, 3, false, appendToBuf, &compressed, errmsg), ==,
+        0);
+    munit_assert_true(IsCompressed(compressed.base, compressed.len));
+    decompressed.len = bufs[0].len + bufs[1].len + bufs[2].len;
+    decompressed.base = raft_malloc(decompressed.len);
+    munit_assert_ptr_not_null(decompressed.base);
+    munit_assert_int(DecompressInto(compressed, decompressed.base,
+                                    decompressed.len, errmsg),
+                     ==, 0);
+    sha1(&decompressed, 1, sha1_decompressed);
+    munit_assert_int(memcmp(sha1_virgin, sha1_decompressed, 20), ==, 0);
+
+    for (unsigned i = 0; i < 3; i++) {
+        free(bufs[i].base);
+    }
+    raft_free(compressed.base);
+    raft_free(decompressed.base);
+    return MUNIT_OK;
+}
+
+/* Corruption of a chunk other than the first one is detected. */
+TEST(Compress, compressDecompressCorruptionChunk, NULL, NULL, 0, NULL)
+{
+    char errmsg[RAFT_ERRMSG_BUF_SIZE] = {0};
+    struct raft_buffer compressed = {0};
+    struct raft_buffer decompressed = {0};
+
+    size_t len = 4 * 1048576;
+    struct raft_buffer buf = getBufWithRandom(len);
+
+    munit_assert_int(Compress(&buf, 1, &compressed, errmsg), ==, 0);
+    munit_assert_ulong(compressed.len, >, len);
+
+    /* Corrupt a data byte in the middle of the stream */
+    ((char *)compressed.base)[compressed.len / 2] += 1;
+
+    munit_assert_int(Decompress(compressed, &decompressed, errmsg), !=, 0);
+    munit_assert_ptr_null(decompressed.base);
+    munit_assert_int(DecompressStream(compressed.len, readFromBuf, &compressed,
+                                      &decompressed, errmsg),
+                     !=, 0);
+    munit_assert_ptr_null(decompressed.base);
+
+    raft_free(compressed.base);
+    free(buf.base);
+    return MUNIT_OK;
+}
+
 TEST(Compress, compressDecompressCorruption, NULL, NULL, 0, NULL)
 {
     char errmsg[RAFT_ERRMSG_BUF_SIZE] = {0};
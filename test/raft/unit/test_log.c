@@ -818,6 +818,94 @@ TEST(logAcquire, oom, setUp, tearDown, 0, NULL)
     return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * logEvict
+ *
+ *****************************************************************************/
+
+/* Read back entries with the payloads set by APPEND_BATCH, as if they were
+ * loaded from disk. */
+static int readEntries(struct raft_io *io,
+                       raft_index index,
+                       unsigned n,
+                       struct raft_entry entries[])
+{
+    uint8_t *batch;
+    unsigned i;
+    (void)io;
+    batch = raft_malloc(8 * n);
+    if (batch == NULL) {
+        return RAFT_NOMEM;
+    }
+    for (i = 0; i < n; i++) {
+        entries[i].term = 1;
+        entries[i].type = RAFT_COMMAND;
+        entries[i].buf.base = batch + 8 * i;
+        entries[i].buf.len = 8;
+        entries[i].batch = batch;
+        *(uint64_t *)entries[i].buf.base = (index + i - 1) * 1000;
+    }
+    return 0;
+}
+
+static struct raft_io io = {.version = 4, .read_entries = readEntries};
+
+SUITE(logEvict)
+
+/* The payloads of the entries of a batch are released together, and read back
+ * when acquired, one budget's worth at a time. */
+TEST(logEvict, batch, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    unsigned n;
+    logSetCache(f->log, 16, &io);
+    APPEND_BATCH(3);
+    logEvict(f->log, 3);
+    munit_assert_ptr_null(GET(1)->buf.base);
+    munit_assert_ptr_null(GET(3)->batch);
+    munit_assert_int(GET(3)->buf.len, ==, 8);
+
+    ACQUIRE(2 /* index */);
+    munit_assert_int(n, ==, 2);
+    munit_assert_int(*(uint64_t *)entries[0].buf.base, ==, 1000);
+    munit_assert_int(*(uint64_t *)entries[1].buf.base, ==, 2000);
+    ASSERT_REFCOUNT(2 /* index */, 2 /* count */);
+    RELEASE(2 /* index */);
+    ASSERT_REFCOUNT(2 /* index */, 1 /* count */);
+
+    return MUNIT_OK;
+}
+
+/* Entries are released only until the resident payloads fit in the budget, and
+ * never while they are acquired. */
+TEST(logEvict, acquired, setUp, tearDown, 0, NULL)
+{
+    struct fixture *f = data;
+    struct raft_entry *entries;
+    unsigned n;
+    logSetCache(f->log, 8, &io);
+    APPEND_MANY(1 /* term */, 3 /* n */);
+    ACQUIRE(1 /* index */);
+    logEvict(f->log, 3);
+    munit_assert_ptr_not_null(GET(1)->buf.base);
+    RELEASE(1 /* index */);
+
+    logEvict(f->log, 3);
+    munit_assert_ptr_null(GET(1)->buf.base);
+    munit_assert_ptr_null(GET(2)->buf.base);
+    munit_assert_ptr_not_null(GET(3)->buf.base);
+
+    /* Entries read back are released with the log entries gone. */
+    ACQUIRE(1 /* index */);
+    munit_assert_int(n, ==, 1);
+    SNAPSHOT(3 /* last index */, 0 /* trailing */);
+    RELEASE(1 /* index */);
+
+    return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * logTruncate
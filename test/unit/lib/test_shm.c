@@ -0,0 +1,203 @@
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../../../src/lib/shm.h"
+
+#include "../../lib/runner.h"
+
+TEST_MODULE(lib_shm);
+
+/******************************************************************************
+ *
+ * Fixture
+ *
+ ******************************************************************************/
+
+/* A server and a client attached to the same channel, as if they were running
+ * in different processes. */
+struct fixture
+{
+	struct shm server;
+	struct shm client;
+};
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+	struct fixture *f = munit_malloc(sizeof *f);
+	int fds[SHM__N_FDS];
+	int sockets[2];
+	uint64_t data = 42;
+	int rv;
+	(void)params;
+	(void)user_data;
+
+	rv = socketpair(AF_UNIX, SOCK_STREAM, 0, sockets);
+	munit_assert_int(rv, ==, 0);
+	rv = shm__create(&f->server);
+	munit_assert_int(rv, ==, 0);
+	rv = shm__send(&f->server, sockets[0], &data, sizeof data);
+	munit_assert_int(rv, ==, 0);
+	data = 0;
+	rv = shm__recv(sockets[1], &data, sizeof data, fds);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(data, ==, 42);
+	rv = shm__attach(&f->client, fds);
+	munit_assert_int(rv, ==, 0);
+	close(sockets[0]);
+	close(sockets[1]);
+	return f;
+}
+
+static void tear_down(void *data)
+{
+	struct fixture *f = data;
+	shm__close(&f->client);
+	shm__close(&f->server);
+	free(f);
+}
+
+/******************************************************************************
+ *
+ * Helper macros.
+ *
+ ******************************************************************************/
+
+/* Fill the given buffer with progressive numbers starting from SEED. */
+#define FILL(BUF, N, SEED)                          \
+	{                                           \
+		size_t i_;                          \
+		for (i_ = 0; i_ < N; i_++) {        \
+			BUF[i_] = (uint8_t)(i_ + SEED); \
+		}                                   \
+	}
+
+/* Assert that the given buffer was filled by FILL with the given SEED. */
+#define ASSERT_FILLED(BUF, N, SEED)                                   \
+	{                                                             \
+		size_t i_;                                            \
+		for (i_ = 0; i_ < N; i_++) {                          \
+			munit_assert_int(BUF[i_], ==, (uint8_t)(i_ + SEED)); \
+		}                                                     \
+	}
+
+/* Assert whether the wake up eventfd of the given side has been signalled. */
+#define ASSERT_WOKEN(SHM, WOKEN)                                          \
+	{                                                                 \
+		uint64_t count_;                                          \
+		ssize_t n_ = read((SHM)->wake_fd, &count_, sizeof count_); \
+		munit_assert_int(n_ == sizeof count_, ==, WOKEN);         \
+	}
+
+/******************************************************************************
+ *
+ * shm__read and shm__write
+ *
+ ******************************************************************************/
+
+TEST_SUITE(ring);
+TEST_SETUP(ring, setup);
+TEST_TEAR_DOWN(ring, tear_down);
+
+/* Data written by one side can be read by the other, in both directions. */
+TEST_CASE(ring, both_directions, NULL)
+{
+	struct fixture *f = data;
+	uint8_t buf[16];
+	(void)params;
+
+	FILL(buf, 16, 1);
+	munit_assert_size(shm__write(&f->client, buf, 16), ==, 16);
+	munit_assert_size(shm__read(&f->client, buf, 16), ==, 0);
+	memset(buf, 0, sizeof buf);
+	munit_assert_size(shm__read(&f->server, buf, 16), ==, 16);
+	ASSERT_FILLED(buf, 16, 1);
+
+	FILL(buf, 16, 7);
+	munit_assert_size(shm__write(&f->server, buf, 16), ==, 16);
+	memset(buf, 0, sizeof buf);
+	munit_assert_size(shm__read(&f->client, buf, 10), ==, 10);
+	munit_assert_size(shm__read(&f->client, buf + 10, 16), ==, 6);
+	ASSERT_FILLED(buf, 16, 7);
+
+	return MUNIT_OK;
+}
+
+/* Writes stop when the ring is full, and data wrapping around the end of the
+ * ring is read back in order. */
+TEST_CASE(ring, wrap_around, NULL)
+{
+	struct fixture *f = data;
+	size_t len = SHM__RING_SIZE + SHM__RING_SIZE / 2;
+	uint8_t *in = munit_malloc(len);
+	uint8_t *out = munit_malloc(len);
+	size_t n;
+	(void)params;
+
+	FILL(in, len, 3);
+	n = shm__write(&f->client, in, len);
+	munit_assert_size(n, ==, SHM__RING_SIZE);
+	munit_assert_size(shm__read(&f->server, out, SHM__RING_SIZE - 100), ==,
+			  SHM__RING_SIZE - 100);
+	n += shm__write(&f->client, in + n, len - n);
+	munit_assert_size(n, ==, len);
+	n = SHM__RING_SIZE - 100;
+	n += shm__read(&f->server, out + n, len - n);
+	munit_assert_size(n, ==, len);
+	ASSERT_FILLED(out, len, 3);
+
+	free(in);
+	free(out);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * shm__wait_read and shm__wait_write
+ *
+ ******************************************************************************/
+
+TEST_SUITE(wait);
+TEST_SETUP(wait, setup);
+TEST_TEAR_DOWN(wait, tear_down);
+
+/* A reader waiting on an empty ring is woken up by the next write, and only
+ * by that one. */
+TEST_CASE(wait, read, NULL)
+{
+	struct fixture *f = data;
+	uint8_t buf[8] = {0};
+	(void)params;
+
+	munit_assert_true(shm__wait_read(&f->server));
+	ASSERT_WOKEN(&f->server, false);
+	shm__write(&f->client, buf, sizeof buf);
+	ASSERT_WOKEN(&f->server, true);
+	shm__write(&f->client, buf, sizeof buf);
+	ASSERT_WOKEN(&f->server, false);
+
+	/* No need to wait when there's data already. */
+	munit_assert_false(shm__wait_read(&f->server));
+	shm__read(&f->server, buf, sizeof buf);
+	ASSERT_WOKEN(&f->client, false);
+
+	return MUNIT_OK;
+}
+
+/* A writer waiting on a full ring is woken up once the reader frees space. */
+TEST_CASE(wait, write, NULL)
+{
+	struct fixture *f = data;
+	uint8_t *buf = munit_malloc(SHM__RING_SIZE);
+	(void)params;
+
+	munit_assert_false(shm__wait_write(&f->server));
+	munit_assert_size(shm__write(&f->server, buf, SHM__RING_SIZE), ==,
+			  SHM__RING_SIZE);
+	munit_assert_true(shm__wait_write(&f->server));
+	ASSERT_WOKEN(&f->server, false);
+	shm__read(&f->client, buf, 1);
+	ASSERT_WOKEN(&f->server, true);
+
+	free(buf);
+	return MUNIT_OK;
+}
@@ -49,3 +49,129 @@ TEST_CASE(open, decode, NULL)
 	raft_free(buf.base);
 	return MUNIT_OK;
 }
+
+/******************************************************************************
+ *
+ * Page deltas.
+ *
+ ******************************************************************************/
+
+TEST_SUITE(delta);
+
+/* A page with a few modified bytes is encoded as patches against its base. */
+TEST_CASE(delta, patches, NULL)
+{
+	uint8_t base[512];
+	uint8_t page[512];
+	uint8_t record[COMMAND__DELTA_MAX(512)];
+	uint8_t rebuilt[512];
+	size_t n;
+	(void)data;
+	(void)params;
+	memset(base, 1, sizeof base);
+	memcpy(page, base, sizeof page);
+	page[3] = 2;
+	page[17] = 3;
+	page[511] = 4;
+
+	n = command__delta_encode(base, page, sizeof page, record);
+	munit_assert_ulong(n, <, 64);
+	munit_assert_ulong(n % 8, ==, 0);
+
+	n = command__delta_apply(record, sizeof record, base, sizeof page,
+				 rebuilt);
+	munit_assert_ulong(n, >, 0);
+	munit_assert_memory_equal(sizeof page, rebuilt, page);
+	return MUNIT_OK;
+}
+
+/* A page without base, or too different from it, is encoded in full. */
+TEST_CASE(delta, full, NULL)
+{
+	uint8_t base[512];
+	uint8_t page[512];
+	uint8_t record[COMMAND__DELTA_MAX(512)];
+	uint8_t rebuilt[512];
+	size_t n;
+	(void)data;
+	(void)params;
+	memset(base, 1, sizeof base);
+	memset(page, 2, sizeof page);
+
+	n = command__delta_encode(NULL, page, sizeof page, record);
+	munit_assert_ulong(n, ==, COMMAND__DELTA_MAX(512));
+	n = command__delta_apply(record, n, NULL, sizeof page, rebuilt);
+	munit_assert_ulong(n, ==, COMMAND__DELTA_MAX(512));
+	munit_assert_memory_equal(sizeof page, rebuilt, page);
+
+	n = command__delta_encode(base, page, sizeof page, record);
+	munit_assert_ulong(n, ==, COMMAND__DELTA_MAX(512));
+	return MUNIT_OK;
+}
+
+/* A truncated record is rejected. */
+TEST_CASE(delta, malformed, NULL)
+{
+	uint8_t base[512];
+	uint8_t page[512];
+	uint8_t record[COMMAND__DELTA_MAX(512)];
+	size_t n;
+	(void)data;
+	(void)params;
+	memset(base, 1, sizeof base);
+	memcpy(page, base, sizeof page);
+	page[100] = 2;
+
+	n = command__delta_encode(base, page, sizeof page, record);
+	munit_assert_ulong(command__delta_apply(record, n - 8, base,
+						sizeof page, page),
+			   ==, 0);
+	munit_assert_ulong(command__delta_apply(record, n, NULL,
+						sizeof page, page),
+			   ==, 0);
+	return MUNIT_OK;
+}
+
+TEST_CASE(delta, decode, NULL)
+{
+	uint8_t page[512];
+	uint8_t records[COMMAND__DELTA_MAX(512)];
+	uint64_t page_numbers[1] = {2};
+	struct command_frames_delta c1;
+	struct command_frames_delta *c2;
+	void *c;
+	int type;
+	struct raft_buffer buf;
+	int rc;
+	(void)data;
+	(void)params;
+	memset(page, 7, sizeof page);
+	c1 = (struct command_frames_delta){
+		.filename = "test.db",
+		.is_commit = 1,
+		.frames = {
+			.n_pages = 1,
+			.page_size = sizeof page,
+			.page_numbers = page_numbers,
+		},
+	};
+	c1.frames.len = command__delta_encode(NULL, page, sizeof page, records);
+	c1.frames.records = records;
+
+	rc = command__encode(COMMAND_FRAMES_DELTA, &c1, &buf);
+	munit_assert_int(rc, ==, 0);
+	rc = command__decode(&buf, &type, &c);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_int(type, ==, COMMAND_FRAMES_DELTA);
+	c2 = c;
+	munit_assert_string_equal(c2->filename, "test.db");
+	munit_assert_int(c2->frames.n_pages, ==, 1);
+	munit_assert_int(c2->frames.page_numbers[0], ==, 2);
+	munit_assert_int(c2->frames.len, ==, c1.frames.len);
+	munit_assert_memory_equal(c1.frames.len, c2->frames.records, records);
+
+	sqlite3_free(c2->frames.page_numbers);
+	raft_free(c2);
+	raft_free(buf.base);
+	return MUNIT_OK;
+}
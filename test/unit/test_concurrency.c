@@ -513,6 +513,74 @@ TEST_CASE(exec, serialization_error, NULL)
 	return MUNIT_OK;
 }
 
+/* A write over the limit of admission control waits for the running one to be
+ * replicated instead of failing with SQLITE_BUSY. */
+TEST_CASE(exec, sched_limit, NULL)
+{
+	struct exec_fixture *f = data;
+	struct registry *registry = CLUSTER_REGISTRY(0);
+	struct dqlite_sched_stats stats;
+	(void)params;
+
+	f->servers[0].config.sched_limits[DQLITE_SCHED_WRITE] = 1;
+
+	PREPARE(f->c1, "CREATE TABLE test (n INT)", &f->stmt_id1);
+	EXEC(f->c1, f->stmt_id1);
+	WAIT(f->c1);
+	ASSERT_CALLBACK(f->c1, 0, RESULT);
+	PREPARE(f->c1, "INSERT INTO test(n) VALUES(1)", &f->stmt_id1);
+	PREPARE(f->c2, "INSERT INTO test(n) VALUES(1)", &f->stmt_id2);
+
+	EXEC(f->c1, f->stmt_id1);
+	EXEC(f->c2, f->stmt_id2);
+	sched_stats(&registry->sched, DQLITE_SCHED_WRITE, &stats);
+	munit_assert_uint(stats.running, ==, 1);
+	munit_assert_uint(stats.waiting, ==, 1);
+
+	WAIT(f->c1);
+	ASSERT_CALLBACK(f->c1, 0, RESULT);
+	WAIT(f->c2);
+	ASSERT_CALLBACK(f->c2, 0, RESULT);
+
+	sched_stats(&registry->sched, DQLITE_SCHED_WRITE, &stats);
+	munit_assert_uint64(stats.admitted, ==, 3);
+	munit_assert_uint(stats.running, ==, 0);
+	munit_assert_uint(stats.waiting, ==, 0);
+	return MUNIT_OK;
+}
+
+/* A write waiting for admission gives up its place when its connection is
+ * closed. */
+TEST_CASE(exec, sched_limit_closed, NULL)
+{
+	struct exec_fixture *f = data;
+	struct registry *registry = CLUSTER_REGISTRY(0);
+	struct dqlite_sched_stats stats;
+	(void)params;
+
+	f->servers[0].config.sched_limits[DQLITE_SCHED_WRITE] = 1;
+
+	PREPARE(f->c1, "CREATE TABLE test1 (n INT)", &f->stmt_id1);
+	PREPARE(f->c2, "CREATE TABLE test2 (n INT)", &f->stmt_id2);
+	EXEC(f->c1, f->stmt_id1);
+	EXEC(f->c2, f->stmt_id2);
+
+	gateway__close(&f->c2->gateway, fixture_close_cb);
+	sched_stats(&registry->sched, DQLITE_SCHED_WRITE, &stats);
+	munit_assert_uint(stats.waiting, ==, 0);
+
+	WAIT(f->c1);
+	ASSERT_CALLBACK(f->c1, 0, RESULT);
+	sched_stats(&registry->sched, DQLITE_SCHED_WRITE, &stats);
+	munit_assert_uint64(stats.admitted, ==, 1);
+	munit_assert_uint(stats.running, ==, 0);
+
+	/* The gateway of the second connection is closed again by TEAR_DOWN. */
+	gateway__init(&f->c2->gateway, CLUSTER_CONFIG(0), CLUSTER_REGISTRY(0),
+		      CLUSTER_RAFT(0));
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * Concurrent query requests
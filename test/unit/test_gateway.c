@@ -277,6 +277,21 @@ static void barrierCb(struct raft_barrier *req, int status) {
 		munit_assert_true(f->context->invoked); \
 	}
 
+/* Wait for the I'th node to apply the entry at the given index. */
+#define WAIT_APPLIED(I, INDEX)                                       \
+	{                                                            \
+		unsigned _i;                                         \
+		for (_i = 0; _i < 60; _i++) {                        \
+			if (raft_last_applied(CLUSTER_RAFT(I)) >=    \
+			    (INDEX)) {                               \
+				break;                               \
+			}                                            \
+			CLUSTER_STEP;                                \
+		}                                                    \
+		munit_assert_ullong(raft_last_applied(CLUSTER_RAFT(I)), \
+				    >=, (INDEX));                    \
+	}
+
 /* Prepare and exec a statement. */
 #define EXEC(SQL)                               \
 	{                                       \
@@ -739,6 +754,69 @@ TEST_CASE(exec, simple, NULL)
 	return MUNIT_OK;
 }
 
+struct spans {
+	unsigned n;
+	char events[4096];
+};
+
+static void spanCb(void *arg, const char *events, size_t len)
+{
+	struct spans *spans = arg;
+	munit_assert_size(len, ==, strlen(events));
+	munit_assert_size(len, <, sizeof spans->events);
+	memcpy(spans->events, events, len + 1);
+	spans->n++;
+}
+
+/* Only the sampled write transactions have their timeline traced. */
+TEST_CASE(exec, span, NULL)
+{
+	struct exec_fixture *f = data;
+	struct config *config = f->gateway->config;
+	struct spans spans = {0};
+	uint64_t stmt_id;
+	unsigned i;
+	(void)params;
+	config->span_rate = 2;
+	config->span_cb = spanCb;
+	config->span_arg = &spans;
+	raft_set_request_timings(CLUSTER_RAFT(0), true);
+
+	EXEC("CREATE TABLE test (n INT)");
+	munit_assert_uint(spans.n, ==, 0);
+	EXEC("INSERT INTO test(n) VALUES(1)");
+	munit_assert_uint(spans.n, ==, 1);
+
+	munit_assert_char(spans.events[0], ==, '[');
+	munit_assert_char(spans.events[strlen(spans.events) - 1], ==, ']');
+	const char *phases[] = {"request", "step",   "poll",  "encode",
+				"propose", "disk",   "quorum", "apply",
+				"reply"};
+	for (i = 0; i < sizeof phases / sizeof phases[0]; i++) {
+		char name[32];
+		snprintf(name, sizeof name, "\"name\":\"%s\"", phases[i]);
+		munit_assert_ptr_not_null(strstr(spans.events, name));
+	}
+	munit_assert_ptr_not_null(strstr(spans.events, "\"ph\":\"X\""));
+
+	/* Read-only statements are not traced. */
+	PREPARE("SELECT n FROM test");
+	for (i = 0; i < 2; i++) {
+		struct request_query query = {
+			.db_id = 0,
+			.stmt_id = stmt_id,
+		};
+		ENCODE(&query, query);
+		HANDLE(QUERY);
+		WAIT;
+		ASSERT_CALLBACK(0, ROWS);
+	}
+	munit_assert_uint(spans.n, ==, 1);
+
+	config->span_rate = 0;
+	return MUNIT_OK;
+}
+
 /* Successfully execute a statement with a one parameter. */
 TEST_CASE(exec, one_param, NULL)
 {
@@ -2126,6 +2204,149 @@ TEST_CASE(query, close_while_in_flight, NULL)
 	return MUNIT_OK;
 }
 
+/* A query that uses up its time slice yields the rows produced so far, and
+ * resumes where it left off. */
+TEST_CASE(query, slice, NULL)
+{
+	struct query_fixture *f = data;
+	unsigned i;
+	uint64_t stmt_id;
+	uint64_t n;
+	const char *column;
+	struct value value;
+	bool finished;
+	(void)params;
+
+	f->gateway->config->query_slice_steps = 1;
+	PREPARE("WITH RECURSIVE seq(n) AS ("
+            "	SELECT 1               "
+            "	UNION ALL              "
+            "	SELECT n+1             "
+            "	FROM seq WHERE n < 3   "
+            ")                         "
+            "SELECT * FROM seq         ");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	WAIT;
+
+	/* Each batch contains a single row. */
+	for (i = 1; i <= 3; i++) {
+		ASSERT_CALLBACK(0, ROWS);
+		uint64__decode(f->cursor, &n);
+		munit_assert_int(n, ==, 1);
+		text__decode(f->cursor, &column);
+		munit_assert_string_equal(column, "n");
+		DECODE_ROW(1, &value);
+		munit_assert_int(value.integer, ==, i);
+		DECODE(&f->response, rows);
+		munit_assert_ullong(f->response.eof, ==,
+				    DQLITE_RESPONSE_ROWS_PART);
+		gateway__resume(f->gateway, &finished);
+		munit_assert_false(finished);
+		WAIT;
+	}
+
+	ASSERT_CALLBACK(0, ROWS);
+	uint64__decode(f->cursor, &n);
+	text__decode(f->cursor, &column);
+	DECODE(&f->response, rows);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+	gateway__resume(f->gateway, &finished);
+	munit_assert_true(finished);
+
+	return MUNIT_OK;
+}
+
+/* Time slices end only between rows, so an aggregate does all its work in the
+ * slice that produces its single row, whatever the budget. */
+TEST_CASE(query, sliceAggregate, NULL)
+{
+	struct query_fixture *f = data;
+	uint64_t stmt_id;
+	uint64_t n;
+	const char *column;
+	struct value value;
+	bool finished;
+	(void)params;
+
+	f->gateway->config->query_slice_steps = 1;
+	PREPARE("WITH RECURSIVE seq(n) AS ("
+            "	SELECT 1               "
+            "	UNION ALL              "
+            "	SELECT n+1             "
+            "	FROM seq WHERE n < 1000"
+            ")                         "
+            "SELECT COUNT(*) FROM seq  ");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	WAIT;
+
+	ASSERT_CALLBACK(0, ROWS);
+	uint64__decode(f->cursor, &n);
+	munit_assert_int(n, ==, 1);
+	text__decode(f->cursor, &column);
+	DECODE_ROW(1, &value);
+	munit_assert_int(value.integer, ==, 1000);
+	DECODE(&f->response, rows);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_PART);
+	gateway__resume(f->gateway, &finished);
+	munit_assert_false(finished);
+	WAIT;
+
+	ASSERT_CALLBACK(0, ROWS);
+	uint64__decode(f->cursor, &n);
+	text__decode(f->cursor, &column);
+	DECODE(&f->response, rows);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+	gateway__resume(f->gateway, &finished);
+	munit_assert_true(finished);
+
+	return MUNIT_OK;
+}
+
+/* A query running past the timeout set by the client is interrupted. */
+TEST_CASE(query, timeout, NULL)
+{
+	struct query_fixture *f = data;
+	struct request_timeout timeout;
+	uint64_t stmt_id;
+	(void)params;
+
+	timeout.db_id = 0;
+	timeout.msecs = 1;
+	ENCODE(&timeout, timeout);
+	HANDLE(TIMEOUT);
+	ASSERT_CALLBACK(0, EMPTY);
+
+	PREPARE("WITH RECURSIVE seq(n) AS ("
+            "	SELECT 1               "
+            "	UNION ALL              "
+            "	SELECT n+1             "
+            "	FROM seq               "
+            ")                         "
+            "SELECT count(*) FROM seq  ");
+	f->request.db_id = 0;
+	f->request.stmt_id = stmt_id;
+	ENCODE(&f->request, query);
+	HANDLE(QUERY);
+	WAIT;
+	ASSERT_CALLBACK(SQLITE_INTERRUPT, FAILURE);
+	ASSERT_FAILURE(SQLITE_INTERRUPT, "interrupted");
+
+	/* Lifting the timeout lets statements run to completion again. */
+	timeout.msecs = 0;
+	ENCODE(&timeout, timeout);
+	HANDLE(TIMEOUT);
+	ASSERT_CALLBACK(0, EMPTY);
+	EXEC("INSERT INTO test(n) VALUES(1)");
+
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * finalize
@@ -3299,6 +3520,398 @@ TEST_CASE(dump, checkpointed, NULL)
 	return MUNIT_OK;
 }
 
+/******************************************************************************
+ *
+ * backup
+ *
+ ******************************************************************************/
+
+struct request_backup_fixture {
+	FIXTURE;
+	struct request_backup request;
+	struct response_pages response;
+};
+
+/* Decode the next page record of a pages response. */
+#define DECODE_PAGE(PGNO)                                            \
+	do {                                                         \
+		int _rv = uint64__decode(f->cursor, PGNO);           \
+		munit_assert_int(_rv, ==, DQLITE_OK);                \
+		munit_assert_ullong(f->cursor->cap, >=,              \
+				    f->response.page_size);          \
+		f->cursor->p += f->response.page_size;               \
+		f->cursor->cap -= f->response.page_size;             \
+	} while (0)
+
+TEST_SUITE(backup);
+TEST_SETUP(backup)
+{
+	struct request_backup_fixture *f = munit_malloc(sizeof *f);
+	SETUP;
+	CLUSTER_ELECT(0);
+	return f;
+}
+TEST_TEAR_DOWN(backup)
+{
+	struct request_backup_fixture *f = data;
+	TEAR_DOWN;
+	free(f);
+}
+
+/* A database that does not exist yet has no pages. */
+TEST_CASE(backup, empty, NULL)
+{
+	(void)params;
+	struct request_backup_fixture *f = data;
+	f->request = (struct request_backup){
+		.filename = "test",
+	};
+	ENCODE(&f->request, backup);
+	HANDLE(BACKUP);
+	WAIT;
+	ASSERT_CALLBACK(0, PAGES);
+	DECODE(&f->response, pages);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+	munit_assert_ullong(f->response.position, ==, 0);
+	munit_assert_ullong(f->response.database_size, ==, 0);
+	munit_assert_ullong(f->response.n, ==, 0);
+	munit_assert_int(f->cursor->cap, ==, 0);
+	return MUNIT_OK;
+}
+
+/* All pages of the database are sent in a single chunk. */
+TEST_CASE(backup, full, NULL)
+{
+	(void)params;
+	struct request_backup_fixture *f = data;
+	uint64_t pgno;
+	unsigned i;
+	OPEN;
+	EXEC("CREATE TABLE test (n INT)");
+	EXEC("INSERT INTO test(n) VALUES(1)");
+
+	f->request = (struct request_backup){
+		.filename = "test",
+	};
+	ENCODE(&f->request, backup);
+	HANDLE(BACKUP);
+	WAIT;
+	ASSERT_CALLBACK(0, PAGES);
+	DECODE(&f->response, pages);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+	munit_assert_ullong(f->response.incremental, ==, 0);
+	munit_assert_ullong(f->response.position, !=, 0);
+	munit_assert_ullong(f->response.page_size, ==,
+			    f->gateway->config->page_size);
+	munit_assert_ullong(f->response.database_size, >, 0);
+	munit_assert_ullong(f->response.n, ==, f->response.database_size);
+	for (i = 0; i < f->response.n; i++) {
+		DECODE_PAGE(&pgno);
+		munit_assert_ullong(pgno, ==, i + 1);
+	}
+	munit_assert_int(f->cursor->cap, ==, 0);
+	return MUNIT_OK;
+}
+
+/* Passing the position of a previous backup only sends the pages changed
+ * since then. */
+TEST_CASE(backup, incremental, NULL)
+{
+	(void)params;
+	struct request_backup_fixture *f = data;
+	uint64_t position;
+	uint64_t pgno;
+	unsigned i;
+	OPEN;
+	EXEC("CREATE TABLE test (n INT)");
+	EXEC("CREATE TABLE other (n INT)");
+
+	f->request = (struct request_backup){
+		.filename = "test",
+	};
+	ENCODE(&f->request, backup);
+	HANDLE(BACKUP);
+	WAIT;
+	ASSERT_CALLBACK(0, PAGES);
+	DECODE(&f->response, pages);
+	munit_assert_ullong(f->response.database_size, ==, 3);
+	position = f->response.position;
+
+	EXEC("INSERT INTO test(n) VALUES(1)");
+
+	f->request = (struct request_backup){
+		.filename = "test",
+		.position = position,
+	};
+	ENCODE(&f->request, backup);
+	HANDLE(BACKUP);
+	WAIT;
+	ASSERT_CALLBACK(0, PAGES);
+	DECODE(&f->response, pages);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+	munit_assert_ullong(f->response.incremental, ==, 1);
+	munit_assert_ullong(f->response.position, >, position);
+	munit_assert_ullong(f->response.database_size, ==, 3);
+	munit_assert_ullong(f->response.n, ==, 1);
+	DECODE_PAGE(&pgno);
+	munit_assert_ullong(pgno, ==, 2);
+	munit_assert_int(f->cursor->cap, ==, 0);
+
+	/* A position from an unknown WAL generation yields a full backup. */
+	f->request = (struct request_backup){
+		.filename = "test",
+		.position = position ^ ((uint64_t)1 << 32),
+	};
+	ENCODE(&f->request, backup);
+	HANDLE(BACKUP);
+	WAIT;
+	ASSERT_CALLBACK(0, PAGES);
+	DECODE(&f->response, pages);
+	munit_assert_ullong(f->response.incremental, ==, 0);
+	munit_assert_ullong(f->response.n, ==, 3);
+	for (i = 0; i < f->response.n; i++) {
+		DECODE_PAGE(&pgno);
+	}
+	munit_assert_int(f->cursor->cap, ==, 0);
+	return MUNIT_OK;
+}
+
+/* Databases bigger than a chunk are streamed over several responses, each
+ * sent after the previous one was written. */
+TEST_CASE(backup, chunks, NULL)
+{
+	(void)params;
+	struct request_backup_fixture *f = data;
+	struct config *config = f->gateway->config;
+	struct value blobsize = {
+		.type = SQLITE_INTEGER,
+		.integer = 1024 * 1024,
+	};
+	uint64_t pgno;
+	uint64_t expected = 1;
+	uint64_t stmt_id;
+	unsigned n_chunks = 0;
+	unsigned i;
+	bool finished;
+	OPEN;
+	EXEC("CREATE TABLE test (data BLOB)");
+	PREPARE("INSERT INTO test VALUES (ZEROBLOB(?))");
+	struct request_exec exec = {
+		.db_id = 0,
+		.stmt_id = stmt_id,
+	};
+	struct response_result result;
+	for (i = 0; i < 2; i++) {
+		ENCODE(&exec, exec);
+		ENCODE_PARAMS(1, &blobsize, TUPLE__PARAMS);
+		HANDLE(EXEC);
+		WAIT;
+		ASSERT_CALLBACK(0, RESULT);
+		DECODE(&result, result);
+	}
+
+	f->request = (struct request_backup){
+		.filename = "test",
+	};
+	ENCODE(&f->request, backup);
+	HANDLE(BACKUP);
+	for (;;) {
+		WAIT;
+		ASSERT_CALLBACK(0, PAGES);
+		DECODE(&f->response, pages);
+		n_chunks++;
+		munit_assert_ullong(f->response.n, >, 0);
+		munit_assert_ullong(f->response.n * config->page_size, <=,
+				    1024 * 1024);
+		for (i = 0; i < f->response.n; i++) {
+			DECODE_PAGE(&pgno);
+			munit_assert_ullong(pgno, ==, expected);
+			expected++;
+		}
+		munit_assert_int(f->cursor->cap, ==, 0);
+		if (f->response.eof == DQLITE_RESPONSE_ROWS_DONE) {
+			break;
+		}
+		f->context->invoked = false;
+		gateway__resume(f->gateway, &finished);
+		munit_assert_false(finished);
+	}
+	munit_assert_ullong(expected - 1, ==, f->response.database_size);
+	munit_assert_uint(n_chunks, >, 1);
+
+	gateway__resume(f->gateway, &finished);
+	munit_assert_true(finished);
+	return MUNIT_OK;
+}
+
+/******************************************************************************
+ *
+ * subscribe
+ *
+ ******************************************************************************/
+
+struct subscribe_fixture {
+	FIXTURE;
+	struct request_subscribe request;
+	struct response_changes response;
+};
+
+TEST_SUITE(subscribe);
+TEST_SETUP(subscribe)
+{
+	struct subscribe_fixture *f = munit_malloc(sizeof *f);
+	SETUP;
+	for (i = 0; i < N_SERVERS; i++) {
+		f->connections[i].gateway.config->feed_size = 1024 * 1024;
+	}
+	CLUSTER_ELECT(0);
+	OPEN;
+	EXEC("CREATE TABLE test (n INT)");
+	WAIT_APPLIED(1, CLUSTER_LAST_INDEX(0));
+	WAIT_APPLIED(2, CLUSTER_LAST_INDEX(0));
+	return f;
+}
+TEST_TEAR_DOWN(subscribe)
+{
+	struct subscribe_fixture *f = data;
+	TEAR_DOWN;
+	free(f);
+}
+
+/* Subscribe with the selected gateway from the given index, and decode the
+ * first response. */
+#define SUBSCRIBE(INDEX)                                       \
+	{                                                      \
+		f->request = (struct request_subscribe){       \
+			.filename = "test",                    \
+			.index = INDEX,                        \
+		};                                             \
+		ENCODE(&f->request, subscribe);                \
+		HANDLE(SUBSCRIBE);                             \
+		ASSERT_CALLBACK(0, CHANGES);                   \
+		DECODE(&f->response, changes);                 \
+	}
+
+/* Decode the next change of a changes response, skipping its pages. */
+#define DECODE_CHANGE(CHANGE)                                            \
+	{                                                                \
+		size_t _n;                                               \
+		DECODE(CHANGE, change);                                  \
+		munit_assert_ullong((CHANGE)->page_size, ==,             \
+				    f->gateway->config->page_size);      \
+		_n = (CHANGE)->n * (8 + (CHANGE)->page_size);            \
+		munit_assert_ullong(f->cursor->cap, >=, _n);             \
+		f->cursor->p += _n;                                      \
+		f->cursor->cap -= _n;                                    \
+	}
+
+/* Subscriptions are refused if no changes are kept. */
+TEST_CASE(subscribe, disabled, NULL)
+{
+	(void)params;
+	struct subscribe_fixture *f = data;
+	SELECT(1);
+	f->gateway->config->feed_size = 0;
+	f->request = (struct request_subscribe){
+		.filename = "test",
+	};
+	ENCODE(&f->request, subscribe);
+	HANDLE(SUBSCRIBE);
+	ASSERT_CALLBACK(SQLITE_MISUSE, FAILURE);
+	ASSERT_FAILURE(SQLITE_MISUSE, "change feed not enabled");
+	return MUNIT_OK;
+}
+
+/* A follower streams the transactions it applies as they are committed, and
+ * a later subscription resumes from the index of the last one received. */
+TEST_CASE(subscribe, stream, NULL)
+{
+	(void)params;
+	struct subscribe_fixture *f = data;
+	struct response_change change;
+	uint64_t start;
+	bool finished;
+
+	SELECT(1);
+	SUBSCRIBE(0);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_PART);
+	munit_assert_ullong(f->response.n, ==, 0);
+	munit_assert_ullong(f->response.index, ==,
+			    raft_last_applied(CLUSTER_RAFT(1)));
+	start = f->response.index;
+	gateway__resume(f->gateway, &finished);
+	munit_assert_false(finished);
+
+	SELECT(0);
+	EXEC("INSERT INTO test(n) VALUES(1)");
+
+	SELECT(1);
+	WAIT;
+	ASSERT_CALLBACK(0, CHANGES);
+	DECODE(&f->response, changes);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_PART);
+	munit_assert_ullong(f->response.n, ==, 1);
+	DECODE_CHANGE(&change);
+	munit_assert_ullong(change.index, >, start);
+	munit_assert_ullong(change.n, >, 0);
+	munit_assert_ullong(f->response.index, >=, change.index);
+	munit_assert_int(f->cursor->cap, ==, 0);
+
+	/* Another node sends the same change to a subscriber resuming from
+	 * before it. */
+	SELECT(2);
+	WAIT_APPLIED(2, change.index);
+	SUBSCRIBE(start);
+	munit_assert_ullong(f->response.n, ==, 1);
+	DECODE_CHANGE(&change);
+	munit_assert_ullong(change.index, >, start);
+	munit_assert_int(f->cursor->cap, ==, 0);
+	return MUNIT_OK;
+}
+
+/* A subscriber that falls behind the changes kept by the node is told to start
+ * over. */
+TEST_CASE(subscribe, behind, NULL)
+{
+	(void)params;
+	struct subscribe_fixture *f = data;
+	struct response_change change;
+	bool finished;
+
+	SELECT(1);
+	f->gateway->config->feed_size = 1;
+	SUBSCRIBE(0);
+	gateway__resume(f->gateway, &finished);
+
+	/* The first change is sent right away, but the subscriber doesn't
+	 * finish reading it before the next two are committed, and only the
+	 * newest one is kept. */
+	SELECT(0);
+	EXEC("INSERT INTO test(n) VALUES(1)");
+	SELECT(1);
+	WAIT;
+	ASSERT_CALLBACK(0, CHANGES);
+	DECODE(&f->response, changes);
+	munit_assert_ullong(f->response.n, ==, 1);
+	DECODE_CHANGE(&change);
+	SELECT(0);
+	EXEC("INSERT INTO test(n) VALUES(2)");
+	EXEC("INSERT INTO test(n) VALUES(3)");
+	WAIT_APPLIED(1, CLUSTER_LAST_INDEX(0));
+
+	SELECT(1);
+	gateway__resume(f->gateway, &finished);
+	munit_assert_false(finished);
+	ASSERT_CALLBACK(0, CHANGES);
+	DECODE(&f->response, changes);
+	munit_assert_ullong(f->response.eof, ==, DQLITE_RESPONSE_ROWS_DONE);
+	munit_assert_ullong(f->response.index, ==, change.index);
+	munit_assert_ullong(f->response.n, ==, 0);
+	gateway__resume(f->gateway, &finished);
+	munit_assert_true(finished);
+	return MUNIT_OK;
+}
+
 /******************************************************************************
  *
  * invalid
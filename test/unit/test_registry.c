@@ -83,3 +83,33 @@ TEST_CASE(db, get_existing, NULL)
 	munit_assert_ptr_equal(db1, db2);
 	return MUNIT_OK;
 }
+
+/* Registering many databases keeps lookups working once the index grows. */
+TEST_CASE(db, get_many, NULL)
+{
+	struct db_fixture *f = data;
+	struct db *db;
+	struct db *first;
+	char filename[32];
+	unsigned i;
+	(void)params;
+	int rc;
+	rc = registry__db_get(&f->registry, "test-0.db", &first);
+	munit_assert_int(rc, ==, 0);
+	for (i = 1; i < 10000; i++) {
+		sprintf(filename, "test-%u.db", i);
+		rc = registry__db_get(&f->registry, filename, &db);
+		munit_assert_int(rc, ==, 0);
+		munit_assert_string_equal(db->filename, filename);
+	}
+	for (i = 0; i < 10000; i += 997) {
+		sprintf(filename, "test-%u.db", i);
+		rc = registry__db_get(&f->registry, filename, &db);
+		munit_assert_int(rc, ==, 0);
+		munit_assert_string_equal(db->filename, filename);
+	}
+	rc = registry__db_get(&f->registry, "test-0.db", &db);
+	munit_assert_int(rc, ==, 0);
+	munit_assert_ptr_equal(db, first);
+	return MUNIT_OK;
+}
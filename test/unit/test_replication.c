@@ -485,6 +485,45 @@ TEST(replication, checkpoint, setUp, tearDown, 0, NULL)
 	return MUNIT_OK;
 }
 
+/* With frames delta enabled, followers rebuild the pages of a transaction from
+ * the changes against their committed content. */
+TEST(replication, framesDelta, setUp, tearDown, 0, NULL)
+{
+	struct fixture *f = data;
+	unsigned i;
+
+	for (i = 0; i < N_SERVERS; i++) {
+		struct config *config = CLUSTER_CONFIG(i);
+		config->frames_delta = true;
+	}
+
+	CLUSTER_ELECT(0);
+
+	PREPARE(0, "CREATE TABLE test (n  INT)");
+	fixture_exec(f, 0);
+	CLUSTER_APPLIED(CLUSTER_LAST_INDEX(0));
+	FINALIZE;
+
+	PREPARE(0, "INSERT INTO test(n) VALUES(1)");
+	fixture_exec(f, 0);
+	CLUSTER_APPLIED(CLUSTER_LAST_INDEX(0));
+	FINALIZE;
+
+	PREPARE(0, "UPDATE test SET n = 2");
+	fixture_exec(f, 0);
+	CLUSTER_APPLIED(CLUSTER_LAST_INDEX(0));
+	FINALIZE;
+
+	SETUP_LEADER(1);
+	PREPARE(1, "SELECT n FROM test");
+	munit_assert_int(sqlite3_step(f->stmt), ==, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(f->stmt, 0), ==, 2);
+	FINALIZE;
+	TEAR_DOWN_LEADER(1);
+
+	return MUNIT_OK;
+}
+
 TEST(replication, leaderToFollowerBusy, setUp, tearDown, 0, NULL)
 {
 	struct fixture *f = data;
@@ -0,0 +1,224 @@
+#include "../../src/sched.h"
+
+#include "../lib/runner.h"
+
+TEST_MODULE(sched);
+
+/******************************************************************************
+ *
+ * Fixture
+ *
+ ******************************************************************************/
+
+/* Two databases and three connections. */
+struct fixture
+{
+	struct config config;
+	struct sched sched;
+	struct sched_db dbs[2];
+	struct sched_conn conns[3];
+	struct sched_req reqs[8];
+};
+
+static void *setup(const MunitParameter params[], void *user_data)
+{
+	struct fixture *f = munit_malloc(sizeof *f);
+	unsigned i;
+	(void)params;
+	(void)user_data;
+
+	memset(&f->config, 0, sizeof f->config);
+	sched_init(&f->sched, &f->config);
+	for (i = 0; i < 2; i++) {
+		sched_db_init(&f->dbs[i]);
+	}
+	for (i = 0; i < 3; i++) {
+		sched_conn_init(&f->conns[i]);
+	}
+	return f;
+}
+
+static void tear_down(void *data)
+{
+	free(data);
+}
+
+/******************************************************************************
+ *
+ * Helper macros.
+ *
+ ******************************************************************************/
+
+#define MS 1000000 /* Nanoseconds in a millisecond */
+
+/* Submit the I'th request of the given class, against the DB'th database and
+ * from the CONN'th connection, at NOW milliseconds, and assert the result. */
+#define SUBMIT(I, CLASS, DB, CONN, NOW, RV)                            \
+	{                                                              \
+		unsigned retry_after_;                                 \
+		int rv_ = sched_submit(&f->sched, &f->reqs[I], CLASS,  \
+				       &f->dbs[DB], &f->conns[CONN],   \
+				       (uint64_t)(NOW)*MS, &retry_after_); \
+		munit_assert_int(rv_, ==, RV);                         \
+	}
+
+/* Complete the I'th request at NOW milliseconds and assert that the J'th one
+ * starts in its place, or none if J is -1. */
+#define DONE(I, NOW, J)                                                \
+	{                                                              \
+		struct sched_req *next_ = sched_done(                  \
+		    &f->sched, &f->reqs[I], (uint64_t)(NOW)*MS);       \
+		munit_assert_ptr_equal(next_,                          \
+				       (J) < 0 ? NULL : f->reqs + (J)); \
+	}
+
+/******************************************************************************
+ *
+ * sched_submit and sched_done
+ *
+ ******************************************************************************/
+
+TEST_SUITE(submit);
+TEST_SETUP(submit, setup);
+TEST_TEAR_DOWN(submit, tear_down);
+
+/* Without limits every request starts right away. */
+TEST_CASE(submit, unlimited, NULL)
+{
+	struct fixture *f = data;
+	(void)params;
+
+	SUBMIT(0, SCHED_WRITE, 0, 0, 0, SCHED_STARTED);
+	SUBMIT(1, SCHED_WRITE, 0, 1, 0, SCHED_STARTED);
+	SUBMIT(2, SCHED_READ, 1, 2, 0, SCHED_STARTED);
+	DONE(0, 1, -1);
+	DONE(1, 1, -1);
+	DONE(2, 1, -1);
+
+	return MUNIT_OK;
+}
+
+/* Requests over the node-wide limit of their class wait for a running one to
+ * complete, while the other class is not affected. */
+TEST_CASE(submit, node_limit, NULL)
+{
+	struct fixture *f = data;
+	(void)params;
+
+	f->config.sched_limits[SCHED_WRITE] = 1;
+	SUBMIT(0, SCHED_WRITE, 0, 0, 0, SCHED_STARTED);
+	SUBMIT(1, SCHED_WRITE, 1, 1, 0, SCHED_QUEUED);
+	SUBMIT(2, SCHED_READ, 1, 2, 0, SCHED_STARTED);
+	DONE(0, 1, 1);
+	DONE(1, 2, -1);
+	DONE(2, 2, -1);
+
+	return MUNIT_OK;
+}
+
+/* A request waiting for its database to have room doesn't hold back requests
+ * against other databases. */
+TEST_CASE(submit, db_limit, NULL)
+{
+	struct fixture *f = data;
+	(void)params;
+
+	f->config.sched_limits[SCHED_READ] = 2;
+	f->config.sched_db_limits[SCHED_READ] = 1;
+	SUBMIT(0, SCHED_READ, 0, 0, 0, SCHED_STARTED);
+	SUBMIT(1, SCHED_READ, 1, 1, 0, SCHED_STARTED);
+	SUBMIT(2, SCHED_READ, 0, 2, 0, SCHED_QUEUED);
+	SUBMIT(3, SCHED_READ, 1, 0, 0, SCHED_QUEUED);
+	DONE(1, 1, 3);
+	DONE(3, 2, -1);
+	DONE(0, 3, 2);
+	DONE(2, 4, -1);
+
+	return MUNIT_OK;
+}
+
+/* A connection running expensive requests is served less often than one
+ * running cheap requests. */
+TEST_CASE(submit, fairness, NULL)
+{
+	struct fixture *f = data;
+	(void)params;
+
+	f->config.sched_limits[SCHED_WRITE] = 1;
+
+	/* Connection 0 takes 10ms per request, connection 1 takes 1ms. */
+	SUBMIT(0, SCHED_WRITE, 0, 0, 0, SCHED_STARTED);
+	DONE(0, 10, -1);
+	SUBMIT(1, SCHED_WRITE, 0, 1, 10, SCHED_STARTED);
+	DONE(1, 11, -1);
+	SUBMIT(0, SCHED_WRITE, 0, 0, 11, SCHED_STARTED);
+	DONE(0, 21, -1);
+	SUBMIT(1, SCHED_WRITE, 0, 1, 21, SCHED_STARTED);
+	DONE(1, 22, -1);
+
+	/* Both queue up behind connection 2. */
+	SUBMIT(2, SCHED_WRITE, 0, 2, 22, SCHED_STARTED);
+	SUBMIT(3, SCHED_WRITE, 0, 0, 22, SCHED_QUEUED);
+	SUBMIT(4, SCHED_WRITE, 0, 0, 22, SCHED_QUEUED);
+	SUBMIT(5, SCHED_WRITE, 0, 1, 22, SCHED_QUEUED);
+	SUBMIT(6, SCHED_WRITE, 0, 1, 22, SCHED_QUEUED);
+	SUBMIT(7, SCHED_WRITE, 0, 1, 22, SCHED_QUEUED);
+
+	/* Connection 1 gets to run all its requests before the second one of
+	 * connection 0. */
+	DONE(2, 23, 3);
+	DONE(3, 33, 5);
+	DONE(5, 34, 6);
+	DONE(6, 35, 7);
+	DONE(7, 36, 4);
+	DONE(4, 46, -1);
+
+	return MUNIT_OK;
+}
+
+/* When the expected wait exceeds the target, requests are rejected with a hint
+ * of how long the queue takes to drain. */
+TEST_CASE(submit, reject, NULL)
+{
+	struct fixture *f = data;
+	struct dqlite_sched_stats stats;
+	unsigned retry_after = 0;
+	int rv;
+	(void)params;
+
+	f->config.sched_limits[SCHED_WRITE] = 1;
+	f->config.sched_target = 25;
+
+	/* Requests take 10ms each. */
+	SUBMIT(0, SCHED_WRITE, 0, 0, 0, SCHED_STARTED);
+	DONE(0, 10, -1);
+	SUBMIT(0, SCHED_WRITE, 0, 0, 10, SCHED_STARTED);
+	SUBMIT(1, SCHED_WRITE, 0, 1, 10, SCHED_QUEUED);
+	SUBMIT(2, SCHED_WRITE, 0, 2, 10, SCHED_QUEUED);
+	rv = sched_submit(&f->sched, &f->reqs[3], SCHED_WRITE, &f->dbs[0],
+			  &f->conns[0], 10 * MS, &retry_after);
+	munit_assert_int(rv, ==, SCHED_REJECTED);
+	munit_assert_uint(retry_after, ==, 30);
+
+	sched_stats(&f->sched, SCHED_WRITE, &stats);
+	munit_assert_uint64(stats.admitted, ==, 2);
+	munit_assert_uint64(stats.rejected, ==, 1);
+	munit_assert_uint(stats.running, ==, 1);
+	munit_assert_uint(stats.waiting, ==, 2);
+
+	/* Once a queued request gives up, there is room again. */
+	sched_cancel(&f->sched, &f->reqs[2]);
+	SUBMIT(3, SCHED_WRITE, 0, 2, 10, SCHED_QUEUED);
+	DONE(0, 20, 1);
+	DONE(1, 30, 3);
+	DONE(3, 40, -1);
+
+	sched_stats(&f->sched, SCHED_WRITE, &stats);
+	munit_assert_uint64(stats.admitted, ==, 4);
+	munit_assert_uint64(stats.wait_max, ==, 20000);
+	munit_assert_uint64(stats.wait_total, ==, 30000);
+	munit_assert_uint(stats.running, ==, 0);
+	munit_assert_uint(stats.waiting, ==, 0);
+
+	return MUNIT_OK;
+}
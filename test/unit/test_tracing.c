@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../src/tracing.h"
+
+#include "../lib/runner.h"
+
+TEST_MODULE(tracing);
+
+/******************************************************************************
+ *
+ * Ring buffer.
+ *
+ ******************************************************************************/
+
+TEST_SUITE(ring);
+
+/* Count the occurrences of a string in a dump. */
+static unsigned countOccurrences(const char *dump, const char *s)
+{
+	unsigned n = 0;
+	for (dump = strstr(dump, s); dump != NULL;
+	     dump = strstr(dump + 1, s)) {
+		n++;
+	}
+	return n;
+}
+
+/* Traces are only formatted when dumped, and only the most recent ones are
+ * kept. */
+TEST_CASE(ring, dump, NULL)
+{
+	(void)data;
+	(void)params;
+	bool enabled = _dqliteTracingEnabled;
+	char name[] = "transient";
+	char *dump;
+	size_t size;
+	FILE *f;
+	unsigned i;
+
+	/* The size of the rings is fixed once they are in use. */
+	if (enabled || getenv("LIBDQLITE_TRACE_RING") != NULL) {
+		return MUNIT_SKIP;
+	}
+
+	setenv("LIBDQLITE_TRACE_RING", "4", 1);
+	dqliteTracingMaybeEnable(true);
+
+	for (i = 0; i < 6; i++) {
+		tracef("record %u of %" PRIu64 " name:%s pad:%*d ratio:%.2f 100%%",
+		       i, (uint64_t)6, name, 3, 7, 0.5);
+		/* Strings are copied when recorded. */
+		name[0] = 'T';
+	}
+
+	f = open_memstream(&dump, &size);
+	munit_assert_ptr_not_null(f);
+	dqliteTracingDump(f);
+	fclose(f);
+
+	munit_assert_ptr_null(strstr(dump, "record 0 "));
+	munit_assert_ptr_null(strstr(dump, "record 1 "));
+	munit_assert_ptr_not_null(strstr(
+	    dump, "record 2 of 6 name:Transient pad:  7 ratio:0.50 100%"));
+	munit_assert_ptr_not_null(strstr(dump, "record 5 of 6"));
+	munit_assert_uint(countOccurrences(dump, "LIBDQLITE["), ==, 4);
+	free(dump);
+
+	/* Dumping drains the rings. */
+	f = open_memstream(&dump, &size);
+	munit_assert_ptr_not_null(f);
+	dqliteTracingDump(f);
+	fclose(f);
+	munit_assert_size(size, ==, 0);
+	free(dump);
+
+	unsetenv("LIBDQLITE_TRACE_RING");
+	_dqliteTracingEnabled = false;
+	return MUNIT_OK;
+}
@@ -121,10 +121,10 @@ static void vfsFillDbPath(struct fixture *f,
 	do {                                                                  \
 		int _flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;      \
 		int _rv;                                                      \
-		char path[VFS_PATH_SZ];                                       \
-		struct fixture *f = data;                                     \
-		vfsFillDbPath(f, VFS, "test.db", path);                       \
-		_rv = sqlite3_open_v2(path, &DB, _flags, VFS);                \
+		char _path[VFS_PATH_SZ];                                      \
+		struct fixture *_f = data;                                    \
+		vfsFillDbPath(_f, VFS, "test.db", _path);                     \
+		_rv = sqlite3_open_v2(_path, &DB, _flags, VFS);               \
 		munit_assert_int(_rv, ==, SQLITE_OK);                         \
 		_rv = sqlite3_extended_result_codes(DB, 1);                   \
 		munit_assert_int(_rv, ==, SQLITE_OK);                         \
@@ -925,6 +925,104 @@ TEST(vfs_extra, secondApplyOnDifferentVfs, setUp, tearDown, 0, vfs_params)
 	return MUNIT_OK;
 }
 
+/* Use VfsApplyBatch() to replicate several write transactions at once on a
+ * different VFS than the one that initially generated them. */
+TEST(vfs_extra, applyBatchOnDifferentVfs, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db1;
+	sqlite3 *db2;
+	sqlite3_stmt *stmt;
+	struct vfsTransaction txs[3];
+	int rv;
+
+	OPEN("1", db1);
+
+	EXEC(db1, "CREATE TABLE test(n INT)");
+	POLL(db1, txs[0]);
+	APPLY(db1, txs[0]);
+	EXEC(db1, "INSERT INTO test(n) VALUES(1)");
+	POLL(db1, txs[1]);
+	APPLY(db1, txs[1]);
+	EXEC(db1, "INSERT INTO test(n) VALUES(2)");
+	POLL(db1, txs[2]);
+	APPLY(db1, txs[2]);
+
+	OPEN("2", db2);
+	rv = VfsApplyBatch(db2, txs, 3);
+	munit_assert_int(rv, ==, 0);
+
+	PREPARE(db2, stmt, "SELECT sum(n) FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 3);
+	FINALIZE(stmt);
+
+	DONE(txs[0]);
+	DONE(txs[1]);
+	DONE(txs[2]);
+
+	CLOSE(db2);
+	CLOSE(db1);
+
+	return MUNIT_OK;
+}
+
+/* VfsCommittedPage() returns the content of a page as of the last applied
+ * transaction, ignoring the one being polled. */
+TEST(vfs_extra, committedPage, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db;
+	struct vfsTransaction tx1;
+	struct vfsTransaction tx2;
+	uint8_t buf[512];
+	const void *page;
+	unsigned i;
+	int rv;
+
+	OPEN("1", db);
+
+	EXEC(db, "CREATE TABLE test(n INT)");
+	POLL(db, tx1);
+
+	/* The table's page wasn't committed yet. */
+	rv = VfsCommittedPage(db, 2, buf, &page);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_ptr_null(page);
+
+	APPLY(db, tx1);
+
+	EXEC(db, "INSERT INTO test(n) VALUES(1)");
+	POLL(db, tx2);
+	for (i = 0; i < tx1.n_pages; i++) {
+		rv = VfsCommittedPage(db, (uint32_t)tx1.page_numbers[i], buf,
+				      &page);
+		munit_assert_int(rv, ==, SQLITE_OK);
+		munit_assert_ptr_not_null(page);
+		munit_assert_memory_equal(512, page, tx1.pages[i]);
+	}
+	rv = VfsCommittedPage(db, 100, buf, &page);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_ptr_null(page);
+	APPLY(db, tx2);
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param == NULL || !atoi(disk_mode_param)) {
+		/* Pages moved to the database by a checkpoint are found too. */
+		rv = VfsCheckpoint(db, 0);
+		munit_assert_int(rv, ==, SQLITE_OK);
+		rv = VfsCommittedPage(db, (uint32_t)tx2.page_numbers[0], buf,
+				      &page);
+		munit_assert_int(rv, ==, SQLITE_OK);
+		munit_assert_ptr_not_null(page);
+		munit_assert_memory_equal(512, page, tx2.pages[0]);
+	}
+
+	DONE(tx1);
+	DONE(tx2);
+	CLOSE(db);
+
+	return MUNIT_OK;
+}
+
 /* Use VfsApply() to replicate a second write transaction on a different
  * VFS than the one that initially generated it and that has an open connection
  * which has built the WAL index header by preparing a statement. */
@@ -1748,6 +1846,228 @@ TEST(vfs_extra, restoreWithOpenConnection, setUp, tearDown, 0, vfs_params)
 	return MUNIT_OK;
 }
 
+static unsigned n_adopted_released;
+
+static void releaseAdopted(void *base)
+{
+	n_adopted_released++;
+	raft_free(base);
+}
+
+/* Restore a snapshot whose pages point into its buffer, which is released
+ * once none of them is in use anymore. */
+TEST(vfs_extra, restoreAdopted, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct snapshot snapshot;
+	struct snapshot snapshot2;
+	struct vfsTransaction tx;
+	struct vfsAdopted *adopted;
+	char db_path[VFS_PATH_SZ];
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param != NULL && atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	OPEN("1", db);
+	EXEC(db, "CREATE TABLE test(n INT)");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	EXEC(db,
+	     "CREATE TABLE other AS WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+	     "SELECT x + 1 FROM c WHERE x < 10) SELECT printf('%.*c', 400, "
+	     "'x') AS b FROM c");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	rv = VfsCheckpoint(db, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	CLOSE(db);
+
+	SNAPSHOT("1", snapshot);
+	SNAPSHOT("1", snapshot2);
+
+	OPEN("2", db);
+	CLOSE(db);
+
+	n_adopted_released = 0;
+	adopted = VfsAdopt(snapshot.data, snapshot.n, releaseAdopted);
+	munit_assert_ptr_not_null(adopted);
+	vfsFillDbPath(data, "2", "test.db", db_path);
+	rv = VfsRestoreAdopted(sqlite3_vfs_find("2"), db_path, adopted,
+			       snapshot.data, snapshot.n);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_ptr_null(VfsAdoptedPut(adopted));
+	munit_assert_uint(n_adopted_released, ==, 0);
+
+	/* Modified pages are copied, leaving the snapshot untouched, while the
+	 * pages of the other table keep pointing into it. */
+	OPEN("2", db);
+	EXEC(db, "INSERT INTO test(n) VALUES(1)");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	rv = VfsCheckpoint(db, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	PREPARE(db, stmt, "SELECT n FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 1);
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+	munit_assert_memory_equal(snapshot.n, snapshot.data, snapshot2.data);
+	munit_assert_uint(n_adopted_released, ==, 0);
+	CLOSE(db);
+
+	/* Replacing the database releases the buffer. */
+	RESTORE("2", snapshot2);
+	munit_assert_uint(n_adopted_released, ==, 1);
+
+	OPEN("2", db);
+	PREPARE(db, stmt, "SELECT * FROM test");
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+	CLOSE(db);
+
+	raft_free(snapshot2.data);
+
+	return MUNIT_OK;
+}
+
+/* Once the pages pointing into an adopted buffer are only a small part of it,
+ * a checkpoint copies them out and releases the buffer. */
+TEST(vfs_extra, restoreAdoptedCopiedOut, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct snapshot snapshot;
+	struct vfsTransaction tx;
+	struct vfsAdopted *adopted;
+	char db_path[VFS_PATH_SZ];
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param != NULL && atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	OPEN("1", db);
+	EXEC(db, "CREATE TABLE test(n INT)");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	EXEC(db,
+	     "CREATE TABLE other AS WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL "
+	     "SELECT x + 1 FROM c WHERE x < 10) SELECT printf('%.*c', 400, "
+	     "'x') AS b FROM c");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	rv = VfsCheckpoint(db, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	CLOSE(db);
+
+	SNAPSHOT("1", snapshot);
+
+	OPEN("2", db);
+	CLOSE(db);
+
+	n_adopted_released = 0;
+	adopted = VfsAdopt(snapshot.data, snapshot.n, releaseAdopted);
+	munit_assert_ptr_not_null(adopted);
+	vfsFillDbPath(data, "2", "test.db", db_path);
+	rv = VfsRestoreAdopted(sqlite3_vfs_find("2"), db_path, adopted,
+			       snapshot.data, snapshot.n);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_ptr_null(VfsAdoptedPut(adopted));
+
+	/* Only the page of the first table is left unmodified. */
+	OPEN("2", db);
+	EXEC(db, "UPDATE other SET b = printf('%.*c', 400, 'y')");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	munit_assert_uint(n_adopted_released, ==, 0);
+	rv = VfsCheckpoint(db, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_uint(n_adopted_released, ==, 1);
+
+	PREPARE(db, stmt, "SELECT count(*) FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 0);
+	FINALIZE(stmt);
+	PREPARE(db, stmt, "PRAGMA integrity_check");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_string_equal((const char *)sqlite3_column_text(stmt, 0),
+				  "ok");
+	FINALIZE(stmt);
+	CLOSE(db);
+
+	return MUNIT_OK;
+}
+
+/* Detaching an adopted buffer makes the databases copy their pages out of it,
+ * and hands it back. */
+TEST(vfs_extra, restoreAdoptedDetach, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct snapshot snapshot;
+	struct vfsTransaction tx;
+	struct vfsAdopted *adopted;
+	char db_path[VFS_PATH_SZ];
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param != NULL && atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	OPEN("1", db);
+	EXEC(db, "CREATE TABLE test(n INT)");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	EXEC(db, "INSERT INTO test(n) VALUES(1)");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	rv = VfsCheckpoint(db, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	CLOSE(db);
+
+	SNAPSHOT("1", snapshot);
+
+	OPEN("2", db);
+	CLOSE(db);
+
+	n_adopted_released = 0;
+	adopted = VfsAdopt(snapshot.data, snapshot.n, releaseAdopted);
+	munit_assert_ptr_not_null(adopted);
+	vfsFillDbPath(data, "2", "test.db", db_path);
+	rv = VfsRestoreAdopted(sqlite3_vfs_find("2"), db_path, adopted,
+			       snapshot.data, snapshot.n);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_ptr_equal(VfsAdoptedDetach(sqlite3_vfs_find("2"), adopted),
+			       snapshot.data);
+	munit_assert_uint(n_adopted_released, ==, 0);
+	memset(snapshot.data, 0, snapshot.n);
+	raft_free(snapshot.data);
+
+	OPEN("2", db);
+	PREPARE(db, stmt, "SELECT n FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 1);
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+	CLOSE(db);
+
+	return MUNIT_OK;
+}
+
 /* Changing page_size to non-default value fails. */
 TEST(vfs_extra, changePageSize, setUp, tearDown, 0, vfs_params)
 {
@@ -1779,3 +2099,535 @@ TEST(vfs_extra, changePageSizeSameValue, setUp, tearDown, 0, vfs_params)
 
 	return MUNIT_OK;
 }
+
+/* With mmap_size set, pages of the in-memory database are handed to SQLite in
+ * place through xFetch, and checkpoints wait for readers holding them. */
+TEST(vfs_extra, fetchPages, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db1;
+	sqlite3 *db2;
+	sqlite3_stmt *stmt;
+	struct sqlite3_file *main_f;
+	struct vfsTransaction tx;
+	char buf[DB_PAGE_SIZE];
+	void *page;
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param != NULL && atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	OPEN("1", db1);
+	EXEC(db1, "CREATE TABLE test(n INT)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	EXEC(db1, "INSERT INTO test(n) VALUES(123)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	CHECKPOINT(db1);
+
+	OPEN("1", db2);
+	rv = sqlite3_exec(db2, "PRAGMA mmap_size=1048576", NULL, NULL, NULL);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = sqlite3_file_control(db2, NULL, SQLITE_FCNTL_FILE_POINTER,
+				  &main_f);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	/* The second page is the table root, fetched without any copy. */
+	rv = main_f->pMethods->xFetch(main_f, DB_PAGE_SIZE, DB_PAGE_SIZE,
+				      &page);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_ptr_not_null(page);
+	rv = main_f->pMethods->xRead(main_f, buf, DB_PAGE_SIZE, DB_PAGE_SIZE);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(memcmp(page, buf, DB_PAGE_SIZE), ==, 0);
+	rv = main_f->pMethods->xUnfetch(main_f, DB_PAGE_SIZE, page);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	/* Partial pages and pages beyond the end are not fetched. */
+	rv = main_f->pMethods->xFetch(main_f, DB_PAGE_SIZE, 100, &page);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_ptr_null(page);
+	rv = main_f->pMethods->xFetch(main_f, 16 * DB_PAGE_SIZE, DB_PAGE_SIZE,
+				      &page);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_ptr_null(page);
+
+	/* A read transaction holding fetched pages blocks the checkpoint. */
+	EXEC(db1, "INSERT INTO test(n) VALUES(456)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	PREPARE(db2, stmt, "SELECT * FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 123);
+	CHECKPOINT_FAIL(db1, SQLITE_BUSY);
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 456);
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+
+	CHECKPOINT(db1);
+	PREPARE(db2, stmt, "SELECT count(*) FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 2);
+	FINALIZE(stmt);
+
+	CLOSE(db2);
+	CLOSE(db1);
+
+	return MUNIT_OK;
+}
+
+/* VfsCheckpoint moves the frames seen by all readers to the database while
+ * readers are active, and resets the WAL once they are gone. */
+TEST(vfs_extra, checkpointAlongsideReader, setUp, tearDown, 0, vfs_params)
+{
+	struct fixture *f = data;
+	sqlite3 *db1;
+	sqlite3 *db2;
+	sqlite3_stmt *stmt;
+	struct sqlite3_file *wal_f;
+	struct vfsTransaction tx;
+	sqlite3_int64 size;
+	uint32_t n;
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param != NULL && atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	OPEN("1", db1);
+	EXEC(db1, "CREATE TABLE test(n INT)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+
+	EXEC(db1, "INSERT INTO test(n) VALUES(1)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+
+	OPEN("1", db2);
+	PREPARE(db2, stmt, "SELECT n FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 1);
+
+	EXEC(db1, "INSERT INTO test(n) VALUES(2)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	EXEC(db1, "INSERT INTO test(n) VALUES(3)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+
+	/* Only the frames seen by the reader are moved. */
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_BUSY);
+	rv = sqlite3_file_control(db1, "main", SQLITE_FCNTL_JOURNAL_POINTER,
+				  &wal_f);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = wal_f->pMethods->xFileSize(wal_f, &size);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(size, >, 0);
+	rv = VfsDatabaseNumPages(&f->vfs[0], "test.db", false, &n);
+	munit_assert_int(rv, ==, 0);
+	munit_assert_int(n, ==, 2);
+
+	/* The reader still sees its snapshot, new readers see everything. */
+	STEP(stmt, SQLITE_DONE);
+	FINALIZE(stmt);
+	PREPARE(db2, stmt, "SELECT count(*) FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 3);
+
+	/* A further attempt moves the frames seen by the new reader, but can't
+	 * reset the WAL while it might read them. */
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_BUSY);
+	FINALIZE(stmt);
+
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = wal_f->pMethods->xFileSize(wal_f, &size);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(size, ==, 0);
+
+	EXEC(db1, "INSERT INTO test(n) VALUES(4)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	PREPARE(db2, stmt, "SELECT sum(n) FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 10);
+	FINALIZE(stmt);
+
+	/* SQLite's own checkpoint copes with pages moved from the WAL. */
+	PREPARE(db2, stmt, "SELECT n FROM test");
+	STEP(stmt, SQLITE_ROW);
+	EXEC(db1, "INSERT INTO test(n) VALUES(5)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_BUSY);
+	FINALIZE(stmt);
+	CHECKPOINT(db1);
+	PREPARE(db2, stmt, "SELECT sum(n) FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 15);
+	FINALIZE(stmt);
+
+	CLOSE(db2);
+	CLOSE(db1);
+
+	return MUNIT_OK;
+}
+
+/* Readers that keep overlapping don't prevent the WAL from being reset: once
+ * all frames are moved, new readers only read the database. */
+TEST(vfs_extra, checkpointRestartAlongsideReaders, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db1;
+	sqlite3 *db2;
+	sqlite3 *db3;
+	sqlite3_stmt *stmt2;
+	sqlite3_stmt *stmt3;
+	struct sqlite3_file *wal_f;
+	struct vfsTransaction tx;
+	sqlite3_int64 before;
+	sqlite3_int64 size;
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param != NULL && atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	OPEN("1", db1);
+	EXEC(db1, "CREATE TABLE test(n INT)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	rv = sqlite3_file_control(db1, "main", SQLITE_FCNTL_JOURNAL_POINTER,
+				  &wal_f);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	OPEN("1", db2);
+	OPEN("1", db3);
+	EXEC(db1, "INSERT INTO test(n) VALUES(1)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+
+	/* All frames are moved, but the reader might still read them. */
+	PREPARE(db2, stmt2, "SELECT n FROM test");
+	STEP(stmt2, SQLITE_ROW);
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_BUSY);
+
+	/* A reader starting now only reads the database, so once the first one
+	 * is done the WAL is reset even if the second one is still active. */
+	PREPARE(db3, stmt3, "SELECT n FROM test");
+	STEP(stmt3, SQLITE_ROW);
+	FINALIZE(stmt2);
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = wal_f->pMethods->xFileSize(wal_f, &size);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(size, ==, 0);
+	munit_assert_int(sqlite3_column_int(stmt3, 0), ==, 1);
+	STEP(stmt3, SQLITE_DONE);
+
+	EXEC(db1, "INSERT INTO test(n) VALUES(2)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	PREPARE(db2, stmt2, "SELECT sum(n) FROM test");
+	STEP(stmt2, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt2, 0), ==, 3);
+	FINALIZE(stmt2);
+
+	/* SQLite doesn't restart the WAL by itself in the same conditions. */
+	PREPARE(db2, stmt2, "SELECT n FROM test");
+	STEP(stmt2, SQLITE_ROW);
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_BUSY);
+	RESET(stmt3, SQLITE_OK);
+	STEP(stmt3, SQLITE_ROW);
+	FINALIZE(stmt2);
+	rv = wal_f->pMethods->xFileSize(wal_f, &before);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	EXEC(db1, "INSERT INTO test(n) VALUES(3)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	rv = wal_f->pMethods->xFileSize(wal_f, &size);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(size, >, before);
+	STEP(stmt3, SQLITE_ROW);
+	STEP(stmt3, SQLITE_DONE);
+
+	PREPARE(db2, stmt2, "SELECT sum(n) FROM test");
+	STEP(stmt2, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt2, 0), ==, 6);
+	FINALIZE(stmt2);
+	FINALIZE(stmt3);
+	CHECKPOINT(db1);
+
+	CLOSE(db3);
+	CLOSE(db2);
+	CLOSE(db1);
+
+	return MUNIT_OK;
+}
+
+/* In disk mode, frames are written to the database file in the background
+ * while transactions keep being applied. */
+TEST(vfs_extra, diskCheckpointInBackground, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db1;
+	sqlite3 *db2;
+	sqlite3_stmt *stmt;
+	struct sqlite3_file *wal_f;
+	struct vfsTransaction tx;
+	sqlite3_int64 size;
+	int i;
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param == NULL || !atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	OPEN("1", db1);
+	EXEC(db1, "CREATE TABLE test(n INT)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	for (i = 1; i <= 100; i++) {
+		char sql[64];
+		sprintf(sql, "INSERT INTO test(n) VALUES(%d)", i);
+		EXEC(db1, sql);
+		POLL(db1, tx);
+		APPLY(db1, tx);
+		DONE(tx);
+	}
+
+	/* The checkpoint is queued, and transactions can still be applied. */
+	rv = VfsCheckpoint(db1, 50);
+	munit_assert_int(rv, ==, SQLITE_BUSY);
+	EXEC(db1, "INSERT INTO test(n) VALUES(0)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+
+	OPEN("1", db2);
+	PREPARE(db2, stmt, "SELECT sum(n) FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 5050);
+	FINALIZE(stmt);
+
+	/* Once the background pass is done, the rest is written right away. */
+	while ((rv = VfsCheckpoint(db1, 50)) == SQLITE_BUSY) {
+		struct timespec delay = { 0, 1000 * 1000 };
+		nanosleep(&delay, NULL);
+	}
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = sqlite3_file_control(db1, "main", SQLITE_FCNTL_JOURNAL_POINTER,
+				  &wal_f);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	rv = wal_f->pMethods->xFileSize(wal_f, &size);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_int(size, ==, 0);
+
+	PREPARE(db2, stmt, "SELECT count(*), sum(n) FROM test");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 101);
+	munit_assert_int(sqlite3_column_int(stmt, 1), ==, 5050);
+	FINALIZE(stmt);
+
+	CLOSE(db2);
+	CLOSE(db1);
+
+	return MUNIT_OK;
+}
+
+/* In tiered mode, cold pages are evicted to a backing file when checkpointing
+ * and restoring, and can still be read and snapshotted. */
+TEST(vfs_extra, tieredEvictsColdPages, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
+	struct snapshot snapshot;
+	struct vfsTransaction tx;
+	char *dir;
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param != NULL && atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	dir = test_dir_setup();
+	for (unsigned i = 0; i < N_VFS; i++) {
+		rv = VfsEnableTiered(sqlite3_vfs_find(i == 0 ? "1" : "2"), dir,
+				     8 * DB_PAGE_SIZE);
+		munit_assert_int(rv, ==, 0);
+	}
+
+	OPEN("1", db);
+	EXEC(db, "CREATE TABLE test(n INT, b TEXT)");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	EXEC(db,
+	     "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c "
+	     "WHERE x < 50) INSERT INTO test SELECT x, printf('%.*c', 400, "
+	     "char(65 + x % 26)) FROM c");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+
+	rv = VfsCheckpoint(db, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_ullong(VfsResidentSize(sqlite3_vfs_find("1")), <=,
+			    8 * DB_PAGE_SIZE);
+
+	/* Evicted pages can be read, and are brought back when there's room. */
+	PREPARE(db, stmt,
+		"SELECT count(*) FROM test WHERE b = printf('%.*c', 400, "
+		"char(65 + n % 26))");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 50);
+	FINALIZE(stmt);
+	EXEC(db, "DELETE FROM test WHERE n > 45");
+	POLL(db, tx);
+	APPLY(db, tx);
+	DONE(tx);
+	rv = VfsCheckpoint(db, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	munit_assert_ullong(VfsResidentSize(sqlite3_vfs_find("1")), <=,
+			    8 * DB_PAGE_SIZE);
+	CLOSE(db);
+
+	SNAPSHOT("1", snapshot);
+	OPEN("2", db);
+	CLOSE(db);
+	RESTORE("2", snapshot);
+	raft_free(snapshot.data);
+	munit_assert_ullong(VfsResidentSize(sqlite3_vfs_find("2")), <=,
+			    8 * DB_PAGE_SIZE);
+
+	OPEN("2", db);
+	PREPARE(db, stmt,
+		"SELECT count(*) FROM test WHERE b = printf('%.*c', 400, "
+		"char(65 + n % 26))");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt, 0), ==, 45);
+	FINALIZE(stmt);
+	PREPARE(db, stmt, "PRAGMA integrity_check");
+	STEP(stmt, SQLITE_ROW);
+	munit_assert_string_equal((const char *)sqlite3_column_text(stmt, 0),
+				  "ok");
+	FINALIZE(stmt);
+	CLOSE(db);
+
+	test_dir_tear_down(dir);
+
+	return MUNIT_OK;
+}
+
+/* In tiered mode, cold pages are evicted also by checkpoints running alongside
+ * readers, which can keep reading the pages they already looked up. */
+TEST(vfs_extra, tieredEvictsAlongsideReader, setUp, tearDown, 0, vfs_params)
+{
+	sqlite3 *db1;
+	sqlite3 *db2;
+	sqlite3 *db3;
+	sqlite3_stmt *stmt2;
+	sqlite3_stmt *stmt3;
+	struct vfsTransaction tx;
+	sqlite3_vfs *vfs;
+	char *dir;
+	int n;
+	int rv;
+
+	const char *disk_mode_param = munit_parameters_get(params, "disk_mode");
+	if (disk_mode_param != NULL && atoi(disk_mode_param)) {
+		return MUNIT_SKIP;
+	}
+
+	dir = test_dir_setup();
+	vfs = sqlite3_vfs_find("1");
+	rv = VfsEnableTiered(vfs, dir, 8 * DB_PAGE_SIZE);
+	munit_assert_int(rv, ==, 0);
+
+	OPEN("1", db1);
+	EXEC(db1, "CREATE TABLE test(n INT, b TEXT)");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	OPEN("1", db2);
+	OPEN("1", db3);
+	EXEC(db1,
+	     "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c "
+	     "WHERE x < 50) INSERT INTO test SELECT x, printf('%.*c', 400, "
+	     "char(65 + x % 26)) FROM c");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+
+	/* Pages still visible in the WAL stay in memory until it's reset. */
+	PREPARE(db2, stmt2, "SELECT n FROM test");
+	STEP(stmt2, SQLITE_ROW);
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_BUSY);
+	PREPARE(db3, stmt3, "SELECT n FROM test");
+	STEP(stmt3, SQLITE_ROW);
+	FINALIZE(stmt2);
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	FINALIZE(stmt3);
+	munit_assert_ullong(VfsResidentSize(vfs), >, 8 * DB_PAGE_SIZE);
+
+	/* The next checkpoint evicts them, while a reader is active. */
+	EXEC(db1, "INSERT INTO test(n, b) VALUES(51, 'Z')");
+	POLL(db1, tx);
+	APPLY(db1, tx);
+	DONE(tx);
+	PREPARE(db2, stmt2,
+		"SELECT b = printf('%.*c', 400, char(65 + n % 26)) FROM test "
+		"WHERE n <= 50");
+	STEP(stmt2, SQLITE_ROW);
+	munit_assert_int(sqlite3_column_int(stmt2, 0), ==, 1);
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_BUSY);
+	munit_assert_ullong(VfsResidentSize(vfs), <=, 8 * DB_PAGE_SIZE);
+	for (n = 1; sqlite3_step(stmt2) == SQLITE_ROW; n++) {
+		munit_assert_int(sqlite3_column_int(stmt2, 0), ==, 1);
+	}
+	munit_assert_int(n, ==, 50);
+	FINALIZE(stmt2);
+
+	rv = VfsCheckpoint(db1, 0);
+	munit_assert_int(rv, ==, SQLITE_OK);
+	PREPARE(db2, stmt2, "PRAGMA integrity_check");
+	STEP(stmt2, SQLITE_ROW);
+	munit_assert_string_equal((const char *)sqlite3_column_text(stmt2, 0),
+				  "ok");
+	FINALIZE(stmt2);
+
+	CLOSE(db3);
+	CLOSE(db2);
+	CLOSE(db1);
+	test_dir_tear_down(dir);
+
+	return MUNIT_OK;
+}